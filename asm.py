@@ -13,6 +13,15 @@ class Settings(pydantic.BaseModel):
     include_indent: bool = True
     include_reg_subname: bool = True
     asm_style: Literal["c", "asm"] = "c"
+    # Compile for the 16-bit machine (simulator16): 64 KiB RAM and 2-byte
+    # operands for data, jmp and jxxx
+    wide: bool = False
+
+    def imm_len(self) -> int:
+        return 2 if self.wide else 1
+
+    def ram_size(self) -> int:
+        return 1 << (8 * self.imm_len())
 
 @dataclasses.dataclass
 class Token:
@@ -151,15 +160,22 @@ class Number:
     def to_asm(self, settings: Settings) -> str:
         return self.text
 
-    def to_int(self, label_pos: dict[str, int]) -> int:
+    def to_int(self, label_pos: dict[str, int], size: int = 1) -> int:
+        limit = 1 << (8 * size)
         if isinstance(self.value, int):
-            if self.value >= 256:
-                raise ValueError(f"Numerical value {self.value=} >= 256")
+            if self.value >= limit:
+                raise ValueError(f"Numerical value {self.value=} >= {limit}")
             return self.value
         if self.value not in label_pos:
             raise ValueError(f"Missing label {self.value}")
+        if label_pos[self.value] >= limit:
+            raise ValueError(f"Label {self.value} at {label_pos[self.value]} >= {limit}")
         return label_pos[self.value]
 
+    def to_imm(self, label_pos: dict[str, int], settings: Settings) -> bytes:
+        """Operand of data, jmp and jxxx, little-endian"""
+        return self.to_int(label_pos, settings.imm_len()).to_bytes(settings.imm_len(), "little")
+
 @dataclasses.dataclass
 class Values:
     raws: list[str]
@@ -235,7 +251,7 @@ class Content(Token):
     def to_asm(self, settings: Settings) -> str:
         raise NotImplementedError
 
-    def get_ram_size(self, ram_pos: int) -> int:
+    def get_ram_size(self, ram_pos: int, settings: Settings) -> int:
         return 1
 
     def to_ram(self, ram: bytes, label_pos: dict[str, int], settings: Settings) -> bytes:
@@ -263,11 +279,11 @@ class CData(Content):
         else:
             raise NotImplementedError
 
-    def get_ram_size(self, ram_pos: int) -> int:
-        return 2
+    def get_ram_size(self, ram_pos: int, settings: Settings) -> int:
+        return 1 + settings.imm_len()
 
     def to_ram(self, ram: bytes, label_pos: dict[str, int], settings: Settings) -> bytes:
-        return ram + bytes([(2 << 4) + self.reg.idx, self.num.to_int(label_pos)])
+        return ram + bytes([(2 << 4) + self.reg.idx]) + self.num.to_imm(label_pos, settings)
 
 @dataclasses.dataclass
 class CEmpty(Content):
@@ -280,7 +296,7 @@ class CEmpty(Content):
     def to_asm(self, settings: Settings) -> str:
         return ""
 
-    def get_ram_size(self, ram_pos: int) -> int:
+    def get_ram_size(self, ram_pos: int, settings: Settings) -> int:
         return 0
 
     def to_ram(self, ram: bytes, label_pos: dict[str, int], settings: Settings) -> bytes:
@@ -317,7 +333,7 @@ class CLabel(Content):
     def to_asm(self, settings: Settings) -> str:
         return f"{self.name}{':' * (self.offset + 1)}"
 
-    def get_ram_size(self, ram_pos: int) -> int:
+    def get_ram_size(self, ram_pos: int, settings: Settings) -> int:
         return 0
 
     def to_ram(self, ram: bytes, label_pos: dict[str, int], settings: Settings) -> bytes:
@@ -336,7 +352,7 @@ class CPragmaSetPos(Content):
     def to_asm(self, settings: Settings) -> str:
         return f"pragma setpos {self.pos}"
 
-    def get_ram_size(self, ram_pos: int) -> int:
+    def get_ram_size(self, ram_pos: int, settings: Settings) -> int:
         if ram_pos > self.pos:
             raise ValueError(f"pragma setpos: {self.pos=} > {ram_pos=}")
         return self.pos - ram_pos
@@ -357,7 +373,7 @@ class CPragmaPos(Content):
     def to_asm(self, settings: Settings) -> str:
         return f"pragma pos {self.pos}"
 
-    def get_ram_size(self, ram_pos: int) -> int:
+    def get_ram_size(self, ram_pos: int, settings: Settings) -> int:
         return 0
 
     def to_ram(self, ram: bytes, label_pos: dict[str, int], settings: Settings) -> bytes:
@@ -376,7 +392,7 @@ class CPragmaPrintPos(Content):
     def to_asm(self, settings: Settings) -> str:
         return "pragma printpos"
 
-    def get_ram_size(self, ram_pos: int) -> int:
+    def get_ram_size(self, ram_pos: int, settings: Settings) -> int:
         return 0
 
     def to_ram(self, ram: bytes, label_pos: dict[str, int], settings: Settings) -> bytes:
@@ -460,11 +476,11 @@ class CJump(Content):
     def to_asm(self, settings: Settings) -> str:
         return f"jmp {self.num.to_asm(settings)}"
 
-    def get_ram_size(self, ram_pos: int) -> int:
-        return 2
+    def get_ram_size(self, ram_pos: int, settings: Settings) -> int:
+        return 1 + settings.imm_len()
 
     def to_ram(self, ram: bytes, label_pos: dict[str, int], settings: Settings) -> bytes:
-        return ram + bytes([4 << 4, self.num.to_int(label_pos)])
+        return ram + bytes([4 << 4]) + self.num.to_imm(label_pos, settings)
 
 @dataclasses.dataclass
 class CJumpRegister(Content):
@@ -497,14 +513,14 @@ class CJumpConditional(Content):
     def to_asm(self, settings: Settings) -> str:
         return f"j{''.join(self.conditions)} {self.num.to_asm(settings)}"
 
-    def get_ram_size(self, ram_pos: int) -> int:
-        return 2
+    def get_ram_size(self, ram_pos: int, settings: Settings) -> int:
+        return 1 + settings.imm_len()
 
     def to_ram(self, ram: bytes, label_pos: dict[str, int], settings: Settings) -> bytes:
         tmp = 0
         for cond in self.conditions:
             tmp |= 1 << self._jmp_op[cond]
-        return ram + bytes([(5 << 4) + tmp, self.num.to_int(label_pos)])
+        return ram + bytes([(5 << 4) + tmp]) + self.num.to_imm(label_pos, settings)
 
 @dataclasses.dataclass
 class CAnd(Content):
@@ -828,8 +844,47 @@ class Line:
             ret += self.comment.to_asm(settings)
         return ret
 
+PROFILE_MAGIC = "# minicomp profile 1"
+# COMPUTER_FAST_INSTR_CYCLES in computer.h
+FAST_INSTR_CYCLES = 6
+
+def profile_hash(ram: bytes, size: int) -> int:
+    """32-bit FNV-1a of the RAM, as profile_hash() in profile.c"""
+    h = 2166136261
+    for byte in ram[:size].ljust(size, b"\0"):
+        h = ((h ^ byte) * 16777619) & 0xffffffff
+    return h
+
+def profile_load(profile_file: str) -> tuple[int, dict[int, int]]:
+    """Image hash and runs per position of a simulator --branch-profile file, see profile.h"""
+    lines = pathlib.Path(profile_file).read_text().split("\n")
+    if lines[0] != PROFILE_MAGIC:
+        raise ValueError(f"'{profile_file}' is not a profile")
+    image = 0
+    exec_count = {}
+    for line in lines[1:]:
+        parts = line.split()
+        if len(parts) == 2 and parts[0] == "image":
+            image = int(parts[1], 16)
+        elif len(parts) == 3 and parts[0] == "exec":
+            exec_count[int(parts[1])] = int(parts[2])
+    return image, exec_count
+
+@dataclasses.dataclass
+class Chain:
+    """Lines from after a jmp or jmpr up to the next one, nothing falls
+    through into it so the layout can move it as a whole"""
+    first: int
+    last: int = 0
+    jmp: int | None = None
+    ends: bool = False
+    pinned: bool = False
+    prev: int | None = None
+    next: int | None = None
+
 class AsmProgram:
     def __init__(self, asm_file: str, settings: Settings):
+        self.asm_file = asm_file
         self.lines: list[Line] = []
         self.errors: list[str] = []
         self.settings = settings
@@ -840,18 +895,31 @@ class AsmProgram:
                 self.lines.append(line)
             else:
                 self.errors.append(f"Line {count+1}: Invalid line: '{raw_line}'")
+        self.compile()
 
+    def compile(self) -> None:
+        # (ram pos, line number, is data, last label) for the source map
+        self.map: list[tuple[int, int, bool, str | None]] = []
+        # RAM position of every line
+        self.line_pos: list[int] = []
         self.label_pos = {}
         ram_pos = 0
+        cur_label = None
         for line in self.lines:
+            self.line_pos.append(ram_pos)
             if isinstance(line.content, CLabel):
                 label_pos = ram_pos + line.content.offset
-                if label_pos >= 256:
-                    self.errors.append(f"Label {line.content.name} points at ram pos {label_pos} >= 256")
+                if label_pos >= self.settings.ram_size():
+                    self.errors.append(f"Label {line.content.name} points at ram pos {label_pos} >= {self.settings.ram_size()}")
                 else:
                     self.label_pos[line.content.name] = ram_pos + line.content.offset
+                if line.content.offset == 0:
+                    cur_label = line.content.name
             try:
-                ram_pos += line.content.get_ram_size(ram_pos)
+                size = line.content.get_ram_size(ram_pos, self.settings)
+                if size and ram_pos < self.settings.ram_size() and not isinstance(line.content, CPragmaSetPos):
+                    self.map.append((ram_pos, line.line_number, isinstance(line.content, CRamSet), cur_label))
+                ram_pos += size
             except ValueError as error:
                 self.errors.append(f"Line {line.line_number}: {line.raw_line}: Error getting ram size: {error!s}")
 
@@ -862,12 +930,165 @@ class AsmProgram:
             except ValueError as error:
                 self.errors.append(f"Line {line.line_number}: {line.raw_line}: Error compiling: {error!s}")
 
+    def _is_pinned(self, line: Line) -> bool:
+        return isinstance(line.content, (CPragmaPos, CPragmaSetPos)) or (isinstance(line.content, CLabel) and line.content.offset == 1)
+
+    def _has_entry(self, chain: Chain, name: str) -> bool:
+        """The chain starts with the label name, before any instruction"""
+        for line in self.lines[chain.first:chain.last + 1]:
+            if isinstance(line.content, CLabel) and line.content.name == name:
+                return True
+            if not isinstance(line.content, (CLabel, CEmpty)):
+                return False
+        return False
+
+    def _needs_padding(self, idx: int) -> bool:
+        """The next pragma is a pos, so the code before it must keep its size"""
+        for line in self.lines[idx:]:
+            if isinstance(line.content, CPragmaPos):
+                return True
+            if isinstance(line.content, CPragmaSetPos):
+                return False
+        return False
+
+    def layout(self, profile_file: str) -> list[str]:
+        """Reorder the lines so the jmps that ran most often fall through,
+        like asm_compiler --profile-use. Returns the report."""
+        try:
+            image, exec_count = profile_load(profile_file)
+        except (OSError, ValueError) as error:
+            self.errors.append(str(error))
+            return []
+        if image != profile_hash(self.ram, self.settings.ram_size()):
+            self.errors.append(f"The profile '{profile_file}' was made with another version of the program")
+            return []
+        total = sum(exec_count.values()) * FAST_INSTR_CYCLES
+        report = []
+
+        chains: list[Chain] = []
+        for idx, line in enumerate(self.lines):
+            if not chains or chains[-1].ends:
+                chains.append(Chain(first=idx))
+            chain = chains[-1]
+            chain.last = idx
+            chain.pinned |= self._is_pinned(line)
+            if isinstance(line.content, (CJump, CJumpRegister)):
+                chain.ends = True
+                if isinstance(line.content, CJump):
+                    chain.jmp = idx
+
+        removed = set()
+        saved = 0
+        lines = []
+        start = 0
+        while start < len(chains):
+            end = start + 1
+            while end < len(chains) and not chains[start].pinned and not chains[end].pinned:
+                end += 1
+            fixed_last = None if chains[end - 1].ends else end - 1
+            padding = self._needs_padding(chains[end - 1].last + 1)
+            removed_bytes = 0
+            if not chains[start].pinned and not (fixed_last is not None and padding):
+                # (runs, from, to) of the jmps between the chains, most run first
+                links = []
+                for a in range(start, end):
+                    jmp = chains[a].jmp
+                    if jmp is None or not isinstance(self.lines[jmp].content.num.value, str):
+                        continue
+                    count = exec_count.get(self.line_pos[jmp], 0)
+                    for b in range(start + 1, end):
+                        if count and b != a and self._has_entry(chains[b], self.lines[jmp].content.num.value):
+                            links.append((-count, a, b))
+                            break
+                for count, a, b in sorted(links):
+                    if chains[a].next is not None or chains[b].prev is not None:
+                        continue
+                    head, tail = a, b
+                    while chains[head].prev is not None:
+                        head = chains[head].prev
+                    while chains[tail].next is not None:
+                        tail = chains[tail].next
+                    # No loops, and the other chains must fit between the ends
+                    if head == b or (head == start and tail == fixed_last):
+                        continue
+                    chains[a].next = b
+                    chains[b].prev = a
+                    jmp_line = self.lines[chains[a].jmp]
+                    removed.add(chains[a].jmp)
+                    removed_bytes += jmp_line.content.get_ram_size(0, self.settings)
+                    saved += -count * FAST_INSTR_CYCLES
+                    report.append(f"{self.asm_file}:{jmp_line.line_number} Layout: jmp ${jmp_line.content.num.value} "
+                                  f"falls through, saves {-count * FAST_INSTR_CYCLES} cycles.")
+            placed = set()
+            for c in range(start, end):
+                head, tail = c, c
+                while chains[head].prev is not None:
+                    head = chains[head].prev
+                while chains[tail].next is not None:
+                    tail = chains[tail].next
+                # The group of a last chain that falls through goes last
+                if c in placed or (tail == fixed_last and c != fixed_last):
+                    continue
+                while head is not None:
+                    placed.add(head)
+                    lines += [line for idx, line in enumerate(self.lines[chains[head].first:chains[head].last + 1],
+                                                              chains[head].first) if idx not in removed]
+                    head = chains[head].next
+            if removed_bytes and padding:
+                # Never run, keeps the following pragma pos
+                line_number = self.lines[chains[end - 1].last].line_number
+                lines += [Line(indent=LineIndent(count=0, rest=""), content=CRamSet(num=Number(value=0, text="0"), rest=""),
+                               comment=None, raw_line=". 0", line_number=line_number)] * removed_bytes
+            start = end
+
+        for idx, line in enumerate(self.lines):
+            if isinstance(line.content, CJumpConditional) and isinstance(line.content.num.value, str):
+                self._report_reversible(idx, exec_count, removed, report)
+        jmp_nr = len(removed)
+        report.append(f"{self.asm_file}: Layout removes {jmp_nr} jump{'' if jmp_nr == 1 else 's'} and saves {saved} "
+                      f"of {total} cycles ({100 * saved / total if total else 0:.2f}%).")
+        if removed:
+            self.lines = lines
+            self.compile()
+        return report
+
+    def _report_reversible(self, idx: int, exec_count: dict[int, int], removed: set[int], report: list[str]) -> None:
+        """A jxxx that jumps over a jmp to the line after it. Reversing the
+        condition would remove the jmp, but the machine has no reversed
+        conditions."""
+        target = self.lines[idx].content.num.value
+        idx_jmp = idx + 1
+        while idx_jmp < len(self.lines) and isinstance(self.lines[idx_jmp].content, CEmpty):
+            idx_jmp += 1
+        if (idx_jmp == len(self.lines) or not isinstance(self.lines[idx_jmp].content, CJump) or idx_jmp in removed
+                or not exec_count.get(self.line_pos[idx_jmp], 0)):
+            return
+        for line in self.lines[idx_jmp + 1:]:
+            if isinstance(line.content, CLabel) and line.content.name == target:
+                # The jmp runs each time the jxxx falls through
+                count = exec_count[self.line_pos[idx_jmp]] * FAST_INSTR_CYCLES
+                report.append(f"{self.asm_file}:{self.lines[idx].line_number} Layout: the reversed condition "
+                              f"would save {count} cycles, the machine has none.")
+                return
+            if not isinstance(line.content, (CLabel, CEmpty)):
+                return
+
     def to_asm(self) -> str:
         return "\n".join(line.to_asm(self.settings) for line in self.lines)
 
     def to_ram(self) -> bytes:
+        if self.settings.wide:
+            # Image header, see COMPUTER_IMAGE_MAGIC in computer.h
+            return b"MC16" + bytes([1, 16, 0, 0]) + self.ram
         return self.ram
 
+    def to_map(self) -> str:
+        """Source map for simulator --map, see srcmap.h for the format"""
+        ret = "# minicomp map 1\n"
+        for pos, line_number, is_data, label in self.map:
+            ret += f"{pos:03d} {line_number} {'d' if is_data else 'c'} {label or '-'} {self.asm_file}\n"
+        return ret
+
 def main(argv):
     parser = argparse.ArgumentParser(prog="8bit ASM compiler")
     parser.add_argument("-c", "--config")
@@ -878,13 +1099,28 @@ def main(argv):
     cmd_compile = cmd_parser.add_parser("compile")
     cmd_compile.add_argument("asm_file_in")
     cmd_compile.add_argument("ram_file_out")
+    cmd_compile.add_argument("--map", help="write a source map for simulator --map")
+    cmd_compile.add_argument("--wide", action="store_true", help="compile for simulator16")
+    cmd_compile.add_argument("--profile-use", help="reorder code so the jumps that ran most in a simulator --branch-profile file fall through")
+    cmd_run = cmd_parser.add_parser("run", help="compile and run in-process (needs 'make python')")
+    cmd_run.add_argument("--input", default="", help="keyboard input")
+    cmd_run.add_argument("--max-cycles", type=int, default=1000000000)
+    cmd_run.add_argument("asm_file_in")
     parsed = parser.parse_args(argv[1:])
     config_file = pathlib.Path(parsed.config or "minicomp.config.json")
     if config_file.exists():
         settings = Settings.model_validate_json(config_file.read_text())
     else:
         settings = Settings()
+    if parsed.cmd == "compile" and parsed.wide:
+        settings.wide = True
+    if parsed.cmd == "run" and settings.wide:
+        print("run only supports the 8-bit machine")
+        return
     asm_program = AsmProgram(parsed.asm_file_in, settings=settings)
+    if parsed.cmd == "compile" and parsed.profile_use and not asm_program.errors:
+        for line in asm_program.layout(parsed.profile_use):
+            print(line, file=sys.stderr)
     if asm_program.errors:
         for error in asm_program.errors:
             print(error)
@@ -896,6 +1132,14 @@ def main(argv):
             print(asm_program.to_asm(), end="")
     elif parsed.cmd == "compile":
         pathlib.Path(parsed.ram_file_out).write_bytes(asm_program.to_ram())
+        if parsed.map:
+            pathlib.Path(parsed.map).write_text(asm_program.to_map())
+    elif parsed.cmd == "run":
+        import pyminicomp
+
+        result = pyminicomp.run(asm_program.to_ram(), input=parsed.input.encode(), max_cycles=parsed.max_cycles)
+        sys.stdout.write(result.output.decode("latin-1"))
+        print(f"Total clock-cycles: {result.cycles}.")
 
 if __name__ == "__main__":
     main(sys.argv)
@@ -4,19 +4,33 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include "computer.h"
+#include "cfg.h"
+#include "srcmap.h"
+#include "profile.h"
 #include <argp.h>
 #include "config_impl.h"
 
+/* Largest image, for the 16-bit machine */
+#define ASM_RAM_MAX (1 << 16)
+
 static int gs_in_line = 0;
 static int gs_error_nr = 0;
+static int gs_ram_size = COMPUTER_RAM_SIZE;
+static int gs_imm_len = 1; /* Bytes of the operand of DATA, JMP and JXXX */
 
 struct arguments {
     int print_label_value;
+    int wide;
+    int step_cycles;
+    char *listing_file;
+    char *label_file;
+    char *map_file;
+    char *profile_file;
     char *asm_file;
     char *ram_file;
 };
 
-static struct arguments gs_arg = { 0, NULL, NULL };
+static struct arguments gs_arg = { 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL };
 
 char const *argp_program_version = "asm_compiler " MINICOMP_VERSION;
 char const *argp_program_bug_address = "<boris.carlsson@gmail.com>";
@@ -27,6 +41,12 @@ static char gs_argp_args_doc[] = "asm-file ram-file";
 static struct argp_option gs_argp_options[] = {
     { "print-label-value", 'L', NULL, 0, "Print numerical value of all labels", 0 },
     { "no-print-label-value", 'l', NULL, OPTION_HIDDEN, "Do not print numerical value of all labels", 0 },
+    { "listing", 'S', "FILE", 0, "Write a listing with basic blocks and cycle costs to FILE (- for stdout)", 0 },
+    { "step-cycles", 'C', NULL, 0, "Count the listing cycles of the simulator without --fast, which steps every clock cycle", 0 },
+    { "label-file", 'Y', "FILE", 0, "Write the value of all labels to FILE, one \"NAME VALUE\" per line", 0 },
+    { "wide", 'W', NULL, 0, "Compile for the 16-bit machine (simulator16): 64 KiB RAM and 2-byte operands", 0 },
+    { "map", 'M', "FILE", 0, "Write a source map (RAM position to line and label) to FILE, for simulator --map", 0 },
+    { "profile-use", 'U', "FILE", 0, "Reorder code so the jumps that ran most in FILE (simulator --branch-profile) fall through", 0 },
     { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -41,12 +61,31 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         case 'l':
             arguments->print_label_value = 0;
             break;
+        case 'S':
+            arguments->listing_file = arg;
+            break;
+        case 'C':
+            arguments->step_cycles = 1;
+            break;
+        case 'Y':
+            arguments->label_file = arg;
+            break;
+        case 'M':
+            arguments->map_file = arg;
+            break;
+        case 'W':
+            arguments->wide = 1;
+            break;
+        case 'U':
+            arguments->profile_file = arg;
+            break;
         case ARGP_KEY_ARG:
             if(state->arg_num == 0) arguments->asm_file = arg;
             if(state->arg_num == 1) arguments->ram_file = arg;
             break;
         case ARGP_KEY_END:
             if(state->arg_num != 2) argp_usage(state);
+            if(arguments->wide && arguments->listing_file) argp_error(state, "--listing can not be used with --wide");
             break;
         default:
         return ARGP_ERR_UNKNOWN;
@@ -68,6 +107,18 @@ static void *malloc_safe(size_t s)
     return d;
 }
 
+static void *realloc_safe(void *p, size_t s)
+{
+    void *d;
+
+    if((d = realloc(p, s)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return d;
+}
+
 static void report_error(char const *msg, ...)
     __attribute__((format(printf, 1, 2)));
 
@@ -92,6 +143,7 @@ static void report_error(char const *msg, ...)
  * so that the base value of the label can be inserted there. */
 struct label_pos_list {
     int pos; /* Position in RAM */
+    int size; /* Number of bytes */
     struct label_pos_list *next;
 };
 
@@ -116,7 +168,7 @@ static struct label_list *label_list_alloc(char *name)
     return label;
 }
 
-static struct label_pos_list *label_pos_list_add_pos(struct label_pos_list *pos, int val)
+static struct label_pos_list *label_pos_list_add_pos(struct label_pos_list *pos, int val, int size)
 {
     struct label_pos_list *p = pos;
 
@@ -124,6 +176,7 @@ static struct label_pos_list *label_pos_list_add_pos(struct label_pos_list *pos,
         pos = malloc_safe(sizeof(struct label_pos_list));
         pos->next = NULL;
         pos->pos = val;
+        pos->size = size;
         return pos;
     }
 
@@ -133,23 +186,24 @@ static struct label_pos_list *label_pos_list_add_pos(struct label_pos_list *pos,
     p->next = malloc_safe(sizeof(struct label_pos_list));
     p->next->next = NULL;
     p->next->pos = val;
+    p->next->size = size;
 
     return pos;
 }
 
-static struct label_list *label_list_add_pos(struct label_list *label, char *name, int pos)
+static struct label_list *label_list_add_pos(struct label_list *label, char *name, int pos, int size)
 {
     struct label_list *p = label;
 
     if(label == NULL) {
         label = label_list_alloc(name);
-        label->pos = label_pos_list_add_pos(label->pos, pos);
+        label->pos = label_pos_list_add_pos(label->pos, pos, size);
         return label;
     }
 
     for(p = label; ; p = p->next) {
         if(strcmp(p->name, name) == 0) {
-            p->pos = label_pos_list_add_pos(p->pos, pos);
+            p->pos = label_pos_list_add_pos(p->pos, pos, size);
             return label;
         }
         if(p->next == NULL) break;
@@ -157,7 +211,7 @@ static struct label_list *label_list_add_pos(struct label_list *label, char *nam
 
     /* The label does not exist, so create it and add the pos */
     p->next = label_list_alloc(name);
-    p->next->pos = label_pos_list_add_pos(p->next->pos, pos);
+    p->next->pos = label_pos_list_add_pos(p->next->pos, pos, size);
 
     return label;
 }
@@ -190,6 +244,196 @@ static struct label_list *label_list_set_base(struct label_list *label, char *na
     return label;
 }
 
+/* Source line with the RAM bytes it produced, used for the listing and
+ * the source map. */
+struct listing_line {
+    char *text;
+    int line;
+    int pos; /* First RAM position */
+    int len; /* Number of RAM bytes */
+    int is_data; /* Raw data, not an instruction */
+    char const *label; /* Last label before the line, NULL if none */
+    int op; /* Opcode (first byte >> 4) of an instruction, -1 if none */
+    char *target; /* Label operand of JMP and JXXX, NULL if none */
+    char *defines; /* Label defined by the line, NULL if none */
+    int pin; /* PIN_*, the line may not be moved */
+};
+
+#define PIN_NONE 0
+#define PIN_POS 1 /* PRAGMA POS */
+#define PIN_SETPOS 2 /* PRAGMA SETPOS */
+#define PIN_LABEL 3 /* "::" label */
+
+static struct listing_line *gs_listing = NULL;
+static int gs_listing_nr = 0;
+static char *gs_label_cur = NULL;
+static struct listing_line *gs_listing_cur = NULL;
+
+static struct listing_line *listing_add(char const *text, int line, int pos)
+{
+    struct listing_line *l;
+    size_t len = strlen(text);
+
+    if((gs_listing_nr & (gs_listing_nr - 1)) == 0) {
+        gs_listing = realloc_safe(gs_listing, sizeof(*gs_listing) * (size_t)(gs_listing_nr ? 2 * gs_listing_nr : 1));
+    }
+    l = &gs_listing[gs_listing_nr++];
+    while(len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) len--;
+    l->text = malloc_safe(len + 1);
+    memcpy(l->text, text, len);
+    l->text[len] = '\0';
+    l->line = line;
+    l->pos = pos;
+    l->len = 0;
+    l->is_data = 0;
+    l->label = gs_label_cur;
+    l->op = -1;
+    l->target = NULL;
+    l->defines = NULL;
+    l->pin = PIN_NONE;
+
+    return l;
+}
+
+/* Remember the label operand of a jump for --profile-use */
+static void listing_set_target(char const *operand)
+{
+    if(gs_listing_cur == NULL || operand == NULL || operand[0] != '$') return;
+    gs_listing_cur->target = malloc_safe(strlen(operand));
+    strcpy(gs_listing_cur->target, operand + 1);
+}
+
+static void listing_clear(void)
+{
+    int i;
+
+    for(i = 0; i < gs_listing_nr; i++) {
+        free(gs_listing[i].text);
+        free(gs_listing[i].target);
+    }
+    gs_listing_nr = 0;
+    gs_listing_cur = NULL;
+    gs_label_cur = NULL;
+}
+
+/* Source line, in the order it is assembled */
+struct src_line {
+    char *text;
+    int line;
+};
+
+static struct src_line *gs_src = NULL;
+static int gs_src_nr = 0;
+
+static void src_add(char const *text, int line)
+{
+    if((gs_src_nr & (gs_src_nr - 1)) == 0) {
+        gs_src = realloc_safe(gs_src, sizeof(*gs_src) * (size_t)(gs_src_nr ? 2 * gs_src_nr : 1));
+    }
+    gs_src[gs_src_nr].text = malloc_safe(strlen(text) + 1);
+    strcpy(gs_src[gs_src_nr].text, text);
+    gs_src[gs_src_nr].line = line;
+    gs_src_nr++;
+}
+
+/* Write the source map, see srcmap.h for the format */
+static void write_map(void)
+{
+    FILE *fp;
+    int i;
+
+    if((fp = fopen(gs_arg.map_file, "w")) == NULL) {
+        fprintf(stderr, "Error: Could not open '%s' for writing.\n", gs_arg.map_file);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "%s\n", SRCMAP_MAGIC);
+    for(i = 0; i < gs_listing_nr; i++) {
+        struct listing_line const *l = &gs_listing[i];
+
+        if(l->len == 0 || l->pos >= gs_ram_size) continue;
+        fprintf(fp, "%03d %d %c %s %s\n", l->pos, l->line, l->is_data ? 'd' : 'c', l->label ? l->label : "-",
+                gs_arg.asm_file);
+    }
+    fclose(fp);
+}
+
+/* Write the listing: every source line with address, encoding and cycle
+ * cost, split into basic blocks, followed by the control flow analysis. */
+static void write_listing(unsigned char const *ram, int ram_size, struct label_list *label)
+{
+    unsigned char is_instr[COMPUTER_RAM_SIZE];
+    unsigned char leader[COMPUTER_RAM_SIZE];
+    char const *name[COMPUTER_RAM_SIZE];
+    struct cfg *cfg = malloc_safe(sizeof(struct cfg));
+    struct label_list *p;
+    FILE *fp;
+    int i;
+
+    if(strcmp(gs_arg.listing_file, "-") == 0) {
+        fp = stdout;
+    } else if((fp = fopen(gs_arg.listing_file, "w")) == NULL) {
+        fprintf(stderr, "Error: Could not open '%s' for writing.\n", gs_arg.listing_file);
+        exit(EXIT_FAILURE);
+    }
+
+    if(ram_size > COMPUTER_RAM_SIZE) ram_size = COMPUTER_RAM_SIZE;
+    memset(is_instr, 0, sizeof(is_instr));
+    memset(leader, 0, sizeof(leader));
+    memset(name, 0, sizeof(name));
+    for(i = 0; i < gs_listing_nr; i++) {
+        if(gs_listing[i].len > 0 && !gs_listing[i].is_data && gs_listing[i].pos < ram_size) {
+            is_instr[gs_listing[i].pos] = 1;
+        }
+    }
+    for(p = label; p; p = p->next) {
+        struct label_pos_list *q;
+
+        if(p->base < 0 || p->base >= ram_size) continue;
+        if(name[p->base] == NULL) name[p->base] = p->name;
+        /* A label loaded with DATA may be the target of JMPR */
+        for(q = p->pos; q; q = q->next) {
+            if(q->pos > 0 && is_instr[q->pos - 1] && (ram[q->pos - 1] >> 4) == COMPUTER_INSTR_DATA) {
+                leader[p->base] = 1;
+            }
+        }
+    }
+
+    cfg_build(cfg, ram, ram_size, is_instr, leader,
+              gs_arg.step_cycles ? COMPUTER_INSTR_LEN : COMPUTER_FAST_INSTR_CYCLES);
+
+    fprintf(fp, "%3s  %-5s %6s %5s  %s\n", "pos", "bytes", "cycles", "line", "source");
+    for(i = 0; i < gs_listing_nr; i++) {
+        struct listing_line const *l = &gs_listing[i];
+        char bytes[8] = "";
+        int b = l->len > 0 && l->pos < ram_size ? cfg->block_of[l->pos] : -1;
+
+        if(!l->is_data && b >= 0 && cfg->block[b].start == l->pos) {
+            fprintf(fp, "---- block %d: %lu cycles", b, cfg->block[b].cycles);
+            if(cfg->block[b].loop >= 0) fprintf(fp, ", loop %d", cfg->block[b].loop);
+            fprintf(fp, " ----\n");
+        }
+        if(l->len > 0 && l->pos < ram_size) {
+            if(l->len == 1) {
+                sprintf(bytes, "%02x", ram[l->pos]);
+            } else if(l->len == 2 && l->pos + 1 < ram_size) {
+                sprintf(bytes, "%02x %02x", ram[l->pos], ram[l->pos + 1]);
+            }
+        }
+        if(l->len > 0 && !l->is_data && b >= 0) {
+            fprintf(fp, "%03d  %-5s %6lu %5d  %s\n", l->pos, bytes, cfg->instr_cycles, l->line, l->text);
+        } else if(l->len > 0) {
+            fprintf(fp, "%03d  %-5s %6s %5d  %s\n", l->pos, bytes, "", l->line, l->text);
+        } else {
+            fprintf(fp, "%3s  %-5s %6s %5d  %s\n", "", "", "", l->line, l->text);
+        }
+    }
+
+    cfg_print(cfg, fp, name);
+
+    if(fp != stdout) fclose(fp);
+    free(cfg);
+}
+
 /* Characters that are treated as whitespace */
 static int isignore(char c)
 {
@@ -247,17 +491,28 @@ static void set_ram(unsigned char *ram, int *pos, int val)
         fprintf(stderr, "Internal compiler error 2.\n");
         exit(EXIT_FAILURE);
     }
-    if(*pos == 256) {
+    if(*pos == gs_ram_size) {
         report_error("Program too large");
     }
-    if(*pos < 256) {
+    if(*pos < gs_ram_size) {
         ram[*pos] = (unsigned char)val;
     }
     (*pos)++;
+    if(gs_listing_cur) {
+        if(gs_listing_cur->len++ == 0 && !gs_listing_cur->is_data) gs_listing_cur->op = val >> 4;
+    }
+}
+
+/* Set the operand of DATA, JMP or JXXX, little-endian for --wide */
+static void set_imm(unsigned char *ram, int *pos, long val)
+{
+    set_ram(ram, pos, (int)(val & 255));
+    if(gs_imm_len == 2) set_ram(ram, pos, (int)(val >> 8));
 }
 
-/* Parse a number, either as binary, decimal, hexadecimal, octal, character or label */
-static unsigned char get_number(char *s, struct label_list **label, int ram_pos)
+/* Parse a number, either as binary, decimal, hexadecimal, octal, character or label.
+ * size is the number of bytes it is stored in. */
+static long get_number(char *s, struct label_list **label, int ram_pos, int size)
 {
     char *p;
     long val;
@@ -274,7 +529,7 @@ static unsigned char get_number(char *s, struct label_list **label, int ram_pos)
 
     /* Check if number is a label */
     if(s[0] == '$') {
-        *label = label_list_add_pos(*label, s+1, ram_pos);
+        *label = label_list_add_pos(*label, s+1, ram_pos, size);
         /* We return 0 now, and will later set all the label positions to the base value.
          * This is necessary since the base value might not be set at this point. */
         return 0;
@@ -307,37 +562,258 @@ static unsigned char get_number(char *s, struct label_list **label, int ram_pos)
         exit(EXIT_FAILURE);
     }
 
-    if(val < 0 || val > 255) {
+    if(val < 0 || val >= 1L << (8 * size)) {
         fprintf(stderr, "Invalid number: %ld.\n", val);
         exit(EXIT_FAILURE);
     }
 
-    return (unsigned char)val;
+    return val;
 }
 
-int main(int argc, char *argv[])
+/* Source lines from after a JMP or JMPR up to the next one. Nothing falls
+ * through into a chain, so --profile-use can move it as a whole. */
+struct chain {
+    int first, last; /* Lines in gs_src */
+    int jmp; /* Line of the JMP that ends the chain, -1 if none */
+    int ends; /* Ends with JMP or JMPR */
+    int pinned; /* Has a PRAGMA or a "::" label */
+    int prev, next; /* Chains placed directly before and after it, -1 if none */
+};
+
+struct layout_link {
+    int from, to; /* Chains */
+    unsigned long count; /* Runs of the JMP at the end of from */
+};
+
+static int compare_link(void const *a, void const *b)
+{
+    struct layout_link const *la = a;
+    struct layout_link const *lb = b;
+
+    if(la->count != lb->count) return la->count < lb->count ? 1 : -1;
+    return la->from - lb->from;
+}
+
+/* 1 if the chain starts with the label name, before any byte */
+static int chain_has_entry(struct chain const *c, char const *name)
 {
-    FILE *in, *out;
-    unsigned char ram[COMPUTER_RAM_SIZE];
-    int ram_pos = 0;
-    struct label_list *label = NULL;
-    char line[BUFSIZ];
     int i;
 
-    argp_parse(&gs_argp, argc, argv, 0, 0, &gs_arg);
+    for(i = c->first; i <= c->last && gs_listing[i].len == 0; i++) {
+        if(gs_listing[i].defines && strcmp(gs_listing[i].defines, name) == 0) return 1;
+    }
+    return 0;
+}
 
-    if((in = fopen(gs_arg.asm_file, "r")) == NULL) {
-        fprintf(stderr, "Could not open '%s' for reading.\n", argv[1]);
+/* 1 if the next PRAGMA from line on is a POS, which needs the code before
+ * it to keep its size */
+static int needs_padding(int line)
+{
+    for(; line < gs_src_nr; line++) {
+        if(gs_listing[line].pin == PIN_POS) return 1;
+        if(gs_listing[line].pin == PIN_SETPOS) return 0;
+    }
+    return 0;
+}
+
+/* Link the chains s to e - 1 so that the most run JMPs between them can be
+ * removed. The first chain stays first, and the last one stays last if it
+ * falls through into the next segment. Returns the bytes removed. */
+static int link_chains(struct chain *chain, int s, int e, struct profile const *prof,
+                       unsigned char *removed, unsigned long *saved)
+{
+    struct layout_link *link = malloc_safe(sizeof(*link) * (size_t)(e - s));
+    int fixed_last = chain[e - 1].ends ? -1 : e - 1;
+    int link_nr = 0;
+    int bytes = 0;
+    int a, b, i;
+
+    /* Without a JMP at the end, nothing can fill the space before a PRAGMA POS */
+    if(fixed_last >= 0 && needs_padding(chain[e - 1].last + 1)) {
+        free(link);
+        return 0;
+    }
+    for(a = s; a < e; a++) {
+        struct listing_line const *j;
+
+        if(chain[a].jmp < 0) continue;
+        j = &gs_listing[chain[a].jmp];
+        if(j->target == NULL || j->pos >= gs_ram_size || prof->exec[j->pos] == 0) continue;
+        for(b = s + 1; b < e; b++) {
+            if(b != a && chain_has_entry(&chain[b], j->target)) {
+                link[link_nr].from = a;
+                link[link_nr].to = b;
+                link[link_nr].count = prof->exec[j->pos];
+                link_nr++;
+                break;
+            }
+        }
+    }
+    qsort(link, (size_t)link_nr, sizeof(*link), compare_link);
+
+    for(i = 0; i < link_nr; i++) {
+        int head = a = link[i].from;
+        int tail = b = link[i].to;
+        struct listing_line const *j = &gs_listing[chain[a].jmp];
+
+        if(chain[a].next >= 0 || chain[b].prev >= 0) continue;
+        while(chain[head].prev >= 0) head = chain[head].prev;
+        while(chain[tail].next >= 0) tail = chain[tail].next;
+        /* No loops, and the other chains must fit between the ends */
+        if(head == b || (head == s && tail == fixed_last)) continue;
+        chain[a].next = b;
+        chain[b].prev = a;
+        removed[chain[a].jmp] = 1;
+        bytes += j->len;
+        *saved += link[i].count * COMPUTER_FAST_INSTR_CYCLES;
+        fprintf(stderr, "%s:%d Layout: JMP $%s falls through, saves %lu cycles.\n", gs_arg.asm_file, j->line,
+                j->target, link[i].count * COMPUTER_FAST_INSTR_CYCLES);
+    }
+    free(link);
+    return bytes;
+}
+
+/* Report a JXXX that jumps over a JMP to the line after it. Reversing the
+ * condition would remove the JMP, but the machine has no reversed
+ * conditions, so it can only be done by changing the comparison. */
+static void report_reversible(int jxxx, struct profile const *prof, unsigned char const *removed)
+{
+    struct listing_line const *l = &gs_listing[jxxx];
+    int i, jmp;
+
+    if(l->target == NULL) return;
+    for(jmp = jxxx + 1; jmp < gs_src_nr && gs_listing[jmp].len == 0 && gs_listing[jmp].defines == NULL; jmp++);
+    if(jmp == gs_src_nr || gs_listing[jmp].op != COMPUTER_INSTR_JMP || removed[jmp] ||
+       gs_listing[jmp].pos >= gs_ram_size || prof->exec[gs_listing[jmp].pos] == 0) {
+        return;
+    }
+    for(i = jmp + 1; i < gs_src_nr && gs_listing[i].len == 0; i++) {
+        if(gs_listing[i].defines && strcmp(gs_listing[i].defines, l->target) == 0) {
+            /* The JMP runs each time the JXXX falls through */
+            fprintf(stderr, "%s:%d Layout: the reversed condition would save %lu cycles, the machine has none.\n",
+                    gs_arg.asm_file, l->line, prof->exec[gs_listing[jmp].pos] * COMPUTER_FAST_INSTR_CYCLES);
+            return;
+        }
+    }
+}
+
+/* Reorder gs_src with the profile from --profile-use, see README.md.
+ * Returns 1 if the order changed. */
+static int layout(unsigned char const *ram)
+{
+    struct profile *prof = malloc_safe(sizeof(struct profile));
+    struct chain *chain = malloc_safe(sizeof(*chain) * (size_t)gs_src_nr);
+    unsigned char *removed = malloc_safe((size_t)gs_src_nr);
+    unsigned char *placed = malloc_safe((size_t)gs_src_nr);
+    struct src_line *src = malloc_safe(sizeof(*src) * (size_t)(gs_src_nr + gs_ram_size));
+    int chain_nr = 0, src_nr = 0, jmp_nr = 0;
+    unsigned long total = 0, saved = 0;
+    int i, s, e, c;
+
+    if(profile_load(prof, gs_arg.profile_file)) {
+        fprintf(stderr, "Error: '%s' is not a profile.\n", gs_arg.profile_file);
+        exit(EXIT_FAILURE);
+    }
+    if(prof->hash != profile_hash(ram, gs_ram_size)) {
+        fprintf(stderr, "Error: The profile '%s' was made with another version of the program.\n", gs_arg.profile_file);
         exit(EXIT_FAILURE);
     }
+    for(i = 0; i < PROFILE_MAX_SIZE; i++) total += prof->exec[i] * COMPUTER_FAST_INSTR_CYCLES;
+    memset(removed, 0, (size_t)gs_src_nr);
+    memset(placed, 0, (size_t)gs_src_nr);
+
+    for(i = 0; i < gs_src_nr; i++) {
+        struct listing_line const *l = &gs_listing[i];
+
+        if(i == 0 || chain[chain_nr - 1].ends) {
+            chain[chain_nr].first = i;
+            chain[chain_nr].jmp = -1;
+            chain[chain_nr].ends = 0;
+            chain[chain_nr].pinned = 0;
+            chain[chain_nr].prev = chain[chain_nr].next = -1;
+            chain_nr++;
+        }
+        chain[chain_nr - 1].last = i;
+        if(l->pin != PIN_NONE) chain[chain_nr - 1].pinned = 1;
+        if(l->op == COMPUTER_INSTR_JMP || l->op == COMPUTER_INSTR_JMPR) {
+            chain[chain_nr - 1].ends = 1;
+            if(l->op == COMPUTER_INSTR_JMP) chain[chain_nr - 1].jmp = i;
+        }
+    }
+
+    for(s = 0; s < chain_nr; s = e) {
+        int bytes = 0;
+
+        /* A segment of chains that may move, or one pinned chain */
+        for(e = s + 1; e < chain_nr && !chain[s].pinned && !chain[e].pinned; e++);
+        if(!chain[s].pinned) bytes = link_chains(chain, s, e, prof, removed, &saved);
+        for(c = s; c < e; c++) {
+            int head = c, tail = c;
+
+            while(chain[head].prev >= 0) head = chain[head].prev;
+            while(chain[tail].next >= 0) tail = chain[tail].next;
+            /* The group of a last chain that falls through goes last */
+            if(placed[c] || (tail == e - 1 && !chain[e - 1].ends && c != e - 1)) continue;
+            for(; head >= 0; head = chain[head].next) {
+                placed[head] = 1;
+                for(i = chain[head].first; i <= chain[head].last; i++) {
+                    if(!removed[i]) src[src_nr++] = gs_src[i];
+                }
+            }
+        }
+        jmp_nr += bytes / (1 + gs_imm_len);
+        if(bytes > 0 && needs_padding(chain[e - 1].last + 1)) {
+            /* Never run, keeps the following PRAGMA POS */
+            for(i = 0; i < bytes; i++) {
+                src[src_nr].text = malloc_safe(4);
+                strcpy(src[src_nr].text, ". 0");
+                src[src_nr].line = gs_src[chain[e - 1].last].line;
+                src_nr++;
+            }
+        }
+    }
+
+    for(i = 0; i < gs_src_nr; i++) {
+        if(gs_listing[i].op == COMPUTER_INSTR_JXXX) report_reversible(i, prof, removed);
+    }
+    fprintf(stderr, "%s: Layout removes %d jump%s and saves %lu of %lu cycles (%.2f%%).\n", gs_arg.asm_file, jmp_nr,
+            jmp_nr == 1 ? "" : "s", saved, total, total ? 100 * (double)saved / (double)total : 0.0);
+
+    free(prof);
+    free(chain);
+    free(removed);
+    free(placed);
+    if(jmp_nr == 0) {
+        free(src);
+        return 0;
+    }
+    free(gs_src);
+    gs_src = src;
+    gs_src_nr = src_nr;
+    return 1;
+}
+
+/* Assemble gs_src into ram. Returns the position after the last byte and
+ * the labels in *label_out, which still have to be resolved. */
+static int assemble(unsigned char *ram, struct label_list **label_out)
+{
+    int ram_pos = 0;
+    struct label_list *label = NULL;
+    char line[BUFSIZ];
+    int i, n;
 
-    while(fgets(line, BUFSIZ, in)) {
-        char *tline = trim(line);
+    for(n = 0; n < gs_src_nr; n++) {
+        char *tline;
         char *sub1 = NULL;
         char *sub2 = NULL;
         int bad;
 
-        gs_in_line++;
+        gs_in_line = gs_src[n].line;
+        strcpy(line, gs_src[n].text);
+        if(gs_arg.listing_file || gs_arg.map_file || gs_arg.profile_file) {
+            gs_listing_cur = listing_add(line, gs_in_line, ram_pos);
+        }
+        tline = trim(line);
 
         /* Skip empty lines and comments */
         if(tline[0] == '\0' || tline[0] == '#') continue;
@@ -391,11 +867,15 @@ int main(int argc, char *argv[])
                     tline[strlen(tline) - 1] = '\0';
                     if(strlen(tline)) {
                         label = label_list_set_base(label, tline, ram_pos + 1);
+                        if(gs_listing_cur) gs_listing_cur->pin = PIN_LABEL;
                     } else {
                         report_error("Too short label name (0 chars)");
                     }
                 } else {
                     label = label_list_set_base(label, tline, ram_pos);
+                    gs_label_cur = malloc_safe(strlen(tline) + 1);
+                    strcpy(gs_label_cur, tline);
+                    if(gs_listing_cur) gs_listing_cur->defines = gs_label_cur;
                 }
             } else {
                 report_error("Too short label name (0 chars)");
@@ -408,7 +888,8 @@ int main(int argc, char *argv[])
             if(sub1 == NULL || sub2 != NULL) {
                 report_error("Bad data format, expected \". <number>\"");
             }
-            set_ram(ram, &ram_pos, (unsigned char)get_number(sub1, &label, ram_pos));
+            if(gs_listing_cur) gs_listing_cur->is_data = 1;
+            set_ram(ram, &ram_pos, (int)get_number(sub1, &label, ram_pos, 1));
             continue;
         }
 
@@ -418,34 +899,36 @@ int main(int argc, char *argv[])
                 report_error("Bad format: Expected a pragma type: \"POS\", \"SETPOS\"");
             }
             if(strcmp(sub1, "POS") == 0) {
-                unsigned char requested_pos;
+                long requested_pos;
 
+                if(gs_listing_cur) gs_listing_cur->pin = PIN_POS;
                 if(sub2 == NULL) {
                     report_error("Expected numerical position after pragma pos");
                 }
 
-                requested_pos = get_number(sub2, &label, ram_pos);
+                requested_pos = get_number(sub2, &label, ram_pos, gs_imm_len);
                 if(requested_pos == 0) {
                     report_error("pragma pos cannot be a label or the position 0");
                 }
                 if(ram_pos != requested_pos) {
-                    report_error("pragma pos mismatch: requested(%d) != actual(%d)", requested_pos, ram_pos);
+                    report_error("pragma pos mismatch: requested(%ld) != actual(%d)", requested_pos, ram_pos);
                 }
             } else if(strcmp(sub1, "SETPOS") == 0) {
-                unsigned char requested_pos;
+                long requested_pos;
 
+                if(gs_listing_cur) gs_listing_cur->pin = PIN_SETPOS;
                 if(sub2 == NULL) {
                     report_error("Expected numerical position after pragma setpos");
                 }
 
-                requested_pos = get_number(sub2, &label, ram_pos);
+                requested_pos = get_number(sub2, &label, ram_pos, gs_imm_len);
                 if(requested_pos == 0) {
                     report_error("pragma setpos cannot be a label or the position 0");
                 }
                 if(ram_pos > requested_pos) {
-                    report_error("actual pos (%d) is larger than requested pos (%d) is setpos", ram_pos, requested_pos);
+                    report_error("actual pos (%d) is larger than requested pos (%ld) is setpos", ram_pos, requested_pos);
                 }
-                ram_pos = requested_pos;
+                ram_pos = (int)requested_pos;
             } else {
                 report_error("Unknown pragma \"%s\"", sub1);
             }
@@ -470,13 +953,14 @@ int main(int argc, char *argv[])
             set_ram(ram, &ram_pos, (unsigned char)((COMPUTER_INSTR_ST << 4) + (get_reg(sub1)<<2) + get_reg(sub2)));
         } else if(strcmp(tline, computer_instr_name[COMPUTER_INSTR_DATA]) == 0) {
             set_ram(ram, &ram_pos, (unsigned char)((COMPUTER_INSTR_DATA << 4) + get_reg(sub1)));
-            set_ram(ram, &ram_pos, (unsigned char)get_number(sub2, &label, ram_pos));
+            set_imm(ram, &ram_pos, get_number(sub2, &label, ram_pos, gs_imm_len));
         } else if(strcmp(tline, computer_instr_name[COMPUTER_INSTR_JMPR]) == 0) {
             set_ram(ram, &ram_pos, (unsigned char)((COMPUTER_INSTR_JMPR << 4) + get_reg(sub1)));
             if(sub2) bad = 1;
         } else if(strcmp(tline, computer_instr_name[COMPUTER_INSTR_JMP]) == 0) {
             set_ram(ram, &ram_pos, (unsigned char)(COMPUTER_INSTR_JMP << 4));
-            set_ram(ram, &ram_pos, (unsigned char)get_number(sub1, &label, ram_pos));
+            listing_set_target(sub1);
+            set_imm(ram, &ram_pos, get_number(sub1, &label, ram_pos, gs_imm_len));
             if(sub2) bad = 1;
         } else if(strcmp(tline, computer_instr_name[COMPUTER_INSTR_CLF]) == 0) {
             set_ram(ram, &ram_pos, (unsigned char)(COMPUTER_INSTR_CLF << 4));
@@ -509,7 +993,8 @@ int main(int argc, char *argv[])
                 }
             }
             set_ram(ram, &ram_pos, (unsigned char)ram_tmp);
-            set_ram(ram, &ram_pos, (unsigned char)get_number(sub1, &label, ram_pos));
+            listing_set_target(sub1);
+            set_imm(ram, &ram_pos, get_number(sub1, &label, ram_pos, gs_imm_len));
             if(sub2) bad = 1;
         } else {
             report_error("Unknown instruction \"%s\"", tline);
@@ -520,34 +1005,109 @@ int main(int argc, char *argv[])
         }
     }
 
-    fclose(in);
     gs_in_line = -1;
+    *label_out = label;
 
-    /* Set label positions. */
-    {
-        struct label_list *p;
+    return ram_pos;
+}
 
-        /* Loop over labels. */
-        for(p = label; p; p = p->next) {
-            struct label_pos_list *q;
+/* Set label positions. */
+static void resolve_labels(unsigned char *ram, struct label_list *label)
+{
+    struct label_list *p;
 
-            /* If the label position is not set. */
-            if(p->base < 0) {
-                report_error("Undefined label \"%s\"", p->name);
-            } else if(gs_arg.print_label_value) {
-                printf("Label \"%s\" at ram-position %d.\n", p->name, p->base);
-            }
-            /* Loop over all positions. */
-            for(q = p->pos; q; q = q->next) {
-                ram[q->pos] = (unsigned char)p->base;
+    /* Loop over labels. */
+    for(p = label; p; p = p->next) {
+        struct label_pos_list *q;
+
+        /* If the label position is not set. */
+        if(p->base < 0) {
+            report_error("Undefined label \"%s\"", p->name);
+        }
+        /* Loop over all positions. */
+        for(q = p->pos; q; q = q->next) {
+            if(q->size == 1 && p->base > 255) {
+                report_error("Label \"%s\" at %d does not fit in a byte", p->name, p->base);
             }
+            ram[q->pos] = (unsigned char)p->base;
+            if(q->size == 2 && q->pos + 1 < gs_ram_size) ram[q->pos + 1] = (unsigned char)(p->base >> 8);
         }
     }
+}
 
+static void check_errors(void)
+{
     if(gs_error_nr) {
         fprintf(stderr, "%d error%s found.\n", gs_error_nr, (gs_error_nr == 1) ? "" : "s");
         exit(EXIT_FAILURE);
     }
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in, *out;
+    static unsigned char ram[ASM_RAM_MAX];
+    int ram_pos;
+    struct label_list *label;
+    char line[BUFSIZ];
+    int i;
+
+    argp_parse(&gs_argp, argc, argv, 0, 0, &gs_arg);
+    if(gs_arg.wide) {
+        gs_ram_size = ASM_RAM_MAX;
+        gs_imm_len = 2;
+    }
+
+    if((in = fopen(gs_arg.asm_file, "r")) == NULL) {
+        fprintf(stderr, "Could not open '%s' for reading.\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    for(i = 1; fgets(line, BUFSIZ, in); i++) {
+        src_add(line, i);
+    }
+    fclose(in);
+
+    ram_pos = assemble(ram, &label);
+    resolve_labels(ram, label);
+    check_errors();
+
+    /* Assemble again with the new order of the lines */
+    if(gs_arg.profile_file && layout(ram)) {
+        memset(ram, 0, sizeof(ram));
+        listing_clear();
+        ram_pos = assemble(ram, &label);
+        resolve_labels(ram, label);
+        check_errors();
+    }
+
+    if(gs_arg.print_label_value) {
+        struct label_list *p;
+
+        for(p = label; p; p = p->next) {
+            printf("Label \"%s\" at ram-position %d.\n", p->name, p->base);
+        }
+    }
+
+    if(gs_arg.listing_file) {
+        write_listing(ram, ram_pos, label);
+    }
+
+    if(gs_arg.map_file) {
+        write_map();
+    }
+
+    if(gs_arg.label_file) {
+        struct label_list *p;
+
+        if((out = fopen(gs_arg.label_file, "w")) == NULL) {
+            fprintf(stderr, "Error: Could not open '%s' for writing.\n", gs_arg.label_file);
+            exit(EXIT_FAILURE);
+        }
+        for(p = label; p; p = p->next) {
+            fprintf(out, "%s %d\n", p->name, p->base);
+        }
+        fclose(out);
+    }
 
     /* Write RAM-data to out-file. */
     if((out = fopen(gs_arg.ram_file, "wb")) == NULL) {
@@ -555,7 +1115,18 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    for(i = 0; i < ram_pos; i++) {
+    if(gs_arg.wide) {
+        unsigned char header[COMPUTER_IMAGE_HEADER_SIZE] = { 0 };
+
+        memcpy(header, COMPUTER_IMAGE_MAGIC, 4);
+        header[4] = COMPUTER_IMAGE_VERSION;
+        header[5] = 16;
+        if(fwrite(header, sizeof(header), 1, out) != 1) {
+            fprintf(stderr, "Error: Could not write to \"%s\".\n", gs_arg.ram_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(i = 0; i < ram_pos && i < gs_ram_size; i++) {
         if(fputc(ram[i], out) == EOF) {
             fprintf(stderr, "Error: Could not write to \"%s\".\n", gs_arg.ram_file);
             exit(EXIT_FAILURE);
@@ -0,0 +1,1095 @@
+#include "cfg.h"
+#include "peri.h"
+#include <string.h>
+
+#define OP(instr) ((instr) >> 4)
+#define REG_A(instr) (((instr) >> 2) & 3)
+#define REG_B(instr) ((instr) & 3)
+
+static void consts_clear(struct cfg_consts *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+/* Register written by an instruction, or -1 */
+static int written_reg(unsigned char instr)
+{
+    int op = OP(instr);
+
+    if(op & 8) {
+        return (op & 7) == COMPUTER_ALU_CMP ? -1 : REG_B(instr);
+    }
+    if(op == COMPUTER_INSTR_LD || op == COMPUTER_INSTR_DATA) {
+        return REG_B(instr);
+    }
+    if(op == COMPUTER_INSTR_IO && ((REG_A(instr) >> 1) & 1) == COMPUTER_IO_INPUT) {
+        return REG_B(instr);
+    }
+    return -1;
+}
+
+static int is_terminate(struct cfg_consts const *c, unsigned char instr)
+{
+    return OP(instr) == COMPUTER_INSTR_IO && REG_A(instr) == 2 &&
+           c->io_known && c->io_addr == PERI_ADDR_TERMINATE;
+}
+
+/* Update the known values after executing the instruction at pos */
+static void consts_step(struct cfg_consts *c, unsigned char const *ram, int pos)
+{
+    unsigned char instr = ram[pos];
+    int op = OP(instr);
+    int a = REG_A(instr);
+    int b = REG_B(instr);
+
+    if(op == COMPUTER_INSTR_DATA) {
+        c->known[b] = 1;
+        c->val[b] = ram[(pos + 1) % COMPUTER_RAM_SIZE];
+    } else if(op == 8 + COMPUTER_ALU_XOR && a == b) {
+        c->known[b] = 1;
+        c->val[b] = 0;
+    } else if(op == 8 + COMPUTER_ALU_NOT) {
+        c->known[b] = c->known[a];
+        c->val[b] = (computer_word)~c->val[a];
+    } else if(op == 8 + COMPUTER_ALU_AND || op == 8 + COMPUTER_ALU_OR || op == 8 + COMPUTER_ALU_XOR) {
+        /* These do not use the carry, so known inputs give a known result */
+        c->known[b] = c->known[a] && c->known[b];
+        c->val[b] = (computer_word)(op == 8 + COMPUTER_ALU_AND ? c->val[a] & c->val[b] :
+                                    op == 8 + COMPUTER_ALU_OR ? c->val[a] | c->val[b] : c->val[a] ^ c->val[b]);
+    } else if(op == COMPUTER_INSTR_IO && a == 3) {
+        c->io_known = c->known[b];
+        c->io_addr = c->val[b];
+    } else {
+        int w = written_reg(instr);
+        if(w >= 0) c->known[w] = 0;
+    }
+}
+
+static int is_block_end(unsigned char instr)
+{
+    int op = OP(instr);
+
+    return op == COMPUTER_INSTR_JMPR || op == COMPUTER_INSTR_JMP || op == COMPUTER_INSTR_JXXX;
+}
+
+/* Find instruction starts by following direct control flow from start */
+static void discover(struct cfg *cfg, int start)
+{
+    int stack[COMPUTER_RAM_SIZE * 2];
+    int sp = 0;
+
+    stack[sp++] = start;
+    while(sp > 0) {
+        int pos = stack[--sp];
+        struct cfg_consts c;
+
+        consts_clear(&c);
+        while(pos < cfg->size && !cfg->is_instr[pos]) {
+            unsigned char instr = cfg->ram[pos];
+            int len = computer_get_instruction_length(instr);
+            int op = OP(instr);
+
+            if(pos + len > cfg->size) break;
+            cfg->is_instr[pos] = 1;
+            if(op == COMPUTER_INSTR_JMPR || is_terminate(&c, instr)) break;
+            if(op == COMPUTER_INSTR_JMP || op == COMPUTER_INSTR_JXXX) {
+                int target = cfg->ram[pos + 1];
+                if(target < cfg->size && sp < (int)(sizeof(stack) / sizeof(stack[0]))) {
+                    stack[sp++] = target;
+                }
+                if(op == COMPUTER_INSTR_JMP) break;
+            }
+            consts_step(&c, cfg->ram, pos);
+            pos += len;
+        }
+    }
+}
+
+/* Instructions that fall through into bytes not marked as instructions,
+ * such as data written with ".", run those bytes as code */
+static void follow_fall_through(struct cfg *cfg)
+{
+    struct cfg_consts c;
+    int pos = 0;
+
+    consts_clear(&c);
+    while(pos < cfg->size) {
+        unsigned char instr = cfg->ram[pos];
+        int len = computer_get_instruction_length(instr);
+        int op = OP(instr);
+
+        if(!cfg->is_instr[pos]) {
+            consts_clear(&c);
+            pos++;
+            continue;
+        }
+        if(op == COMPUTER_INSTR_JMPR || op == COMPUTER_INSTR_JMP || is_terminate(&c, instr)) {
+            consts_clear(&c);
+        } else {
+            consts_step(&c, cfg->ram, pos);
+            if(pos + len < cfg->size && !cfg->is_instr[pos + len]) discover(cfg, pos + len);
+        }
+        pos += len;
+    }
+}
+
+static void add_succ(struct cfg *cfg, int b, int target)
+{
+    struct cfg_block *blk = &cfg->block[b];
+    int s;
+
+    if(target < 0 || target >= cfg->size || !cfg->is_instr[target]) return;
+    s = cfg->block_of[target];
+    if(s < 0 || cfg->block[s].start != target) return;
+    if(blk->succ_nr == 1 && blk->succ[0] == s) return;
+    blk->succ[blk->succ_nr++] = s;
+}
+
+static void build_blocks(struct cfg *cfg, unsigned char const *leader)
+{
+    unsigned char is_leader[COMPUTER_RAM_SIZE];
+    int pos, b;
+
+    memset(is_leader, 0, sizeof(is_leader));
+    for(pos = 0; pos < cfg->size; pos++) {
+        unsigned char instr = cfg->ram[pos];
+        int len, op;
+
+        if(!cfg->is_instr[pos]) continue;
+        len = computer_get_instruction_length(instr);
+        op = OP(instr);
+        if(leader && leader[pos]) is_leader[pos] = 1;
+        if(op == COMPUTER_INSTR_JMP || op == COMPUTER_INSTR_JXXX) {
+            int target = cfg->ram[(pos + 1) % COMPUTER_RAM_SIZE];
+            if(target < cfg->size) is_leader[target] = 1;
+        }
+        if(pos + len < cfg->size && is_block_end(instr)) {
+            is_leader[pos + len] = 1;
+        }
+    }
+    is_leader[0] = 1;
+
+    cfg->block_nr = 0;
+    for(pos = 0; pos < cfg->size; pos++) {
+        struct cfg_block *blk;
+        struct cfg_consts c;
+
+        if(!cfg->is_instr[pos] || cfg->block_of[pos] >= 0) continue;
+
+        blk = &cfg->block[cfg->block_nr];
+        memset(blk, 0, sizeof(*blk));
+        blk->start = pos;
+        blk->loop = -1;
+        blk->is_entry = pos == 0 || (leader && leader[pos]);
+        consts_clear(&c);
+        while(1) {
+            unsigned char instr = cfg->ram[pos];
+            int len = computer_get_instruction_length(instr);
+            int i;
+
+            for(i = 0; i < len && pos + i < cfg->size; i++) {
+                cfg->block_of[pos + i] = cfg->block_nr;
+            }
+            blk->last = pos;
+            blk->instr_nr++;
+            if(is_terminate(&c, instr)) {
+                blk->is_terminate = 1;
+            }
+            consts_step(&c, cfg->ram, pos);
+            pos += len;
+            if(blk->is_terminate || is_block_end(instr) || pos >= cfg->size ||
+               !cfg->is_instr[pos] || is_leader[pos]) {
+                break;
+            }
+        }
+        blk->end = pos;
+        blk->cycles = (unsigned long)blk->instr_nr * cfg->instr_cycles;
+        cfg->block_nr++;
+        pos--;
+    }
+
+    for(b = 0; b < cfg->block_nr; b++) {
+        struct cfg_block *blk = &cfg->block[b];
+        unsigned char instr = cfg->ram[blk->last];
+        int op = OP(instr);
+        int target = cfg->ram[(blk->last + 1) % COMPUTER_RAM_SIZE];
+
+        blk->succ[0] = blk->succ[1] = -1;
+        if(blk->is_terminate) continue;
+        if(op == COMPUTER_INSTR_JMPR) {
+            blk->is_indirect = 1;
+        } else if(op == COMPUTER_INSTR_JMP) {
+            add_succ(cfg, b, target);
+        } else if(op == COMPUTER_INSTR_JXXX) {
+            add_succ(cfg, b, blk->end);
+            add_succ(cfg, b, target);
+        } else {
+            add_succ(cfg, b, blk->end);
+        }
+    }
+}
+
+/* Run known values through a block up to (not including) address stop */
+static void block_consts(struct cfg const *cfg, int b, int stop, struct cfg_consts *c)
+{
+    int pos;
+
+    *c = cfg->entry[b];
+    for(pos = cfg->block[b].start; pos < stop; pos += computer_get_instruction_length(cfg->ram[pos])) {
+        consts_step(c, cfg->ram, pos);
+    }
+}
+
+/* Last instruction before address stop in block b that sets the flags, or -1 */
+static int last_flag_setter(struct cfg const *cfg, int b, int stop)
+{
+    int pos, setter = -1;
+
+    for(pos = cfg->block[b].start; pos < stop; pos += computer_get_instruction_length(cfg->ram[pos])) {
+        int op = OP(cfg->ram[pos]);
+        if(op & 8 || op == COMPUTER_INSTR_CLF) setter = pos;
+    }
+    return setter;
+}
+
+/* Values known when control goes from block b to its successor s. A JZ
+ * that is taken right after an ALU instruction also tells that the
+ * result register is 0. */
+static void edge_consts(struct cfg const *cfg, int b, int s, struct cfg_consts *c)
+{
+    struct cfg_block const *blk = &cfg->block[b];
+    unsigned char instr = cfg->ram[blk->last];
+    int setter, pos, r;
+
+    block_consts(cfg, b, blk->end, c);
+    if(OP(instr) != COMPUTER_INSTR_JXXX || (instr & 15) != 1 << COMPUTER_FLAG_ZERO) return;
+    if(cfg->block[s].start != cfg->ram[(blk->last + 1) % COMPUTER_RAM_SIZE] || cfg->block[s].start == blk->end) return;
+    if((setter = last_flag_setter(cfg, b, blk->last)) < 0) return;
+    if(!(OP(cfg->ram[setter]) & 8) || OP(cfg->ram[setter]) == 8 + COMPUTER_ALU_CMP) return;
+    r = REG_B(cfg->ram[setter]);
+    for(pos = setter + 1; pos < blk->last; pos += computer_get_instruction_length(cfg->ram[pos])) {
+        if(written_reg(cfg->ram[pos]) == r) return;
+    }
+    c->known[r] = 1;
+    c->val[r] = 0;
+}
+
+/* Keep in c what is known in both. Returns 1 if c changed. */
+static int consts_meet(struct cfg_consts *c, struct cfg_consts const *other)
+{
+    int changed = 0;
+    int r;
+
+    for(r = 0; r < COMPUTER_REG_NR; r++) {
+        if(c->known[r] && (!other->known[r] || other->val[r] != c->val[r])) {
+            c->known[r] = 0;
+            changed = 1;
+        }
+    }
+    if(c->io_known && (!other->io_known || other->io_addr != c->io_addr)) {
+        c->io_known = 0;
+        changed = 1;
+    }
+    return changed;
+}
+
+/* Find the values known at the start of every block. The registers and
+ * the IO address are 0 after reset; blocks entered by JMPR start with
+ * nothing known. */
+static void propagate_consts(struct cfg *cfg)
+{
+    unsigned char seen[CFG_MAX_BLOCKS];
+    int b, i, changed = 1;
+
+    memset(seen, 0, sizeof(seen));
+    for(b = 0; b < cfg->block_nr; b++) {
+        consts_clear(&cfg->entry[b]);
+        if(!cfg->block[b].is_entry) continue;
+        if(cfg->block[b].start == 0) {
+            for(i = 0; i < COMPUTER_REG_NR; i++) cfg->entry[b].known[i] = 1;
+            cfg->entry[b].io_known = 1;
+        }
+        seen[b] = 1;
+    }
+    while(changed) {
+        changed = 0;
+        for(b = 0; b < cfg->block_nr; b++) {
+            if(!seen[b]) continue;
+            for(i = 0; i < cfg->block[b].succ_nr; i++) {
+                int s = cfg->block[b].succ[i];
+                struct cfg_consts c;
+
+                edge_consts(cfg, b, s, &c);
+                if(!seen[s]) {
+                    cfg->entry[s] = c;
+                    seen[s] = 1;
+                    changed = 1;
+                } else if(consts_meet(&cfg->entry[s], &c)) {
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+static void build_dominators(struct cfg *cfg)
+{
+    unsigned char has_pred[CFG_MAX_BLOCKS];
+    unsigned char is_root[CFG_MAX_BLOCKS];
+    unsigned char seen[CFG_MAX_BLOCKS];
+    int stack[CFG_MAX_BLOCKS];
+    int n = cfg->block_nr;
+    int b, i, pass, changed;
+
+    memset(has_pred, 0, sizeof(has_pred));
+    memset(is_root, 0, sizeof(is_root));
+    memset(seen, 0, sizeof(seen));
+    for(b = 0; b < n; b++) {
+        for(i = 0; i < cfg->block[b].succ_nr; i++) {
+            has_pred[cfg->block[b].succ[i]] = 1;
+        }
+    }
+    /* Roots are the entry, blocks without predecessors and one block of
+     * every cycle that can not be reached from any other root. */
+    for(pass = 0; pass < 2; pass++) {
+        for(b = 0; b < n; b++) {
+            int sp = 0;
+
+            if(seen[b] || (pass == 0 && b != 0 && has_pred[b])) continue;
+            is_root[b] = 1;
+            seen[b] = 1;
+            stack[sp++] = b;
+            while(sp > 0) {
+                int v = stack[--sp];
+                for(i = 0; i < cfg->block[v].succ_nr; i++) {
+                    int s = cfg->block[v].succ[i];
+                    if(!seen[s]) {
+                        seen[s] = 1;
+                        stack[sp++] = s;
+                    }
+                }
+            }
+        }
+    }
+
+    for(b = 0; b < n; b++) {
+        if(is_root[b]) {
+            memset(cfg->dom[b], 0, (size_t)n);
+            cfg->dom[b][b] = 1;
+        } else {
+            memset(cfg->dom[b], 1, (size_t)n);
+        }
+    }
+    do {
+        changed = 0;
+        for(b = 0; b < n; b++) {
+            unsigned char tmp[CFG_MAX_BLOCKS];
+            int p, first = 1;
+
+            if(is_root[b]) continue;
+            memset(tmp, 0, (size_t)n);
+            for(p = 0; p < n; p++) {
+                int is_pred = 0;
+                for(i = 0; i < cfg->block[p].succ_nr; i++) {
+                    if(cfg->block[p].succ[i] == b) is_pred = 1;
+                }
+                if(!is_pred) continue;
+                if(first) {
+                    memcpy(tmp, cfg->dom[p], (size_t)n);
+                    first = 0;
+                } else {
+                    for(i = 0; i < n; i++) tmp[i] &= cfg->dom[p][i];
+                }
+            }
+            tmp[b] = 1;
+            if(memcmp(tmp, cfg->dom[b], (size_t)n)) {
+                memcpy(cfg->dom[b], tmp, (size_t)n);
+                changed = 1;
+            }
+        }
+    } while(changed);
+}
+
+static int loop_size(struct cfg const *cfg, int l)
+{
+    int b, size = 0;
+
+    for(b = 0; b < cfg->block_nr; b++) size += cfg->loop[l].member[b];
+    return size;
+}
+
+static void find_loops(struct cfg *cfg)
+{
+    int n = cfg->block_nr;
+    int b, i, l;
+
+    cfg->loop_nr = 0;
+    for(b = 0; b < n; b++) {
+        for(i = 0; i < cfg->block[b].succ_nr; i++) {
+            int h = cfg->block[b].succ[i];
+            struct cfg_loop *loop = NULL;
+            int stack[CFG_MAX_BLOCKS];
+            int sp = 0;
+
+            if(!cfg->dom[b][h]) continue;
+
+            /* Back edge b -> h, merge with an existing loop with the same header */
+            for(l = 0; l < cfg->loop_nr; l++) {
+                if(cfg->loop[l].header == h) loop = &cfg->loop[l];
+            }
+            if(loop == NULL) {
+                loop = &cfg->loop[cfg->loop_nr++];
+                memset(loop, 0, sizeof(*loop));
+                loop->header = h;
+                loop->member[h] = 1;
+            }
+            if(!loop->member[b]) {
+                loop->member[b] = 1;
+                stack[sp++] = b;
+            }
+            while(sp > 0) {
+                int v = stack[--sp];
+                int p, j;
+                for(p = 0; p < n; p++) {
+                    for(j = 0; j < cfg->block[p].succ_nr; j++) {
+                        if(cfg->block[p].succ[j] == v && !loop->member[p]) {
+                            loop->member[p] = 1;
+                            stack[sp++] = p;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for(l = 0; l < cfg->loop_nr; l++) {
+        int size = loop_size(cfg, l);
+        int best = -1, best_size = 0;
+        int m;
+
+        for(m = 0; m < cfg->loop_nr; m++) {
+            int msize;
+            if(m == l || !cfg->loop[m].member[cfg->loop[l].header]) continue;
+            msize = loop_size(cfg, m);
+            if(msize <= size) continue;
+            if(best < 0 || msize < best_size) {
+                best = m;
+                best_size = msize;
+            }
+        }
+        cfg->loop[l].parent = best;
+    }
+    for(l = 0; l < cfg->loop_nr; l++) {
+        int p;
+        cfg->loop[l].depth = 1;
+        for(p = cfg->loop[l].parent; p >= 0; p = cfg->loop[p].parent) cfg->loop[l].depth++;
+    }
+    for(b = 0; b < n; b++) {
+        int best_depth = 0;
+        for(l = 0; l < cfg->loop_nr; l++) {
+            if(cfg->loop[l].member[b] && cfg->loop[l].depth > best_depth) {
+                best_depth = cfg->loop[l].depth;
+                cfg->block[b].loop = l;
+            }
+        }
+    }
+}
+
+/* Child loop of l that contains block b, or -1 if b is directly in l */
+static int child_of(struct cfg const *cfg, int l, int b)
+{
+    int c = cfg->block[b].loop;
+
+    while(c >= 0 && cfg->loop[c].parent != l) {
+        if(c == l) return -1;
+        c = cfg->loop[c].parent;
+    }
+    return c;
+}
+
+struct iter_state {
+    unsigned char state[CFG_MAX_BLOCKS]; /* 0 new, 1 in progress, 2 done */
+    unsigned char valid[CFG_MAX_BLOCKS];
+    unsigned long dmin[CFG_MAX_BLOCKS];
+    unsigned long dmax[CFG_MAX_BLOCKS];
+    int irreducible;
+    int max_unknown; /* An inner loop without a known worst case was passed */
+};
+
+static void iter_visit(struct cfg const *cfg, int l, int v, struct iter_state *st);
+
+static void iter_edge(struct cfg const *cfg, int l, int v, int s, struct iter_state *st,
+                      int *valid, unsigned long *best, unsigned long *worst)
+{
+    struct cfg_loop const *loop = &cfg->loop[l];
+    unsigned long smin = 0, smax = 0;
+
+    if(s == loop->header) {
+        /* Back edge, end of the iteration */
+    } else if(!loop->member[s]) {
+        return;
+    } else {
+        int c = child_of(cfg, l, s);
+        if(c >= 0) s = cfg->loop[c].header;
+        iter_visit(cfg, l, s, st);
+        if(!st->valid[s]) return;
+        smin = st->dmin[s];
+        smax = st->dmax[s];
+    }
+    if(!*valid || smin < *best) *best = smin;
+    if(!*valid || smax > *worst) *worst = smax;
+    *valid = 1;
+}
+
+static void iter_visit(struct cfg const *cfg, int l, int v, struct iter_state *st)
+{
+    int c = v == cfg->loop[l].header ? -1 : child_of(cfg, l, v);
+    unsigned long cmin, cmax, best = 0, worst = 0;
+    int valid = 0;
+    int i, m;
+
+    if(st->state[v] == 2) return;
+    if(st->state[v] == 1) {
+        /* Irreducible flow, give up */
+        st->irreducible = 1;
+        return;
+    }
+    st->state[v] = 1;
+
+    if(c < 0) {
+        cmin = cmax = cfg->block[v].cycles;
+        for(i = 0; i < cfg->block[v].succ_nr; i++) {
+            iter_edge(cfg, l, v, cfg->block[v].succ[i], st, &valid, &best, &worst);
+        }
+    } else {
+        struct cfg_loop const *child = &cfg->loop[c];
+        if(child->total_known) {
+            cmin = child->total_min;
+            cmax = child->total_max;
+        } else {
+            /* At least one pass through the inner loop header */
+            st->max_unknown = 1;
+            cmin = cmax = cfg->block[v].cycles;
+        }
+        for(m = 0; m < cfg->block_nr; m++) {
+            if(!child->member[m]) continue;
+            for(i = 0; i < cfg->block[m].succ_nr; i++) {
+                int s = cfg->block[m].succ[i];
+                if(!child->member[s]) {
+                    iter_edge(cfg, l, v, s, st, &valid, &best, &worst);
+                }
+            }
+        }
+    }
+
+    st->valid[v] = (unsigned char)valid;
+    st->dmin[v] = cmin + best;
+    st->dmax[v] = cmax + worst;
+    st->state[v] = 2;
+}
+
+/* Check that no store outside of what is allowed can write address addr.
+ * Stores in blocks where in_set[b] == want are checked, except the store
+ * at address allowed. */
+static int only_store(struct cfg const *cfg, unsigned char const *in_set, int want, int addr, int allowed)
+{
+    int b, pos;
+
+    for(b = 0; b < cfg->block_nr; b++) {
+        struct cfg_consts c;
+
+        if((in_set[b] != 0) != want) continue;
+        consts_clear(&c);
+        for(pos = cfg->block[b].start; pos < cfg->block[b].end; pos += computer_get_instruction_length(cfg->ram[pos])) {
+            unsigned char instr = cfg->ram[pos];
+            if(OP(instr) == COMPUTER_INSTR_ST && pos != allowed) {
+                int a = REG_A(instr);
+                if(!c.known[a] || c.val[a] == addr) return 0;
+            }
+            consts_step(&c, cfg->ram, pos);
+        }
+    }
+    return 1;
+}
+
+/* Number of times an ADD counter step is executed until the exit is taken,
+ * or 0 if it never exits. */
+static unsigned long count_iterations(int counter, int addend, int carry_in, int mask, int exit_on_taken)
+{
+    unsigned long n = 0;
+
+    while(n <= COMPUTER_RAM_SIZE) {
+        int sum = addend + counter + carry_in;
+        int flags = 0;
+        int taken;
+
+        if(addend > counter) flags |= 1 << COMPUTER_FLAG_A_LARGER;
+        if(addend == counter) flags |= 1 << COMPUTER_FLAG_EQUAL;
+        if(sum > COMPUTER_WORD_MAX) flags |= 1 << COMPUTER_FLAG_CARRY;
+        if((sum & COMPUTER_WORD_MAX) == 0) flags |= 1 << COMPUTER_FLAG_ZERO;
+        n++;
+        taken = (flags & mask) != 0;
+        if(taken == exit_on_taken) return n;
+        counter = sum & COMPUTER_WORD_MAX;
+    }
+    return 0;
+}
+
+/* Number of times "cmp" runs until the exit is taken, when the counter
+ * is compared with a bound that does not change and is stepped by an ADD
+ * before (step_first) or after the compare. 0 if it never exits. */
+static unsigned long count_compare(int counter, int addend, int carry_in, int bound, int counter_is_a,
+                                   int step_first, int mask, int exit_on_taken)
+{
+    unsigned long n = 0;
+
+    while(n <= COMPUTER_RAM_SIZE) {
+        int a, b, flags = 0;
+
+        if(step_first) counter = (addend + counter + carry_in) & COMPUTER_WORD_MAX;
+        a = counter_is_a ? counter : bound;
+        b = counter_is_a ? bound : counter;
+        if(a > b) flags |= 1 << COMPUTER_FLAG_A_LARGER;
+        if(a == b) flags |= 1 << COMPUTER_FLAG_EQUAL;
+        n++;
+        if(((flags & mask) != 0) == exit_on_taken) return n;
+        if(!step_first) counter = (addend + counter + carry_in) & COMPUTER_WORD_MAX;
+    }
+    return 0;
+}
+
+/* Returns 1 if block b runs in every iteration of loop l */
+static int every_iteration(struct cfg const *cfg, int l, int b)
+{
+    int p, i;
+
+    for(p = 0; p < cfg->block_nr; p++) {
+        for(i = 0; cfg->loop[l].member[p] && i < cfg->block[p].succ_nr; i++) {
+            if(cfg->block[p].succ[i] == cfg->loop[l].header && !cfg->dom[p][b]) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Values known when loop l is entered from outside */
+static void loop_entry_consts(struct cfg const *cfg, int l, struct cfg_consts *c)
+{
+    int h = cfg->loop[l].header;
+    int p, i, first = 1;
+
+    consts_clear(c);
+    if(cfg->block[h].is_entry) return;
+    for(p = 0; p < cfg->block_nr; p++) {
+        for(i = 0; !cfg->loop[l].member[p] && i < cfg->block[p].succ_nr; i++) {
+            struct cfg_consts e;
+
+            if(cfg->block[p].succ[i] != h) continue;
+            edge_consts(cfg, p, h, &e);
+            if(first) *c = e;
+            else consts_meet(c, &e);
+            first = 0;
+        }
+    }
+}
+
+/* Returns 1 if register r is written in loop l, other than at address except */
+static int written_in_loop(struct cfg const *cfg, int l, int r, int except)
+{
+    int p, pos;
+
+    for(p = 0; p < cfg->block_nr; p++) {
+        if(!cfg->loop[l].member[p]) continue;
+        for(pos = cfg->block[p].start; pos < cfg->block[p].end; pos += computer_get_instruction_length(cfg->ram[pos])) {
+            if(pos != except && written_reg(cfg->ram[pos]) == r) return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns 1 if the flags set at setter (-1 for none) may have the carry */
+static int may_carry(struct cfg const *cfg, int setter)
+{
+    int op = setter < 0 ? -1 : OP(cfg->ram[setter]);
+
+    return setter < 0 || op == 8 + COMPUTER_ALU_ADD || op == 8 + COMPUTER_ALU_SHL || op == 8 + COMPUTER_ALU_SHR;
+}
+
+/* Returns 1 if the carry is clear when the instruction at pos in block b
+ * runs, as the flags were last set by an instruction that clears it,
+ * in b or at the end of every predecessor */
+static int carry_clear(struct cfg const *cfg, int b, int pos)
+{
+    int setter = last_flag_setter(cfg, b, pos);
+    int p, i, pred = 0;
+
+    if(setter >= 0) return !may_carry(cfg, setter);
+    if(cfg->block[b].is_entry) return 0;
+    for(p = 0; p < cfg->block_nr; p++) {
+        for(i = 0; i < cfg->block[p].succ_nr; i++) {
+            if(cfg->block[p].succ[i] != b) continue;
+            if(may_carry(cfg, last_flag_setter(cfg, p, cfg->block[p].end))) return 0;
+            pred = 1;
+        }
+    }
+    return pred;
+}
+
+/* Bound loop l by a "cmp" at address cmp in block b, which decides the
+ * exit: one register is a counter that a single ADD of a known value steps
+ * in every iteration, the other is not written in the loop. Returns 1 and
+ * the number of header executions if every start value leads out. */
+static int infer_compare(struct cfg const *cfg, int l, int b, int cmp, int exit_on_taken,
+                         unsigned long *cmin, unsigned long *cmax, int *counter)
+{
+    unsigned char instr = cfg->ram[cmp];
+    int mask = cfg->ram[cfg->block[b].last] & 15;
+    int side;
+
+    if(REG_A(instr) == REG_B(instr) || cfg->block[b].loop != l) return 0;
+    for(side = 0; side < 2; side++) {
+        int reg = side == 0 ? REG_A(instr) : REG_B(instr);
+        int bound_reg = side == 0 ? REG_B(instr) : REG_A(instr);
+        int inits[COMPUTER_RAM_SIZE], init_nr = 0;
+        int bounds[COMPUTER_RAM_SIZE], bound_nr = 0;
+        int step = -1, s = -1, addend, step_first, cin, i, j, p, pos;
+        struct cfg_consts c, entry;
+
+        if(written_in_loop(cfg, l, bound_reg, -1)) continue;
+        /* The only write to the counter must be an ADD of a known value */
+        for(p = 0; p < cfg->block_nr && step != -2; p++) {
+            if(!cfg->loop[l].member[p]) continue;
+            for(pos = cfg->block[p].start; pos < cfg->block[p].end; pos += computer_get_instruction_length(cfg->ram[pos])) {
+                if(written_reg(cfg->ram[pos]) != reg) continue;
+                if(step != -1 || OP(cfg->ram[pos]) != 8 + COMPUTER_ALU_ADD || REG_A(cfg->ram[pos]) == reg) {
+                    step = -2;
+                    break;
+                }
+                step = pos;
+                s = p;
+            }
+        }
+        if(step < 0 || cfg->block[s].loop != l || !every_iteration(cfg, l, s)) continue;
+        block_consts(cfg, s, step, &c);
+        if(!c.known[REG_A(cfg->ram[step])]) continue;
+        addend = c.val[REG_A(cfg->ram[step])];
+        if(s == b) step_first = step < cmp;
+        else if(cfg->dom[b][s]) step_first = 1;
+        else if(cfg->dom[s][b]) step_first = 0;
+        else continue;
+
+        loop_entry_consts(cfg, l, &entry);
+        if(entry.known[reg]) inits[init_nr++] = entry.val[reg];
+        else for(i = 0; i < COMPUTER_RAM_SIZE; i++) inits[init_nr++] = i;
+        block_consts(cfg, b, cmp, &c);
+        if(c.known[bound_reg]) bounds[bound_nr++] = c.val[bound_reg];
+        else for(i = 0; i < COMPUTER_RAM_SIZE; i++) bounds[bound_nr++] = i;
+
+        *cmin = *cmax = 0;
+        for(i = 0; i < init_nr; i++) {
+            for(j = 0; j < bound_nr; j++) {
+                for(cin = 0; cin <= (carry_clear(cfg, s, step) ? 0 : 1); cin++) {
+                    unsigned long n = count_compare(inits[i], addend, cin, bounds[j], side == 0, step_first, mask, exit_on_taken);
+                    if(n == 0) return 0;
+                    if(*cmax == 0 || n < *cmin) *cmin = n;
+                    if(n > *cmax) *cmax = n;
+                }
+            }
+        }
+        *counter = reg;
+        return 1;
+    }
+    return 0;
+}
+
+static void set_count(struct cfg_loop *loop, unsigned long cmin, unsigned long cmax, int kind, int counter)
+{
+    loop->count_known = 1;
+    loop->count_min = cmin;
+    loop->count_max = cmax;
+    loop->counter_kind = kind;
+    loop->counter = counter;
+}
+
+/* Try to find a constant counter that bounds the number of iterations of loop l */
+static void infer_count(struct cfg *cfg, int l)
+{
+    struct cfg_loop *loop = &cfg->loop[l];
+    int b;
+
+    for(b = 0; b < cfg->block_nr; b++) {
+        struct cfg_block const *blk = &cfg->block[b];
+        unsigned char jinstr = cfg->ram[blk->last];
+        int target_in, fall_in, exit_on_taken;
+        int pos, adder = -1, cin_known = 0, carry_in = 0;
+        int counter_reg, addend, kind, counter = 0;
+        int inits[COMPUTER_RAM_SIZE], init_nr = 0;
+        int ok, i, p;
+        struct cfg_consts c;
+        unsigned long cmin = 0, cmax = 0;
+
+        if(!loop->member[b] || OP(jinstr) != COMPUTER_INSTR_JXXX || blk->succ_nr != 2) continue;
+        fall_in = loop->member[blk->succ[0]];
+        target_in = loop->member[blk->succ[1]];
+        if(fall_in == target_in) continue;
+        exit_on_taken = !target_in;
+
+        /* The exit test must run once every iteration */
+        if(!every_iteration(cfg, l, b)) continue;
+
+        /* Find the last flag setting instruction before the jump */
+        for(pos = blk->start; pos < blk->last; pos += computer_get_instruction_length(cfg->ram[pos])) {
+            int op = OP(cfg->ram[pos]);
+            if(op & 8 || op == COMPUTER_INSTR_CLF) {
+                if(adder >= 0) {
+                    int prev = OP(cfg->ram[adder]);
+                    cin_known = !(prev == 8 + COMPUTER_ALU_ADD || prev == 8 + COMPUTER_ALU_SHL ||
+                                  prev == 8 + COMPUTER_ALU_SHR);
+                    carry_in = 0;
+                }
+                adder = pos;
+            }
+        }
+        if(adder >= 0 && OP(cfg->ram[adder]) == 8 + COMPUTER_ALU_CMP) {
+            if(!infer_compare(cfg, l, b, adder, exit_on_taken, &cmin, &cmax, &counter)) continue;
+            set_count(loop, cmin, cmax, CFG_COUNTER_REG, counter);
+            return;
+        }
+        if(adder < 0 || OP(cfg->ram[adder]) != 8 + COMPUTER_ALU_ADD) continue;
+        counter_reg = REG_B(cfg->ram[adder]);
+        if(REG_A(cfg->ram[adder]) == counter_reg) continue;
+        block_consts(cfg, b, adder, &c);
+        if(!c.known[REG_A(cfg->ram[adder])]) continue;
+        addend = c.val[REG_A(cfg->ram[adder])];
+
+        /* Find where the counter lives between iterations */
+        kind = CFG_COUNTER_REG;
+        for(pos = blk->start; pos < adder; pos += computer_get_instruction_length(cfg->ram[pos])) {
+            unsigned char instr = cfg->ram[pos];
+            if(written_reg(instr) != counter_reg) continue;
+            if(OP(instr) == COMPUTER_INSTR_LD) {
+                struct cfg_consts lc;
+                block_consts(cfg, b, pos, &lc);
+                if(lc.known[REG_A(instr)]) {
+                    kind = CFG_COUNTER_RAM;
+                    counter = lc.val[REG_A(instr)];
+                    continue;
+                }
+            }
+            kind = CFG_COUNTER_NONE;
+        }
+        if(kind == CFG_COUNTER_NONE) continue;
+
+        if(kind == CFG_COUNTER_REG) {
+            counter = counter_reg;
+            if(written_in_loop(cfg, l, counter_reg, adder)) continue;
+            loop_entry_consts(cfg, l, &c);
+            if(c.known[counter_reg]) inits[init_nr++] = c.val[counter_reg];
+        } else {
+            /* The counter must be written back to RAM after the step */
+            int store = -1;
+            int after = -1;
+            struct cfg_consts sc;
+
+            block_consts(cfg, b, adder, &sc);
+            for(pos = adder; pos < blk->end && store < 0; pos += computer_get_instruction_length(cfg->ram[pos])) {
+                unsigned char instr = cfg->ram[pos];
+                if(pos > adder && written_reg(instr) == counter_reg) break;
+                if(OP(instr) == COMPUTER_INSTR_ST && REG_B(instr) == counter_reg &&
+                   sc.known[REG_A(instr)] && sc.val[REG_A(instr)] == counter) {
+                    store = pos;
+                }
+                consts_step(&sc, cfg->ram, pos);
+            }
+            if(store < 0 && pos >= blk->end) {
+                /* Continue into the successor that stays in the loop */
+                int s = blk->succ[exit_on_taken ? 0 : 1];
+                int only_pred = 1;
+                for(p = 0; p < cfg->block_nr; p++) {
+                    for(i = 0; p != b && i < cfg->block[p].succ_nr; i++) {
+                        if(cfg->block[p].succ[i] == s) only_pred = 0;
+                    }
+                }
+                if(only_pred) after = s;
+            }
+            if(after >= 0) {
+                for(pos = cfg->block[after].start; pos < cfg->block[after].end && store < 0;
+                    pos += computer_get_instruction_length(cfg->ram[pos])) {
+                    unsigned char instr = cfg->ram[pos];
+                    if(OP(instr) == COMPUTER_INSTR_ST && REG_B(instr) == counter_reg &&
+                       sc.known[REG_A(instr)] && sc.val[REG_A(instr)] == counter) {
+                        store = pos;
+                    }
+                    if(written_reg(instr) == counter_reg) break;
+                    consts_step(&sc, cfg->ram, pos);
+                }
+            }
+            if(store < 0) continue;
+            {
+                unsigned char in_loop[CFG_MAX_BLOCKS];
+                for(p = 0; p < cfg->block_nr; p++) in_loop[p] = loop->member[p];
+                if(!only_store(cfg, in_loop, 1, counter, store)) continue;
+                if(counter < cfg->size && only_store(cfg, in_loop, 0, counter, -1)) {
+                    inits[init_nr++] = cfg->ram[counter];
+                }
+            }
+        }
+
+        if(init_nr == 0) {
+            for(i = 0; i < COMPUTER_RAM_SIZE; i++) inits[init_nr++] = i;
+        }
+        ok = 1;
+        for(i = 0; i < init_nr && ok; i++) {
+            int cin;
+            for(cin = 0; cin <= (cin_known ? carry_in : 1); cin++) {
+                unsigned long n = count_iterations(inits[i], addend, cin, jinstr & 15, exit_on_taken);
+                if(n == 0) {
+                    ok = 0;
+                    break;
+                }
+                if(cmax == 0 || n < cmin) cmin = n;
+                if(n > cmax) cmax = n;
+            }
+        }
+        if(!ok) continue;
+
+        set_count(loop, cmin, cmax, kind, counter);
+        return;
+    }
+}
+
+static void analyze_loops(struct cfg *cfg)
+{
+    unsigned char done[CFG_MAX_LOOPS];
+    int left = cfg->loop_nr;
+
+    memset(done, 0, sizeof(done));
+    /* Inner loops first, so that their totals are known to the outer ones */
+    while(left > 0) {
+        int l, best = -1;
+
+        for(l = 0; l < cfg->loop_nr; l++) {
+            if(!done[l] && (best < 0 || cfg->loop[l].depth > cfg->loop[best].depth)) best = l;
+        }
+        {
+            struct cfg_loop *loop = &cfg->loop[best];
+            struct iter_state st;
+
+            memset(&st, 0, sizeof(st));
+            iter_visit(cfg, best, loop->header, &st);
+            loop->iter_known = !st.irreducible && st.valid[loop->header];
+            loop->iter_max_known = loop->iter_known && !st.max_unknown;
+            loop->iter_min = st.dmin[loop->header];
+            loop->iter_max = st.dmax[loop->header];
+
+            infer_count(cfg, best);
+            if(loop->iter_max_known && loop->count_known) {
+                loop->total_known = 1;
+                loop->total_min = (loop->count_min - 1) * loop->iter_min + cfg->block[loop->header].cycles;
+                loop->total_max = loop->count_max * loop->iter_max;
+            }
+        }
+        done[best] = 1;
+        left--;
+    }
+}
+
+void cfg_build(struct cfg *cfg, unsigned char const *ram, int size,
+               unsigned char const *is_instr, unsigned char const *leader,
+               unsigned long instr_cycles)
+{
+    int i;
+
+    cfg->instr_cycles = instr_cycles;
+    memset(cfg->ram, 0, sizeof(cfg->ram));
+    memset(cfg->is_instr, 0, sizeof(cfg->is_instr));
+    if(size > COMPUTER_RAM_SIZE) size = COMPUTER_RAM_SIZE;
+    cfg->size = size;
+    memcpy(cfg->ram, ram, (size_t)size);
+    for(i = 0; i < COMPUTER_RAM_SIZE; i++) cfg->block_of[i] = -1;
+
+    if(is_instr) {
+        memcpy(cfg->is_instr, is_instr, (size_t)size);
+        follow_fall_through(cfg);
+    } else {
+        discover(cfg, 0);
+    }
+    build_blocks(cfg, leader);
+    propagate_consts(cfg);
+    build_dominators(cfg);
+    find_loops(cfg);
+    analyze_loops(cfg);
+}
+
+static char const *name_at(char const *const *name, int pos)
+{
+    if(name && name[pos]) return name[pos];
+    return "";
+}
+
+void cfg_print(struct cfg const *cfg, FILE *fp, char const *const *name)
+{
+    int b, l, i;
+
+    fprintf(fp, "--- Basic blocks ---\n");
+    for(b = 0; b < cfg->block_nr; b++) {
+        struct cfg_block const *blk = &cfg->block[b];
+
+        fprintf(fp, "block %3d: %03d-%03d %3d instr. %6lu cycles ->", b, blk->start, blk->end - 1,
+                blk->instr_nr, blk->cycles);
+        for(i = 0; i < blk->succ_nr; i++) {
+            fprintf(fp, " %d", blk->succ[i]);
+        }
+        if(blk->is_indirect) fprintf(fp, " (indirect)");
+        if(blk->is_terminate) fprintf(fp, " (terminate)");
+        if(blk->loop >= 0) fprintf(fp, " [loop %d]", blk->loop);
+        if(name_at(name, blk->start)[0]) fprintf(fp, " %s", name_at(name, blk->start));
+        fprintf(fp, "\n");
+    }
+
+    fprintf(fp, "--- Loops ---\n");
+    for(l = 0; l < cfg->loop_nr; l++) {
+        struct cfg_loop const *loop = &cfg->loop[l];
+        int start = cfg->block[loop->header].start;
+
+        fprintf(fp, "loop %3d: header %03d %s depth %d, blocks", l, start, name_at(name, start), loop->depth);
+        for(b = 0; b < cfg->block_nr; b++) {
+            if(loop->member[b]) fprintf(fp, " %d", b);
+        }
+        fprintf(fp, "\n");
+        if(loop->iter_max_known) {
+            fprintf(fp, "          iteration %lu-%lu cycles\n", loop->iter_min, loop->iter_max);
+        } else if(loop->iter_known) {
+            fprintf(fp, "          iteration at least %lu cycles\n", loop->iter_min);
+        } else {
+            fprintf(fp, "          iteration cycles unknown\n");
+        }
+        if(loop->count_known) {
+            fprintf(fp, "          %lu-%lu iterations (counter in %s %d)\n", loop->count_min, loop->count_max,
+                    loop->counter_kind == CFG_COUNTER_RAM ? "ram" : "register",
+                    loop->counter);
+        } else {
+            fprintf(fp, "          iteration count unknown\n");
+        }
+        if(loop->total_known) {
+            fprintf(fp, "          total %lu-%lu cycles\n", loop->total_min, loop->total_max);
+        }
+    }
+
+    fprintf(fp, "--- Label cycle bounds ---\n");
+    for(i = 0; name && i < cfg->size; i++) {
+        int blk_nr = cfg->block_of[i];
+
+        if(!name[i] || blk_nr < 0 || cfg->block[blk_nr].start != i) continue;
+        for(l = 0; l < cfg->loop_nr; l++) {
+            if(cfg->loop[l].header == blk_nr) break;
+        }
+        if(l == cfg->loop_nr) {
+            fprintf(fp, "%-24s %03d: block %lu cycles\n", name[i], i, cfg->block[blk_nr].cycles);
+        } else if(cfg->loop[l].total_known) {
+            fprintf(fp, "%-24s %03d: loop best %lu, worst %lu cycles\n", name[i], i,
+                    cfg->loop[l].total_min, cfg->loop[l].total_max);
+        } else {
+            fprintf(fp, "%-24s %03d: loop, bounds unknown\n", name[i], i);
+        }
+    }
+}
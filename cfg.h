@@ -0,0 +1,88 @@
+#ifndef CFG_H_
+#define CFG_H_
+
+#include <stdio.h>
+#include "computer.h"
+
+#define CFG_MAX_BLOCKS COMPUTER_RAM_SIZE
+#define CFG_MAX_LOOPS COMPUTER_RAM_SIZE
+
+/* Counter kinds found when inferring loop bounds */
+#define CFG_COUNTER_NONE 0
+#define CFG_COUNTER_REG  1
+#define CFG_COUNTER_RAM  2
+
+/* Register and IO address values known at a point in the program */
+struct cfg_consts {
+    int known[COMPUTER_REG_NR];
+    computer_word val[COMPUTER_REG_NR];
+    int io_known;
+    unsigned char io_addr;
+};
+
+struct cfg_block {
+    int start; /* Address of the first instruction */
+    int end; /* Address after the last instruction byte */
+    int last; /* Address of the last instruction */
+    int instr_nr;
+    unsigned long cycles; /* Cycles for one pass through the block */
+    int succ[2]; /* Successor blocks, the first one is the fall through */
+    int succ_nr;
+    int is_indirect; /* Ends with JMPR, successors unknown */
+    int is_terminate; /* Ends by turning off the computer */
+    int is_entry; /* Can be entered without a jump or fall through (address 0, JMPR) */
+    int loop; /* Innermost loop containing the block, -1 if none */
+};
+
+struct cfg_loop {
+    int header; /* Block index of the loop header */
+    int parent; /* Enclosing loop, -1 if outermost */
+    int depth;
+    unsigned char member[CFG_MAX_BLOCKS];
+    /* Cycles for one iteration (header to back edge). iter_known is 0 if
+     * the loop has no path back to the header that could be measured,
+     * iter_max_known is 0 if an inner loop has no known bound. */
+    int iter_known;
+    int iter_max_known;
+    unsigned long iter_min, iter_max;
+    /* Number of header executions, only set if count_known */
+    int count_known;
+    unsigned long count_min, count_max;
+    int counter_kind; /* CFG_COUNTER_* */
+    int counter; /* Register index or RAM address of the counter */
+    /* Total cycles spent in the loop, only set if total_known */
+    int total_known;
+    unsigned long total_min, total_max;
+};
+
+struct cfg {
+    int size; /* Number of RAM bytes analyzed */
+    unsigned long instr_cycles; /* Cycles per instruction of the engine */
+    unsigned char ram[COMPUTER_RAM_SIZE];
+    unsigned char is_instr[COMPUTER_RAM_SIZE];
+    int block_of[COMPUTER_RAM_SIZE]; /* Block containing address, -1 if none */
+    int block_nr;
+    struct cfg_block block[CFG_MAX_BLOCKS];
+    struct cfg_consts entry[CFG_MAX_BLOCKS]; /* Values known when a block starts */
+    int loop_nr;
+    struct cfg_loop loop[CFG_MAX_LOOPS];
+    unsigned char dom[CFG_MAX_BLOCKS][CFG_MAX_BLOCKS]; /* dom[b][d]: d dominates b */
+};
+
+/* Split the RAM image into basic blocks and find loops.
+ * is_instr marks addresses where instructions start; if NULL, they are
+ * found by following all direct control flow from address 0. Bytes that
+ * code falls through into are instructions either way.
+ * leader marks extra addresses that must start a block, e.g. labels that
+ * may be the target of JMPR. It may be NULL.
+ * instr_cycles is the cost of an instruction in the engine the cycles are
+ * counted for: COMPUTER_FAST_INSTR_CYCLES or COMPUTER_INSTR_LEN. */
+void cfg_build(struct cfg *cfg, unsigned char const *ram, int size,
+               unsigned char const *is_instr, unsigned char const *leader,
+               unsigned long instr_cycles);
+
+/* Print blocks and loops, with label names taken from name (may be NULL
+ * or contain NULL entries). */
+void cfg_print(struct cfg const *cfg, FILE *fp, char const *const *name);
+
+#endif
@@ -0,0 +1,347 @@
+#include "chan.h"
+#include "peri.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config_impl.h"
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#   include <poll.h>
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#endif
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/* Single producer, single consumer. head and tail only grow, the
+ * position in data is the value modulo CHAN_RING_SIZE. */
+struct ring {
+    unsigned char data[CHAN_RING_SIZE];
+    unsigned long head; /* Written by the producer */
+    unsigned long tail; /* Written by the consumer */
+};
+
+static int gs_in_addr = -1;
+static int gs_out_addr = -1;
+static int gs_status_addr = -1;
+static char const *gs_path = NULL;
+static char const *gs_out_path = NULL;
+
+#ifdef HAVE_PTHREAD
+static struct ring gs_in; /* Filled by the thread */
+static struct ring gs_out; /* Filled by the program */
+static int gs_is_socket = 0;
+static int gs_listen = -1;
+static int gs_in_fd = -1;
+static int gs_out_fd = -1; /* The same as gs_in_fd for a socket */
+static int gs_out_open = 0; /* 1 while output has somewhere to go */
+static int gs_notify[2] = { -1, -1 }; /* Thread to program: input arrived */
+static int gs_wake[2] = { -1, -1 }; /* Program to thread: ring changed or stop */
+static pthread_mutex_t gs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gs_space = PTHREAD_COND_INITIALIZER;
+static pthread_t gs_thread;
+static int gs_thread_running = 0;
+static int gs_stop = 0;
+
+static void set_nonblock(int fd, int enable)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    fcntl(fd, F_SETFL, enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+static void poke(int fd)
+{
+    unsigned char c = 0;
+
+    if(write(fd, &c, 1) < 0) {
+        /* The pipe is full, so the reader will wake anyway */
+    }
+}
+
+static void drain(int fd)
+{
+    unsigned char buf[64];
+
+    while(read(fd, buf, sizeof(buf)) > 0);
+}
+
+/* Wakes a program waiting for space in the output ring */
+static void set_out_open(int open)
+{
+    pthread_mutex_lock(&gs_mutex);
+    STORE(gs_out_open, open);
+    if(!open) STORE(gs_out.tail, LOAD(gs_out.head));
+    pthread_cond_broadcast(&gs_space);
+    pthread_mutex_unlock(&gs_mutex);
+}
+
+static void close_client(void)
+{
+    close(gs_in_fd);
+    gs_in_fd = gs_out_fd = -1;
+    set_out_open(0);
+}
+
+static void accept_client(void)
+{
+    int fd = accept(gs_listen, NULL, NULL);
+
+    if(fd < 0) return;
+    set_nonblock(fd, 1);
+    gs_in_fd = gs_out_fd = fd;
+    set_out_open(1);
+}
+
+static void receive(void)
+{
+    unsigned long head = gs_in.head;
+    unsigned long space = CHAN_RING_SIZE - (head - LOAD(gs_in.tail));
+    size_t pos = head % CHAN_RING_SIZE;
+    size_t len = space < CHAN_RING_SIZE - pos ? space : CHAN_RING_SIZE - pos;
+    ssize_t n;
+
+    if(len == 0) return;
+    n = read(gs_in_fd, gs_in.data + pos, len);
+    if(n > 0) {
+        STORE(gs_in.head, head + (unsigned long)n);
+        poke(gs_notify[1]);
+    } else if(gs_is_socket && (n == 0 || (errno != EAGAIN && errno != EINTR))) {
+        close_client();
+    }
+}
+
+static ssize_t put(void const *buf, size_t len)
+{
+    if(gs_is_socket) return send(gs_out_fd, buf, len, MSG_NOSIGNAL);
+    return write(gs_out_fd, buf, len);
+}
+
+/* Returns -1 if the output can not be written anymore */
+static int send_out(void)
+{
+    unsigned long tail = gs_out.tail;
+    unsigned long used = LOAD(gs_out.head) - tail;
+    size_t pos = tail % CHAN_RING_SIZE;
+    size_t len = used < CHAN_RING_SIZE - pos ? used : CHAN_RING_SIZE - pos;
+    ssize_t n;
+
+    if(len == 0) return 0;
+    n = put(gs_out.data + pos, len);
+    if(n > 0) {
+        pthread_mutex_lock(&gs_mutex);
+        STORE(gs_out.tail, tail + (unsigned long)n);
+        pthread_cond_broadcast(&gs_space);
+        pthread_mutex_unlock(&gs_mutex);
+    } else if(n < 0 && errno != EAGAIN && errno != EINTR) {
+        if(gs_is_socket) {
+            close_client();
+        } else {
+            gs_out_fd = -1;
+            set_out_open(0);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void *chan_thread(void *arg)
+{
+    while(!LOAD(gs_stop)) {
+        struct pollfd pfd[4];
+        int nfds = 1;
+        int i_listen = -1, i_in = -1, i_out = -1;
+
+        pfd[0].fd = gs_wake[0];
+        pfd[0].events = POLLIN;
+        if(gs_is_socket && gs_in_fd < 0) {
+            pfd[nfds].fd = gs_listen;
+            pfd[nfds].events = POLLIN;
+            i_listen = nfds++;
+        }
+        if(gs_in_fd >= 0 && gs_in.head - LOAD(gs_in.tail) < CHAN_RING_SIZE) {
+            pfd[nfds].fd = gs_in_fd;
+            pfd[nfds].events = POLLIN;
+            i_in = nfds++;
+        }
+        if(gs_out_fd >= 0 && LOAD(gs_out.head) != gs_out.tail) {
+            pfd[nfds].fd = gs_out_fd;
+            pfd[nfds].events = POLLOUT;
+            i_out = nfds++;
+        }
+        if(poll(pfd, (nfds_t)nfds, -1) < 0) continue;
+        if(pfd[0].revents) drain(gs_wake[0]);
+        if(i_listen >= 0 && pfd[i_listen].revents) accept_client();
+        if(i_in >= 0 && pfd[i_in].revents) receive();
+        if(i_out >= 0 && pfd[i_out].revents && gs_out_fd >= 0) send_out();
+    }
+    /* Send the rest before the program ends */
+    if(gs_out_fd >= 0) {
+        set_nonblock(gs_out_fd, 0);
+        while(gs_out_fd >= 0 && LOAD(gs_out.head) != gs_out.tail && send_out() == 0);
+    }
+    return NULL;
+}
+
+static int open_socket(char const *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    set_nonblock(fd, 1);
+    return fd;
+}
+
+/* 1 if a byte can be read. Otherwise the program may be in a loop waiting
+ * for one, then peri_idle_wait() sleeps until the thread sends a notify. */
+static int input_ready(computer *comp)
+{
+    if(LOAD(gs_in.head) != gs_in.tail) return 1;
+    drain(gs_notify[0]);
+    if(LOAD(gs_in.head) != gs_in.tail) return 1;
+    return peri_idle_wait(comp, gs_notify[0]) && LOAD(gs_in.head) != gs_in.tail;
+}
+
+static void in_input(computer *comp, unsigned char *c)
+{
+    unsigned long tail = gs_in.tail;
+
+    if(!input_ready(comp)) {
+        *c = 0;
+        return;
+    }
+    *c = gs_in.data[tail % CHAN_RING_SIZE];
+    STORE(gs_in.tail, tail + 1);
+    /* The thread stops reading while the ring is full */
+    if(LOAD(gs_in.head) - tail == CHAN_RING_SIZE) poke(gs_wake[1]);
+}
+
+static void status_input(computer *comp, unsigned char *c)
+{
+    *c = (unsigned char)input_ready(comp);
+}
+
+static void out_output(computer *comp, unsigned char c)
+{
+    unsigned long head = gs_out.head;
+
+    if(!LOAD(gs_out_open)) return;
+    if(head - LOAD(gs_out.tail) == CHAN_RING_SIZE) {
+        pthread_mutex_lock(&gs_mutex);
+        while(LOAD(gs_out_open) && head - LOAD(gs_out.tail) == CHAN_RING_SIZE) {
+            pthread_cond_wait(&gs_space, &gs_mutex);
+        }
+        pthread_mutex_unlock(&gs_mutex);
+        if(!LOAD(gs_out_open)) return;
+    }
+    gs_out.data[head % CHAN_RING_SIZE] = c;
+    STORE(gs_out.head, head + 1);
+    /* The thread only waits for the socket while there is output */
+    if(LOAD(gs_out.tail) == head) poke(gs_wake[1]);
+}
+#endif
+
+int chan_parse(char *arg)
+{
+    char *eq = strchr(arg, '=');
+    char *comma;
+    char *p = arg;
+    char *end = arg;
+    long addr[3] = { -1, -1, -1 };
+    int n = 0;
+
+    if(eq == NULL) return -1;
+    *eq = '\0';
+    while(n < 3) {
+        addr[n] = strtol(p, &end, 0);
+        if(end == p || addr[n] < 0 || addr[n] >= COMPUTER_ADDR_SIZE) return -1;
+        n++;
+        if(*end != ':') break;
+        p = end + 1;
+    }
+    if(n < 2 || *end != '\0') return -1;
+    gs_in_addr = (int)addr[0];
+    gs_out_addr = (int)addr[1];
+    gs_status_addr = (int)addr[2];
+    if((comma = strchr(eq + 1, ',')) != NULL) {
+        *comma = '\0';
+        gs_out_path = comma + 1;
+    }
+    gs_path = eq + 1;
+    return *gs_path ? 0 : -1;
+}
+
+int chan_init(void)
+{
+#ifdef HAVE_PTHREAD
+    struct stat st;
+    int i;
+
+    if(gs_path == NULL) return 0;
+    if(pipe(gs_notify) || pipe(gs_wake)) return -1;
+    for(i = 0; i < 2; i++) {
+        set_nonblock(gs_notify[i], 1);
+        set_nonblock(gs_wake[i], 1);
+    }
+    if(stat(gs_path, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        if((gs_in_fd = open(gs_path, O_RDWR | O_NONBLOCK)) < 0) return -1;
+        if(gs_out_path) {
+            if((gs_out_fd = open(gs_out_path, O_RDWR | O_NONBLOCK)) < 0) return -1;
+            STORE(gs_out_open, 1);
+        }
+    } else {
+        if(gs_out_path || (gs_listen = open_socket(gs_path)) < 0) return -1;
+        gs_is_socket = 1;
+    }
+    if(pthread_create(&gs_thread, NULL, chan_thread, NULL)) return -1;
+    gs_thread_running = 1;
+    return 0;
+#else
+    return gs_path ? -1 : 0;
+#endif
+}
+
+void chan_attach(computer_devices *dev)
+{
+#ifdef HAVE_PTHREAD
+    if(gs_path == NULL) return;
+    dev->input[gs_in_addr] = in_input;
+    dev->output[gs_out_addr] = out_output;
+    if(gs_status_addr >= 0) dev->input[gs_status_addr] = status_input;
+#endif
+}
+
+void chan_finalize(void)
+{
+#ifdef HAVE_PTHREAD
+    if(gs_thread_running) {
+        STORE(gs_stop, 1);
+        poke(gs_wake[1]);
+        pthread_join(gs_thread, NULL);
+        gs_thread_running = 0;
+    }
+    if(gs_in_fd >= 0) close(gs_in_fd);
+    if(gs_out_fd >= 0 && gs_out_fd != gs_in_fd) close(gs_out_fd);
+    gs_in_fd = gs_out_fd = -1;
+    if(gs_listen >= 0) {
+        close(gs_listen);
+        unlink(gs_path);
+        gs_listen = -1;
+    }
+#endif
+}
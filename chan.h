@@ -0,0 +1,37 @@
+#ifndef CHAN_H_
+#define CHAN_H_
+
+#include "computer.h"
+
+/* A byte channel between the program and a local process, without the
+ * terminal. It binds three IO addresses:
+ *
+ * IN:     input, the next received byte (0 if there is none)
+ * OUT:    output, sends a byte
+ * STATUS: input, 1 if a byte can be read (optional)
+ *
+ * PATH is a Unix domain stream socket the simulator listens on, serving
+ * one client at a time. If PATH is an existing FIFO, bytes are read from
+ * it instead, and sent to OUTPATH if given (opened read-write, so neither
+ * side sees EOF when the other goes away).
+ *
+ * A helper thread moves the bytes between the file descriptors and two
+ * ring buffers, woken by poll() whenever there is something to do. When
+ * the output ring is full the program stalls until the client has read
+ * enough (back-pressure); output with no client connected is dropped. A
+ * program polling IN or STATUS in a loop that can not change sleeps until
+ * a byte arrives, like for the keyboard. Needs pthreads. */
+
+#define CHAN_RING_SIZE 4096
+
+/* Parse "IN:OUT[:STATUS]=PATH[,OUTPATH]". Returns -1 if malformed. */
+int chan_parse(char *arg);
+/* Create the socket or open the FIFOs and start the helper thread.
+ * Returns -1 on failure. */
+int chan_init(void);
+/* Connect the channel to the addresses in dev */
+void chan_attach(computer_devices *dev);
+/* Send what is left, stop the thread and remove the socket */
+void chan_finalize(void);
+
+#endif
@@ -19,20 +19,45 @@ char const *computer_instr_name[COMPUTER_INSTR_NR] = {
 char const computer_flag_name[COMPUTER_FLAG_NR] = {
     'Z', 'E', 'A', 'C' };
 
+static computer_devices const gs_default_devices = {
+    {
+        [PERI_ADDR_ASCII_PRINTER] = peri_ascii_printer_output,
+        [PERI_ADDR_INTEGER_PRINTER] = peri_integer_printer_output,
+        [PERI_ADDR_HEX_PRINTER] = peri_hex_printer_output,
+        [PERI_ADDR_INTEGER16_PRINTER] = peri_integer16_printer_output,
+        [PERI_ADDR_INTEGER24_PRINTER] = peri_integer24_printer_output,
+        [PERI_ADDR_INTEGER32_PRINTER] = peri_integer32_printer_output,
+        [PERI_ADDR_TERMINATE] = peri_terminate_output,
+        [PERI_ADDR_XRAM_BANK] = peri_xram_bank_output,
+        [PERI_ADDR_XRAM_ADDR] = peri_xram_addr_output,
+        [PERI_ADDR_XRAM_DATA] = peri_xram_data_output,
+        [PERI_ADDR_XRAM_DMA] = peri_xram_dma_output,
+        [PERI_ADDR_TIMER_SLEEP] = peri_timer_sleep_output,
+        [PERI_ADDR_TIMER_MARK] = peri_timer_mark_output,
+        [PERI_ADDR_MATH_A] = peri_math_a_output,
+        [PERI_ADDR_MATH_B] = peri_math_b_output,
+        [PERI_ADDR_MATH_OP] = peri_math_op_output
+    },
+    {
+        [PERI_ADDR_KEYBOARD] = peri_keyboard_buffered_input,
+        [PERI_ADDR_KEYBOARD_HAS_INPUT] = peri_keyboard_has_input,
+        [PERI_ADDR_RANDOM] = peri_random_input,
+        [PERI_ADDR_XRAM_DATA] = peri_xram_data_input,
+        [PERI_ADDR_TIMER_ELAPSED] = peri_timer_elapsed_input,
+        [PERI_ADDR_MATH_RESULT] = peri_math_result_input
+    }
+};
+
 void computer_reset(computer *comp)
 {
     memset(comp, 0, sizeof(*comp));
     comp->is_running = 1;
-    comp->io_input[PERI_ADDR_KEYBOARD] = peri_keyboard_buffered_input;
-    comp->io_input[PERI_ADDR_KEYBOARD_HAS_INPUT] = peri_keyboard_has_input;
-    comp->io_output[PERI_ADDR_ASCII_PRINTER] = peri_ascii_printer_output;
-    comp->io_output[PERI_ADDR_INTEGER_PRINTER] = peri_integer_printer_output;
-    comp->io_output[PERI_ADDR_HEX_PRINTER] = peri_hex_printer_output;
-    comp->io_output[PERI_ADDR_INTEGER16_PRINTER] = peri_integer16_printer_output;
-    comp->io_output[PERI_ADDR_INTEGER24_PRINTER] = peri_integer24_printer_output;
-    comp->io_output[PERI_ADDR_INTEGER32_PRINTER] = peri_integer32_printer_output;
-    comp->io_output[PERI_ADDR_TERMINATE] = peri_terminate_output;
-    comp->io_input[PERI_ADDR_RANDOM] = peri_random_input;
+    comp->dev = &gs_default_devices;
+}
+
+void computer_devices_init(computer_devices *dev)
+{
+    *dev = gs_default_devices;
 }
 
 int computer_is_running(computer *comp)
@@ -57,7 +82,7 @@ static void unset_flag(unsigned char *flag, unsigned char pos)
 }
 */
 
-static void alu_comp(unsigned char a, unsigned char b, unsigned char carry_in, unsigned char op, unsigned char *c, unsigned char *flag)
+static void alu_comp(computer_word a, computer_word b, unsigned char carry_in, unsigned char op, computer_word *c, unsigned char *flag)
 {
     *flag = 0;
     if(a > b) {
@@ -67,29 +92,29 @@ static void alu_comp(unsigned char a, unsigned char b, unsigned char carry_in, u
     }
 
     if(op == COMPUTER_ALU_ADD) {
-        int sum = (a + b + carry_in);
-        if(sum > 255) {
+        long sum = (a + b + carry_in);
+        if(sum > COMPUTER_WORD_MAX) {
             set_flag(flag, COMPUTER_FLAG_CARRY);
         }
-        *c = (unsigned char)(sum & 255);
+        *c = (computer_word)(sum & COMPUTER_WORD_MAX);
     } else if(op == COMPUTER_ALU_SHL) {
-        if(a & 128) {
+        if(a & (1 << (COMPUTER_ADDR_BITS - 1))) {
             set_flag(flag, COMPUTER_FLAG_CARRY);
         }
-        *c = (unsigned char)((a << 1) + carry_in);
+        *c = (computer_word)((a << 1) + carry_in);
     } else if(op == COMPUTER_ALU_SHR) {
         if(a & 1) {
             set_flag(flag, COMPUTER_FLAG_CARRY);
         }
-        *c = (unsigned char)((a >> 1) + (carry_in << 7));
+        *c = (computer_word)((a >> 1) + (carry_in << (COMPUTER_ADDR_BITS - 1)));
     } else if(op == COMPUTER_ALU_NOT) {
-        *c = (unsigned char)(~a);
+        *c = (computer_word)(~a);
     } else if(op == COMPUTER_ALU_AND) {
-        *c = (unsigned char)(a & b);
+        *c = (computer_word)(a & b);
     } else if(op == COMPUTER_ALU_OR) {
-        *c = (unsigned char)(a | b);
+        *c = (computer_word)(a | b);
     } else if(op == COMPUTER_ALU_XOR) {
-        *c = (unsigned char)(a ^ b);
+        *c = (computer_word)(a ^ b);
     } else if(op == COMPUTER_ALU_CMP) {
         /* Do nothing */
     }
@@ -97,6 +122,28 @@ static void alu_comp(unsigned char a, unsigned char b, unsigned char carry_in, u
     if(op != COMPUTER_ALU_CMP && *c == 0) set_flag(flag, COMPUTER_FLAG_ZERO);
 }
 
+computer_word computer_read_imm(computer const *comp, computer_word addr)
+{
+#if COMPUTER_IMM_LEN == 1
+    return comp->ram[addr];
+#else
+    return (computer_word)(comp->ram[addr] | comp->ram[(computer_word)(addr + 1)] << 8);
+#endif
+}
+
+/* Input handlers write a byte, the 16-bit machine gets it zero-extended */
+static void io_input(computer *comp, computer_word *reg)
+{
+#if COMPUTER_ADDR_BITS == 8
+    comp->dev->input[comp->io_addr](comp, reg);
+#else
+    unsigned char c = (unsigned char)*reg;
+
+    comp->dev->input[comp->io_addr](comp, &c);
+    *reg = c;
+#endif
+}
+
 void computer_step_cycle(computer *comp)
 {
     int step = (int)(comp->clock_cycle % COMPUTER_INSTR_LEN);
@@ -106,7 +153,7 @@ void computer_step_cycle(computer *comp)
         comp->mar = comp->iar;
         alu_comp(comp->iar, 1, 0, 0, &comp->acc, &flag_unused);
     } else if(step == 1) {
-        comp->ir = comp->ram[(int)comp->mar];
+        comp->ir = comp->ram[comp->mar];
     } else if(step == 2) {
         comp->iar = comp->acc;
     } else if(step < 6) {
@@ -135,7 +182,8 @@ void computer_step_cycle(computer *comp)
             if(step == 3) {
                 comp->mar = comp->reg[A];
             } else if(step == 4) {
-                comp->ram[comp->mar] = comp->reg[B];
+                comp->ram[comp->mar] = (unsigned char)comp->reg[B];
+                comp->ram_writes++;
             }
         } else if(instr == COMPUTER_INSTR_DATA) {
             if(step == 3) {
@@ -143,9 +191,9 @@ void computer_step_cycle(computer *comp)
                 alu_comp(comp->iar, 1, 0, 0, &comp->acc, &flag_unused);
                 comp->mar = comp->iar;
             } else if(step == 4) {
-                comp->reg[B] = comp->ram[comp->mar];
+                comp->reg[B] = computer_read_imm(comp, comp->mar);
             } else if(step == 5) {
-                comp->iar = comp->acc;
+                comp->iar = (computer_word)(comp->acc + COMPUTER_IMM_LEN - 1);
             }
         } else if(instr == COMPUTER_INSTR_JMPR) {
             if(step == 3) {
@@ -155,23 +203,23 @@ void computer_step_cycle(computer *comp)
             if(step == 3) {
                 comp->mar = comp->iar;
             } else if(step == 4) {
-                comp->iar = comp->ram[comp->mar];
+                comp->iar = computer_read_imm(comp, comp->mar);
             }
         } else if(instr == COMPUTER_INSTR_JXXX) {
             if(step == 3) {
                 unsigned char flag_unused;
-                alu_comp(comp->iar, 1, 0, COMPUTER_ALU_ADD, &comp->acc, &flag_unused);
+                alu_comp(comp->iar, COMPUTER_IMM_LEN, 0, COMPUTER_ALU_ADD, &comp->acc, &flag_unused);
                 comp->mar = comp->iar;
             } else if(step == 4) {
                 comp->iar = comp->acc;
             } else if(step == 5) {
                 if(comp->flags & comp->ir) {
-                    comp->iar = comp->ram[comp->mar];
+                    comp->iar = computer_read_imm(comp, comp->mar);
                 }
             }
         } else if(instr == COMPUTER_INSTR_CLF) {
             if(step == 3) {
-                unsigned char acc_unused;
+                computer_word acc_unused;
                 alu_comp(0, 1, 0, COMPUTER_ALU_ADD, &acc_unused, &comp->flags);
             }
         } else if(instr == COMPUTER_INSTR_IO) {
@@ -179,16 +227,18 @@ void computer_step_cycle(computer *comp)
             int is_data = ((A & 1) == COMPUTER_IO_DATA);
             if(step == 3 && !is_input) {
                 if(is_data) {
-                    if(comp->io_output[comp->io_addr]) {
-                        comp->io_output[comp->io_addr](comp, comp->reg[B]);
+                    comp->io_count++;
+                    if(comp->dev->output[comp->io_addr]) {
+                        comp->dev->output[comp->io_addr](comp, (unsigned char)comp->reg[B]);
                     }
                 } else {
-                    comp->io_addr = comp->reg[B];
+                    comp->io_addr = (unsigned char)comp->reg[B];
                 }
             } else if(step == 4 && is_input) {
                 if(is_data) {
-                    if(comp->io_input[comp->io_addr]) {
-                        comp->io_input[comp->io_addr](comp, &comp->reg[B]);
+                    comp->io_count++;
+                    if(comp->dev->input[comp->io_addr]) {
+                        io_input(comp, &comp->reg[B]);
                     }
                 } else {
                     /* Can not get current address */
@@ -218,13 +268,13 @@ static void fast_ADD(computer *comp, int a, int b)
     int va = comp->reg[a];
     int vb = comp->reg[b];
     unsigned char flags = 0;
-    int sum = va + vb + get_flag(comp->flags, COMPUTER_FLAG_CARRY);
+    long sum = va + vb + get_flag(comp->flags, COMPUTER_FLAG_CARRY);
 
-    comp->reg[b] = (unsigned char)(sum);
+    comp->reg[b] = (computer_word)(sum);
     comp->flags = 0;
     if(va > vb) set_flag(&flags, COMPUTER_FLAG_A_LARGER);
     if(va == vb) set_flag(&flags, COMPUTER_FLAG_EQUAL);
-    if(sum > 255) set_flag(&flags, COMPUTER_FLAG_CARRY);
+    if(sum > COMPUTER_WORD_MAX) set_flag(&flags, COMPUTER_FLAG_CARRY);
     if(comp->reg[b] == 0) set_flag(&flags, COMPUTER_FLAG_ZERO);
     comp->flags = (unsigned char)flags;
 }
@@ -235,7 +285,7 @@ static void fast_SHR(computer *comp, int a, int b)
     int vb = comp->reg[b];
     unsigned char flags = 0;
     int carry_in = get_flag(comp->flags, COMPUTER_FLAG_CARRY);
-    comp->reg[b] = (unsigned char)((va >> 1) + (carry_in << 7));
+    comp->reg[b] = (computer_word)((va >> 1) + (carry_in << (COMPUTER_ADDR_BITS - 1)));
 
     if(va > vb) set_flag(&flags, COMPUTER_FLAG_A_LARGER);
     if(va == vb) set_flag(&flags, COMPUTER_FLAG_EQUAL);
@@ -251,11 +301,11 @@ static void fast_SHL(computer *comp, int a, int b)
     unsigned char flags = 0;
     int carry_in = get_flag(comp->flags, COMPUTER_FLAG_CARRY);
 
-    comp->reg[b] = (unsigned char)((va << 1) + carry_in);
+    comp->reg[b] = (computer_word)((va << 1) + carry_in);
 
     if(va > vb) set_flag(&flags, COMPUTER_FLAG_A_LARGER);
     if(va == vb) set_flag(&flags, COMPUTER_FLAG_EQUAL);
-    if(va & 128) set_flag(&flags, COMPUTER_FLAG_CARRY);
+    if(va & (1 << (COMPUTER_ADDR_BITS - 1))) set_flag(&flags, COMPUTER_FLAG_CARRY);
     if(comp->reg[b] == 0) set_flag(&flags, COMPUTER_FLAG_ZERO);
     comp->flags = (unsigned char)flags;
 }
@@ -266,7 +316,7 @@ static void fast_NOT(computer *comp, int a, int b)
     int vb = comp->reg[b];
     unsigned char flags = 0;
 
-    comp->reg[b] = (unsigned char)~va;
+    comp->reg[b] = (computer_word)~va;
     if(va > vb) set_flag(&flags, COMPUTER_FLAG_A_LARGER);
     if(va == vb) set_flag(&flags, COMPUTER_FLAG_EQUAL);
     if(comp->reg[b] == 0) set_flag(&flags, COMPUTER_FLAG_ZERO);
@@ -279,7 +329,7 @@ static void fast_AND(computer *comp, int a, int b)
     int vb = comp->reg[b];
     unsigned char flags = 0;
 
-    comp->reg[b] = (unsigned char)(va & vb);
+    comp->reg[b] = (computer_word)(va & vb);
     if(va > vb) set_flag(&flags, COMPUTER_FLAG_A_LARGER);
     if(va == vb) set_flag(&flags, COMPUTER_FLAG_EQUAL);
     if(comp->reg[b] == 0) set_flag(&flags, COMPUTER_FLAG_ZERO);
@@ -292,7 +342,7 @@ static void fast_OR(computer *comp, int a, int b)
     int vb = comp->reg[b];
     unsigned char flags = 0;
 
-    comp->reg[b] = (unsigned char)(va | vb);
+    comp->reg[b] = (computer_word)(va | vb);
     if(va > vb) set_flag(&flags, COMPUTER_FLAG_A_LARGER);
     if(va == vb) set_flag(&flags, COMPUTER_FLAG_EQUAL);
     if(comp->reg[b] == 0) set_flag(&flags, COMPUTER_FLAG_ZERO);
@@ -305,7 +355,7 @@ static void fast_XOR(computer *comp, int a, int b)
     int vb = comp->reg[b];
     unsigned char flags = 0;
 
-    comp->reg[b] = (unsigned char)(va ^ vb);
+    comp->reg[b] = (computer_word)(va ^ vb);
     if(va > vb) set_flag(&flags, COMPUTER_FLAG_A_LARGER);
     if(va == vb) set_flag(&flags, COMPUTER_FLAG_EQUAL);
     if(comp->reg[b] == 0) set_flag(&flags, COMPUTER_FLAG_ZERO);
@@ -325,36 +375,43 @@ static void fast_CMP(computer *comp, int a, int b)
 
 static void fast_LD(computer *comp, int a, int b)
 {
-    comp->reg[b] = (unsigned char)(comp->ram[comp->reg[a]]);
+    comp->reg[b] = comp->ram[comp->reg[a]];
 }
 
 static void fast_ST(computer *comp, int a, int b)
 {
-    comp->ram[comp->reg[a]] = (unsigned char)(comp->reg[b]);
+    computer_word addr = comp->reg[a];
+
+    comp->ram[addr] = (unsigned char)(comp->reg[b]);
+    comp->ram_writes++;
+    if(comp->watch_write && (comp->watch_write[addr >> 3] >> (addr & 7)) & 1) {
+        comp->break_hit = COMPUTER_BREAK_WRITE;
+        comp->break_addr = addr;
+    }
 }
 
 static void fast_DATA(computer *comp, int a, int b)
 {
-    comp->iar = (unsigned char)(comp->iar + 1);
-    comp->reg[b] = comp->ram[comp->iar];
+    comp->reg[b] = computer_read_imm(comp, (computer_word)(comp->iar + 1));
+    comp->iar = (computer_word)(comp->iar + COMPUTER_IMM_LEN);
 }
 
 static void fast_JMPR(computer *comp, int a, int b)
 {
-    comp->iar = (unsigned char)(comp->reg[b] - 1);
+    comp->iar = (computer_word)(comp->reg[b] - 1);
 }
 
 static void fast_JMP(computer *comp, int a, int b)
 {
-    comp->iar = (unsigned char)(comp->ram[(unsigned char)(comp->iar + 1)] - 1);
+    comp->iar = (computer_word)(computer_read_imm(comp, (computer_word)(comp->iar + 1)) - 1);
 }
 
 static void fast_JCAEZ(computer *comp, int a, int b)
 {
     if(comp->flags & ((a << 2) + b)) {
-        comp->iar = (unsigned char)(comp->ram[(unsigned char)(comp->iar + 1)] - 1);
+        comp->iar = (computer_word)(computer_read_imm(comp, (computer_word)(comp->iar + 1)) - 1);
     } else {
-        comp->iar = (unsigned char)(comp->iar + 1);
+        comp->iar = (computer_word)(comp->iar + COMPUTER_IMM_LEN);
     }
 }
 
@@ -365,14 +422,21 @@ static void fast_CLF(computer *comp, int a, int b)
 
 static void fast_IO(computer *comp, int a, int b)
 {
+    if(comp->break_io && (a & 1) == COMPUTER_IO_DATA && (comp->break_io[comp->io_addr >> 3] >> (comp->io_addr & 7)) & 1) {
+        comp->break_hit = COMPUTER_BREAK_IO;
+        comp->break_addr = comp->io_addr;
+    }
+    if((a & 1) == COMPUTER_IO_DATA) {
+        comp->io_count++;
+    }
     if(a == 0) {
-        comp->io_input[comp->io_addr](comp, &comp->reg[b]);
+        io_input(comp, &comp->reg[b]);
     } else if(a == 1) {
         comp->reg[b] = comp->io_addr;
     } else if(a == 2) {
-        comp->io_output[comp->io_addr](comp, comp->reg[b]);
+        comp->dev->output[comp->io_addr](comp, (unsigned char)comp->reg[b]);
     } else {
-        comp->io_addr = comp->reg[b];
+        comp->io_addr = (unsigned char)comp->reg[b];
     }
 }
 
@@ -384,13 +448,24 @@ static void (*fast_func[16])(computer *, int, int) = {
 
 void computer_step_instruction_fast(computer *comp)
 {
-    unsigned char iar = comp->iar;
+    computer_word iar = comp->iar;
     unsigned char op = comp->ram[iar];
 
     fast_func[op >> 4](comp, (op >> 2) & 3, op & 3);
     
-    comp->iar = (unsigned char)(comp->iar + 1);
-    comp->clock_cycle += 6;
+    comp->iar = (computer_word)(comp->iar + 1);
+    comp->clock_cycle += COMPUTER_FAST_INSTR_CYCLES;
+}
+
+unsigned long computer_run_fast(computer *comp, unsigned long cycle)
+{
+    unsigned long instructions = 0;
+
+    while(comp->is_running && comp->clock_cycle < cycle) {
+        computer_step_instruction_fast(comp);
+        instructions++;
+    }
+    return instructions;
 }
 
 void computer_get_instruction_name(unsigned char instruction, char *name)
@@ -442,3 +517,47 @@ void computer_get_instruction_name(unsigned char instruction, char *name)
         }
     }
 }
+
+int computer_get_instruction_length(unsigned char instruction)
+{
+    int op = instruction >> 4;
+
+    if(op == COMPUTER_INSTR_DATA || op == COMPUTER_INSTR_JMP || op == COMPUTER_INSTR_JXXX) {
+        return 1 + COMPUTER_IMM_LEN;
+    }
+    return 1;
+}
+
+int computer_get_write_target(computer const *comp, computer_word *target)
+{
+    unsigned char instruction = comp->ram[comp->iar];
+    int op = instruction >> 4;
+    int a = (instruction >> 2) & 3;
+    int b = instruction & 3;
+
+    *target = (computer_word)b;
+    if(op & 8) { /* ALU operation */
+        return (op & 7) == COMPUTER_ALU_CMP ? COMPUTER_WRITE_NONE : COMPUTER_WRITE_REG;
+    }
+    switch(op) {
+        case COMPUTER_INSTR_LD:
+        case COMPUTER_INSTR_DATA:
+            return COMPUTER_WRITE_REG;
+        case COMPUTER_INSTR_ST:
+            *target = comp->reg[a];
+            return COMPUTER_WRITE_RAM;
+        case COMPUTER_INSTR_IO:
+            return (a >> 1) == COMPUTER_IO_INPUT ? COMPUTER_WRITE_REG : COMPUTER_WRITE_NONE;
+        default:
+            return COMPUTER_WRITE_NONE;
+    }
+}
+
+int computer_image_check(unsigned char const *data, unsigned long len)
+{
+    int wide = len >= COMPUTER_IMAGE_HEADER_SIZE && memcmp(data, COMPUTER_IMAGE_MAGIC, 4) == 0 &&
+               data[4] == COMPUTER_IMAGE_VERSION && data[5] == 16;
+
+    if(wide != (COMPUTER_ADDR_BITS == 16)) return -1;
+    return wide ? COMPUTER_IMAGE_HEADER_SIZE : 0;
+}
@@ -1,10 +1,33 @@
 #ifndef COMPUTER_H_
 #define COMPUTER_H_
 
-#define COMPUTER_RAM_SIZE 256
+/* COMPUTER_ADDR_BITS selects the machine at compile time: 8 for the
+ * classic computer, 16 for the wide variant with 64 KiB RAM, 16-bit
+ * registers and 2-byte (little-endian) operands for DATA, JMP and JXXX.
+ * The IO address space is 256 in both, and IO moves the low byte. */
+#ifndef COMPUTER_ADDR_BITS
+#   define COMPUTER_ADDR_BITS 8
+#endif
+
+#if COMPUTER_ADDR_BITS == 8
+typedef unsigned char computer_word;
+#elif COMPUTER_ADDR_BITS == 16
+typedef unsigned short computer_word;
+#else
+#   error "COMPUTER_ADDR_BITS must be 8 or 16"
+#endif
+
+#define COMPUTER_RAM_SIZE (1 << COMPUTER_ADDR_BITS)
+#define COMPUTER_WORD_MAX (COMPUTER_RAM_SIZE - 1)
+/* Bytes of the operand of DATA, JMP and JXXX */
+#define COMPUTER_IMM_LEN (COMPUTER_ADDR_BITS / 8)
 #define COMPUTER_ADDR_SIZE 256
 #define COMPUTER_REG_NR 4
+/* Alignment of struct computer; allocate it with posix_memalign() */
+#define COMPUTER_CACHE_LINE 64
 #define COMPUTER_INSTR_LEN 7
+/* Clock cycles accounted per instruction by the fast engine */
+#define COMPUTER_FAST_INSTR_CYCLES 6
 
 #define COMPUTER_FLAG_ZERO     0
 #define COMPUTER_FLAG_EQUAL    1
@@ -32,6 +55,23 @@
 #define COMPUTER_INSTR_IO   7 /* 0111[IO][DA]RB; RB */
 #define COMPUTER_INSTR_NR   8
 
+/* Reasons for the fast engine to set break_hit */
+#define COMPUTER_BREAK_NONE  0
+#define COMPUTER_BREAK_WRITE 1 /* RAM write to a watched address */
+#define COMPUTER_BREAK_IO    2 /* IND/OUTD at a watched IO address */
+
+/* What an instruction writes besides iar, flags and io_addr */
+#define COMPUTER_WRITE_NONE 0
+#define COMPUTER_WRITE_REG  1
+#define COMPUTER_WRITE_RAM  2
+
+/* Images for the 16-bit machine start with a header: COMPUTER_IMAGE_MAGIC,
+ * the version, COMPUTER_ADDR_BITS and two reserved bytes. 8-bit images
+ * have no header. */
+#define COMPUTER_IMAGE_MAGIC "MC16"
+#define COMPUTER_IMAGE_VERSION 1
+#define COMPUTER_IMAGE_HEADER_SIZE 8
+
 #define COMPUTER_IO_INPUT  0
 #define COMPUTER_IO_OUTPUT 1
 #define COMPUTER_IO_DATA 0
@@ -43,29 +83,66 @@ extern char const *computer_instr_name[COMPUTER_INSTR_NR];
 extern char const computer_flag_name[COMPUTER_FLAG_NR];
 
 typedef struct computer computer;
+typedef struct computer_devices computer_devices;
+
+/* IO handlers by address, NULL where nothing is connected. Computers only
+ * hold a pointer to their map, so one map can serve any number of them; it
+ * must not change while they run. */
+struct computer_devices {
+    void (*output[COMPUTER_ADDR_SIZE])(computer *, unsigned char);
+    void (*input[COMPUTER_ADDR_SIZE])(computer *, unsigned char *);
+};
 
+/* The machine state. What every instruction uses comes first, so that it
+ * shares the first cache line, and the RAM follows. */
 struct computer {
-    unsigned char mar;
-    unsigned char ram[COMPUTER_RAM_SIZE];
-    unsigned char reg[COMPUTER_REG_NR];
-    unsigned char ir, iar, tmp, acc, flags;
+    computer_word reg[COMPUTER_REG_NR];
+    computer_word iar, mar, tmp, acc;
+    unsigned char ir, flags;
     unsigned char io_addr;
-    void (*io_output[COMPUTER_ADDR_SIZE])(computer *, unsigned char);
-    void (*io_input[COMPUTER_ADDR_SIZE])(computer *, unsigned char *);
-
-    unsigned long clock_cycle;
     int is_running;
-};
+    unsigned long clock_cycle;
+    unsigned long io_count; /* Number of IND and OUTD instructions run */
+    unsigned long ram_writes; /* Number of RAM writes by ST, the debugger or undo */
+    computer_devices const *dev;
+
+    /* Debugger hooks, bitmaps with one bit per address (NULL when unused).
+     * Only the fast engine checks them. After a matching instruction
+     * break_hit is set to COMPUTER_BREAK_* and break_addr to the address. */
+    unsigned char const *watch_write;
+    unsigned char const *break_io;
+    int break_hit;
+    computer_word break_addr;
+
+    unsigned char ram[COMPUTER_RAM_SIZE];
+} __attribute__((aligned(COMPUTER_CACHE_LINE)));
 
+/* Connects comp to the default peripherals of peri.h */
 void computer_reset(computer *comp);
+/* Fill dev with the default peripherals, for adding more to them */
+void computer_devices_init(computer_devices *dev);
 int computer_is_running(computer *comp);
 /* Step a single clock cycle */
 void computer_step_cycle(computer *comp);
 /* Step an entire instruction */
 void computer_step_instruction(computer *comp);
 void computer_step_instruction_fast(computer *comp);
+/* Run the fast engine until the clock reaches cycle or the computer stops.
+ * Returns the number of instructions run. */
+unsigned long computer_run_fast(computer *comp, unsigned long cycle);
 
 void computer_get_instruction_name(unsigned char instruction, char *name);
+/* Number of RAM bytes used by an instruction (1 or 1 + COMPUTER_IMM_LEN) */
+int computer_get_instruction_length(unsigned char instruction);
+/* What the next instruction will write (COMPUTER_WRITE_*), with the
+ * register index or RAM address in target. Writes done by peripherals
+ * (e.g. DMA) are not included. */
+int computer_get_write_target(computer const *comp, computer_word *target);
+/* Read the operand of DATA, JMP or JXXX at addr */
+computer_word computer_read_imm(computer const *comp, computer_word addr);
+/* Check the header of an image of len bytes. Returns the number of header
+ * bytes to skip, or -1 if the image is for the other width. */
+int computer_image_check(unsigned char const *data, unsigned long len);
 
 #endif
 
@@ -6,6 +6,7 @@
 #else
 #   define HAVE_TIMING
 #   define HAVE_SIGNAL
+#   define HAVE_PTHREAD
 #   define MINICOMP_VERSION "0.0"
 #endif
 
@@ -7,6 +7,8 @@ minc=Makefile.inc
 use_timing=1
 use_signal=1
 use_ncurses=0
+use_threads=1
+use_zstd=0
 debug=0
 
 [ -f "config.local" ] && source config.local
@@ -27,6 +29,14 @@ if [ "$use_ncurses" == "1" ]; then
     echo "#define HAVE_NCURSES" >> $conf_tmp
     echo "LDFLAGS += -lncurses" >> $minc
 fi
+if [ "$use_threads" == "1" ]; then
+    echo "#define HAVE_PTHREAD" >> $conf_tmp
+    echo "LDFLAGS += -lpthread" >> $minc
+fi
+if [ "$use_zstd" == "1" ]; then
+    echo "#define HAVE_ZSTD" >> $conf_tmp
+    echo "LDFLAGS += -lzstd" >> $minc
+fi
 if [ "$debug" == "1" ]; then
     echo "#define DEBUG" >> $conf_tmp
 fi
@@ -0,0 +1,486 @@
+#include "debugger.h"
+#include "undo.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <unistd.h>
+#include "config_impl.h"
+
+#define MAP_SIZE (COMPUTER_RAM_SIZE / 8)
+
+#define STOP_NONE  0
+#define STOP_PC    1
+#define STOP_WRITE 2
+#define STOP_IO    3
+#define STOP_USER  4
+#define STOP_START 5 /* Reverse execution reached the oldest instruction */
+#define STOP_WRITE_NEXT 6 /* Reverse execution found a watched write */
+
+struct debugger {
+    computer *comp;
+    FILE *in;
+    int (*find_label)(char const *);
+    int interactive;
+    int quit;
+    undo_log *undo; /* NULL if reverse execution is not enabled */
+    unsigned char pc_break[MAP_SIZE];
+    /* Addresses from which straight-line code reaches a PC breakpoint
+     * before the next jump. Only blocks starting at such an address are
+     * run one instruction at a time, all others run without checks. */
+    unsigned char slow[MAP_SIZE];
+    unsigned char watch_write[MAP_SIZE];
+    unsigned char break_io[MAP_SIZE];
+};
+
+static volatile sig_atomic_t gs_interrupt = 0;
+
+static int get_bit(unsigned char const *map, int addr)
+{
+    return (map[addr >> 3] >> (addr & 7)) & 1;
+}
+
+static void set_bit(unsigned char *map, int addr)
+{
+    map[addr >> 3] = (unsigned char)(map[addr >> 3] | (1 << (addr & 7)));
+}
+
+static void clear_bit(unsigned char *map, int addr)
+{
+    map[addr >> 3] = (unsigned char)(map[addr >> 3] & ~(1 << (addr & 7)));
+}
+
+static int is_empty(unsigned char const *map)
+{
+    int i;
+
+    for(i = 0; i < MAP_SIZE; i++) {
+        if(map[i]) return 0;
+    }
+    return 1;
+}
+
+static int is_jump(unsigned char instr)
+{
+    int op = instr >> 4;
+
+    return op == COMPUTER_INSTR_JMPR || op == COMPUTER_INSTR_JMP || op == COMPUTER_INSTR_JXXX;
+}
+
+/* Recomputed every time the program is continued, code written while
+ * running may hide a breakpoint until then. An address is slow if it has a
+ * breakpoint, or if it is not a jump and the next instruction is slow. The
+ * next instruction is at a higher address except at the end of RAM, so a
+ * pass from the top down settles everything but code that runs over the end,
+ * which the following passes pick up. */
+static void update_slow(debugger *dbg)
+{
+    unsigned char const *ram = dbg->comp->ram;
+    int changed;
+
+    memset(dbg->slow, 0, sizeof(dbg->slow));
+    if(is_empty(dbg->pc_break)) return;
+    do {
+        int addr;
+
+        changed = 0;
+        for(addr = COMPUTER_RAM_SIZE - 1; addr >= 0; addr--) {
+            int next = (addr + computer_get_instruction_length(ram[addr])) % COMPUTER_RAM_SIZE;
+
+            if(get_bit(dbg->slow, addr)) continue;
+            if(get_bit(dbg->pc_break, addr) || (!is_jump(ram[addr]) && get_bit(dbg->slow, next))) {
+                set_bit(dbg->slow, addr);
+                changed = 1;
+            }
+        }
+    } while(changed);
+}
+
+debugger *debug_create(computer *comp, FILE *in, int (*find_label)(char const *))
+{
+    debugger *dbg = calloc(1, sizeof(*dbg));
+
+    if(dbg == NULL) return NULL;
+    dbg->comp = comp;
+    dbg->in = in;
+    dbg->find_label = find_label;
+    dbg->interactive = isatty(fileno(in));
+
+    return dbg;
+}
+
+void debug_destroy(debugger *dbg)
+{
+    if(dbg == NULL) return;
+    dbg->comp->watch_write = NULL;
+    dbg->comp->break_io = NULL;
+    free(dbg);
+}
+
+void debug_set_undo_log(debugger *dbg, undo_log *log)
+{
+    dbg->undo = log;
+}
+
+void debug_interrupt(void)
+{
+    gs_interrupt = 1;
+}
+
+static void step(debugger *dbg)
+{
+    if(dbg->undo) {
+        undo_step(dbg->undo, dbg->comp);
+    } else {
+        computer_step_instruction_fast(dbg->comp);
+    }
+}
+
+static void set_hooks(debugger *dbg)
+{
+    dbg->comp->watch_write = is_empty(dbg->watch_write) ? NULL : dbg->watch_write;
+    dbg->comp->break_io = is_empty(dbg->break_io) ? NULL : dbg->break_io;
+}
+
+/* Run until a breakpoint, watchpoint or interrupt. A breakpoint at the
+ * current address is ignored so that it is possible to continue from it. */
+static int run(debugger *dbg)
+{
+    computer *comp = dbg->comp;
+    int first = 1;
+
+    update_slow(dbg);
+    set_hooks(dbg);
+    gs_interrupt = 0;
+    comp->break_hit = COMPUTER_BREAK_NONE;
+    while(comp->is_running) {
+        unsigned long instructions = 0;
+        unsigned char instr;
+
+        if(gs_interrupt) return STOP_USER;
+        if(get_bit(dbg->slow, comp->iar)) {
+            do {
+                if(!first && get_bit(dbg->pc_break, comp->iar)) {
+                    stats_publish(comp, instructions);
+                    return STOP_PC;
+                }
+                first = 0;
+                instr = comp->ram[comp->iar];
+                step(dbg);
+                instructions++;
+            } while(comp->is_running && !comp->break_hit && !is_jump(instr));
+        } else {
+            do {
+                instr = comp->ram[comp->iar];
+                step(dbg);
+                instructions++;
+            } while(comp->is_running && !comp->break_hit && !is_jump(instr));
+            first = 0;
+        }
+        /* Once per block, like the chunks of the fast loop */
+        stats_publish(comp, instructions);
+        if(comp->break_hit) {
+            return comp->break_hit == COMPUTER_BREAK_WRITE ? STOP_WRITE : STOP_IO;
+        }
+    }
+    return STOP_NONE;
+}
+
+static void print_state(computer *comp)
+{
+    char name[32];
+    int i;
+
+    computer_get_instruction_name(comp->ram[comp->iar], name);
+    printf("IAR %3d ", comp->iar);
+    for(i = 0; i < COMPUTER_REG_NR; i++) {
+        printf(" %s %3d", computer_reg_name[i], comp->reg[i]);
+    }
+    printf("  FLAGS ");
+    for(i = COMPUTER_FLAG_NR - 1; i >= 0; i--) {
+        putchar((comp->flags >> i) & 1 ? computer_flag_name[i] : '-');
+    }
+    printf("  IO %3d  cycle %lu\n", comp->io_addr, comp->clock_cycle);
+    if(computer_get_instruction_length(comp->ram[comp->iar]) > 1) {
+        printf("  next: %s %d\n", name, computer_read_imm(comp, (computer_word)(comp->iar + 1)));
+    } else {
+        printf("  next: %s\n", name);
+    }
+}
+
+static void print_stop(debugger *dbg, int reason)
+{
+    computer *comp = dbg->comp;
+
+    switch(reason) {
+        case STOP_PC:
+            printf("Breakpoint at %d.\n", comp->iar);
+            break;
+        case STOP_WRITE:
+            printf("Write to %d, now %d.\n", comp->break_addr, comp->ram[comp->break_addr]);
+            break;
+        case STOP_IO:
+            printf("IO at address %d.\n", comp->break_addr);
+            break;
+        case STOP_USER:
+            printf("Interrupted.\n");
+            break;
+        case STOP_WRITE_NEXT:
+            printf("Next instruction writes to %d, now %d.\n", comp->break_addr, comp->ram[comp->break_addr]);
+            break;
+        case STOP_START:
+            printf("Reached the oldest recorded instruction.\n");
+            break;
+        default:
+            if(dbg->undo && !comp->is_running) {
+                printf("The computer is turned off.\n");
+            }
+            return;
+    }
+    print_state(comp);
+}
+
+/* Parse a number, a label or label+offset. Returns -1 on error. */
+static int parse_value(debugger *dbg, char const *str, long *val)
+{
+    char buf[256];
+    char *end;
+    char *plus;
+    int addr;
+
+    if(str == NULL) return -1;
+    *val = strtol(str, &end, 0);
+    if(end != str && *end == '\0') return 0;
+    if(dbg->find_label == NULL || strlen(str) >= sizeof(buf)) return -1;
+    strcpy(buf, str);
+    if((plus = strchr(buf, '+')) != NULL) *plus = '\0';
+    if((addr = dbg->find_label(buf)) < 0) return -1;
+    *val = addr + (plus ? strtol(plus + 1, NULL, 0) : 0);
+
+    return 0;
+}
+
+static int parse_addr(debugger *dbg, char const *str)
+{
+    long addr;
+
+    if(parse_value(dbg, str, &addr) || addr < 0 || addr >= COMPUTER_RAM_SIZE) {
+        printf("Invalid address '%s'.\n", str ? str : "");
+        return -1;
+    }
+    return (int)addr;
+}
+
+static void print_map(char const *name, unsigned char const *map)
+{
+    int addr;
+
+    printf("%s:", name);
+    for(addr = 0; addr < COMPUTER_RAM_SIZE; addr++) {
+        if(get_bit(map, addr)) printf(" %d", addr);
+    }
+    printf("\n");
+}
+
+static void cmd_set(debugger *dbg, char const *what, char const *val_str)
+{
+    computer *comp = dbg->comp;
+    long val;
+    int i;
+
+    if(what == NULL || parse_value(dbg, val_str, &val) || val < -128 || val > COMPUTER_WORD_MAX) {
+        printf("Usage: set ra|rb|rc|rd|iar|flags|io|ADDR VALUE\n");
+        return;
+    }
+    for(i = 0; i < COMPUTER_REG_NR; i++) {
+        if(strcasecmp(what, computer_reg_name[i]) == 0) {
+            comp->reg[i] = (computer_word)val;
+            return;
+        }
+    }
+    if(strcasecmp(what, "iar") == 0) {
+        comp->iar = (computer_word)val;
+    } else if(strcasecmp(what, "flags") == 0) {
+        comp->flags = (unsigned char)(val & ((1 << COMPUTER_FLAG_NR) - 1));
+    } else if(strcasecmp(what, "io") == 0) {
+        comp->io_addr = (unsigned char)val;
+    } else {
+        int addr = parse_addr(dbg, what);
+        if(addr >= 0) {
+            comp->ram[addr] = (unsigned char)val;
+            comp->ram_writes++;
+        }
+    }
+}
+
+static void cmd_dump(debugger *dbg, char const *addr_str, char const *len_str)
+{
+    int addr = addr_str ? parse_addr(dbg, addr_str) : 0;
+    long len = len_str ? strtol(len_str, NULL, 0) : (addr_str ? 1 : COMPUTER_RAM_SIZE);
+    long i;
+
+    if(addr < 0) return;
+    for(i = 0; i < len && addr + i < COMPUTER_RAM_SIZE; i++) {
+        if(i % 16 == 0) printf("%s%3ld:", i ? "\n" : "", addr + i);
+        printf(" %3d", dbg->comp->ram[addr + i]);
+    }
+    printf("\n");
+}
+
+/* Go back to just before the latest instruction that hit a breakpoint or
+ * watchpoint */
+static int reverse_continue(debugger *dbg)
+{
+    long index = undo_find_back(dbg->undo, is_empty(dbg->pc_break) ? NULL : dbg->pc_break,
+                                is_empty(dbg->watch_write) ? NULL : dbg->watch_write);
+    struct undo_info info;
+
+    if(index < 0) {
+        undo_goto(dbg->undo, dbg->comp, undo_get_oldest(dbg->undo));
+        return STOP_START;
+    }
+    undo_get_info(dbg->undo, (unsigned long)index, &info);
+    undo_goto(dbg->undo, dbg->comp, (unsigned long)index);
+    if(info.kind == UNDO_KIND_RAM && get_bit(dbg->watch_write, info.target)) {
+        dbg->comp->break_addr = info.target;
+        return STOP_WRITE_NEXT;
+    }
+    return STOP_PC;
+}
+
+static void cmd_who(debugger *dbg, char const *addr_str)
+{
+    unsigned char map[MAP_SIZE] = { 0 };
+    struct undo_info info;
+    int addr = parse_addr(dbg, addr_str);
+    long index;
+
+    if(addr < 0) return;
+    set_bit(map, addr);
+    if((index = undo_find_back(dbg->undo, NULL, map)) < 0) {
+        printf("RAM %d not written since instruction %lu.\n", addr, undo_get_oldest(dbg->undo));
+        return;
+    }
+    undo_get_info(dbg->undo, (unsigned long)index, &info);
+    printf("RAM %d last written by instruction %ld at %d, value before %d.\n", addr, index, info.iar, info.old);
+}
+
+static void print_help(void)
+{
+    printf("b ADDR      break before executing ADDR\n"
+           "w ADDR      stop after a write to ADDR\n"
+           "io ADDR     stop after IND/OUTD at IO address ADDR\n"
+           "d [ADDR]    delete all stops at ADDR, or all stops\n"
+           "l           list stops\n"
+           "c           continue\n"
+           "s [N]       step N instructions\n"
+           "r           show registers and flags\n"
+           "x [ADDR [N]] show N bytes of RAM from ADDR\n"
+           "set WHAT VALUE  set ra, rb, rc, rd, iar, flags, io or a RAM address\n"
+           "rs [N]      step N instructions backwards (needs --undo-log)\n"
+           "rc          continue backwards to a breakpoint or watched write\n"
+           "who ADDR    show which instruction last wrote ADDR\n"
+           "q           turn off the computer and quit\n"
+           "ADDR may be a number, a label or label+N.\n");
+}
+
+/* Run one command line. Returns 1 when the program should continue. */
+static int command(debugger *dbg, char *line)
+{
+    computer *comp = dbg->comp;
+    char *cmd = strtok(line, " \t\r\n");
+    char *arg1 = strtok(NULL, " \t\r\n");
+    char *arg2 = strtok(NULL, " \t\r\n");
+    int addr;
+
+    if(cmd == NULL || cmd[0] == '#') return 0;
+    if(strcmp(cmd, "b") == 0 || strcmp(cmd, "break") == 0) {
+        if((addr = parse_addr(dbg, arg1)) >= 0) set_bit(dbg->pc_break, addr);
+    } else if(strcmp(cmd, "w") == 0 || strcmp(cmd, "watch") == 0) {
+        if((addr = parse_addr(dbg, arg1)) >= 0) set_bit(dbg->watch_write, addr);
+    } else if(strcmp(cmd, "io") == 0) {
+        if((addr = parse_addr(dbg, arg1)) >= 0) set_bit(dbg->break_io, addr);
+    } else if(strcmp(cmd, "d") == 0 || strcmp(cmd, "delete") == 0) {
+        if(arg1 == NULL) {
+            memset(dbg->pc_break, 0, sizeof(dbg->pc_break));
+            memset(dbg->watch_write, 0, sizeof(dbg->watch_write));
+            memset(dbg->break_io, 0, sizeof(dbg->break_io));
+        } else if((addr = parse_addr(dbg, arg1)) >= 0) {
+            clear_bit(dbg->pc_break, addr);
+            clear_bit(dbg->watch_write, addr);
+            clear_bit(dbg->break_io, addr);
+        }
+    } else if(strcmp(cmd, "l") == 0 || strcmp(cmd, "list") == 0) {
+        print_map("break", dbg->pc_break);
+        print_map("watch", dbg->watch_write);
+        print_map("io", dbg->break_io);
+    } else if(strcmp(cmd, "c") == 0 || strcmp(cmd, "continue") == 0) {
+        return 1;
+    } else if(strcmp(cmd, "s") == 0 || strcmp(cmd, "step") == 0) {
+        long n = arg1 ? strtol(arg1, NULL, 0) : 1;
+        comp->watch_write = NULL;
+        comp->break_io = NULL;
+        while(n-- > 0 && comp->is_running) {
+            step(dbg);
+            stats_publish(comp, 1);
+        }
+        print_state(comp);
+    } else if(dbg->undo == NULL && (strcmp(cmd, "rs") == 0 || strcmp(cmd, "rc") == 0 || strcmp(cmd, "who") == 0)) {
+        printf("Reverse execution needs --undo-log.\n");
+    } else if(strcmp(cmd, "rs") == 0) {
+        long n = arg1 ? strtol(arg1, NULL, 0) : 1;
+        while(n-- > 0) {
+            if(undo_back(dbg->undo, comp)) {
+                print_stop(dbg, STOP_START);
+                return 0;
+            }
+        }
+        print_state(comp);
+    } else if(strcmp(cmd, "rc") == 0) {
+        print_stop(dbg, reverse_continue(dbg));
+    } else if(strcmp(cmd, "who") == 0) {
+        cmd_who(dbg, arg1);
+    } else if(strcmp(cmd, "r") == 0 || strcmp(cmd, "regs") == 0) {
+        print_state(comp);
+    } else if(strcmp(cmd, "x") == 0) {
+        cmd_dump(dbg, arg1, arg2);
+    } else if(strcmp(cmd, "set") == 0) {
+        cmd_set(dbg, arg1, arg2);
+    } else if(strcmp(cmd, "q") == 0 || strcmp(cmd, "quit") == 0) {
+        comp->is_running = 0;
+        dbg->quit = 1;
+    } else if(strcmp(cmd, "h") == 0 || strcmp(cmd, "help") == 0) {
+        print_help();
+    } else {
+        printf("Unknown command '%s', try help.\n", cmd);
+    }
+    return 0;
+}
+
+void debug_run(debugger *dbg)
+{
+    computer *comp = dbg->comp;
+    char line[256];
+
+    /* With an undo log, it is possible to go back after the end */
+    while(!dbg->quit && (comp->is_running || dbg->undo)) {
+        if(dbg->interactive) {
+            printf("(dbg) ");
+        }
+        fflush(stdout);
+        if(fgets(line, sizeof(line), dbg->in) == NULL) {
+            /* Out of commands, run to the end */
+            comp->watch_write = NULL;
+            comp->break_io = NULL;
+            while(comp->is_running && !gs_interrupt) {
+                step(dbg); /* Keeps recording the undo log */
+                stats_publish(comp, 1);
+            }
+            return;
+        }
+        if(command(dbg, line)) {
+            print_stop(dbg, run(dbg));
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef DEBUGGER_H_
+#define DEBUGGER_H_
+
+#include <stdio.h>
+#include "computer.h"
+#include "undo.h"
+
+typedef struct debugger debugger;
+
+/* Create a debugger for comp that reads commands from in (stdin or a
+ * script file). find_label resolves label names in addresses, it may be
+ * NULL. */
+debugger *debug_create(computer *comp, FILE *in, int (*find_label)(char const *));
+void debug_destroy(debugger *dbg);
+/* Record instructions in log, so that they can be stepped backwards */
+void debug_set_undo_log(debugger *dbg, undo_log *log);
+/* Run commands until the computer turns off or the user quits. When the
+ * commands run out, the program runs to the end without stopping. */
+void debug_run(debugger *dbg);
+/* Stop at the next block boundary, may be called from a signal handler */
+void debug_interrupt(void);
+
+#endif
@@ -0,0 +1,174 @@
+#include "disk.h"
+#include "peri.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static unsigned char *gs_map = NULL;
+static unsigned long gs_size = 0; /* Bytes, whole sectors */
+static unsigned long gs_pos = 0;
+/* Byte range written since the last sync, empty if lo >= hi */
+static unsigned long gs_dirty_lo = 0;
+static unsigned long gs_dirty_hi = 0;
+static unsigned long gs_seek_cycles = DISK_DEFAULT_SEEK_CYCLES;
+static unsigned long gs_byte_cycles = DISK_DEFAULT_BYTE_CYCLES;
+
+#define DISK_END (DISK_MAX_SECTORS * DISK_SECTOR_SIZE)
+
+static void mark_dirty(unsigned long lo, unsigned long hi)
+{
+    if(gs_dirty_lo >= gs_dirty_hi) {
+        gs_dirty_lo = lo;
+        gs_dirty_hi = hi;
+        return;
+    }
+    if(lo < gs_dirty_lo) gs_dirty_lo = lo;
+    if(hi > gs_dirty_hi) gs_dirty_hi = hi;
+}
+
+static void sync_dirty(void)
+{
+    unsigned long page = (unsigned long)sysconf(_SC_PAGESIZE);
+    unsigned long lo;
+
+    if(gs_dirty_lo >= gs_dirty_hi) return;
+    /* msync wants a page aligned start */
+    lo = gs_dirty_lo / page * page;
+    msync(gs_map + lo, gs_dirty_hi - lo, MS_SYNC);
+    gs_dirty_lo = gs_dirty_hi = 0;
+}
+
+static void sector_output(computer *comp, unsigned char c)
+{
+    static unsigned long len = 0;
+    static unsigned long num = 0;
+
+    num += (unsigned long)c << (8*len);
+    len++;
+    if(len == 2) {
+        gs_pos = num * DISK_SECTOR_SIZE;
+        len = 0;
+        num = 0;
+    }
+}
+
+static void addr_output(computer *comp, unsigned char c)
+{
+    gs_pos = gs_pos / DISK_SECTOR_SIZE * DISK_SECTOR_SIZE + c;
+}
+
+static void data_output(computer *comp, unsigned char c)
+{
+    if(gs_pos < gs_size) {
+        gs_map[gs_pos] = c;
+        mark_dirty(gs_pos, gs_pos + 1);
+    }
+    gs_pos = (gs_pos + 1) % DISK_END;
+}
+
+static void data_input(computer *comp, unsigned char *c)
+{
+    *c = gs_pos < gs_size ? gs_map[gs_pos] : 0;
+    gs_pos = (gs_pos + 1) % DISK_END;
+}
+
+static void dma_output(computer *comp, unsigned char c)
+{
+    static unsigned long len = 0;
+    /* RAM address (COMPUTER_IMM_LEN bytes, low first), length, direction */
+    static unsigned char arg[COMPUTER_IMM_LEN + 2];
+    unsigned long i, n, addr = 0;
+
+    arg[len++] = c;
+    if(len < sizeof(arg)) return;
+    len = 0;
+
+    for(i = 0; i < COMPUTER_IMM_LEN; i++) addr |= (unsigned long)arg[i] << (8*i);
+    n = arg[COMPUTER_IMM_LEN] ? arg[COMPUTER_IMM_LEN] : DISK_SECTOR_SIZE;
+    for(i = 0; i < n; i++) {
+        unsigned char *r = &comp->ram[(addr + i) % COMPUTER_RAM_SIZE];
+        unsigned long x = (gs_pos + i) % DISK_END;
+
+        if(arg[COMPUTER_IMM_LEN + 1] == DISK_DMA_FROM_RAM) {
+            if(x < gs_size) {
+                gs_map[x] = *r;
+                mark_dirty(x, x + 1);
+            }
+        } else {
+            *r = x < gs_size ? gs_map[x] : 0;
+        }
+    }
+    gs_pos = (gs_pos + n) % DISK_END;
+    peri_add_cycles(comp, gs_seek_cycles + n * gs_byte_cycles);
+}
+
+static void sync_output(computer *comp, unsigned char c)
+{
+    sync_dirty();
+}
+
+static void size_input(computer *comp, unsigned char *c)
+{
+    static int high = 0;
+
+    *c = (unsigned char)((gs_size / DISK_SECTOR_SIZE) >> (high ? 8 : 0));
+    high = !high;
+}
+
+int disk_init(char const *path, unsigned long sectors)
+{
+    struct stat st;
+    unsigned long size;
+    int fd;
+
+    if(sectors > DISK_MAX_SECTORS) sectors = DISK_MAX_SECTORS;
+    if((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) return -1;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    /* Whole sectors, so the mapping never reaches past the end of the file */
+    size = ((unsigned long)st.st_size + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE * DISK_SECTOR_SIZE;
+    if(size < sectors * DISK_SECTOR_SIZE) size = sectors * DISK_SECTOR_SIZE;
+    if(size > DISK_END) size = DISK_END;
+    if(size == 0 || (size > (unsigned long)st.st_size && ftruncate(fd, (off_t)size) < 0)) {
+        close(fd);
+        return -1;
+    }
+    gs_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(gs_map == MAP_FAILED) {
+        gs_map = NULL;
+        return -1;
+    }
+    gs_size = size;
+    return 0;
+}
+
+void disk_set_cycles(unsigned long seek, unsigned long per_byte)
+{
+    gs_seek_cycles = seek;
+    gs_byte_cycles = per_byte;
+}
+
+void disk_attach(computer_devices *dev)
+{
+    if(gs_map == NULL) return;
+    dev->output[PERI_ADDR_DISK_SECTOR] = sector_output;
+    dev->output[PERI_ADDR_DISK_ADDR] = addr_output;
+    dev->output[PERI_ADDR_DISK_DATA] = data_output;
+    dev->input[PERI_ADDR_DISK_DATA] = data_input;
+    dev->output[PERI_ADDR_DISK_DMA] = dma_output;
+    dev->output[PERI_ADDR_DISK_SYNC] = sync_output;
+    dev->input[PERI_ADDR_DISK_SIZE] = size_input;
+}
+
+void disk_finalize(void)
+{
+    if(gs_map == NULL) return;
+    sync_dirty();
+    munmap(gs_map, gs_size);
+    gs_map = NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef DISK_H_
+#define DISK_H_
+
+#include "computer.h"
+
+/* Block storage backed by a host file that is mapped into memory, so the
+ * data outlives the program and may be much larger than RAM. The file holds
+ * up to DISK_MAX_SECTORS sectors of DISK_SECTOR_SIZE bytes.
+ *
+ * SECTOR: output, two bytes (low first) select the sector and move the
+ *         position to its start
+ * ADDR:   output, one byte sets the position in the sector
+ * DATA:   input/output, reads or writes the byte at the position, which is
+ *         then incremented (continuing into the next sector)
+ * DMA:    output, three bytes: RAM address, length (0 means 256) and
+ *         direction (DISK_DMA_*), like the extended RAM (four in the 16-bit
+ *         build, with a 2-byte RAM address). The computer is stalled for the
+ *         seek cost plus the cost per byte.
+ * SYNC:   output, any byte: writes the changed sectors to the file
+ * SIZE:   input, the number of sectors, two bytes low first (0 means
+ *         DISK_MAX_SECTORS)
+ *
+ * Positions past the end read as 0 and writes to them are ignored. Writes
+ * go to the mapping and reach the file at SYNC and when the simulator
+ * ends. */
+
+#define DISK_SECTOR_SIZE 256
+#define DISK_MAX_SECTORS 65536UL
+#define DISK_DMA_TO_RAM 0
+#define DISK_DMA_FROM_RAM 1
+#define DISK_DEFAULT_SEEK_CYCLES 100
+#define DISK_DEFAULT_BYTE_CYCLES 1
+
+/* Map the file at path, created or extended to at least sectors sectors.
+ * Returns -1 if it can not be opened or is empty. */
+int disk_init(char const *path, unsigned long sectors);
+/* DMA cost: seek cycles per transfer and cycles per byte */
+void disk_set_cycles(unsigned long seek, unsigned long per_byte);
+/* Connect the disk to dev */
+void disk_attach(computer_devices *dev);
+/* Write the changes to the file and unmap it */
+void disk_finalize(void);
+
+#endif
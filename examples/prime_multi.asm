@@ -0,0 +1,187 @@
+# Prints all the primes < 256, with the sieve of prime.asm split across CPUs.
+# Run with e.g.
+#   ./simulator -F --cpus 4 --shared-ram examples/prime_multi.ram
+# Every CPU runs this program. The shared RAM window is the sieve: position i
+# stands for n = 2 * i + 1 and is set when n is composite. For every odd
+# d = 3, 5, ..., 15 that is not already marked, the odd multiples of d from
+# 3 * d on are marked, and the CPUs share them out so that CPU id marks the
+# multiples number id, id + cpus, id + 2 * cpus, ... The other CPUs send a
+# message to CPU 0 when they are done, and CPU 0 then prints the numbers that
+# are not marked.
+# CPU 0 turns off after 18.0K clock-cycles with one CPU, 15.4K with two and
+# 13.5K with four, where prime.asm takes 17.2K. Printing, which only CPU 0
+# does, takes about 8K of them, and with more CPUs each one gets too few
+# multiples to make up for its setup.
+
+start:
+  data ra 57 # CPU count
+  outa ra
+  ind  rb
+  data ra $cpus
+  st   ra rb
+  data ra 56 # CPU id
+  outa ra
+  ind  rb
+  data ra $id
+  st   ra rb
+  data rc 3 # rc = d
+
+sieve_d: # rc = d
+  clf
+  shr  rc rb # rb = d / 2, the position of d
+  data ra 63 # shared RAM address
+  outa ra
+  outd rb
+  data ra 64 # shared RAM data
+  outa ra
+  ind  ra
+  and  ra ra
+  jz   $get_step
+  jmp  $next_d # d is composite, its multiples are marked already
+
+get_step: # rb = d / 2, rc = d
+  data ra $cpus
+  ld   ra rd # rd = cpus
+  xor  ra ra # ra = step = 0
+mul_loop: # ra = step, rc = d, rd = cpus left to add
+  clf
+  add  rc ra
+  jc   $step_big
+  data rb 255
+  clf
+  add  rb rd # rd -= 1
+  jz   $step_done
+  jmp  $mul_loop
+step_big: # Only one multiple per CPU fits, any step past 255 will do
+  data ra 255
+step_done: # ra = d * cpus
+  data rb $step
+  st   rb ra
+
+  clf
+  shr  rc rb # rb = d / 2
+  clf
+  add  rc rb # rb = position of 3 * d
+  data ra $id
+  ld   ra rd # rd = id
+skip_loop: # rb = position, rc = d, rd = multiples to skip
+  and  rd rd
+  jz   $mark_start
+  clf
+  add  rc rb
+  jc   $next_d
+  data ra 255
+  clf
+  add  ra rd # rd -= 1
+  jmp  $skip_loop
+
+mark_start:
+  data ra $step
+  ld   ra rd # rd = step
+mark_loop: # rb = position, rc = d, rd = step
+  data ra 127
+  cmp  rb ra
+  ja   $next_d # past the last position, n = 255
+  data ra 63 # shared RAM address
+  outa ra
+  outd rb
+  data ra 64 # shared RAM data
+  outa ra
+  outd rb # shared[position] = position, not 0
+  clf
+  add  rd rb # position += step
+  jc   $next_d
+  jmp  $mark_loop
+
+next_d: # rc = d
+  data ra 2
+  clf
+  add  ra rc # d += 2
+  data ra 15 # 17 * 17 > 255
+  cmp  rc ra
+  ja   $done
+  jmp  $sieve_d
+
+done:
+  data ra $id
+  ld   ra ra
+  and  ra ra
+  jz   $collect
+  data ra 58 # mailbox data
+  outa ra
+  outd ra
+  xor  rc rc
+send: # rc = 0
+  data ra 59 # mailbox send
+  outa ra
+  outd rc # to CPU 0
+  ind  ra
+  and  ra ra
+  jz   $send # mailbox full, try again
+  data ra 4 # power button
+  outa ra
+  outd ra
+
+collect:
+  data ra $cpus
+  ld   ra rd # rd = cpus
+  data rc 255
+wait_done: # rd = number of CPUs not done, counting this one
+  clf
+  add  rc rd
+  jz   $print
+wait_msg:
+  data ra 60 # mailbox receive
+  outa ra
+  ind  ra
+  and  ra ra
+  jz   $wait_msg
+  jmp  $wait_done
+
+print:
+  data ra 3 # integer printer
+  outa ra
+  data rb 2
+  outd rb
+  data ra 2 # ascii printer
+  outa ra
+  data ra 10
+  outd ra
+  data ra 63 # shared RAM address
+  outa ra
+  data ra 1
+  outd ra # Start at n = 3, the data port then moves on by itself
+  data rd 64 # shared RAM data
+  outa rd
+  data rb 3
+  data rc 2
+print_loop: # rb = n, rc = 2, rd = 64, the shared RAM data port is selected
+  ind  ra
+  and  ra ra
+  jz   $print_prime
+print_next:
+  clf
+  add  rc rb # n += 2
+  jc   $end
+  jmp  $print_loop
+print_prime:
+  data ra 3 # integer printer
+  outa ra
+  outd rb
+  data ra 2 # ascii printer
+  outa ra
+  data ra 10
+  outd ra
+  outa rd
+  jmp  $print_next
+end:
+  data ra 4 # power button
+  outa ra
+  outd ra
+
+cpus:
+. 0
+id:
+. 0
+step:
+. 0
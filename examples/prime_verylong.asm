@@ -7,12 +7,16 @@
 #           if n % m == 0: not prime, test next n
 #       print n
 #   exit
-# For git version d1ecada, I made the following estimates for this program:
-# Total number of clock-cycles: 2.957e+13
-# Clock-cycles per natural number: 6.885e+03
-# Clock-cycles per tested number: 2.065e+04
-# Total time @ 1 GHz : 1.87 months
-#   (i.e. 1 giga-instructions per second, 1 instr = 6 clock cycles)
+# asm_compiler -S lists the cycle cost of every block and bounds the loops it
+# can count:
+#   ./asm_compiler -S - examples/prime_verylong.asm examples/prime_verylong.ram
+# With the --fast engine (6 cycles per instruction, -C for the 7 of the
+# stepping engine) it reports PRINT_AGAIN as 4 iterations of 30 cycles (120 in
+# total), and the blocks of one NEXT_POS iteration (one bit of the 16-bit
+# remainder) add up to 138-270 cycles.
+# The loops over n, m, the 16-bit remainder and ADD_AGAIN use counters stored
+# in RAM or wider than a register, so their iteration counts are unknown and
+# the total running time (months at 1 GHz) can not be derived statically.
 
 # Numbers larger than 8 bit are stored as x0, x1, x2, ..., with x0 being the least
 # significant byte.
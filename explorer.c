@@ -0,0 +1,1052 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <argp.h>
+#include "computer.h"
+#include "peri.h"
+#include "config_impl.h"
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#   include <sched.h>
+#endif
+
+/* Runs a RAM image with every possible input. At each read from the
+ * keyboard the computer is copied once per byte of the alphabet, and at
+ * each read from the random number generator once per value. States that
+ * are equal right after a read are only explored once, so the exploration
+ * ends when no new states can be reached, even for programs that never
+ * turn off. The reads that lead from each state to the others are kept,
+ * and the longest run is found in that graph when the exploration ends.
+ *
+ * The work between two reads (a segment) is deterministic, so the worst
+ * case response time is the longest segment found. The states waiting to
+ * be explored are spread over the worker threads, and a worker without
+ * work steals from the others. */
+
+#define MAX_ENTRIES 256
+#define MAX_WORKERS 64
+#define MAX_REPORTED 10
+#define HASH_SHARDS 64
+
+/* State layout: RAM, registers, iar, flags, io_addr, bytes held by the
+ * 16, 24 and 32-bit printers (3 counts and 3 * 4 bytes) */
+#define KEY_REG COMPUTER_RAM_SIZE
+#define KEY_IAR (KEY_REG + COMPUTER_REG_NR)
+#define KEY_FLAGS (KEY_IAR + 1)
+#define KEY_IO_ADDR (KEY_FLAGS + 1)
+#define KEY_NUM_LEN (KEY_IO_ADDR + 1)
+#define KEY_NUM (KEY_NUM_LEN + 3)
+#define KEY_SIZE (KEY_NUM + 3 * 4)
+
+#define DEFAULT_MAX_STATES 1000000UL
+#define DEFAULT_MAX_CYCLES 10000000UL
+
+struct arguments {
+    int entry_nr;
+    int entry[MAX_ENTRIES];
+    char *alphabet;
+    int alphabet_len;
+    int random;
+    int inputs;
+    unsigned long max_states;
+    unsigned long max_cycles;
+    int workers;
+    int print_outputs;
+    char *ram_file;
+};
+
+static struct arguments gs_arg = { 0, { 0 }, NULL, 0, -1, 0, DEFAULT_MAX_STATES, DEFAULT_MAX_CYCLES, 0, 0, NULL };
+
+char const *argp_program_version = "explorer " MINICOMP_VERSION;
+char const *argp_program_bug_address = "<boris.carlsson@gmail.com>";
+
+static char gs_argp_doc[] = "explorer - Run a minicomp RAM image with all possible input.\n\n"
+    "Every keyboard read is tried with every byte of the alphabet and every\n"
+    "random number read with every value. Reports the worst case number of\n"
+    "clock cycles from a read to the next read or to turning off, and the\n"
+    "paths that crash or hang.";
+static char gs_argp_args_doc[] = "ram-file";
+
+static struct argp_option gs_argp_options[] = {
+    { "alphabet", 'a', "CHARS", 0, "Keyboard input to try, with \\n, \\t, \\\\ and \\xHH escapes (default: all 256 bytes)", 0 },
+    { "random", 'r', "VALUE", 0, "Random number reads return VALUE instead of trying all values", 0 },
+    { "inputs", 'n', "N", 0, "Stop a path after N keyboard reads (default: no limit)", 0 },
+    { "max-states", 's', "N", 0, "Stop after N states (default: 1000000)", 0 },
+    { "max-cycles", 'c', "N", 0, "Report a hang after N cycles without a read (default: 10000000)", 0 },
+    { "entry", 'e', "ADDR", 0, "Address that may be jumped to with JMPR (can be repeated)", 0 },
+    { "jobs", 'j', "N", 0, "Number of worker threads (default: number of processors)", 0 },
+    { "outputs", 'o', NULL, 0, "Print every different output printed between two reads", 0 },
+    { 0, 0, 0, 0, 0, 0 }
+};
+
+static int parse_alphabet(char *arg)
+{
+    char *in = arg, *out = arg;
+
+    while(*in) {
+        if(*in != '\\') {
+            *out++ = *in++;
+            continue;
+        }
+        in++;
+        switch(*in) {
+            case 'n': *out++ = '\n'; in++; break;
+            case 't': *out++ = '\t'; in++; break;
+            case 'r': *out++ = '\r'; in++; break;
+            case '\\': *out++ = '\\'; in++; break;
+            case 'x': {
+                char hex[3] = { 0, 0, 0 };
+                char *end;
+
+                strncpy(hex, in + 1, 2);
+                *out++ = (char)strtol(hex, &end, 16);
+                if(end == hex) return -1;
+                in += 1 + (end - hex);
+                break;
+            }
+            default: return -1;
+        }
+    }
+    return (int)(out - arg);
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+    char *end;
+    long value;
+
+    switch (key) {
+        case 'a':
+            arguments->alphabet = arg;
+            if((arguments->alphabet_len = parse_alphabet(arg)) <= 0) argp_usage(state);
+            break;
+        case 'r':
+            value = strtol(arg, &end, 0);
+            if(*end || value < 0 || value > 255) argp_usage(state);
+            arguments->random = (int)value;
+            break;
+        case 'n':
+            arguments->inputs = atoi(arg);
+            break;
+        case 's':
+            arguments->max_states = strtoul(arg, NULL, 0);
+            break;
+        case 'c':
+            arguments->max_cycles = strtoul(arg, NULL, 0);
+            break;
+        case 'e':
+            value = strtol(arg, &end, 0);
+            if(*end || value < 0 || value >= COMPUTER_RAM_SIZE || arguments->entry_nr == MAX_ENTRIES) argp_usage(state);
+            arguments->entry[arguments->entry_nr++] = (int)value;
+            break;
+        case 'j':
+            arguments->workers = atoi(arg);
+            if(arguments->workers < 1 || arguments->workers > MAX_WORKERS) argp_usage(state);
+            break;
+        case 'o':
+            arguments->print_outputs = 1;
+            break;
+        case ARGP_KEY_ARG:
+            if(state->arg_num == 0) arguments->ram_file = arg;
+            break;
+        case ARGP_KEY_END:
+            if(state->arg_num != 1) argp_usage(state);
+            break;
+        default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp gs_argp = { gs_argp_options, parse_opt, gs_argp_args_doc, gs_argp_doc, 0, 0, 0 };
+
+struct node;
+
+/* A read from one state that leads to another */
+struct edge {
+    struct node *to;
+    unsigned char value;
+};
+
+/* A state right after a read, or the reset state */
+struct node {
+    struct node *parent; /* On the first path found */
+    struct node *next; /* In the hash chain */
+    unsigned long hash;
+    unsigned long clock_cycle;
+    int inputs; /* Keyboard reads on the path */
+    unsigned char addr; /* IO address of the read */
+    unsigned char value; /* Value read */
+    /* Set by explore(): the cycles from this state to the states after the
+     * next read (or to turning off) and the different states reached */
+    unsigned long cycles;
+    int turns_off;
+    unsigned char read_addr;
+    struct edge *edge;
+    int edge_nr;
+    /* Set by find_longest() */
+    unsigned long longest;
+    int longest_edge; /* LONGEST_* or the index of the edge to take */
+    unsigned char mark;
+    unsigned char key[KEY_SIZE];
+};
+
+#define LONGEST_TURN_OFF (-1) /* Turns off in this segment */
+#define LONGEST_NONE (-2) /* Never turns off */
+
+struct shard {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+    struct node **bucket;
+    unsigned long bucket_nr;
+    unsigned long node_nr;
+};
+
+struct worker {
+    computer comp; /* First, the IO handlers only get a pointer to it */
+    int id;
+    unsigned char input;
+    int unsupported;
+    unsigned long num[3];
+    int num_len[3];
+    char *output;
+    size_t output_len;
+    size_t output_size;
+    /* Nodes to explore, the owner takes from the tail and thieves from
+     * the head */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+    pthread_t thread;
+#endif
+    struct node **work;
+    size_t work_head;
+    size_t work_tail;
+    size_t work_size;
+};
+
+/* A path that ended in a way worth reporting */
+struct finding {
+    struct node *node;
+    unsigned long cycles;
+    int addr;
+    char *output;
+    size_t output_len;
+};
+
+static unsigned char gs_image[COMPUTER_RAM_SIZE];
+static unsigned char gs_is_code[COMPUTER_RAM_SIZE];
+static struct shard gs_shard[HASH_SHARDS];
+static struct worker *gs_worker = NULL;
+static computer_devices gs_devices;
+static int gs_worker_nr = 1;
+static unsigned long gs_pending = 0; /* Nodes pushed but not explored */
+static unsigned long gs_node_nr = 0;
+static int gs_limit_hit = 0;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t gs_result_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static unsigned long gs_segment_nr = 0;
+static unsigned long gs_terminated_nr = 0;
+static unsigned long gs_input_limit_nr = 0;
+static struct finding gs_startup = { NULL, 0, -1, NULL, 0 };
+static struct finding gs_worst = { NULL, 0, -1, NULL, 0 };
+static int gs_read_loop = 0; /* A state that turns off can be reached from itself */
+static unsigned long gs_crash_nr = 0;
+static struct finding gs_crash[MAX_REPORTED];
+static unsigned long gs_hang_nr = 0;
+static struct finding gs_hang[MAX_REPORTED];
+static unsigned long gs_unsupported_nr = 0;
+static struct finding gs_unsupported[MAX_REPORTED];
+static struct finding *gs_outputs = NULL;
+static size_t gs_output_nr = 0;
+static size_t gs_output_size = 0;
+
+static void lock_results(void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&gs_result_lock);
+#endif
+}
+
+static void unlock_results(void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&gs_result_lock);
+#endif
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if(p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static int next_addr(int addr, int n)
+{
+    return (addr + n) % COMPUTER_RAM_SIZE;
+}
+
+/* Mark the instructions reachable from addr through JMP, JXXX and falling
+ * through */
+static void mark_code(int addr)
+{
+    int stack[COMPUTER_RAM_SIZE * 2];
+    int sp = 0;
+
+    stack[sp++] = addr;
+    while(sp > 0) {
+        unsigned char op;
+
+        addr = stack[--sp];
+        if(gs_is_code[addr]) continue;
+        gs_is_code[addr] = 1;
+        op = gs_image[addr];
+        switch(op >> 4) {
+            case COMPUTER_INSTR_JMP:
+                stack[sp++] = gs_image[next_addr(addr, 1)];
+                break;
+            case COMPUTER_INSTR_JXXX:
+                stack[sp++] = gs_image[next_addr(addr, 1)];
+                stack[sp++] = next_addr(addr, 2);
+                break;
+            case COMPUTER_INSTR_JMPR:
+                break;
+            default:
+                stack[sp++] = next_addr(addr, computer_get_instruction_length(op));
+                break;
+        }
+    }
+}
+
+/* Code is what can be reached from address 0 and the -e addresses by
+ * jumping and falling through, and the return points of calls: the byte
+ * after a JMP, when a DATA loads its address as in "data rc $back; jmp $f;
+ * back:", for the JMPR that returns. Running anything else is a crash. */
+static void find_code(void)
+{
+    int addr, i, again = 1;
+
+    mark_code(0);
+    for(i = 0; i < gs_arg.entry_nr; i++) {
+        mark_code(gs_arg.entry[i]);
+    }
+    while(again) {
+        again = 0;
+        for(addr = 0; addr < COMPUTER_RAM_SIZE; addr++) {
+            int back, jmp;
+
+            if(!gs_is_code[addr] || gs_image[addr] >> 4 != COMPUTER_INSTR_DATA) continue;
+            back = gs_image[next_addr(addr, 1)];
+            jmp = next_addr(back, COMPUTER_RAM_SIZE - 2);
+            if(!gs_is_code[back] && gs_is_code[jmp] && gs_image[jmp] >> 4 == COMPUTER_INSTR_JMP) {
+                mark_code(back);
+                again = 1;
+            }
+        }
+    }
+}
+
+static void append(struct worker *w, char const *fmt, unsigned long value)
+{
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), fmt, value);
+
+    if(w->output_len + (size_t)len > w->output_size) {
+        while(w->output_len + (size_t)len > w->output_size) {
+            w->output_size = w->output_size ? w->output_size * 2 : 256;
+        }
+        if((w->output = realloc(w->output, w->output_size)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(w->output + w->output_len, buf, (size_t)len);
+    w->output_len += (size_t)len;
+}
+
+static void printer_output(computer *comp, unsigned char c)
+{
+    struct worker *w = (struct worker *)comp;
+    int i;
+
+    switch(comp->io_addr) {
+        case PERI_ADDR_ASCII_PRINTER: append(w, "%c", c); return;
+        case PERI_ADDR_INTEGER_PRINTER: append(w, "%lu", c); return;
+        case PERI_ADDR_HEX_PRINTER: append(w, "%02lx", c); return;
+        case PERI_ADDR_INTEGER16_PRINTER: i = 0; break;
+        case PERI_ADDR_INTEGER24_PRINTER: i = 1; break;
+        default: i = 2; break;
+    }
+    w->num[i] |= (unsigned long)c << (8 * w->num_len[i]);
+    if(++w->num_len[i] == i + 2) {
+        append(w, "%lu", w->num[i]);
+        w->num[i] = 0;
+        w->num_len[i] = 0;
+    }
+}
+
+static void terminate_output(computer *comp, unsigned char c)
+{
+    comp->is_running = 0;
+}
+
+static void read_input(computer *comp, unsigned char *c)
+{
+    *c = ((struct worker *)comp)->input;
+}
+
+/* Input is always available, the reads try all of it */
+static void has_input(computer *comp, unsigned char *c)
+{
+    *c = 1;
+}
+
+static void unsupported_output(computer *comp, unsigned char c)
+{
+    ((struct worker *)comp)->unsupported = 1;
+    comp->is_running = 0;
+}
+
+static void unsupported_input(computer *comp, unsigned char *c)
+{
+    ((struct worker *)comp)->unsupported = 1;
+    comp->is_running = 0;
+}
+
+/* Shared by all workers */
+static void connect(computer_devices *dev)
+{
+    int i;
+
+    for(i = 0; i < COMPUTER_ADDR_SIZE; i++) {
+        dev->output[i] = unsupported_output;
+        dev->input[i] = unsupported_input;
+    }
+    dev->output[PERI_ADDR_ASCII_PRINTER] = printer_output;
+    dev->output[PERI_ADDR_INTEGER_PRINTER] = printer_output;
+    dev->output[PERI_ADDR_HEX_PRINTER] = printer_output;
+    dev->output[PERI_ADDR_INTEGER16_PRINTER] = printer_output;
+    dev->output[PERI_ADDR_INTEGER24_PRINTER] = printer_output;
+    dev->output[PERI_ADDR_INTEGER32_PRINTER] = printer_output;
+    dev->output[PERI_ADDR_TERMINATE] = terminate_output;
+    dev->input[PERI_ADDR_KEYBOARD] = read_input;
+    dev->input[PERI_ADDR_RANDOM] = read_input;
+    dev->input[PERI_ADDR_KEYBOARD_HAS_INPUT] = has_input;
+}
+
+static void save_key(struct worker const *w, unsigned char *key)
+{
+    int i, j;
+
+    memcpy(key, w->comp.ram, COMPUTER_RAM_SIZE);
+    memcpy(key + KEY_REG, w->comp.reg, COMPUTER_REG_NR);
+    key[KEY_IAR] = w->comp.iar;
+    key[KEY_FLAGS] = w->comp.flags;
+    key[KEY_IO_ADDR] = w->comp.io_addr;
+    for(i = 0; i < 3; i++) {
+        key[KEY_NUM_LEN + i] = (unsigned char)w->num_len[i];
+        for(j = 0; j < 4; j++) {
+            key[KEY_NUM + 4 * i + j] = (unsigned char)(w->num[i] >> (8 * j));
+        }
+    }
+}
+
+static void load_key(struct worker *w, unsigned char const *key, unsigned long clock_cycle)
+{
+    int i, j;
+
+    memcpy(w->comp.ram, key, COMPUTER_RAM_SIZE);
+    memcpy(w->comp.reg, key + KEY_REG, COMPUTER_REG_NR);
+    w->comp.iar = key[KEY_IAR];
+    w->comp.flags = key[KEY_FLAGS];
+    w->comp.io_addr = key[KEY_IO_ADDR];
+    w->comp.clock_cycle = clock_cycle;
+    w->comp.is_running = 1;
+    for(i = 0; i < 3; i++) {
+        w->num_len[i] = key[KEY_NUM_LEN + i];
+        w->num[i] = 0;
+        for(j = 0; j < 4; j++) {
+            w->num[i] |= (unsigned long)key[KEY_NUM + 4 * i + j] << (8 * j);
+        }
+    }
+}
+
+/* FNV-1a over 8 bytes at a time */
+static unsigned long hash_key(unsigned char const *key)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    unsigned long long word;
+    int i;
+
+    for(i = 0; i + 8 <= KEY_SIZE; i += 8) {
+        memcpy(&word, key + i, 8);
+        h = (h ^ word) * 1099511628211ULL;
+        h ^= h >> 29;
+    }
+    for(; i < KEY_SIZE; i++) {
+        h = (h ^ key[i]) * 1099511628211ULL;
+    }
+    return (unsigned long)(h ^ (h >> 32));
+}
+
+static void shard_grow(struct shard *s)
+{
+    unsigned long bucket_nr = s->bucket_nr ? s->bucket_nr * 2 : 1024;
+    struct node **bucket = calloc(bucket_nr, sizeof(*bucket));
+    unsigned long i;
+
+    if(bucket == NULL) return;
+    for(i = 0; i < s->bucket_nr; i++) {
+        struct node *n = s->bucket[i], *next;
+
+        for(; n; n = next) {
+            next = n->next;
+            n->next = bucket[(n->hash / HASH_SHARDS) & (bucket_nr - 1)];
+            bucket[(n->hash / HASH_SHARDS) & (bucket_nr - 1)] = n;
+        }
+    }
+    free(s->bucket);
+    s->bucket = bucket;
+    s->bucket_nr = bucket_nr;
+}
+
+/* Returns n if it was added, the node with the same state if it is known
+ * and NULL if the state limit is reached */
+static struct node *insert(struct node *n)
+{
+    struct shard *s = &gs_shard[n->hash % HASH_SHARDS];
+    struct node *other;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&s->lock);
+#endif
+    if(s->node_nr >= s->bucket_nr) shard_grow(s);
+    other = s->bucket[(n->hash / HASH_SHARDS) & (s->bucket_nr - 1)];
+    for(; other; other = other->next) {
+        if(other->hash == n->hash && memcmp(other->key, n->key, KEY_SIZE) == 0) break;
+    }
+    if(other == NULL) {
+        if(__atomic_add_fetch(&gs_node_nr, 1, __ATOMIC_RELAXED) > gs_arg.max_states) {
+            __atomic_store_n(&gs_limit_hit, 1, __ATOMIC_RELAXED);
+        } else {
+            n->next = s->bucket[(n->hash / HASH_SHARDS) & (s->bucket_nr - 1)];
+            s->bucket[(n->hash / HASH_SHARDS) & (s->bucket_nr - 1)] = n;
+            s->node_nr++;
+            other = n;
+        }
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&s->lock);
+#endif
+    return other;
+}
+
+static void push(struct worker *w, struct node *n)
+{
+    __atomic_add_fetch(&gs_pending, 1, __ATOMIC_RELAXED);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&w->lock);
+#endif
+    if(w->work_tail == w->work_size) {
+        if(w->work_head > 0) {
+            memmove(w->work, w->work + w->work_head, (w->work_tail - w->work_head) * sizeof(*w->work));
+            w->work_tail -= w->work_head;
+            w->work_head = 0;
+        } else {
+            w->work_size = w->work_size ? w->work_size * 2 : 1024;
+            if((w->work = realloc(w->work, w->work_size * sizeof(*w->work))) == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    w->work[w->work_tail++] = n;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&w->lock);
+#endif
+}
+
+/* The owner works depth first, which keeps the queues short */
+static struct node *pop(struct worker *w)
+{
+    struct node *n = NULL;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&w->lock);
+#endif
+    if(w->work_tail > w->work_head) n = w->work[--w->work_tail];
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&w->lock);
+#endif
+    return n;
+}
+
+/* Thieves take the oldest nodes, which tend to have the largest subtrees */
+static struct node *steal(struct worker *w)
+{
+    struct node *n = NULL;
+#ifdef HAVE_PTHREAD
+    int i;
+
+    for(i = 1; i < gs_worker_nr && n == NULL; i++) {
+        struct worker *victim = &gs_worker[(w->id + i) % gs_worker_nr];
+
+        pthread_mutex_lock(&victim->lock);
+        if(victim->work_tail > victim->work_head) n = victim->work[victim->work_head++];
+        pthread_mutex_unlock(&victim->lock);
+    }
+#endif
+    return n;
+}
+
+static void copy_output(struct finding *f, struct worker const *w)
+{
+    f->output = xmalloc(w->output_len + 1);
+    memcpy(f->output, w->output, w->output_len);
+    f->output[w->output_len] = '\0';
+    f->output_len = w->output_len;
+}
+
+static void record(struct finding *list, unsigned long *nr, struct worker const *w, struct node *n, unsigned long cycles, int addr)
+{
+    lock_results();
+    if(*nr < MAX_REPORTED) {
+        list[*nr].node = n;
+        list[*nr].cycles = cycles;
+        list[*nr].addr = addr;
+        copy_output(&list[*nr], w);
+    }
+    (*nr)++;
+    unlock_results();
+}
+
+static void record_max(struct finding *f, struct worker const *w, struct node *n, unsigned long cycles)
+{
+    if(cycles < __atomic_load_n(&f->cycles, __ATOMIC_RELAXED)) return;
+    lock_results();
+    if(cycles > f->cycles || f->node == NULL) {
+        free(f->output);
+        f->node = n;
+        f->cycles = cycles;
+        copy_output(f, w);
+    }
+    unlock_results();
+}
+
+static void record_output(struct worker const *w, struct node *n)
+{
+    size_t i;
+
+    lock_results();
+    for(i = 0; i < gs_output_nr; i++) {
+        if(gs_outputs[i].output_len == w->output_len && memcmp(gs_outputs[i].output, w->output, w->output_len) == 0) break;
+    }
+    if(i == gs_output_nr) {
+        if(gs_output_nr == gs_output_size) {
+            gs_output_size = gs_output_size ? gs_output_size * 2 : 64;
+            if((gs_outputs = realloc(gs_outputs, gs_output_size * sizeof(*gs_outputs))) == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        gs_outputs[i].node = n;
+        copy_output(&gs_outputs[i], w);
+        gs_output_nr++;
+    }
+    unlock_results();
+}
+
+static void add_edge(struct node *n, struct node *to, unsigned char value)
+{
+    int i;
+
+    for(i = 0; i < n->edge_nr; i++) {
+        if(n->edge[i].to == to) return;
+    }
+    if((n->edge_nr & (n->edge_nr - 1)) == 0) {
+        if((n->edge = realloc(n->edge, (size_t)(n->edge_nr ? n->edge_nr * 2 : 1) * sizeof(*n->edge))) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    n->edge[n->edge_nr].to = to;
+    n->edge[n->edge_nr].value = value;
+    n->edge_nr++;
+}
+
+/* The computer is at a read from addr: add one child per possible value */
+static void fork_state(struct worker *w, struct node *parent, unsigned char addr)
+{
+    unsigned char key[KEY_SIZE];
+    unsigned long clock_cycle = w->comp.clock_cycle;
+    int is_keyboard = addr == PERI_ADDR_KEYBOARD;
+    int value_nr = is_keyboard ? gs_arg.alphabet_len : 256;
+    struct node *n = NULL;
+    int i;
+
+    if(is_keyboard && gs_arg.inputs > 0 && parent->inputs >= gs_arg.inputs) {
+        __atomic_add_fetch(&gs_input_limit_nr, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    save_key(w, key);
+    parent->read_addr = addr;
+    for(i = 0; i < value_nr; i++) {
+        struct node *to;
+
+        if(n == NULL) n = xmalloc(sizeof(*n));
+        load_key(w, key, clock_cycle);
+        w->input = is_keyboard ? (unsigned char)gs_arg.alphabet[i] : (unsigned char)i;
+        computer_step_instruction_fast(&w->comp);
+        n->parent = parent;
+        n->clock_cycle = w->comp.clock_cycle;
+        n->inputs = parent->inputs + is_keyboard;
+        n->addr = addr;
+        n->value = w->input;
+        n->turns_off = 0;
+        n->edge = NULL;
+        n->edge_nr = 0;
+        n->mark = 0;
+        parent->cycles = n->clock_cycle - parent->clock_cycle;
+        save_key(w, n->key);
+        n->hash = hash_key(n->key);
+        if((to = insert(n)) == n) {
+            push(w, n);
+            n = NULL;
+        }
+        if(to) add_edge(parent, to, w->input);
+    }
+    free(n);
+}
+
+/* Run from n to the next read that forks */
+static void explore(struct worker *w, struct node *n)
+{
+    computer *comp = &w->comp;
+    unsigned long start = n->clock_cycle;
+
+    load_key(w, n->key, n->clock_cycle);
+    w->unsupported = 0;
+    w->output_len = 0;
+    for(;;) {
+        unsigned char op;
+
+        if(w->unsupported) {
+            record(gs_unsupported, &gs_unsupported_nr, w, n, comp->clock_cycle - start, comp->io_addr);
+            return;
+        }
+        if(!comp->is_running) {
+            __atomic_add_fetch(&gs_terminated_nr, 1, __ATOMIC_RELAXED);
+            record_max(n->parent ? &gs_worst : &gs_startup, w, n, comp->clock_cycle - start);
+            if(gs_arg.print_outputs) record_output(w, n);
+            n->cycles = comp->clock_cycle - start;
+            n->turns_off = 1;
+            break;
+        }
+        if(!gs_is_code[comp->iar]) {
+            record(gs_crash, &gs_crash_nr, w, n, comp->clock_cycle - start, comp->iar);
+            return;
+        }
+        op = comp->ram[comp->iar];
+        if(op >> 4 == COMPUTER_INSTR_IO && ((op >> 2) & 3) == 0 &&
+           (comp->io_addr == PERI_ADDR_KEYBOARD || (comp->io_addr == PERI_ADDR_RANDOM && gs_arg.random < 0))) {
+            record_max(n->parent ? &gs_worst : &gs_startup, w, n, comp->clock_cycle - start);
+            if(gs_arg.print_outputs) record_output(w, n);
+            fork_state(w, n, comp->io_addr);
+            break;
+        }
+        if(comp->clock_cycle - start >= gs_arg.max_cycles) {
+            record(gs_hang, &gs_hang_nr, w, n, comp->clock_cycle - start, comp->iar);
+            return;
+        }
+        computer_step_instruction_fast(comp);
+    }
+    __atomic_add_fetch(&gs_segment_nr, 1, __ATOMIC_RELAXED);
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+
+    while(__atomic_load_n(&gs_pending, __ATOMIC_ACQUIRE) > 0) {
+        struct node *n = pop(w);
+
+        if(n == NULL) n = steal(w);
+        if(n == NULL) {
+#ifdef HAVE_PTHREAD
+            sched_yield();
+#endif
+            continue;
+        }
+        explore(w, n);
+        __atomic_sub_fetch(&gs_pending, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void print_escaped(FILE *fp, char const *s, size_t len)
+{
+    size_t i;
+
+    fputc('"', fp);
+    for(i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+
+        if(c == '\n') fputs("\\n", fp);
+        else if(c == '\t') fputs("\\t", fp);
+        else if(c == '\\' || c == '"') fprintf(fp, "\\%c", c);
+        else if(c < 32 || c > 126) fprintf(fp, "\\x%02x", c);
+        else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Print the keyboard input and the random numbers of len reads, from
+ * addr[i] with value[i] */
+static void print_reads(FILE *fp, unsigned char const *addr, unsigned char const *value, size_t len)
+{
+    char *input = xmalloc(len + 1);
+    size_t input_len = 0, i;
+    int random = 0;
+
+    for(i = 0; i < len; i++) {
+        if(addr[i] == PERI_ADDR_KEYBOARD) input[input_len++] = (char)value[i];
+    }
+    if(len == 0) {
+        fprintf(fp, "no input");
+    } else {
+        fprintf(fp, "input ");
+        print_escaped(fp, input, input_len);
+    }
+    for(i = 0; i < len; i++) {
+        if(addr[i] == PERI_ADDR_KEYBOARD) continue;
+        fprintf(fp, random++ ? " %d" : ", random %d", value[i]);
+    }
+    free(input);
+}
+
+/* Print the keyboard input and the random numbers that lead to n */
+static void print_path(FILE *fp, struct node const *n)
+{
+    struct node const *p;
+    unsigned char *addr, *value;
+    size_t len = 0, i;
+
+    for(p = n; p->parent; p = p->parent) {
+        len++;
+    }
+    addr = xmalloc(len + 1);
+    value = xmalloc(len + 1);
+    for(i = len, p = n; i > 0; i--, p = p->parent) {
+        addr[i - 1] = p->addr;
+        value[i - 1] = p->value;
+    }
+    print_reads(fp, addr, value, len);
+    free(addr);
+    free(value);
+}
+
+/* Print the reads of the longest run from n */
+static void print_longest(FILE *fp, struct node const *n)
+{
+    struct node const *p;
+    unsigned char *addr, *value;
+    size_t len = 0;
+
+    for(p = n; p->longest_edge >= 0; p = p->edge[p->longest_edge].to) {
+        len++;
+    }
+    addr = xmalloc(len + 1);
+    value = xmalloc(len + 1);
+    for(len = 0, p = n; p->longest_edge >= 0; p = p->edge[p->longest_edge].to, len++) {
+        addr[len] = p->read_addr;
+        value[len] = p->edge[p->longest_edge].value;
+    }
+    print_reads(fp, addr, value, len);
+    free(addr);
+    free(value);
+}
+
+/* Find the longest run to turning off from every state reachable from
+ * root, depth first without recursion as the paths can be long. A loop of
+ * reads is not followed again, so if a state that turns off can reach
+ * itself there is no longest run and gs_read_loop is set. */
+static void find_longest(struct node *root)
+{
+    struct frame {
+        struct node *n;
+        int i;
+    } *stack = NULL;
+    size_t sp = 0, size = 0;
+    int i;
+
+    root->mark = 1;
+    stack = xmalloc((size = 1024) * sizeof(*stack));
+    stack[sp].n = root;
+    stack[sp++].i = 0;
+    while(sp > 0) {
+        struct node *n = stack[sp - 1].n;
+
+        if(stack[sp - 1].i < n->edge_nr) {
+            struct node *to = n->edge[stack[sp - 1].i++].to;
+
+            if(to->mark == 1) {
+                to->mark = 3; /* On the stack and in a loop */
+            } else if(to->mark == 0) {
+                if(sp == size && (stack = realloc(stack, (size *= 2) * sizeof(*stack))) == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                to->mark = 1;
+                stack[sp].n = to;
+                stack[sp++].i = 0;
+            }
+            continue;
+        }
+        n->longest = n->cycles;
+        n->longest_edge = n->turns_off ? LONGEST_TURN_OFF : LONGEST_NONE;
+        for(i = 0; i < n->edge_nr; i++) {
+            struct node const *to = n->edge[i].to;
+
+            if(to->mark != 2 || to->longest_edge == LONGEST_NONE) continue;
+            if(n->longest_edge == LONGEST_NONE || n->cycles + to->longest > n->longest) {
+                n->longest = n->cycles + to->longest;
+                n->longest_edge = i;
+            }
+        }
+        if(n->mark == 3 && n->longest_edge != LONGEST_NONE) gs_read_loop = 1;
+        n->mark = 2;
+        sp--;
+    }
+    free(stack);
+}
+
+static void print_findings(char const *what, struct finding const *list, unsigned long nr)
+{
+    unsigned long i;
+
+    for(i = 0; i < nr && i < MAX_REPORTED; i++) {
+        printf("%s %d after %lu cycles, ", what, list[i].addr, list[i].cycles);
+        print_path(stdout, list[i].node);
+        printf("\n");
+    }
+    if(nr > MAX_REPORTED) printf("... and %lu more\n", nr - MAX_REPORTED);
+}
+
+int main(int argc, char *argv[])
+{
+    static char all_bytes[256];
+    struct node *root;
+    FILE *in;
+    int i;
+
+    for(i = 0; i < 256; i++) {
+        all_bytes[i] = (char)i;
+    }
+    gs_arg.alphabet = all_bytes;
+    gs_arg.alphabet_len = 256;
+    argp_parse(&gs_argp, argc, argv, 0, 0, &gs_arg);
+
+    if((in = fopen(gs_arg.ram_file, "rb")) == NULL) {
+        fprintf(stderr, "Could not open '%s' for reading.\n", gs_arg.ram_file);
+        exit(EXIT_FAILURE);
+    }
+    if(fread(gs_image, 1, sizeof(gs_image), in) == 0 && ferror(in)) {
+        fprintf(stderr, "Could not read '%s'.\n", gs_arg.ram_file);
+        exit(EXIT_FAILURE);
+    }
+    fclose(in);
+    find_code();
+
+#ifdef HAVE_PTHREAD
+    gs_worker_nr = gs_arg.workers;
+    if(gs_worker_nr == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        gs_worker_nr = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus;
+    }
+    for(i = 0; i < HASH_SHARDS; i++) {
+        pthread_mutex_init(&gs_shard[i].lock, NULL);
+    }
+#endif
+    if(posix_memalign((void **)&gs_worker, COMPUTER_CACHE_LINE, (size_t)gs_worker_nr * sizeof(*gs_worker))) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(gs_worker, 0, (size_t)gs_worker_nr * sizeof(*gs_worker));
+    connect(&gs_devices);
+    for(i = 0; i < gs_worker_nr; i++) {
+        computer_reset(&gs_worker[i].comp);
+        gs_worker[i].comp.dev = &gs_devices;
+        gs_worker[i].id = i;
+        gs_worker[i].input = (unsigned char)(gs_arg.random < 0 ? 0 : gs_arg.random);
+#ifdef HAVE_PTHREAD
+        pthread_mutex_init(&gs_worker[i].lock, NULL);
+#endif
+    }
+
+    root = xmalloc(sizeof(*root));
+    memset(root, 0, sizeof(*root));
+    memcpy(gs_worker[0].comp.ram, gs_image, COMPUTER_RAM_SIZE);
+    save_key(&gs_worker[0], root->key);
+    root->hash = hash_key(root->key);
+    insert(root);
+    push(&gs_worker[0], root);
+
+#ifdef HAVE_PTHREAD
+    for(i = 1; i < gs_worker_nr; i++) {
+        if(pthread_create(&gs_worker[i].thread, NULL, work, &gs_worker[i])) {
+            fprintf(stderr, "Could not start worker thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+    work(&gs_worker[0]);
+#ifdef HAVE_PTHREAD
+    for(i = 1; i < gs_worker_nr; i++) {
+        pthread_join(gs_worker[i].thread, NULL);
+    }
+#endif
+
+    printf("States: %lu, %s\n", gs_node_nr < gs_arg.max_states ? gs_node_nr : gs_arg.max_states,
+           gs_limit_hit ? "incomplete (state limit reached)" :
+           gs_input_limit_nr ? "complete up to the input limit" : "complete");
+    printf("Paths: %lu turned off, %lu crashed, %lu hung, %lu used unsupported IO, %lu at the input limit\n",
+           gs_terminated_nr, gs_crash_nr, gs_hang_nr, gs_unsupported_nr, gs_input_limit_nr);
+    if(gs_startup.node) printf("Startup: %lu cycles to the first read or turning off\n", gs_startup.cycles);
+    if(gs_worst.node) {
+        printf("Worst response: %lu cycles after ", gs_worst.cycles);
+        print_path(stdout, gs_worst.node);
+        printf(", printing ");
+        print_escaped(stdout, gs_worst.output, gs_worst.output_len);
+        printf("\n");
+    }
+    find_longest(root);
+    if(gs_read_loop) {
+        printf("Longest run: no limit, a loop of reads can be repeated before turning off\n");
+    } else if(root->longest_edge != LONGEST_NONE) {
+        printf("Longest run: %lu cycles to turn off after ", root->longest);
+        print_longest(stdout, root);
+        printf("\n");
+    }
+    print_findings("Crash at", gs_crash, gs_crash_nr);
+    print_findings("Hang at", gs_hang, gs_hang_nr);
+    print_findings("Unsupported IO address", gs_unsupported, gs_unsupported_nr);
+    for(i = 0; i < (int)gs_output_nr; i++) {
+        printf("Output ");
+        print_escaped(stdout, gs_outputs[i].output, gs_outputs[i].output_len);
+        printf(" after ");
+        print_path(stdout, gs_outputs[i].node);
+        printf("\n");
+    }
+
+    return gs_crash_nr || gs_hang_nr ? EXIT_FAILURE : EXIT_SUCCESS;
+}
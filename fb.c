@@ -0,0 +1,310 @@
+#include "fb.h"
+#include "peri.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "config_impl.h"
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#endif
+#ifdef HAVE_NCURSES
+#   include <ncurses.h>
+#endif
+
+static int gs_cols = 0;
+static int gs_rows = 0;
+static int gs_fps = FB_DEFAULT_FPS;
+static unsigned char *gs_cell = NULL;
+static int gs_x = 0;
+static int gs_y = 0;
+/* Changed rectangle, empty when x0 >= x1 */
+static int gs_dirty_x0, gs_dirty_y0, gs_dirty_x1, gs_dirty_y1;
+static unsigned char gs_fill[3];
+static int gs_fill_len = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t gs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t gs_thread;
+static int gs_thread_running = 0;
+static int gs_stop = 0;
+#endif
+
+static void lock(void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&gs_mutex);
+#endif
+}
+
+static void unlock(void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&gs_mutex);
+#endif
+}
+
+static void mark_dirty(int x0, int y0, int x1, int y1)
+{
+    if(gs_dirty_x0 >= gs_dirty_x1) {
+        gs_dirty_x0 = x0;
+        gs_dirty_y0 = y0;
+        gs_dirty_x1 = x1;
+        gs_dirty_y1 = y1;
+        return;
+    }
+    if(x0 < gs_dirty_x0) gs_dirty_x0 = x0;
+    if(y0 < gs_dirty_y0) gs_dirty_y0 = y0;
+    if(x1 > gs_dirty_x1) gs_dirty_x1 = x1;
+    if(y1 > gs_dirty_y1) gs_dirty_y1 = y1;
+}
+
+/* Draw the changed rectangle */
+static void render(void)
+{
+    static unsigned char buf[FB_MAX_COLS * FB_MAX_ROWS];
+    int x0, y0, x1, y1;
+    int x, y;
+
+    lock();
+    x0 = gs_dirty_x0;
+    y0 = gs_dirty_y0;
+    x1 = gs_dirty_x1;
+    y1 = gs_dirty_y1;
+    gs_dirty_x0 = gs_dirty_x1 = 0;
+    for(y = y0; y < y1 && x0 < x1; y++) {
+        memcpy(buf + (y - y0) * (x1 - x0), gs_cell + y * gs_cols + x0, (size_t)(x1 - x0));
+    }
+    unlock();
+    if(x0 >= x1) return;
+
+    for(x = 0; x < (x1 - x0) * (y1 - y0); x++) {
+        if(buf[x] < ' ' || buf[x] > '~') buf[x] = ' ';
+    }
+    peri_screen_lock();
+#ifdef HAVE_NCURSES
+    {
+        int old_y, old_x;
+
+        getyx(stdscr, old_y, old_x);
+        for(y = y0; y < y1; y++) {
+            mvaddnstr(y, x0, (char const *)buf + (y - y0) * (x1 - x0), x1 - x0);
+        }
+        move(old_y, old_x);
+        refresh();
+    }
+#else
+    printf("\0337");
+    for(y = y0; y < y1; y++) {
+        printf("\033[%d;%dH", y + 1, x0 + 1);
+        fwrite(buf + (y - y0) * (x1 - x0), 1, (size_t)(x1 - x0), stdout);
+    }
+    printf("\0338");
+    fflush(stdout);
+#endif
+    peri_screen_unlock();
+}
+
+#ifdef HAVE_PTHREAD
+static void *render_thread(void *arg)
+{
+    struct timespec frame;
+
+    frame.tv_sec = 1 / gs_fps;
+    frame.tv_nsec = (1000000000L / gs_fps) % 1000000000L;
+    while(!__atomic_load_n(&gs_stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&frame, NULL);
+        render();
+    }
+    return NULL;
+}
+#else
+/* Without threads, draw from the device calls at most fps times per second */
+static void maybe_render(void)
+{
+    static double last = 0;
+    struct timespec ts;
+    double now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+    if(now - last >= 1.0 / gs_fps) {
+        last = now;
+        render();
+    }
+}
+#endif
+
+/* Called after a write, without the lock */
+static void written(void)
+{
+#ifndef HAVE_PTHREAD
+    maybe_render();
+#endif
+}
+
+static void put(int x, int y, unsigned char c)
+{
+    gs_cell[y * gs_cols + x] = c;
+    mark_dirty(x, y, x + 1, y + 1);
+}
+
+static void advance(void)
+{
+    if(++gs_x >= gs_cols) {
+        gs_x = 0;
+        if(++gs_y >= gs_rows) gs_y = 0;
+    }
+}
+
+static void x_output(computer *comp, unsigned char c)
+{
+    lock();
+    gs_x = c < gs_cols ? c : gs_cols - 1;
+    unlock();
+}
+
+static void y_output(computer *comp, unsigned char c)
+{
+    lock();
+    gs_y = c < gs_rows ? c : gs_rows - 1;
+    unlock();
+}
+
+static void data_output(computer *comp, unsigned char c)
+{
+    lock();
+    put(gs_x, gs_y, c);
+    advance();
+    unlock();
+    written();
+}
+
+static void data_input(computer *comp, unsigned char *c)
+{
+    lock();
+    *c = gs_cell[gs_y * gs_cols + gs_x];
+    advance();
+    unlock();
+}
+
+static void fill_output(computer *comp, unsigned char c)
+{
+    int x1, y1, y;
+
+    gs_fill[gs_fill_len++] = c;
+    if(gs_fill_len < 3) return;
+    gs_fill_len = 0;
+
+    lock();
+    x1 = gs_x + gs_fill[0] < gs_cols ? gs_x + gs_fill[0] : gs_cols;
+    y1 = gs_y + gs_fill[1] < gs_rows ? gs_y + gs_fill[1] : gs_rows;
+    for(y = gs_y; y < y1 && gs_x < x1; y++) {
+        memset(gs_cell + y * gs_cols + gs_x, gs_fill[2], (size_t)(x1 - gs_x));
+    }
+    if(gs_x < x1 && gs_y < y1) mark_dirty(gs_x, gs_y, x1, y1);
+    unlock();
+    written();
+}
+
+static void cols_input(computer *comp, unsigned char *c)
+{
+    *c = (unsigned char)gs_cols;
+}
+
+static void rows_input(computer *comp, unsigned char *c)
+{
+    *c = (unsigned char)gs_rows;
+}
+
+static void new_line(void)
+{
+    gs_x = 0;
+    if(++gs_y < gs_rows) return;
+    gs_y = gs_rows - 1;
+    memmove(gs_cell, gs_cell + gs_cols, (size_t)(gs_cols * (gs_rows - 1)));
+    memset(gs_cell + gs_cols * (gs_rows - 1), ' ', (size_t)gs_cols);
+    mark_dirty(0, 0, gs_cols, gs_rows);
+}
+
+static void printer_output(computer *comp, unsigned char c)
+{
+    lock();
+    if(c == '\n') {
+        new_line();
+    } else if(c == '\r') {
+        gs_x = 0;
+    } else if(c == '\b') {
+        if(gs_x > 0) gs_x--;
+    } else if(c == '\f') {
+        memset(gs_cell, ' ', (size_t)(gs_cols * gs_rows));
+        mark_dirty(0, 0, gs_cols, gs_rows);
+        gs_x = gs_y = 0;
+    } else {
+        if(gs_x >= gs_cols) new_line();
+        put(gs_x, gs_y, c);
+        gs_x++;
+    }
+    unlock();
+    written();
+}
+
+static int gs_printer = 0;
+
+int fb_init(int cols, int rows, int fps, int printer)
+{
+    if(cols < 1 || cols > FB_MAX_COLS || rows < 1 || rows > FB_MAX_ROWS || fps < 1) return -1;
+    if((gs_cell = malloc((size_t)(cols * rows))) == NULL) return -1;
+    memset(gs_cell, ' ', (size_t)(cols * rows));
+    gs_cols = cols;
+    gs_rows = rows;
+    gs_fps = fps;
+    gs_printer = printer;
+    mark_dirty(0, 0, cols, rows);
+
+    peri_screen_lock();
+#ifdef HAVE_NCURSES
+    clear();
+    move(rows, 0);
+    refresh();
+#else
+    printf("\033[2J\033[%d;1H", rows + 1);
+    fflush(stdout);
+#endif
+    peri_screen_unlock();
+#ifdef HAVE_PTHREAD
+    if(pthread_create(&gs_thread, NULL, render_thread, NULL) == 0) {
+        gs_thread_running = 1;
+    }
+#endif
+    return 0;
+}
+
+void fb_attach(computer_devices *dev)
+{
+    if(gs_cell == NULL) return;
+    dev->output[PERI_ADDR_FB_X] = x_output;
+    dev->output[PERI_ADDR_FB_Y] = y_output;
+    dev->output[PERI_ADDR_FB_DATA] = data_output;
+    dev->input[PERI_ADDR_FB_DATA] = data_input;
+    dev->output[PERI_ADDR_FB_FILL] = fill_output;
+    dev->input[PERI_ADDR_FB_COLS] = cols_input;
+    dev->input[PERI_ADDR_FB_ROWS] = rows_input;
+    if(gs_printer) {
+        dev->output[PERI_ADDR_ASCII_PRINTER] = printer_output;
+    }
+}
+
+void fb_finalize(void)
+{
+    if(gs_cell == NULL) return;
+#ifdef HAVE_PTHREAD
+    if(gs_thread_running) {
+        __atomic_store_n(&gs_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(gs_thread, NULL);
+        gs_thread_running = 0;
+    }
+#endif
+    render();
+    free(gs_cell);
+    gs_cell = NULL;
+}
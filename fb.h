@@ -0,0 +1,37 @@
+#ifndef FB_H_
+#define FB_H_
+
+#include "computer.h"
+
+/* A character framebuffer: a grid of cols x rows characters that is drawn
+ * in the top left corner of the terminal by a render thread, at most
+ * fps times per second and only where it has changed.
+ *
+ * FB_X:    output sets the cursor column
+ * FB_Y:    output sets the cursor row
+ * FB_DATA: output writes a character at the cursor, input reads it; the
+ *          cursor then moves right, wrapping to the next row
+ * FB_FILL: output, three bytes: width, height and character. Fills the
+ *          rectangle at the cursor (clipped to the grid).
+ * FB_COLS: input, number of columns
+ * FB_ROWS: input, number of rows
+ *
+ * If printer is set, the ASCII printer writes into the grid like a
+ * terminal: '\n' starts a new line, '\r' goes to the start of the line,
+ * '\b' moves back, '\f' clears the grid and moves home, and the grid
+ * scrolls up when the cursor moves past the last row. */
+
+#define FB_MAX_COLS 255
+#define FB_MAX_ROWS 255
+#define FB_DEFAULT_COLS 80
+#define FB_DEFAULT_ROWS 24
+#define FB_DEFAULT_FPS 30
+
+/* Returns -1 if the size is invalid or there is no memory */
+int fb_init(int cols, int rows, int fps, int printer);
+/* Connect the framebuffer devices to dev */
+void fb_attach(computer_devices *dev);
+/* Draw what is left and stop the render thread */
+void fb_finalize(void);
+
+#endif
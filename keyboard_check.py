@@ -0,0 +1,60 @@
+import os
+import pty
+import select
+import sys
+import time
+
+# Checks that keys typed without Enter reach a program that polls the
+# keyboard, with the simulator on a terminal. It runs
+# examples/add_from_keyboard.ram under a pseudo terminal, types "120" one key
+# at a time and expects the sum 3 to be printed. With idle waiting the
+# simulator sleeps in poll() between the keys, so this fails if the terminal
+# is left in canonical mode there.
+#
+# Usage:
+#   python3 keyboard_check.py ./simulator examples/add_from_keyboard.ram
+
+TIMEOUT = 10
+
+
+def run(simulator, ram_file, options):
+    pid, fd = pty.fork()
+    if pid == 0:
+        os.execv(simulator, [simulator] + options + [ram_file])
+    out = b''
+    try:
+        time.sleep(0.3)
+        for key in b'120':
+            os.write(fd, bytes([key]))
+            time.sleep(0.1)
+        end = time.monotonic() + TIMEOUT
+        while b'c?3' not in out and time.monotonic() < end:
+            if select.select([fd], [], [], 0.1)[0]:
+                try:
+                    out += os.read(fd, 4096)
+                except OSError:
+                    break
+    finally:
+        try:
+            os.kill(pid, 9)
+        except ProcessLookupError:
+            pass
+        os.waitpid(pid, 0)
+        os.close(fd)
+    return out
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(f'usage: {sys.argv[0]} SIMULATOR RAM_FILE')
+    failed = 0
+    for options in (['-B', '--fast'], ['-B'], ['--fast']):
+        out = run(sys.argv[1], sys.argv[2], options)
+        if b'c?3' not in out:
+            print(f'FAILED {" ".join(options)}: {out!r}', file=sys.stderr)
+            failed = 1
+    sys.exit(failed)
+
+
+if __name__ == '__main__':
+    main()
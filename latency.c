@@ -0,0 +1,200 @@
+#include "latency.h"
+#include "peri.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct histogram {
+    unsigned long count;
+    unsigned long min, max;
+    double sum;
+    unsigned long bucket[LATENCY_BUCKET_NR];
+};
+
+struct rule {
+    unsigned char in, out;
+    unsigned long inputs;
+    int pending;
+    unsigned long start_cycle;
+    unsigned long start_ns;
+    struct histogram cycles;
+    struct histogram ns;
+};
+
+static struct rule gs_rule[LATENCY_RULE_NR];
+static int gs_rule_nr = 0;
+static void (*gs_output[COMPUTER_ADDR_SIZE])(computer *, unsigned char);
+static void (*gs_input[COMPUTER_ADDR_SIZE])(computer *, unsigned char *);
+static volatile int gs_report_requested = 0;
+
+static unsigned long time_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long)now.tv_sec * 1000000000UL + (unsigned long)now.tv_nsec;
+}
+
+/* Values below LATENCY_SUB_BUCKETS get a bucket each, above that every
+ * power of two is split into LATENCY_SUB_BUCKETS buckets */
+static int bucket_index(unsigned long v)
+{
+    int shift;
+
+    if(v < LATENCY_SUB_BUCKETS) return (int)v;
+    shift = 63 - __builtin_clzl(v) - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) + (int)((v >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* Highest value that goes into bucket i */
+static unsigned long bucket_high(int i)
+{
+    int shift = (i >> LATENCY_SUB_BITS) - 1;
+
+    if(shift < 0) return (unsigned long)i;
+    return (((unsigned long)(LATENCY_SUB_BUCKETS + (i & (LATENCY_SUB_BUCKETS - 1))) + 1) << shift) - 1;
+}
+
+static void histogram_add(struct histogram *h, unsigned long v)
+{
+    if(h->count == 0 || v < h->min) h->min = v;
+    if(v > h->max) h->max = v;
+    h->count++;
+    h->sum += (double)v;
+    h->bucket[bucket_index(v)]++;
+}
+
+/* Value at or below which a fraction p of the samples lie */
+static unsigned long histogram_percentile(struct histogram const *h, double p)
+{
+    unsigned long want = (unsigned long)(p * (double)h->count + 0.5);
+    unsigned long seen = 0;
+    int i;
+
+    if(want == 0) want = 1;
+    for(i = 0; i < LATENCY_BUCKET_NR; i++) {
+        seen += h->bucket[i];
+        if(seen >= want) return bucket_high(i) < h->max ? bucket_high(i) : h->max;
+    }
+    return h->max;
+}
+
+static void print_histogram(FILE *fp, char const *unit, struct histogram const *h)
+{
+    if(h->count == 0) return;
+    fprintf(fp, "  %-6s %10lu %14lu %14.0f %14lu %14lu %14lu %14lu %14lu\n", unit, h->count, h->min,
+            h->sum / (double)h->count, histogram_percentile(h, 0.5), histogram_percentile(h, 0.9),
+            histogram_percentile(h, 0.99), histogram_percentile(h, 0.999), h->max);
+}
+
+static void maybe_report(void)
+{
+    if(gs_report_requested) {
+        gs_report_requested = 0;
+        latency_print_report(stderr);
+    }
+}
+
+static void input_wrapper(computer *comp, unsigned char *c)
+{
+    unsigned char addr = comp->io_addr;
+    unsigned long read_count = peri_keyboard_read_count();
+    int i;
+
+    gs_input[addr](comp, c);
+    if(addr != PERI_ADDR_KEYBOARD || peri_keyboard_read_count() != read_count) {
+        for(i = 0; i < gs_rule_nr; i++) {
+            struct rule *r = &gs_rule[i];
+
+            if(r->in != addr) continue;
+            r->inputs++;
+            if(r->pending) continue;
+            r->pending = 1;
+            r->start_cycle = comp->clock_cycle;
+            r->start_ns = time_ns();
+        }
+    }
+    maybe_report();
+}
+
+static void output_wrapper(computer *comp, unsigned char c)
+{
+    unsigned char addr = comp->io_addr;
+    unsigned long now = time_ns();
+    int i;
+
+    for(i = 0; i < gs_rule_nr; i++) {
+        struct rule *r = &gs_rule[i];
+
+        if(r->out != addr || !r->pending) continue;
+        r->pending = 0;
+        histogram_add(&r->cycles, comp->clock_cycle - r->start_cycle);
+        histogram_add(&r->ns, now - r->start_ns);
+    }
+    gs_output[addr](comp, c);
+    maybe_report();
+}
+
+int latency_add_rules(char *arg)
+{
+    char *tok;
+
+    for(tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        char *end;
+        long in, out;
+
+        if(eq == NULL || gs_rule_nr == LATENCY_RULE_NR) return -1;
+        *eq = '\0';
+        in = strtol(tok, &end, 0);
+        if(*end != '\0' || in < 0 || in >= COMPUTER_ADDR_SIZE) return -1;
+        out = strtol(eq + 1, &end, 0);
+        if(*end != '\0' || out < 0 || out >= COMPUTER_ADDR_SIZE) return -1;
+        gs_rule[gs_rule_nr].in = (unsigned char)in;
+        gs_rule[gs_rule_nr].out = (unsigned char)out;
+        gs_rule_nr++;
+    }
+    return 0;
+}
+
+void latency_attach(computer_devices *dev)
+{
+    int i;
+
+    for(i = 0; i < gs_rule_nr; i++) {
+        unsigned char in = gs_rule[i].in;
+        unsigned char out = gs_rule[i].out;
+
+        if(dev->input[in] && dev->input[in] != input_wrapper) {
+            gs_input[in] = dev->input[in];
+            dev->input[in] = input_wrapper;
+        }
+        if(dev->output[out] && dev->output[out] != output_wrapper) {
+            gs_output[out] = dev->output[out];
+            dev->output[out] = output_wrapper;
+        }
+    }
+}
+
+void latency_request_report(void)
+{
+    gs_report_requested = 1;
+}
+
+void latency_print_report(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "--- Latency ---\n");
+    for(i = 0; i < gs_rule_nr; i++) {
+        struct rule const *r = &gs_rule[i];
+
+        fprintf(fp, "%d -> %d: %lu inputs, %lu responses%s\n", r->in, r->out, r->inputs, r->cycles.count,
+                r->pending ? ", one waiting" : "");
+        if(r->cycles.count == 0) continue;
+        fprintf(fp, "  %-6s %10s %14s %14s %14s %14s %14s %14s %14s\n", "unit", "count", "min", "mean", "p50",
+                "p90", "p99", "p99.9", "max");
+        print_histogram(fp, "cycles", &r->cycles);
+        print_histogram(fp, "ns", &r->ns);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdio.h>
+#include "computer.h"
+
+/* Response times between IO ports. A rule IN=OUT starts a measurement when
+ * a read of port IN returns data (for the keyboard: a byte was in the
+ * buffer) and ends it at the next write to port OUT. Reads of IN while a
+ * measurement is running do not restart it, so the time is counted from
+ * the oldest unanswered input. Every response is added to two
+ * log-linear histograms, in clock cycles and in host nanoseconds, with
+ * LATENCY_SUB_BUCKETS buckets per power of two (about 6% resolution over
+ * the whole range of unsigned long). The handlers of the ports are
+ * wrapped, so the engine checks nothing. */
+
+#define LATENCY_RULE_NR 16
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKET_NR ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/* Add rules "IN=OUT[,..]". Returns -1 if arg is malformed or there are
+ * more than LATENCY_RULE_NR rules. */
+int latency_add_rules(char *arg);
+/* Wrap the ports of the rules in dev. Call after the peripherals are
+ * connected. */
+void latency_attach(computer_devices *dev);
+/* Ask for a report on stderr at the next IO on a port of a rule, may be
+ * called from a signal handler */
+void latency_request_report(void);
+void latency_print_report(FILE *fp);
+
+#endif
@@ -0,0 +1,187 @@
+#include "minicomp.h"
+#include "computer.h"
+#include "peri.h"
+#include <stdlib.h>
+#include <string.h>
+#include "config_impl.h"
+
+#define STATE_VERSION 1
+
+struct minicomp {
+    computer comp; /* First, so that handlers can find the instance */
+    minicomp_output_fn output[COMPUTER_ADDR_SIZE];
+    void *output_user[COMPUTER_ADDR_SIZE];
+    minicomp_input_fn input[COMPUTER_ADDR_SIZE];
+    void *input_user[COMPUTER_ADDR_SIZE];
+};
+
+static void output_handler(computer *comp, unsigned char c)
+{
+    minicomp *mc = (minicomp *)comp;
+    unsigned char addr = comp->io_addr;
+
+    if(mc->output[addr]) {
+        mc->output[addr](mc, mc->output_user[addr], addr, c);
+    } else if(addr == PERI_ADDR_TERMINATE) {
+        comp->is_running = 0;
+    }
+}
+
+static void input_handler(computer *comp, unsigned char *c)
+{
+    minicomp *mc = (minicomp *)comp;
+    unsigned char addr = comp->io_addr;
+
+    *c = mc->input[addr] ? mc->input[addr](mc, mc->input_user[addr], addr) : 0;
+}
+
+#define H4(h) h, h, h, h
+#define H16(h) H4(h), H4(h), H4(h), H4(h)
+#define H64(h) H16(h), H16(h), H16(h), H16(h)
+#define H256(h) H64(h), H64(h), H64(h), H64(h)
+
+/* The simulator's peripherals use process wide state, so every address
+ * goes through the instance's callbacks instead. All instances share
+ * this map. */
+static computer_devices const gs_devices = { { H256(output_handler) }, { H256(input_handler) } };
+
+static void connect(minicomp *mc)
+{
+    mc->comp.dev = &gs_devices;
+}
+
+minicomp *minicomp_create(void)
+{
+    minicomp *mc;
+
+    if(posix_memalign((void **)&mc, COMPUTER_CACHE_LINE, sizeof(*mc))) return NULL;
+    memset(mc, 0, sizeof(*mc));
+    computer_reset(&mc->comp);
+    connect(mc);
+    return mc;
+}
+
+void minicomp_destroy(minicomp *mc)
+{
+    free(mc);
+}
+
+int minicomp_load(minicomp *mc, void const *image, size_t len)
+{
+    if(len > COMPUTER_RAM_SIZE) return -1;
+    computer_reset(&mc->comp);
+    connect(mc);
+    memcpy(mc->comp.ram, image, len);
+    return 0;
+}
+
+void minicomp_set_output(minicomp *mc, unsigned char addr, minicomp_output_fn fn, void *user)
+{
+    mc->output[addr] = fn;
+    mc->output_user[addr] = user;
+}
+
+void minicomp_set_input(minicomp *mc, unsigned char addr, minicomp_input_fn fn, void *user)
+{
+    mc->input[addr] = fn;
+    mc->input_user[addr] = user;
+}
+
+int minicomp_run_cycles(minicomp *mc, unsigned long cycles)
+{
+    computer_run_fast(&mc->comp, mc->comp.clock_cycle + cycles);
+    return mc->comp.is_running ? MINICOMP_RUNNING : MINICOMP_STOPPED;
+}
+
+int minicomp_run_instructions(minicomp *mc, unsigned long instructions)
+{
+    while(instructions-- && mc->comp.is_running) {
+        computer_step_instruction_fast(&mc->comp);
+    }
+    return mc->comp.is_running ? MINICOMP_RUNNING : MINICOMP_STOPPED;
+}
+
+void minicomp_stop(minicomp *mc)
+{
+    mc->comp.is_running = 0;
+}
+
+int minicomp_is_running(minicomp const *mc)
+{
+    return mc->comp.is_running;
+}
+
+unsigned long minicomp_get_cycles(minicomp const *mc)
+{
+    return mc->comp.clock_cycle;
+}
+
+unsigned char minicomp_get_iar(minicomp const *mc)
+{
+    return mc->comp.iar;
+}
+
+unsigned char minicomp_get_reg(minicomp const *mc, int reg)
+{
+    return mc->comp.reg[reg & (COMPUTER_REG_NR - 1)];
+}
+
+unsigned char minicomp_peek(minicomp const *mc, unsigned char addr)
+{
+    return mc->comp.ram[addr];
+}
+
+void minicomp_poke(minicomp *mc, unsigned char addr, unsigned char value)
+{
+    mc->comp.ram[addr] = value;
+}
+
+/* Layout: "MCS" version, RAM, registers, iar, flags, io_addr, is_running,
+ * clock cycle (8 bytes, low byte first) */
+void minicomp_save(minicomp const *mc, unsigned char *buf)
+{
+    computer const *comp = &mc->comp;
+    int i;
+
+    buf[0] = 'M';
+    buf[1] = 'C';
+    buf[2] = 'S';
+    buf[3] = STATE_VERSION;
+    memcpy(buf + 4, comp->ram, COMPUTER_RAM_SIZE);
+    buf += 4 + COMPUTER_RAM_SIZE;
+    memcpy(buf, comp->reg, COMPUTER_REG_NR);
+    buf += COMPUTER_REG_NR;
+    buf[0] = comp->iar;
+    buf[1] = comp->flags;
+    buf[2] = comp->io_addr;
+    buf[3] = (unsigned char)(comp->is_running != 0);
+    buf += 4;
+    for(i = 0; i < 8; i++) {
+        buf[i] = (unsigned char)((unsigned long long)comp->clock_cycle >> (8 * i));
+    }
+}
+
+int minicomp_restore(minicomp *mc, unsigned char const *buf)
+{
+    computer *comp = &mc->comp;
+    unsigned long long clock_cycle = 0;
+    int i;
+
+    if(buf[0] != 'M' || buf[1] != 'C' || buf[2] != 'S' || buf[3] != STATE_VERSION) return -1;
+    computer_reset(comp);
+    connect(mc);
+    memcpy(comp->ram, buf + 4, COMPUTER_RAM_SIZE);
+    buf += 4 + COMPUTER_RAM_SIZE;
+    memcpy(comp->reg, buf, COMPUTER_REG_NR);
+    buf += COMPUTER_REG_NR;
+    comp->iar = buf[0];
+    comp->flags = buf[1];
+    comp->io_addr = buf[2];
+    comp->is_running = buf[3];
+    buf += 4;
+    for(i = 0; i < 8; i++) {
+        clock_cycle |= (unsigned long long)buf[i] << (8 * i);
+    }
+    comp->clock_cycle = (unsigned long)clock_cycle;
+    return 0;
+}
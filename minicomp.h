@@ -0,0 +1,72 @@
+#ifndef MINICOMP_H_
+#define MINICOMP_H_
+
+/* libminicomp - run minicomp computers inside another program.
+ *
+ * Every instance is independent and owns all of its state, so instances
+ * may be run from different threads at the same time (one thread per
+ * instance at a time). IO does not go to the process' stdio: an instance
+ * has no peripherals except terminate (address 4) until the host
+ * registers callbacks for the addresses it wants to serve. Input from an
+ * address without a callback reads 0, output to one is ignored.
+ *
+ * The programs run with the fast engine, see README.md for the timing. */
+
+#include <stddef.h>
+
+#define MINICOMP_API_VERSION 1
+
+#define MINICOMP_RAM_SIZE 256
+/* Bytes written by minicomp_save() */
+#define MINICOMP_STATE_SIZE 276
+
+/* Return values of the run functions */
+#define MINICOMP_STOPPED 0 /* The computer is turned off */
+#define MINICOMP_RUNNING 1 /* The budget ran out */
+
+typedef struct minicomp minicomp;
+
+/* Called for output to addr. user is the pointer given at registration. */
+typedef void (*minicomp_output_fn)(minicomp *mc, void *user, unsigned char addr, unsigned char value);
+/* Called for input from addr, returns the value */
+typedef unsigned char (*minicomp_input_fn)(minicomp *mc, void *user, unsigned char addr);
+
+/* Returns NULL if there is no memory. The new instance is reset with
+ * zeroed RAM. */
+minicomp *minicomp_create(void);
+void minicomp_destroy(minicomp *mc);
+
+/* Reset the computer and copy len bytes of image to the start of RAM, the
+ * rest is zeroed. Callbacks stay registered. Returns -1 if len is larger
+ * than MINICOMP_RAM_SIZE. */
+int minicomp_load(minicomp *mc, void const *image, size_t len);
+
+/* Register callbacks for an address, NULL removes them. Output to address 4
+ * turns the computer off unless an output callback is registered for it. */
+void minicomp_set_output(minicomp *mc, unsigned char addr, minicomp_output_fn fn, void *user);
+void minicomp_set_input(minicomp *mc, unsigned char addr, minicomp_input_fn fn, void *user);
+
+/* Run until cycles more clock cycles have passed (rounded up to a whole
+ * instruction) or the computer turns off */
+int minicomp_run_cycles(minicomp *mc, unsigned long cycles);
+/* Run at most instructions instructions */
+int minicomp_run_instructions(minicomp *mc, unsigned long instructions);
+/* Turn the computer off, e.g. from a callback */
+void minicomp_stop(minicomp *mc);
+int minicomp_is_running(minicomp const *mc);
+
+unsigned long minicomp_get_cycles(minicomp const *mc);
+unsigned char minicomp_get_iar(minicomp const *mc);
+/* Register 0-3 (RA-RD) */
+unsigned char minicomp_get_reg(minicomp const *mc, int reg);
+unsigned char minicomp_peek(minicomp const *mc, unsigned char addr);
+void minicomp_poke(minicomp *mc, unsigned char addr, unsigned char value);
+
+/* Write the complete computer state (RAM, registers, flags, clock) to
+ * buf, which must hold MINICOMP_STATE_SIZE bytes. The format does not
+ * depend on the host. Callbacks are not part of the state. */
+void minicomp_save(minicomp const *mc, unsigned char *buf);
+/* Returns -1 if buf does not hold a saved state */
+int minicomp_restore(minicomp *mc, unsigned char const *buf);
+
+#endif
@@ -0,0 +1,782 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <argp.h>
+#include "computer.h"
+#include "peri.h"
+#include "config_impl.h"
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#endif
+#ifdef HAVE_SIGNAL
+#   include <signal.h>
+#endif
+
+/* Coverage guided fuzzing of the keyboard input of a RAM image. Every run
+ * starts from the loaded image and feeds an input from the corpus, mutated
+ * a little, to the keyboard buffer of peri.c, with the fast engine. The run
+ * loop counts the (previous address, address) edges taken, in a map per
+ * worker that only the touched entries are read back from. An input that takes a new edge,
+ * or an edge a new number of times (rounded to a power of two), joins the
+ * corpus shared by all workers.
+ *
+ * A run ends when the program turns off or polls the keyboard after the
+ * input is used up. It is reported when it runs a byte that is not code,
+ * runs for more than the cycle budget without reading the keyboard, uses
+ * an IO address the fuzzer does not serve, or turns off at an address
+ * where none of the seeds did. */
+
+#define MAX_ENTRIES 256
+#define MAX_SEEDS 64
+#define MAX_EXITS 256
+#define MAX_WORKERS 64
+#define MAX_REPORTED 10
+#define MAX_CORPUS 65536
+#define EDGE_NR (COMPUTER_RAM_SIZE * COMPUTER_RAM_SIZE)
+/* Runs between updates of the shared run count */
+#define RUN_BATCH 256
+
+#define DEFAULT_MAX_LEN 64
+#define DEFAULT_MAX_CYCLES 1000000UL
+#define DEFAULT_SECONDS 10
+
+#define FIND_CRASH 0
+#define FIND_HANG 1
+#define FIND_UNSUPPORTED 2
+#define FIND_EXIT 3
+#define FIND_NR 4
+
+struct arguments {
+    int entry_nr;
+    int entry[MAX_ENTRIES];
+    int exit_nr;
+    int exit[MAX_EXITS];
+    int seed_nr;
+    char *seed[MAX_SEEDS];
+    size_t max_len;
+    unsigned long max_cycles;
+    unsigned long seconds;
+    unsigned long runs;
+    unsigned long random_seed;
+    int number;
+    int workers;
+    int quiet;
+    char *ram_file;
+};
+
+static struct arguments gs_arg = { 0, { 0 }, 0, { 0 }, 0, { NULL }, DEFAULT_MAX_LEN, DEFAULT_MAX_CYCLES,
+    DEFAULT_SECONDS, 0, 1, 0, 0, 0, NULL };
+
+char const *argp_program_version = "minifuzz " MINICOMP_VERSION;
+char const *argp_program_bug_address = "<boris.carlsson@gmail.com>";
+
+static char gs_argp_doc[] = "minifuzz - Fuzz the keyboard input of a minicomp RAM image.\n\n"
+    "Mutates keyboard input, keeping what reaches new code paths, and reports\n"
+    "input that makes the program run data, hang, use an unknown IO address\n"
+    "or turn off where the seed input does not.";
+static char gs_argp_args_doc[] = "ram-file";
+
+static struct argp_option gs_argp_options[] = {
+    { "seed", 'i', "FILE", 0, "Start the corpus with the input in FILE (can be repeated)", 0 },
+    { "number", 'n', NULL, 0, "Read the input as lines of numbers, like simulator -N", 0 },
+    { "max-len", 'l', "N", 0, "Longest input in bytes (default: 64)", 0 },
+    { "max-cycles", 'c', "N", 0, "Report a hang after N cycles without a keyboard read (default: 1000000)", 0 },
+    { "time", 't', "SECONDS", 0, "Stop after SECONDS (default: 10, 0 for no limit)", 0 },
+    { "runs", 'r', "N", 0, "Stop after about N runs", 0 },
+    { "random-seed", 's', "N", 0, "Seed of the mutations (default: 1)", 0 },
+    { "entry", 'e', "ADDR", 0, "Address that may be jumped to with JMPR (can be repeated)", 0 },
+    { "exit", 'x', "ADDR", 0, "Address where turning off is expected (can be repeated)", 0 },
+    { "jobs", 'j', "N", 0, "Number of worker threads (default: number of processors)", 0 },
+    { "quiet", 'q', NULL, 0, "Do not print progress every second", 0 },
+    { 0, 0, 0, 0, 0, 0 }
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+    char *end;
+    long value;
+
+    switch (key) {
+        case 'i':
+            if(arguments->seed_nr == MAX_SEEDS) argp_usage(state);
+            arguments->seed[arguments->seed_nr++] = arg;
+            break;
+        case 'n':
+            arguments->number = 1;
+            break;
+        case 'l':
+            value = strtol(arg, &end, 0);
+            if(*end || value < 1) argp_usage(state);
+            arguments->max_len = (size_t)value;
+            break;
+        case 'c':
+            arguments->max_cycles = strtoul(arg, NULL, 0);
+            break;
+        case 't':
+            arguments->seconds = strtoul(arg, NULL, 0);
+            break;
+        case 'r':
+            arguments->runs = strtoul(arg, NULL, 0);
+            break;
+        case 's':
+            arguments->random_seed = strtoul(arg, NULL, 0);
+            break;
+        case 'e':
+        case 'x':
+            value = strtol(arg, &end, 0);
+            if(*end || value < 0 || value >= COMPUTER_RAM_SIZE) argp_usage(state);
+            if(key == 'e') {
+                if(arguments->entry_nr == MAX_ENTRIES) argp_usage(state);
+                arguments->entry[arguments->entry_nr++] = (int)value;
+            } else {
+                if(arguments->exit_nr == MAX_EXITS) argp_usage(state);
+                arguments->exit[arguments->exit_nr++] = (int)value;
+            }
+            break;
+        case 'j':
+            arguments->workers = atoi(arg);
+            if(arguments->workers < 1 || arguments->workers > MAX_WORKERS) argp_usage(state);
+            break;
+        case 'q':
+            arguments->quiet = 1;
+            break;
+        case ARGP_KEY_ARG:
+            if(state->arg_num == 0) arguments->ram_file = arg;
+            break;
+        case ARGP_KEY_END:
+            if(state->arg_num != 1) argp_usage(state);
+            break;
+        default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp gs_argp = { gs_argp_options, parse_opt, gs_argp_args_doc, gs_argp_doc, 0, 0, 0 };
+
+struct worker {
+    computer comp; /* First, the IO handlers only get a pointer to it */
+    int id;
+    unsigned long rng; /* Mutations */
+    unsigned long random; /* Reads from PERI_ADDR_RANDOM, the same every run */
+    struct peri_keyboard kb; /* What the program has not read yet */
+    size_t typed; /* Bytes of input given to kb */
+    int exhausted; /* Polled the keyboard with no input left */
+    int unsupported;
+    unsigned long last_read; /* Clock cycle of the last keyboard read */
+    unsigned long runs; /* Not yet added to gs_run_nr */
+    unsigned char *input; /* Raw input, max_len bytes */
+    size_t input_len;
+    size_t touched_nr;
+    unsigned int touched[EDGE_NR];
+    unsigned char hits[EDGE_NR]; /* Saturating count per edge */
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+#endif
+};
+
+struct entry {
+    unsigned char *data;
+    size_t len;
+};
+
+struct finding {
+    int addr;
+    unsigned long cycles;
+    unsigned char *input;
+    size_t len;
+};
+
+static unsigned char gs_image[COMPUTER_RAM_SIZE];
+static unsigned char gs_is_code[COMPUTER_RAM_SIZE];
+static unsigned char gs_exit_ok[COMPUTER_RAM_SIZE];
+static unsigned char gs_bucket[256]; /* Hit count to a bit per power of two */
+static unsigned char gs_seen[EDGE_NR]; /* Buckets seen per edge */
+static computer gs_start;
+static computer_devices gs_devices;
+static struct worker *gs_worker = NULL;
+static int gs_worker_nr = 1;
+static int gs_calibrating = 0;
+static int gs_stop = 0;
+static unsigned long gs_run_nr = 0;
+static unsigned long gs_edge_nr = 0;
+
+static struct entry gs_corpus[MAX_CORPUS];
+static unsigned long gs_corpus_nr = 0;
+
+static char const *gs_find_name[FIND_NR] = {
+    "Data executed at", "Hang at", "Unsupported IO address", "Unexpected turn off at"
+};
+static unsigned long gs_find_nr[FIND_NR];
+static unsigned char gs_find_seen[FIND_NR][COMPUTER_ADDR_SIZE];
+static struct finding gs_find[FIND_NR][MAX_REPORTED];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t gs_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void lock(void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&gs_lock);
+#endif
+}
+
+static void unlock(void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&gs_lock);
+#endif
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if(p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static int next_addr(int addr, int n)
+{
+    return (addr + n) % COMPUTER_RAM_SIZE;
+}
+
+/* Mark the instructions reachable from addr through JMP, JXXX and falling
+ * through */
+static void mark_code(int addr)
+{
+    int stack[COMPUTER_RAM_SIZE * 2];
+    int sp = 0;
+
+    stack[sp++] = addr;
+    while(sp > 0) {
+        unsigned char op;
+
+        addr = stack[--sp];
+        if(gs_is_code[addr]) continue;
+        gs_is_code[addr] = 1;
+        op = gs_image[addr];
+        switch(op >> 4) {
+            case COMPUTER_INSTR_JMP:
+                stack[sp++] = gs_image[next_addr(addr, 1)];
+                break;
+            case COMPUTER_INSTR_JXXX:
+                stack[sp++] = gs_image[next_addr(addr, 1)];
+                stack[sp++] = next_addr(addr, 2);
+                break;
+            case COMPUTER_INSTR_JMPR:
+                break;
+            default:
+                stack[sp++] = next_addr(addr, computer_get_instruction_length(op));
+                break;
+        }
+    }
+}
+
+/* The same code as the explorer finds: what can be reached from address
+ * 0 and the -e addresses, and the return points after calls */
+static void find_code(void)
+{
+    int addr, i, again = 1;
+
+    mark_code(0);
+    for(i = 0; i < gs_arg.entry_nr; i++) {
+        mark_code(gs_arg.entry[i]);
+    }
+    while(again) {
+        again = 0;
+        for(addr = 0; addr < COMPUTER_RAM_SIZE; addr++) {
+            int back, jmp;
+
+            if(!gs_is_code[addr] || gs_image[addr] >> 4 != COMPUTER_INSTR_DATA) continue;
+            back = gs_image[next_addr(addr, 1)];
+            jmp = next_addr(back, COMPUTER_RAM_SIZE - 2);
+            if(!gs_is_code[back] && gs_is_code[jmp] && gs_image[jmp] >> 4 == COMPUTER_INSTR_JMP) {
+                mark_code(back);
+                again = 1;
+            }
+        }
+    }
+}
+
+/* xorshift64* */
+static unsigned long next_random(unsigned long *state)
+{
+    unsigned long long x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = (unsigned long)x;
+    return (unsigned long)((x * 2685821657736338717ULL) >> 32);
+}
+
+static void discard_output(computer *comp, unsigned char c)
+{
+}
+
+static void terminate_output(computer *comp, unsigned char c)
+{
+    comp->is_running = 0;
+}
+
+/* As if all of the input was piped into the simulator: every poll types
+ * what is left through the keyboard code of the simulator, which turns
+ * lines into numbers with --number */
+static void type_input(struct worker *w)
+{
+    while(w->typed < w->input_len) {
+        peri_keyboard_type(&w->kb, &w->comp, w->input[w->typed++]);
+    }
+}
+
+/* The run ends at the first poll after the input is used up */
+static void keyboard_input(computer *comp, unsigned char *c)
+{
+    struct worker *w = (struct worker *)comp;
+    int key;
+
+    w->last_read = comp->clock_cycle;
+    type_input(w);
+    if((key = peri_keyboard_take(&w->kb)) >= 0) {
+        *c = (unsigned char)key;
+        return;
+    }
+    *c = 0;
+    w->exhausted = 1;
+    comp->is_running = 0;
+}
+
+static void has_input(computer *comp, unsigned char *c)
+{
+    struct worker *w = (struct worker *)comp;
+
+    w->last_read = comp->clock_cycle;
+    type_input(w);
+    *c = !peri_keyboard_is_empty(&w->kb);
+    if(!*c) {
+        w->exhausted = 1;
+        comp->is_running = 0;
+    }
+}
+
+static void random_input(computer *comp, unsigned char *c)
+{
+    *c = (unsigned char)next_random(&((struct worker *)comp)->random);
+}
+
+static void unsupported_output(computer *comp, unsigned char c)
+{
+    ((struct worker *)comp)->unsupported = 1;
+    comp->is_running = 0;
+}
+
+static void unsupported_input(computer *comp, unsigned char *c)
+{
+    ((struct worker *)comp)->unsupported = 1;
+    comp->is_running = 0;
+}
+
+/* Shared by all workers */
+static void connect(computer_devices *dev)
+{
+    int i;
+
+    for(i = 0; i < COMPUTER_ADDR_SIZE; i++) {
+        dev->output[i] = unsupported_output;
+        dev->input[i] = unsupported_input;
+    }
+    dev->output[PERI_ADDR_ASCII_PRINTER] = discard_output;
+    dev->output[PERI_ADDR_INTEGER_PRINTER] = discard_output;
+    dev->output[PERI_ADDR_HEX_PRINTER] = discard_output;
+    dev->output[PERI_ADDR_INTEGER16_PRINTER] = discard_output;
+    dev->output[PERI_ADDR_INTEGER24_PRINTER] = discard_output;
+    dev->output[PERI_ADDR_INTEGER32_PRINTER] = discard_output;
+    dev->output[PERI_ADDR_TERMINATE] = terminate_output;
+    dev->input[PERI_ADDR_KEYBOARD] = keyboard_input;
+    dev->input[PERI_ADDR_KEYBOARD_HAS_INPUT] = has_input;
+    dev->input[PERI_ADDR_RANDOM] = random_input;
+}
+
+static void report(struct worker const *w, int kind, int addr)
+{
+    /* Only the first input per address is kept */
+    if(__atomic_load_n(&gs_find_seen[kind][addr], __ATOMIC_RELAXED)) return;
+    lock();
+    if(!gs_find_seen[kind][addr]) {
+        __atomic_store_n(&gs_find_seen[kind][addr], 1, __ATOMIC_RELAXED);
+        if(gs_find_nr[kind] < MAX_REPORTED) {
+            struct finding *f = &gs_find[kind][gs_find_nr[kind]];
+
+            f->addr = addr;
+            f->cycles = w->comp.clock_cycle;
+            f->len = w->input_len;
+            f->input = xmalloc(w->input_len + 1);
+            memcpy(f->input, w->input, w->input_len);
+        }
+        gs_find_nr[kind]++;
+    }
+    unlock();
+}
+
+/* Run w->input from the start of the image. Returns 1 if it is reported. */
+static int run(struct worker *w)
+{
+    computer *comp = &w->comp;
+    unsigned int prev = 0;
+
+    memcpy(comp, &gs_start, sizeof(*comp));
+    peri_keyboard_init(&w->kb, gs_arg.number ? PERI_INPUT_MODE_NUMBER : PERI_INPUT_MODE_RAW, NULL);
+    w->typed = 0;
+    w->exhausted = 0;
+    w->unsupported = 0;
+    w->last_read = 0;
+    w->random = 1;
+
+    while(comp->is_running) {
+        unsigned int edge;
+
+        prev = comp->iar;
+        if(!gs_is_code[prev]) {
+            report(w, FIND_CRASH, (int)prev);
+            return 1;
+        }
+        if(comp->clock_cycle - w->last_read > gs_arg.max_cycles) {
+            report(w, FIND_HANG, (int)prev);
+            return 1;
+        }
+        computer_step_instruction_fast(comp);
+        edge = prev * COMPUTER_RAM_SIZE + comp->iar;
+        if(w->hits[edge] == 0) w->touched[w->touched_nr++] = edge;
+        if(w->hits[edge] != 255) w->hits[edge]++;
+    }
+    if(w->unsupported) {
+        report(w, FIND_UNSUPPORTED, comp->io_addr);
+        return 1;
+    }
+    if(!w->exhausted) {
+        if(gs_calibrating) gs_exit_ok[prev] = 1;
+        else if(!gs_exit_ok[prev]) {
+            report(w, FIND_EXIT, (int)prev);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Clears the hit counts, returns 1 if the run had new coverage */
+static int check_coverage(struct worker *w)
+{
+    int found = 0;
+    size_t i;
+
+    for(i = 0; i < w->touched_nr; i++) {
+        unsigned int edge = w->touched[i];
+        unsigned char bit = gs_bucket[w->hits[edge]];
+
+        w->hits[edge] = 0;
+        if(__atomic_load_n(&gs_seen[edge], __ATOMIC_RELAXED) & bit) continue;
+        if(__atomic_fetch_or(&gs_seen[edge], bit, __ATOMIC_RELAXED) == 0) {
+            __atomic_add_fetch(&gs_edge_nr, 1, __ATOMIC_RELAXED);
+        }
+        found = 1;
+    }
+    w->touched_nr = 0;
+    return found;
+}
+
+/* Entries are never changed once published, so workers read them without
+ * the lock */
+static void add_corpus(unsigned char const *data, size_t len)
+{
+    lock();
+    if(gs_corpus_nr < MAX_CORPUS) {
+        struct entry *e = &gs_corpus[gs_corpus_nr];
+
+        e->data = xmalloc(len + 1);
+        memcpy(e->data, data, len);
+        e->len = len;
+        __atomic_store_n(&gs_corpus_nr, gs_corpus_nr + 1, __ATOMIC_RELEASE);
+    }
+    unlock();
+}
+
+static void mutate(struct worker *w)
+{
+    static char const interesting[] = "0123456789\n\r '-+x\\";
+    int n = 1 + (int)(next_random(&w->rng) % 4);
+    size_t max = gs_arg.max_len;
+
+    while(n-- > 0) {
+        size_t len = w->input_len;
+        size_t pos = len ? next_random(&w->rng) % len : 0;
+        unsigned long r = next_random(&w->rng);
+
+        switch(r % 8) {
+            case 0:
+                if(len) w->input[pos] ^= (unsigned char)(1 << (r / 8 % 8));
+                break;
+            case 1:
+                if(len) w->input[pos] = (unsigned char)(r / 8);
+                break;
+            case 2:
+                if(len) w->input[pos] = (unsigned char)interesting[r / 8 % (sizeof(interesting) - 1)];
+                break;
+            case 3:
+                /* Insert a byte */
+                if(len == max) break;
+                memmove(w->input + pos + 1, w->input + pos, len - pos);
+                w->input[pos] = r / 8 % 2 ? (unsigned char)(r / 16) : (unsigned char)interesting[r / 16 % (sizeof(interesting) - 1)];
+                w->input_len++;
+                break;
+            case 4:
+                /* Delete a byte */
+                if(len == 0) break;
+                memmove(w->input + pos, w->input + pos + 1, len - pos - 1);
+                w->input_len--;
+                break;
+            case 5: {
+                /* Copy a piece of the input over another place */
+                size_t from = len ? r / 8 % len : 0;
+                size_t chunk = len ? 1 + next_random(&w->rng) % (len - (from > pos ? from : pos)) : 0;
+
+                memmove(w->input + pos, w->input + from, chunk);
+                break;
+            }
+            case 6: {
+                /* Insert a number and a newline */
+                char num[8];
+                int num_len = snprintf(num, sizeof(num), "%lu\n", r / 8 % 300);
+
+                if(len + (size_t)num_len > max) break;
+                memmove(w->input + pos + num_len, w->input + pos, len - pos);
+                memcpy(w->input + pos, num, (size_t)num_len);
+                w->input_len += (size_t)num_len;
+                break;
+            }
+            default: {
+                /* Splice: the end of another corpus entry from pos on */
+                unsigned long nr = __atomic_load_n(&gs_corpus_nr, __ATOMIC_ACQUIRE);
+                struct entry const *e = &gs_corpus[r / 8 % nr];
+                size_t from = e->len ? next_random(&w->rng) % e->len : 0;
+                size_t chunk = e->len - from;
+
+                if(pos + chunk > max) chunk = max - pos;
+                memcpy(w->input + pos, e->data + from, chunk);
+                w->input_len = pos + chunk;
+                break;
+            }
+        }
+    }
+}
+
+#ifdef HAVE_SIGNAL
+/* Ctrl-C stops the workers and prints what was found */
+static void sig_handler(int signo)
+{
+    __atomic_store_n(&gs_stop, 1, __ATOMIC_RELAXED);
+}
+#endif
+
+static unsigned long elapsed_seconds(struct timespec const *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long)(now.tv_sec - start->tv_sec);
+}
+
+static void print_progress(unsigned long seconds)
+{
+    unsigned long runs = __atomic_load_n(&gs_run_nr, __ATOMIC_RELAXED);
+    unsigned long found = 0;
+    int i;
+
+    for(i = 0; i < FIND_NR; i++) {
+        found += gs_find_nr[i];
+    }
+    fprintf(stderr, "%4lus: %lu runs (%lu/s), corpus %lu, edges %lu, findings %lu\n", seconds, runs,
+            seconds ? runs / seconds : runs, __atomic_load_n(&gs_corpus_nr, __ATOMIC_RELAXED),
+            __atomic_load_n(&gs_edge_nr, __ATOMIC_RELAXED), found);
+}
+
+static void *fuzz(void *arg)
+{
+    struct worker *w = arg;
+    struct timespec start;
+    unsigned long printed = 0;
+    int reported;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!__atomic_load_n(&gs_stop, __ATOMIC_RELAXED)) {
+        unsigned long nr = __atomic_load_n(&gs_corpus_nr, __ATOMIC_ACQUIRE);
+        struct entry const *e = &gs_corpus[next_random(&w->rng) % nr];
+
+        memcpy(w->input, e->data, e->len);
+        w->input_len = e->len;
+        mutate(w);
+        reported = run(w);
+        /* Inputs that end in a finding would mostly find it again */
+        if(check_coverage(w) && !reported) add_corpus(w->input, w->input_len);
+        if(++w->runs < RUN_BATCH) continue;
+
+        /* Now and then: count the runs and check the limits */
+        __atomic_add_fetch(&gs_run_nr, w->runs, __ATOMIC_RELAXED);
+        w->runs = 0;
+        if(w->id == 0) {
+            unsigned long seconds = elapsed_seconds(&start);
+
+            if(!gs_arg.quiet && seconds > printed) {
+                print_progress(seconds);
+                printed = seconds;
+            }
+            if((gs_arg.seconds && seconds >= gs_arg.seconds) ||
+               (gs_arg.runs && __atomic_load_n(&gs_run_nr, __ATOMIC_RELAXED) >= gs_arg.runs)) {
+                __atomic_store_n(&gs_stop, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    __atomic_add_fetch(&gs_run_nr, w->runs, __ATOMIC_RELAXED);
+    w->runs = 0;
+    return NULL;
+}
+
+static void print_escaped(FILE *fp, unsigned char const *s, size_t len)
+{
+    size_t i;
+
+    fputc('"', fp);
+    for(i = 0; i < len; i++) {
+        unsigned char c = s[i];
+
+        if(c == '\n') fputs("\\n", fp);
+        else if(c == '\t') fputs("\\t", fp);
+        else if(c == '\\' || c == '"') fprintf(fp, "\\%c", c);
+        else if(c < 32 || c > 126) fprintf(fp, "\\x%02x", c);
+        else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Run a seed file, or the empty input, and add it to the corpus */
+static void add_seed(struct worker *w, char const *file)
+{
+    w->input_len = 0;
+    if(file) {
+        FILE *fp = fopen(file, "rb");
+
+        if(fp == NULL) {
+            fprintf(stderr, "Could not open '%s' for reading.\n", file);
+            exit(EXIT_FAILURE);
+        }
+        w->input_len = fread(w->input, 1, gs_arg.max_len, fp);
+        fclose(fp);
+    }
+    run(w);
+    check_coverage(w);
+    add_corpus(w->input, w->input_len);
+}
+
+int main(int argc, char *argv[])
+{
+    struct timespec start;
+    unsigned long seconds, found = 0;
+    FILE *in;
+    int i, j;
+
+    argp_parse(&gs_argp, argc, argv, 0, 0, &gs_arg);
+
+    if((in = fopen(gs_arg.ram_file, "rb")) == NULL) {
+        fprintf(stderr, "Could not open '%s' for reading.\n", gs_arg.ram_file);
+        exit(EXIT_FAILURE);
+    }
+    if(fread(gs_image, 1, sizeof(gs_image), in) == 0 && ferror(in)) {
+        fprintf(stderr, "Could not read '%s'.\n", gs_arg.ram_file);
+        exit(EXIT_FAILURE);
+    }
+    fclose(in);
+    find_code();
+    for(i = 0; i < gs_arg.exit_nr; i++) {
+        gs_exit_ok[gs_arg.exit[i]] = 1;
+    }
+    /* AFL style: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ */
+    for(i = 1; i < 256; i++) {
+        gs_bucket[i] = (unsigned char)(i <= 3 ? 1 << (i - 1) : i < 8 ? 8 : i < 16 ? 16 : i < 32 ? 32 : i < 128 ? 64 : 128);
+    }
+
+#ifdef HAVE_PTHREAD
+    gs_worker_nr = gs_arg.workers;
+    if(gs_worker_nr == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        gs_worker_nr = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus;
+    }
+#endif
+    if(posix_memalign((void **)&gs_worker, COMPUTER_CACHE_LINE, (size_t)gs_worker_nr * sizeof(*gs_worker))) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(gs_worker, 0, (size_t)gs_worker_nr * sizeof(*gs_worker));
+    connect(&gs_devices);
+    computer_reset(&gs_start);
+    gs_start.dev = &gs_devices;
+    memcpy(gs_start.ram, gs_image, COMPUTER_RAM_SIZE);
+    for(i = 0; i < gs_worker_nr; i++) {
+        gs_worker[i].id = i;
+        gs_worker[i].rng = (unsigned long)(gs_arg.random_seed * 0x9e3779b97f4a7c15ULL) + (unsigned long)i + 1;
+        gs_worker[i].input = xmalloc(gs_arg.max_len);
+    }
+
+    /* Where the seeds turn off is where the program is meant to */
+    gs_calibrating = 1;
+    add_seed(&gs_worker[0], NULL);
+    for(i = 0; i < gs_arg.seed_nr; i++) {
+        add_seed(&gs_worker[0], gs_arg.seed[i]);
+    }
+    gs_calibrating = 0;
+
+#ifdef HAVE_SIGNAL
+    if(signal(SIGINT, sig_handler) == SIG_ERR) {
+        fprintf(stderr, "Warning: Can not catch SIGINT.\n");
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#ifdef HAVE_PTHREAD
+    for(i = 1; i < gs_worker_nr; i++) {
+        if(pthread_create(&gs_worker[i].thread, NULL, fuzz, &gs_worker[i])) {
+            fprintf(stderr, "Could not start worker thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+    fuzz(&gs_worker[0]);
+#ifdef HAVE_PTHREAD
+    for(i = 1; i < gs_worker_nr; i++) {
+        pthread_join(gs_worker[i].thread, NULL);
+    }
+#endif
+    seconds = elapsed_seconds(&start);
+
+    printf("Runs: %lu in %lu s with %d workers\n", gs_run_nr, seconds, gs_worker_nr);
+    printf("Corpus: %lu inputs, %lu edges\n", gs_corpus_nr, gs_edge_nr);
+    printf("Findings: %lu data executed, %lu hangs, %lu unsupported IO, %lu unexpected turn offs\n",
+           gs_find_nr[FIND_CRASH], gs_find_nr[FIND_HANG], gs_find_nr[FIND_UNSUPPORTED], gs_find_nr[FIND_EXIT]);
+    for(i = 0; i < FIND_NR; i++) {
+        found += gs_find_nr[i];
+        for(j = 0; j < (int)gs_find_nr[i] && j < MAX_REPORTED; j++) {
+            printf("%s %d after %lu cycles, input ", gs_find_name[i], gs_find[i][j].addr, gs_find[i][j].cycles);
+            print_escaped(stdout, gs_find[i][j].input, gs_find[i][j].len);
+            printf("\n");
+        }
+        if(gs_find_nr[i] > MAX_REPORTED) printf("... and %lu more\n", gs_find_nr[i] - MAX_REPORTED);
+    }
+
+    return found ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,433 @@
+#include "multi.h"
+#include "peri.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include "config_impl.h"
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#endif
+
+struct multi_msg {
+    unsigned char src;
+    unsigned char len;
+    unsigned char data[MULTI_MSG_LEN];
+};
+
+/* Bounded lock-free queue. Every cell carries a sequence number telling
+ * whether it is free for the producer at a position or filled for the
+ * consumer, so producers only need one compare-and-swap on the tail. */
+struct multi_cell {
+    unsigned long seq;
+    struct multi_msg msg;
+};
+
+struct multi_queue {
+    struct multi_cell cell[MULTI_QUEUE_SIZE];
+    unsigned long head;
+    unsigned long tail;
+};
+
+struct multi_cpu {
+    computer comp; /* Must be first, the devices only get a pointer to it */
+    multi_system *sys;
+    int id;
+    struct multi_msg out;
+    int last_send_ok;
+    struct multi_msg in;
+    int in_pos;
+    unsigned char semaphore;
+    unsigned char shared_addr;
+    struct multi_queue inbox;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+#endif
+};
+
+struct multi_system {
+    int cpu_nr;
+    int stop;
+    struct multi_cpu *cpu;
+    computer_devices dev; /* Shared by all CPUs */
+    /* The devices as multi_create() left them, the ones of this file keep
+     * per-CPU state or use atomics. The others are wrapped to take io_lock
+     * when the CPUs run in parallel. */
+    computer_devices own;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t io_lock;
+    void (*locked_output[COMPUTER_ADDR_SIZE])(computer *, unsigned char);
+    void (*locked_input[COMPUTER_ADDR_SIZE])(computer *, unsigned char *);
+#endif
+    unsigned long semaphore[MULTI_SEMAPHORE_NR];
+    unsigned char *shared;
+    unsigned long instructions; /* Run by all CPUs since CPU 0 last published */
+};
+
+static struct multi_cpu *get_cpu(computer *comp)
+{
+    return (struct multi_cpu *)comp;
+}
+
+static void queue_init(struct multi_queue *q)
+{
+    unsigned long i;
+
+    for(i = 0; i < MULTI_QUEUE_SIZE; i++) {
+        q->cell[i].seq = i;
+    }
+    q->head = q->tail = 0;
+}
+
+static int queue_push(struct multi_queue *q, struct multi_msg const *msg)
+{
+    unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct multi_cell *cell;
+
+    while(1) {
+        long dif;
+
+        cell = &q->cell[pos & (MULTI_QUEUE_SIZE - 1)];
+        dif = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)pos;
+        if(dif == 0) {
+            if(__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if(dif < 0) {
+            return 0; /* Full */
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->msg = *msg;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/* Only the owning CPU takes messages, so the head needs no compare-and-swap */
+static int queue_pop(struct multi_queue *q, struct multi_msg *msg)
+{
+    unsigned long pos = q->head;
+    struct multi_cell *cell = &q->cell[pos & (MULTI_QUEUE_SIZE - 1)];
+
+    if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+        return 0; /* Empty */
+    }
+    *msg = cell->msg;
+    q->head = pos + 1;
+    __atomic_store_n(&cell->seq, pos + MULTI_QUEUE_SIZE, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static void cpu_id_input(computer *comp, unsigned char *c)
+{
+    *c = (unsigned char)get_cpu(comp)->id;
+}
+
+static void cpu_nr_input(computer *comp, unsigned char *c)
+{
+    *c = (unsigned char)get_cpu(comp)->sys->cpu_nr;
+}
+
+static void mailbox_data_output(computer *comp, unsigned char c)
+{
+    struct multi_cpu *cpu = get_cpu(comp);
+
+    if(cpu->out.len < MULTI_MSG_LEN) {
+        cpu->out.data[cpu->out.len++] = c;
+    }
+}
+
+static void mailbox_data_input(computer *comp, unsigned char *c)
+{
+    struct multi_cpu *cpu = get_cpu(comp);
+
+    *c = cpu->in_pos < cpu->in.len ? cpu->in.data[cpu->in_pos++] : 0;
+}
+
+static void mailbox_send_output(computer *comp, unsigned char c)
+{
+    struct multi_cpu *cpu = get_cpu(comp);
+
+    cpu->last_send_ok = 0;
+    if(c >= cpu->sys->cpu_nr) return;
+    cpu->out.src = (unsigned char)cpu->id;
+    if(queue_push(&cpu->sys->cpu[c].inbox, &cpu->out)) {
+        cpu->last_send_ok = 1;
+        cpu->out.len = 0;
+    }
+}
+
+static void mailbox_send_input(computer *comp, unsigned char *c)
+{
+    *c = (unsigned char)get_cpu(comp)->last_send_ok;
+}
+
+static void mailbox_recv_input(computer *comp, unsigned char *c)
+{
+    struct multi_cpu *cpu = get_cpu(comp);
+
+    if(queue_pop(&cpu->inbox, &cpu->in)) {
+        cpu->in_pos = 0;
+        *c = (unsigned char)(cpu->in.src + 1);
+    } else {
+        *c = 0;
+    }
+}
+
+static void semaphore_select_output(computer *comp, unsigned char c)
+{
+    get_cpu(comp)->semaphore = c;
+}
+
+static void semaphore_output(computer *comp, unsigned char c)
+{
+    struct multi_cpu *cpu = get_cpu(comp);
+
+    __atomic_add_fetch(&cpu->sys->semaphore[cpu->semaphore], 1, __ATOMIC_ACQ_REL);
+}
+
+static void semaphore_input(computer *comp, unsigned char *c)
+{
+    struct multi_cpu *cpu = get_cpu(comp);
+    unsigned long *sem = &cpu->sys->semaphore[cpu->semaphore];
+    unsigned long val = __atomic_load_n(sem, __ATOMIC_ACQUIRE);
+
+    *c = 0;
+    while(val > 0) {
+        if(__atomic_compare_exchange_n(sem, &val, val - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *c = 1;
+            break;
+        }
+    }
+}
+
+static void shared_addr_output(computer *comp, unsigned char c)
+{
+    get_cpu(comp)->shared_addr = c;
+}
+
+static void shared_data_output(computer *comp, unsigned char c)
+{
+    struct multi_cpu *cpu = get_cpu(comp);
+
+    if(cpu->sys->shared) {
+        __atomic_store_n(&cpu->sys->shared[cpu->shared_addr], c, __ATOMIC_RELEASE);
+    }
+    cpu->shared_addr++;
+}
+
+static void shared_data_input(computer *comp, unsigned char *c)
+{
+    struct multi_cpu *cpu = get_cpu(comp);
+
+    *c = cpu->sys->shared ? __atomic_load_n(&cpu->sys->shared[cpu->shared_addr], __ATOMIC_ACQUIRE) : 0;
+    cpu->shared_addr++;
+}
+
+multi_system *multi_create(int cpu_nr, int shared_ram)
+{
+    multi_system *sys;
+    int i;
+
+    if(cpu_nr < 1 || cpu_nr > MULTI_MAX_CPUS) return NULL;
+    if((sys = calloc(1, sizeof(*sys))) == NULL) return NULL;
+    if(posix_memalign((void **)&sys->cpu, COMPUTER_CACHE_LINE, (size_t)cpu_nr * sizeof(*sys->cpu))) {
+        free(sys);
+        return NULL;
+    }
+    memset(sys->cpu, 0, (size_t)cpu_nr * sizeof(*sys->cpu));
+    if(shared_ram && (sys->shared = calloc(MULTI_SHARED_SIZE, 1)) == NULL) {
+        free(sys->cpu);
+        free(sys);
+        return NULL;
+    }
+    sys->cpu_nr = cpu_nr;
+
+    computer_devices_init(&sys->dev);
+    sys->dev.input[PERI_ADDR_CPU_ID] = cpu_id_input;
+    sys->dev.input[PERI_ADDR_CPU_NR] = cpu_nr_input;
+    sys->dev.output[PERI_ADDR_MAILBOX_DATA] = mailbox_data_output;
+    sys->dev.input[PERI_ADDR_MAILBOX_DATA] = mailbox_data_input;
+    sys->dev.output[PERI_ADDR_MAILBOX_SEND] = mailbox_send_output;
+    sys->dev.input[PERI_ADDR_MAILBOX_SEND] = mailbox_send_input;
+    sys->dev.input[PERI_ADDR_MAILBOX_RECV] = mailbox_recv_input;
+    sys->dev.output[PERI_ADDR_SEMAPHORE_SELECT] = semaphore_select_output;
+    sys->dev.output[PERI_ADDR_SEMAPHORE] = semaphore_output;
+    sys->dev.input[PERI_ADDR_SEMAPHORE] = semaphore_input;
+    sys->dev.output[PERI_ADDR_SHARED_ADDR] = shared_addr_output;
+    sys->dev.output[PERI_ADDR_SHARED_DATA] = shared_data_output;
+    sys->dev.input[PERI_ADDR_SHARED_DATA] = shared_data_input;
+    sys->own = sys->dev;
+
+    for(i = 0; i < cpu_nr; i++) {
+        struct multi_cpu *cpu = &sys->cpu[i];
+        computer *comp = &cpu->comp;
+
+        computer_reset(comp);
+        comp->dev = &sys->dev;
+        cpu->sys = sys;
+        cpu->id = i;
+        queue_init(&cpu->inbox);
+    }
+
+    return sys;
+}
+
+void multi_destroy(multi_system *sys)
+{
+    if(sys == NULL) return;
+    free(sys->shared);
+    free(sys->cpu);
+    free(sys);
+}
+
+int multi_get_cpu_nr(multi_system *sys)
+{
+    return sys->cpu_nr;
+}
+
+computer *multi_get_cpu(multi_system *sys, int id)
+{
+    return &sys->cpu[id].comp;
+}
+
+computer_devices *multi_get_devices(multi_system *sys)
+{
+    return &sys->dev;
+}
+
+void multi_load(multi_system *sys, unsigned char const *image, int size)
+{
+    int i;
+
+    if(size > COMPUTER_RAM_SIZE) size = COMPUTER_RAM_SIZE;
+    for(i = 0; i < sys->cpu_nr; i++) {
+        memcpy(sys->cpu[i].comp.ram, image, (size_t)size);
+    }
+}
+
+void multi_stop(multi_system *sys)
+{
+    __atomic_store_n(&sys->stop, 1, __ATOMIC_RELEASE);
+}
+
+static int is_stopped(multi_system *sys)
+{
+    return __atomic_load_n(&sys->stop, __ATOMIC_ACQUIRE);
+}
+
+void multi_run_deterministic(multi_system *sys, unsigned long quantum)
+{
+    unsigned long until = 0;
+
+    if(quantum == 0) quantum = 1;
+    while(computer_is_running(&sys->cpu[0].comp) && !is_stopped(sys)) {
+        int i;
+
+        until += quantum;
+        for(i = 0; i < sys->cpu_nr; i++) {
+            sys->instructions += computer_run_fast(&sys->cpu[i].comp, until);
+        }
+        stats_publish(&sys->cpu[0].comp, sys->instructions);
+        sys->instructions = 0;
+    }
+}
+
+#ifdef HAVE_PTHREAD
+static void run_cpu(struct multi_cpu *cpu)
+{
+    computer *comp = &cpu->comp;
+
+    while(computer_is_running(comp) && !is_stopped(cpu->sys)) {
+        unsigned long instructions = computer_run_fast(comp, comp->clock_cycle + MULTI_CHUNK_CYCLES);
+
+        /* Only the thread of CPU 0 publishes, with the sum of all CPUs */
+        __atomic_fetch_add(&cpu->sys->instructions, instructions, __ATOMIC_RELAXED);
+        if(cpu->id == 0) {
+            stats_publish(comp, __atomic_exchange_n(&cpu->sys->instructions, 0, __ATOMIC_RELAXED));
+        }
+    }
+}
+
+static void locked_output(computer *comp, unsigned char c)
+{
+    multi_system *sys = get_cpu(comp)->sys;
+
+    pthread_mutex_lock(&sys->io_lock);
+    sys->locked_output[comp->io_addr](comp, c);
+    pthread_mutex_unlock(&sys->io_lock);
+}
+
+static void locked_input(computer *comp, unsigned char *c)
+{
+    multi_system *sys = get_cpu(comp)->sys;
+
+    pthread_mutex_lock(&sys->io_lock);
+    sys->locked_input[comp->io_addr](comp, c);
+    pthread_mutex_unlock(&sys->io_lock);
+}
+
+/* The printers, keyboard, extended RAM, math coprocessor, timer and disk keep
+ * their state in statics, so only one CPU may be in them at a time */
+static void lock_devices(multi_system *sys)
+{
+    int i;
+
+    for(i = 0; i < COMPUTER_ADDR_SIZE; i++) {
+        if(sys->dev.output[i] != sys->own.output[i]) {
+            sys->locked_output[i] = sys->dev.output[i];
+            sys->dev.output[i] = locked_output;
+        }
+        if(sys->dev.input[i] != sys->own.input[i]) {
+            sys->locked_input[i] = sys->dev.input[i];
+            sys->dev.input[i] = locked_input;
+        }
+    }
+}
+
+static void unlock_devices(multi_system *sys)
+{
+    int i;
+
+    for(i = 0; i < COMPUTER_ADDR_SIZE; i++) {
+        if(sys->dev.output[i] == locked_output) sys->dev.output[i] = sys->locked_output[i];
+        if(sys->dev.input[i] == locked_input) sys->dev.input[i] = sys->locked_input[i];
+    }
+}
+
+static void *cpu_thread(void *arg)
+{
+    run_cpu(arg);
+    return NULL;
+}
+#endif
+
+int multi_run_parallel(multi_system *sys)
+{
+#ifdef HAVE_PTHREAD
+    int i, started;
+
+    if(pthread_mutex_init(&sys->io_lock, NULL)) return -1;
+    lock_devices(sys);
+    for(started = 1; started < sys->cpu_nr; started++) {
+        if(pthread_create(&sys->cpu[started].thread, NULL, cpu_thread, &sys->cpu[started])) {
+            break;
+        }
+    }
+    if(started == sys->cpu_nr) {
+        run_cpu(&sys->cpu[0]);
+    }
+    multi_stop(sys);
+    for(i = 1; i < started; i++) {
+        pthread_join(sys->cpu[i].thread, NULL);
+    }
+    unlock_devices(sys);
+    pthread_mutex_destroy(&sys->io_lock);
+
+    return started == sys->cpu_nr ? 0 : -1;
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,60 @@
+#ifndef MULTI_H_
+#define MULTI_H_
+
+#include "computer.h"
+
+/* A system of several computers running the same image, connected by
+ * mailboxes, semaphores and an optional shared RAM window.
+ *
+ * CPU_ID:           input, id of the reading CPU (0 is the master)
+ * CPU_NR:           input, number of CPUs
+ * MAILBOX_DATA:     output appends a byte to the message being built
+ *                   (at most MULTI_MSG_LEN bytes), input reads the next
+ *                   byte of the last received message
+ * MAILBOX_SEND:     output sends the message to the given CPU; input is 1
+ *                   if the last send succeeded and 0 if the receiving
+ *                   mailbox was full, in which case the message is kept
+ * MAILBOX_RECV:     input takes the next message from the own mailbox and
+ *                   gives the sending CPU id + 1, or 0 if it is empty
+ * SEMAPHORE_SELECT: output selects one of MULTI_SEMAPHORE_NR semaphores
+ * SEMAPHORE:        output increments the selected semaphore, input tries
+ *                   to decrement it and gives 1 on success, 0 otherwise
+ * SHARED_ADDR:      output sets the position in the shared RAM window
+ * SHARED_DATA:      reads or writes the shared RAM at the position, which
+ *                   is then incremented. Reads give 0 if it is disabled.
+ *
+ * All other peripherals are shared by the CPUs, so the multi-byte printers,
+ * the extended RAM and the math coprocessor should only be used by one CPU
+ * at a time. In parallel mode every IO operation on them holds one lock, so
+ * their state stays consistent, but the bytes of different CPUs may still
+ * interleave. The system runs until CPU 0 turns off. */
+
+#define MULTI_MAX_CPUS 64
+#define MULTI_MSG_LEN 8
+#define MULTI_QUEUE_SIZE 256 /* Messages per mailbox, power of two */
+#define MULTI_SEMAPHORE_NR 256
+#define MULTI_SHARED_SIZE 256
+/* Cycles each CPU runs between checks for stop in parallel mode */
+#define MULTI_CHUNK_CYCLES 65536
+
+typedef struct multi_system multi_system;
+
+/* Returns NULL if cpu_nr is out of range */
+multi_system *multi_create(int cpu_nr, int shared_ram);
+void multi_destroy(multi_system *sys);
+int multi_get_cpu_nr(multi_system *sys);
+computer *multi_get_cpu(multi_system *sys, int id);
+/* The devices of all CPUs, more can be connected before they run */
+computer_devices *multi_get_devices(multi_system *sys);
+/* Load the same image into all CPUs */
+void multi_load(multi_system *sys, unsigned char const *image, int size);
+/* Run all CPUs on one host thread, in turn for quantum cycles each.
+ * The result does not depend on host timing. */
+void multi_run_deterministic(multi_system *sys, unsigned long quantum);
+/* Run every CPU on its own host thread. Returns -1 if threads are not
+ * available. */
+int multi_run_parallel(multi_system *sys);
+/* Ask a running system to stop (safe from signal handlers) */
+void multi_stop(multi_system *sys);
+
+#endif
@@ -0,0 +1,152 @@
+#include "perf.h"
+#include "peri.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct perf_region {
+    int open;
+    unsigned long start_cycle, start_instr, start_us;
+    unsigned long runs;
+    unsigned long cycles, instructions, us;
+    unsigned long min_cycles, max_cycles;
+    char const *name;
+};
+
+static unsigned long gs_instructions = 0;
+static unsigned long gs_class[PERF_CLASS_NR];
+static double gs_start = 0;
+static unsigned char gs_latch[8];
+static int gs_latch_pos = 0;
+static struct perf_region gs_region[PERF_REGION_NR];
+
+static double time_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static unsigned long host_us(void)
+{
+    return (unsigned long)((time_now() - gs_start) * 1e6);
+}
+
+static unsigned long counter(computer const *comp, int id)
+{
+    if(id == PERF_COUNTER_CYCLES) return comp->clock_cycle;
+    if(id == PERF_COUNTER_INSTRUCTIONS) return gs_instructions;
+    if(id == PERF_COUNTER_HOST_US) return host_us();
+    if(id >= PERF_COUNTER_CLASS && id < PERF_COUNTER_CLASS + PERF_CLASS_NR) return gs_class[id - PERF_COUNTER_CLASS];
+    return 0;
+}
+
+static void select_output(computer *comp, unsigned char c)
+{
+    unsigned long val = counter(comp, c);
+    int i;
+
+    for(i = 0; i < (int)sizeof(gs_latch); i++) {
+        gs_latch[i] = (unsigned char)(val & 255);
+        val >>= 8;
+    }
+    gs_latch_pos = 0;
+}
+
+static void data_input(computer *comp, unsigned char *c)
+{
+    *c = gs_latch_pos < (int)sizeof(gs_latch) ? gs_latch[gs_latch_pos++] : 0;
+}
+
+static void region_start_output(computer *comp, unsigned char c)
+{
+    struct perf_region *r = &gs_region[c];
+
+    r->open = 1;
+    r->start_cycle = comp->clock_cycle;
+    r->start_instr = gs_instructions;
+    r->start_us = host_us();
+}
+
+static void region_stop_output(computer *comp, unsigned char c)
+{
+    struct perf_region *r = &gs_region[c];
+    unsigned long cycles;
+
+    if(!r->open) return;
+    r->open = 0;
+    cycles = comp->clock_cycle - r->start_cycle;
+    if(r->runs == 0 || cycles < r->min_cycles) r->min_cycles = cycles;
+    if(cycles > r->max_cycles) r->max_cycles = cycles;
+    r->runs++;
+    r->cycles += cycles;
+    r->instructions += gs_instructions - r->start_instr;
+    r->us += host_us() - r->start_us;
+}
+
+void perf_init(void)
+{
+    gs_start = time_now();
+}
+
+void perf_attach(computer_devices *dev)
+{
+    dev->output[PERI_ADDR_PERF_SELECT] = select_output;
+    dev->input[PERI_ADDR_PERF_DATA] = data_input;
+    dev->output[PERI_ADDR_PERF_REGION_START] = region_start_output;
+    dev->output[PERI_ADDR_PERF_REGION_STOP] = region_stop_output;
+}
+
+void perf_count(computer const *comp)
+{
+    unsigned char op = comp->ram[comp->iar];
+
+    gs_instructions++;
+    gs_class[op & 0x80 ? PERF_CLASS_ALU : op >> 4]++;
+}
+
+int perf_set_region_names(char *arg)
+{
+    char *tok;
+
+    for(tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        char *end;
+        long id;
+
+        if(eq == NULL) return -1;
+        *eq = '\0';
+        id = strtol(tok, &end, 0);
+        if(*end != '\0' || id < 0 || id >= PERF_REGION_NR) return -1;
+        gs_region[id].name = eq + 1;
+    }
+    return 0;
+}
+
+void perf_print_report(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "--- Performance regions ---\n");
+    fprintf(fp, "%-16s %10s %20s %20s %14s %14s %14s %14s\n", "region", "runs", "cycles", "instructions",
+            "avg cycles", "min cycles", "max cycles", "host us");
+    for(i = 0; i < PERF_REGION_NR; i++) {
+        struct perf_region const *r = &gs_region[i];
+        char name[32];
+
+        if(r->runs == 0) continue;
+        if(r->name) {
+            snprintf(name, sizeof(name), "%s", r->name);
+        } else {
+            snprintf(name, sizeof(name), "region %d", i);
+        }
+        fprintf(fp, "%-16s %10lu %20lu %20lu %14lu %14lu %14lu %14lu\n", name, r->runs, r->cycles, r->instructions,
+                r->cycles / r->runs, r->min_cycles, r->max_cycles, r->us);
+    }
+    fprintf(fp, "%-16s", "instructions");
+    for(i = 0; i < PERF_CLASS_NR; i++) {
+        fprintf(fp, " %s %lu", i == PERF_CLASS_ALU ? "ALU" : computer_instr_name[i], gs_class[i]);
+    }
+    fprintf(fp, "\n");
+}
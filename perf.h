@@ -0,0 +1,42 @@
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <stdio.h>
+#include "computer.h"
+
+/* Performance counters the program can read about itself, and regions it
+ * can time. The run loop calls perf_count() before every instruction, so
+ * the counters are exact when they are read.
+ *
+ * PERF_SELECT:       output, latches the counter (PERF_COUNTER_*) and
+ *                    starts reading it from the low byte
+ * PERF_DATA:         input, the next byte of the latched counter (8 bytes,
+ *                    low first, 0 after that)
+ * PERF_REGION_START: output, region number; starts timing the region
+ * PERF_REGION_STOP:  output, region number; adds the time since its start
+ *
+ * Regions are independent of each other, so they may nest or overlap.
+ * perf_print_report() prints the number of runs and the cycles,
+ * instructions and host time spent in each region. */
+
+#define PERF_COUNTER_CYCLES 0 /* clock_cycle */
+#define PERF_COUNTER_INSTRUCTIONS 1 /* Instructions started, this one included */
+#define PERF_COUNTER_HOST_US 2 /* Host microseconds since perf_init() */
+/* Instructions per class: PERF_COUNTER_CLASS + COMPUTER_INSTR_* or
+ * PERF_CLASS_ALU */
+#define PERF_COUNTER_CLASS 16
+#define PERF_CLASS_ALU COMPUTER_INSTR_NR
+#define PERF_CLASS_NR (COMPUTER_INSTR_NR + 1)
+
+#define PERF_REGION_NR 256
+
+void perf_init(void);
+/* Connect the counter devices to dev */
+void perf_attach(computer_devices *dev);
+/* Count the instruction at comp->iar, call before running it */
+void perf_count(computer const *comp);
+/* Name a region in the report, "ID=NAME[,..]". Returns -1 on a bad id. */
+int perf_set_region_names(char *arg);
+void perf_print_report(FILE *fp);
+
+#endif
@@ -3,7 +3,13 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <errno.h>
 #include "config_impl.h"
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#endif
 #ifdef HAVE_NCURSES
 #   include <ncurses.h>
 #else
@@ -12,12 +18,38 @@
 #   define ERR 0
 #endif
 
-static int gs_input_mode = PERI_INPUT_MODE_RAW;
-static char gs_input_line_buf[BUFSIZ];
-static char *gs_input_line_buf_pos = gs_input_line_buf;
-static unsigned char gs_input_buf[BUFSIZ];
-static unsigned char *gs_input_buf_head = gs_input_buf;
-static unsigned char *gs_input_buf_tail = gs_input_buf;
+static struct peri_keyboard gs_keyboard = { PERI_INPUT_MODE_RAW, NULL, { 0 }, 0, { 0 }, 0, 0 };
+static unsigned long gs_keyboard_read_count = 0;
+
+static unsigned char *gs_xram = NULL;
+static unsigned long gs_xram_size = PERI_XRAM_DEFAULT_SIZE;
+static unsigned long gs_xram_pos = 0;
+static unsigned long gs_xram_dma_cycles = 1;
+
+static unsigned long gs_timer_mark = 0;
+static double gs_timer_frequency = 0;
+
+static unsigned long gs_math_a = 0;
+static unsigned long gs_math_a_len = 0;
+static unsigned long gs_math_b = 0;
+static unsigned long gs_math_b_len = 0;
+static unsigned char gs_math_result[8];
+static unsigned long gs_math_result_len = 0;
+static unsigned long gs_math_result_pos = 0;
+static unsigned long gs_math_cycles[PERI_MATH_OP_NR] = { 7, 7, 7, 7, 7 };
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t gs_screen_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Idle poll detection, see idle_wait() */
+static int gs_idle_wait = 0;
+static double gs_idle_frequency = 0;
+static int gs_idle_valid = 0;
+static computer gs_idle_last; /* Only the registers and counters are used */
+
+char const *peri_math_op_name[PERI_MATH_OP_NR] = {
+    "add", "sub", "mul", "divmod", "cmp" };
 
 int my_getch()
 {
@@ -53,10 +85,51 @@ int my_getch()
 #endif
 }
 
-static int parse_number(char *s)
+void peri_screen_lock(void)
 {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&gs_screen_mutex);
+#endif
+}
+
+void peri_screen_unlock(void)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&gs_screen_mutex);
+#endif
+}
+
+/* All printer output goes through here, so that it does not mix with the
+ * framebuffer render thread (see fb.c) */
+static void screen_print(char const *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void screen_print(char const *fmt, ...)
+{
+    va_list ap;
+
+    peri_screen_lock();
+    va_start(ap, fmt);
+#ifdef HAVE_NCURSES
+    vw_printw(stdscr, fmt, ap);
+    refresh();
+#else
+    vprintf(fmt, ap);
+    fflush(stdout);
+#endif
+    va_end(ap);
+    peri_screen_unlock();
+}
+
+void peri_add_cycles(computer *comp, unsigned long cycles)
+{
+    comp->clock_cycle += (cycles + COMPUTER_INSTR_LEN - 1) / COMPUTER_INSTR_LEN * COMPUTER_INSTR_LEN;
+}
+
+int peri_parse_number(char const *s)
+{
+    long value;
+
     if(strlen(s) == 3 && s[0] == '\'' && s[2] == '\'') {
-        return s[1];
+        return (unsigned char)s[1];
     }
 
     /* Check if number is in binary */
@@ -79,7 +152,58 @@ static int parse_number(char *s)
         }
     }
 
-    return (int)strtol(s, NULL, 0);
+    value = strtol(s, NULL, 0);
+    return value < 0 || value > 255 ? -1 : (int)value;
+}
+
+void peri_keyboard_init(struct peri_keyboard *kb, int input_mode, void (*echo)(computer *, unsigned char))
+{
+    kb->input_mode = input_mode;
+    kb->echo = echo;
+    kb->line_len = 0;
+    kb->head = kb->tail = 0;
+}
+
+static void keyboard_push(struct peri_keyboard *kb, unsigned char c)
+{
+    kb->buf[kb->head] = c;
+    kb->head = (kb->head + 1) % sizeof(kb->buf);
+}
+
+void peri_keyboard_type(struct peri_keyboard *kb, computer *comp, unsigned char c)
+{
+    if (kb->input_mode == PERI_INPUT_MODE_RAW) {
+        keyboard_push(kb, c);
+    } else if (kb->input_mode == PERI_INPUT_MODE_NUMBER) {
+        if (c == '\n') {
+            kb->line[kb->line_len] = '\0';
+            int number = peri_parse_number(kb->line);
+            if (number >= 0 && number <= 0xff) {
+                keyboard_push(kb, (unsigned char)number);
+            } else if(kb->echo) {
+                kb->echo(comp, (unsigned char)'E');
+            }
+            kb->line_len = 0;
+        } else if(kb->line_len < sizeof(kb->line) - 1) {
+            kb->line[kb->line_len++] = (char)c;
+        }
+        if(kb->echo) kb->echo(comp, c);
+    }
+}
+
+int peri_keyboard_take(struct peri_keyboard *kb)
+{
+    unsigned char c;
+
+    if(kb->head == kb->tail) return -1;
+    c = kb->buf[kb->tail];
+    kb->tail = (kb->tail + 1) % sizeof(kb->buf);
+    return c;
+}
+
+int peri_keyboard_is_empty(struct peri_keyboard const *kb)
+{
+    return kb->head == kb->tail;
 }
 
 static void get_keyboard_input(computer *comp)
@@ -87,77 +211,165 @@ static void get_keyboard_input(computer *comp)
     int c;
 
     while ((c = my_getch()) != ERR) {
-        if (gs_input_mode == PERI_INPUT_MODE_RAW) {
-            *gs_input_buf_head = (unsigned char)c;
-            gs_input_buf_head = gs_input_buf + ((size_t)gs_input_buf_head + 1) % sizeof(gs_input_buf);
-        } else if (gs_input_mode == PERI_INPUT_MODE_NUMBER) {
-            if (c == '\n') {
-                *gs_input_line_buf_pos = '\0';
-                int number = parse_number(gs_input_line_buf);
-                if (number >= 0 && number <= 0xff) {
-                    *gs_input_buf_head = (unsigned char)number;
-                    gs_input_buf_head = gs_input_buf + ((size_t)gs_input_buf_head + 1) % sizeof(gs_input_buf);
-                } else {
-                    peri_ascii_printer_output(comp, (unsigned char)'E');
-                }
-                gs_input_line_buf_pos = gs_input_line_buf;
-            } else {
-                *gs_input_line_buf_pos++ = (char)c;
-            }
-            peri_ascii_printer_output(comp, (unsigned char)c);
-        }
+        peri_keyboard_type(&gs_keyboard, comp, (unsigned char)c);
     }
 }
 
+static int same_state(computer const *a, computer const *b)
+{
+    return a->iar == b->iar && a->flags == b->flags && a->io_addr == b->io_addr &&
+           a->ir == b->ir && a->mar == b->mar && a->tmp == b->tmp && a->acc == b->acc &&
+           a->ram_writes == b->ram_writes && memcmp(a->reg, b->reg, sizeof(a->reg)) == 0;
+}
+
+#ifdef HAVE_TIMING
+static double idle_time_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+#endif
+
+/* Wait until pfd is readable. A terminal is only put into non-canonical
+ * mode by my_getch() for each read (and by the simulator without -B), so
+ * it is switched here too, otherwise a key without Enter would not wake
+ * the poll and would be echoed. */
+static int poll_input(struct pollfd *pfd)
+{
+    int ret;
+#ifndef HAVE_NCURSES
+    struct termios old, tmp;
+    int is_tty = isatty(pfd->fd) && tcgetattr(pfd->fd, &old) == 0;
+
+    if(is_tty) {
+        tmp = old;
+        tmp.c_lflag &= (tcflag_t)~(ICANON | ECHO);
+        tmp.c_cc[VMIN] = 0;
+        tmp.c_cc[VTIME] = 0;
+        tcsetattr(pfd->fd, TCSANOW, &tmp);
+    }
+#endif
+    ret = poll(pfd, 1, -1);
+#ifndef HAVE_NCURSES
+    if(is_tty) tcsetattr(pfd->fd, TCSADRAIN, &old);
+#endif
+    return ret;
+}
+
+/* Called when a keyboard poll found no input. If the computer is in the
+ * same state as at the previous empty poll, this poll is the only IO since
+ * then and no ST ran in between (so the RAM is unchanged without comparing
+ * it), it is in a loop that can not change until input arrives.
+ * The host then sleeps until fd is readable, and the clock is advanced by
+ * the whole loop iterations that would have run in the meantime (only with
+ * a frequency, in fast mode no time passes). Returns 1 after sleeping. */
+static int idle_wait(computer *comp, int fd)
+{
+    struct pollfd pfd;
+    unsigned long period;
+#ifdef HAVE_TIMING
+    double start;
+#endif
+
+    if(!gs_idle_wait) return 0;
+    if(!gs_idle_valid || comp->io_count != gs_idle_last.io_count + 1 || !same_state(comp, &gs_idle_last)) {
+        gs_idle_last.iar = comp->iar;
+        gs_idle_last.flags = comp->flags;
+        gs_idle_last.io_addr = comp->io_addr;
+        gs_idle_last.ir = comp->ir;
+        gs_idle_last.mar = comp->mar;
+        gs_idle_last.tmp = comp->tmp;
+        gs_idle_last.acc = comp->acc;
+        memcpy(gs_idle_last.reg, comp->reg, sizeof(comp->reg));
+        gs_idle_last.ram_writes = comp->ram_writes;
+        gs_idle_last.io_count = comp->io_count;
+        gs_idle_last.clock_cycle = comp->clock_cycle;
+        gs_idle_valid = 1;
+        return 0;
+    }
+    period = comp->clock_cycle - gs_idle_last.clock_cycle;
+    gs_idle_valid = 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+#ifdef HAVE_TIMING
+    start = idle_time_now();
+#endif
+    if(poll_input(&pfd) < 0) return 0; /* Interrupted by a signal */
+#ifdef HAVE_TIMING
+    if(gs_idle_frequency > 0 && period > 0) {
+        unsigned long cycles = (unsigned long)((idle_time_now() - start) * gs_idle_frequency);
+        comp->clock_cycle += cycles / period * period;
+    }
+#else
+    (void)period;
+#endif
+    return 1;
+}
+
+int peri_idle_wait(computer *comp, int fd)
+{
+    return idle_wait(comp, fd);
+}
+
+void peri_set_idle_wait(int enable, double frequency)
+{
+    gs_idle_wait = enable;
+    gs_idle_frequency = frequency;
+    gs_idle_valid = 0;
+}
+
+int peri_output_writes_ram(unsigned char addr)
+{
+    return addr == PERI_ADDR_XRAM_DMA || addr == PERI_ADDR_DISK_DMA;
+}
 
 void peri_keyboard_buffered_input(computer *comp, unsigned char *key)
 {
+    int c;
+
     get_keyboard_input(comp);
-    if (gs_input_buf_head == gs_input_buf_tail) {
+    if(peri_keyboard_is_empty(&gs_keyboard) && idle_wait(comp, 0)) {
+        get_keyboard_input(comp);
+    }
+    if ((c = peri_keyboard_take(&gs_keyboard)) < 0) {
         *key = 0;
     } else {
-        *key = *gs_input_buf_tail;
-        gs_input_buf_tail = gs_input_buf + ((size_t)gs_input_buf_tail + 1) % sizeof(gs_input_buf);
+        *key = (unsigned char)c;
+        gs_keyboard_read_count++;
     }
 }
 
+unsigned long peri_keyboard_read_count(void)
+{
+    return gs_keyboard_read_count;
+}
+
 void peri_keyboard_has_input(computer *comp, unsigned char *has_input)
 {
     get_keyboard_input(comp);
-    *has_input = gs_input_buf_head != gs_input_buf_tail;
+    if(peri_keyboard_is_empty(&gs_keyboard) && idle_wait(comp, 0)) {
+        get_keyboard_input(comp);
+    }
+    *has_input = !peri_keyboard_is_empty(&gs_keyboard);
 }
 
 void peri_ascii_printer_output(computer *comp, unsigned char c)
 {
-#ifdef HAVE_NCURSES
-    printw("%c", c);
-    refresh();
-#else
-    printf("%c", c);
-    fflush(stdout);
-#endif
+    screen_print("%c", c);
 }
 
 void peri_integer_printer_output(computer *comp, unsigned char i)
 {
-#ifdef HAVE_NCURSES
-    printw("%u", i);
-    refresh();
-#else
-    printf("%u", i);
-    fflush(stdout);
-#endif
+    screen_print("%u", i);
 }
 
 void peri_hex_printer_output(computer *comp, unsigned char i)
 {
-#ifdef HAVE_NCURSES
-    printw("%02x", i);
-    refresh();
-#else
-    printf("%02x", i);
-    fflush(stdout);
-#endif
+    screen_print("%02x", i);
 }
 
 void peri_integer16_printer_output(computer *comp, unsigned char i)
@@ -168,13 +380,7 @@ void peri_integer16_printer_output(computer *comp, unsigned char i)
     num += (unsigned long)i << (8*len);
     len++;
     if(len == 2) {
-#ifdef HAVE_NCURSES
-        printw("%ld", num);
-        refresh();
-#else
-        printf("%ld", num);
-        fflush(stdout);
-#endif
+        screen_print("%ld", num);
         len = 0;
         num = 0;
     }
@@ -188,13 +394,7 @@ void peri_integer24_printer_output(computer *comp, unsigned char i)
     num += (unsigned long)i << (8*len);
     len++;
     if(len == 3) {
-#ifdef HAVE_NCURSES
-        printw("%ld", num);
-        refresh();
-#else
-        printf("%ld", num);
-        fflush(stdout);
-#endif
+        screen_print("%ld", num);
         len = 0;
         num = 0;
     }
@@ -208,13 +408,7 @@ void peri_integer32_printer_output(computer *comp, unsigned char i)
     num += (unsigned long)i << (8*len);
     len++;
     if(len == 4) {
-#ifdef HAVE_NCURSES
-        printw("%ld", num);
-        refresh();
-#else
-        printf("%ld", num);
-        fflush(stdout);
-#endif
+        screen_print("%ld", num);
         len = 0;
         num = 0;
     }
@@ -239,5 +433,217 @@ void peri_random_input(computer *comp, unsigned char *rnd)
 
 void peri_keyboard_set_input_mode(int input_mode)
 {
-    gs_input_mode = input_mode;
+    peri_keyboard_init(&gs_keyboard, input_mode, peri_ascii_printer_output);
+}
+
+static unsigned char *xram_get(void)
+{
+    if(gs_xram == NULL) {
+        if((gs_xram = calloc(gs_xram_size, 1)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return gs_xram;
+}
+
+void peri_xram_bank_output(computer *comp, unsigned char c)
+{
+    static unsigned long len = 0;
+    static unsigned long num = 0;
+
+    num += (unsigned long)c << (8*len);
+    len++;
+    if(len == 2) {
+        gs_xram_pos = num * PERI_XRAM_PAGE_SIZE;
+        len = 0;
+        num = 0;
+    }
+}
+
+void peri_xram_addr_output(computer *comp, unsigned char c)
+{
+    gs_xram_pos = gs_xram_pos / PERI_XRAM_PAGE_SIZE * PERI_XRAM_PAGE_SIZE + c;
+}
+
+void peri_xram_data_output(computer *comp, unsigned char c)
+{
+    if(gs_xram_pos < gs_xram_size) {
+        xram_get()[gs_xram_pos] = c;
+    }
+    gs_xram_pos = (gs_xram_pos + 1) % PERI_XRAM_MAX_SIZE;
+}
+
+void peri_xram_data_input(computer *comp, unsigned char *c)
+{
+    *c = gs_xram_pos < gs_xram_size ? xram_get()[gs_xram_pos] : 0;
+    gs_xram_pos = (gs_xram_pos + 1) % PERI_XRAM_MAX_SIZE;
+}
+
+void peri_xram_dma_output(computer *comp, unsigned char c)
+{
+    static unsigned long len = 0;
+    /* RAM address (COMPUTER_IMM_LEN bytes, low first), length, direction */
+    static unsigned char arg[COMPUTER_IMM_LEN + 2];
+    unsigned long i, n, addr = 0;
+    unsigned char *xram;
+
+    arg[len++] = c;
+    if(len < sizeof(arg)) return;
+    len = 0;
+
+    for(i = 0; i < COMPUTER_IMM_LEN; i++) addr |= (unsigned long)arg[i] << (8*i);
+    n = arg[COMPUTER_IMM_LEN] ? arg[COMPUTER_IMM_LEN] : PERI_XRAM_PAGE_SIZE;
+    xram = xram_get();
+    for(i = 0; i < n; i++) {
+        unsigned char *r = &comp->ram[(addr + i) % COMPUTER_RAM_SIZE];
+        unsigned long x = (gs_xram_pos + i) % PERI_XRAM_MAX_SIZE;
+
+        if(arg[COMPUTER_IMM_LEN + 1] == PERI_XRAM_DMA_FROM_RAM) {
+            if(x < gs_xram_size) xram[x] = *r;
+        } else {
+            *r = x < gs_xram_size ? xram[x] : 0;
+        }
+    }
+    gs_xram_pos = (gs_xram_pos + n) % PERI_XRAM_MAX_SIZE;
+    peri_add_cycles(comp, n * gs_xram_dma_cycles);
+}
+
+void peri_xram_set_size(unsigned long size)
+{
+    if(size > PERI_XRAM_MAX_SIZE) size = PERI_XRAM_MAX_SIZE;
+    gs_xram_size = (size + PERI_XRAM_PAGE_SIZE - 1) / PERI_XRAM_PAGE_SIZE * PERI_XRAM_PAGE_SIZE;
+}
+
+void peri_xram_set_dma_cycles(unsigned long cycles_per_byte)
+{
+    gs_xram_dma_cycles = cycles_per_byte;
+}
+
+void peri_timer_sleep_output(computer *comp, unsigned char c)
+{
+    static unsigned long len = 0;
+    static unsigned long cycles = 0;
+
+    cycles |= (unsigned long)c << (8*len);
+    if(++len < 4) return;
+#ifdef HAVE_TIMING
+    if(gs_timer_frequency > 0) {
+        double seconds = (double)cycles / gs_timer_frequency;
+        struct timespec t;
+
+        t.tv_sec = (time_t)seconds;
+        t.tv_nsec = (long)((seconds - (double)t.tv_sec) * 1e9);
+        while(nanosleep(&t, &t) < 0) {
+            if(errno != EINTR) {
+                perror("nanosleep");
+                break;
+            }
+        }
+    }
+#endif
+    peri_add_cycles(comp, cycles);
+    len = 0;
+    cycles = 0;
+}
+
+void peri_timer_mark_output(computer *comp, unsigned char c)
+{
+    gs_timer_mark = comp->clock_cycle;
+}
+
+void peri_timer_elapsed_input(computer *comp, unsigned char *c)
+{
+    static unsigned long pos = 0;
+    static unsigned long elapsed = 0;
+
+    if(pos == 0) elapsed = comp->clock_cycle - gs_timer_mark;
+    *c = (unsigned char)(elapsed >> (8*pos));
+    pos = (pos + 1) % 4;
+}
+
+void peri_timer_set_frequency(double frequency)
+{
+    gs_timer_frequency = frequency;
+}
+
+void peri_math_a_output(computer *comp, unsigned char c)
+{
+    if(gs_math_a_len < 4) {
+        gs_math_a += (unsigned long)c << (8*gs_math_a_len);
+        gs_math_a_len++;
+    }
+}
+
+void peri_math_b_output(computer *comp, unsigned char c)
+{
+    if(gs_math_b_len < 4) {
+        gs_math_b += (unsigned long)c << (8*gs_math_b_len);
+        gs_math_b_len++;
+    }
+}
+
+static void math_result_add(unsigned long long value, unsigned long len)
+{
+    unsigned long i;
+
+    for(i = 0; i < len; i++) {
+        gs_math_result[gs_math_result_len++] = (unsigned char)(value >> (8*i));
+    }
+}
+
+void peri_math_op_output(computer *comp, unsigned char c)
+{
+    int op = c >> 4;
+    unsigned long width = c & 15;
+    unsigned long long mask, a, b;
+
+    if(width < 1) width = 1;
+    if(width > 4) width = 4;
+    mask = (1ULL << (8*width)) - 1;
+    a = gs_math_a & mask;
+    b = gs_math_b & mask;
+    gs_math_a = gs_math_b = 0;
+    gs_math_a_len = gs_math_b_len = 0;
+    gs_math_result_len = gs_math_result_pos = 0;
+
+    if(op == PERI_MATH_ADD) {
+        math_result_add(a + b, width);
+        math_result_add((a + b) >> (8*width), 1);
+    } else if(op == PERI_MATH_SUB) {
+        math_result_add(a - b, width);
+        math_result_add(a < b, 1);
+    } else if(op == PERI_MATH_MUL) {
+        math_result_add(a * b, 2*width);
+    } else if(op == PERI_MATH_DIVMOD) {
+        /* Division by zero gives an all ones quotient and remainder a */
+        math_result_add(b ? a / b : mask, width);
+        math_result_add(b ? a % b : a, width);
+    } else if(op == PERI_MATH_CMP) {
+        math_result_add(a == b ? 0 : (a < b ? 1 : 2), 1);
+    } else {
+        return;
+    }
+
+    if(op == PERI_MATH_MUL || op == PERI_MATH_DIVMOD) {
+        peri_add_cycles(comp, gs_math_cycles[op] * width * width);
+    } else {
+        peri_add_cycles(comp, gs_math_cycles[op] * width);
+    }
+}
+
+void peri_math_result_input(computer *comp, unsigned char *c)
+{
+    if(gs_math_result_pos < gs_math_result_len) {
+        *c = gs_math_result[gs_math_result_pos++];
+    } else {
+        *c = 0;
+    }
+}
+
+void peri_math_set_cycles(int op, unsigned long cycles)
+{
+    if(op >= 0 && op < PERI_MATH_OP_NR) {
+        gs_math_cycles[op] = cycles;
+    }
 }
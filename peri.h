@@ -1,6 +1,7 @@
 #ifndef PERI_H_
 #define PERI_H_
 
+#include <stdio.h>
 #include "computer.h"
 
 #define PERI_ADDR_KEYBOARD 1
@@ -13,13 +14,93 @@
 #define PERI_ADDR_INTEGER16_PRINTER 16
 #define PERI_ADDR_INTEGER24_PRINTER 24
 #define PERI_ADDR_INTEGER32_PRINTER 32
+#define PERI_ADDR_XRAM_BANK 40
+#define PERI_ADDR_XRAM_ADDR 41
+#define PERI_ADDR_XRAM_DATA 42
+#define PERI_ADDR_XRAM_DMA 43
+#define PERI_ADDR_TIMER_SLEEP 44
+#define PERI_ADDR_TIMER_MARK 45
+#define PERI_ADDR_TIMER_ELAPSED 46
+#define PERI_ADDR_MATH_A 48
+#define PERI_ADDR_MATH_B 49
+#define PERI_ADDR_MATH_OP 50
+#define PERI_ADDR_MATH_RESULT 51
+/* Multi CPU devices, see multi.h */
+#define PERI_ADDR_CPU_ID 56
+#define PERI_ADDR_CPU_NR 57
+#define PERI_ADDR_MAILBOX_DATA 58
+#define PERI_ADDR_MAILBOX_SEND 59
+#define PERI_ADDR_MAILBOX_RECV 60
+#define PERI_ADDR_SEMAPHORE_SELECT 61
+#define PERI_ADDR_SEMAPHORE 62
+#define PERI_ADDR_SHARED_ADDR 63
+#define PERI_ADDR_SHARED_DATA 64
+/* Framebuffer devices, see fb.h */
+#define PERI_ADDR_FB_X 72
+#define PERI_ADDR_FB_Y 73
+#define PERI_ADDR_FB_DATA 74
+#define PERI_ADDR_FB_FILL 75
+#define PERI_ADDR_FB_COLS 76
+#define PERI_ADDR_FB_ROWS 77
+/* Performance counters, see perf.h */
+#define PERI_ADDR_PERF_SELECT 80
+#define PERI_ADDR_PERF_DATA 81
+#define PERI_ADDR_PERF_REGION_START 82
+#define PERI_ADDR_PERF_REGION_STOP 83
+/* Block storage, see disk.h */
+#define PERI_ADDR_DISK_SECTOR 88
+#define PERI_ADDR_DISK_ADDR 89
+#define PERI_ADDR_DISK_DATA 90
+#define PERI_ADDR_DISK_DMA 91
+#define PERI_ADDR_DISK_SYNC 92
+#define PERI_ADDR_DISK_SIZE 93
 
 #define PERI_INPUT_MODE_RAW 0
 #define PERI_INPUT_MODE_NUMBER 1
 
+#define PERI_XRAM_PAGE_SIZE 256
+#define PERI_XRAM_MAX_SIZE (65536UL * PERI_XRAM_PAGE_SIZE)
+#define PERI_XRAM_DEFAULT_SIZE (256UL * PERI_XRAM_PAGE_SIZE)
+#define PERI_XRAM_DMA_TO_RAM 0
+#define PERI_XRAM_DMA_FROM_RAM 1
+
+/* Math coprocessor operations, in the high nibble of the opcode.
+ * The low nibble is the operand width in bytes (1-4). */
+#define PERI_MATH_ADD 0 /* result: sum (width bytes), carry (1 byte) */
+#define PERI_MATH_SUB 1 /* result: a - b (width bytes), borrow (1 byte) */
+#define PERI_MATH_MUL 2 /* result: product (2 * width bytes) */
+#define PERI_MATH_DIVMOD 3 /* result: quotient, remainder (width bytes each) */
+#define PERI_MATH_CMP 4 /* result: 0 if a == b, 1 if a < b, 2 if a > b */
+#define PERI_MATH_OP_NR 5
+
+/* What has been typed on a keyboard and not read yet. In
+ * PERI_INPUT_MODE_NUMBER characters are collected into lines, and the value
+ * of every complete line that is a number is buffered. The simulator has one
+ * for the terminal, minifuzz one per worker. */
+struct peri_keyboard {
+    int input_mode;
+    /* Called with every character typed in PERI_INPUT_MODE_NUMBER, and with
+     * 'E' after a line that is not a number. May be NULL. */
+    void (*echo)(computer *comp, unsigned char c);
+    char line[BUFSIZ];
+    size_t line_len;
+    unsigned char buf[BUFSIZ];
+    size_t head, tail;
+};
+
+void peri_keyboard_init(struct peri_keyboard *kb, int input_mode, void (*echo)(computer *, unsigned char));
+/* Handle one typed character */
+void peri_keyboard_type(struct peri_keyboard *kb, computer *comp, unsigned char c);
+/* Returns the next buffered byte, -1 if there is none */
+int peri_keyboard_take(struct peri_keyboard *kb);
+int peri_keyboard_is_empty(struct peri_keyboard const *kb);
+
 void peri_keyboard_buffered_input(computer *comp, unsigned char *key);
 void peri_keyboard_unbuffered_input(computer *comp, unsigned char *key);
 void peri_keyboard_has_input(computer *comp, unsigned char *has_input);
+/* Number of bytes taken from the keyboard buffer, reads that found it
+ * empty (and returned 0) are not counted */
+unsigned long peri_keyboard_read_count(void);
 
 void peri_ascii_printer_output(computer *comp, unsigned char c);
 void peri_integer_printer_output(computer *comp, unsigned char i);
@@ -33,6 +114,73 @@ void peri_terminate_output(computer *comp, unsigned char c);
 void peri_random_input(computer *comp, unsigned char *rnd);
 
 void peri_keyboard_set_input_mode(int input_mode);
+/* Value of a line in PERI_INPUT_MODE_NUMBER: 'c', eight binary digits or a
+ * C number. Returns -1 if it is not in 0-255. */
+int peri_parse_number(char const *s);
+/* Taken while writing to the terminal */
+void peri_screen_lock(void);
+void peri_screen_unlock(void);
+/* Let the host sleep while the computer polls the keyboard in a loop that
+ * can not change until there is input. With frequency > 0, the clock is
+ * advanced as if the loop had kept running at that frequency. */
+void peri_set_idle_wait(int enable, double frequency);
+/* For other input devices: call when a poll found no input, sleeps until
+ * fd is readable if the computer is in such a loop. Returns 1 after
+ * sleeping. */
+int peri_idle_wait(computer *comp, int fd);
+/* Stall the computer for at least the given number of cycles. Whole
+ * instructions are added, so that the cycle simulation stays in step. */
+void peri_add_cycles(computer *comp, unsigned long cycles);
+
+/* 1 if output to addr may write RAM behind the program's back (DMA) */
+int peri_output_writes_ram(unsigned char addr);
+
+/* Extended RAM: a host side store of up to PERI_XRAM_MAX_SIZE bytes seen
+ * through a 256 byte page window.
+ * BANK: two bytes (low first) select the page.
+ * ADDR: one byte sets the position in the page.
+ * DATA: reads or writes the byte at the current position, which is then
+ *       incremented (continuing into the next page).
+ * DMA:  three bytes: RAM address, length (0 means 256) and direction
+ *       (PERI_XRAM_DMA_*). The block is copied from/to the current position,
+ *       which is advanced by the length. The RAM address is COMPUTER_IMM_LEN
+ *       bytes (low first), so four bytes in the 16-bit build. */
+void peri_xram_bank_output(computer *comp, unsigned char c);
+void peri_xram_addr_output(computer *comp, unsigned char c);
+void peri_xram_data_output(computer *comp, unsigned char c);
+void peri_xram_data_input(computer *comp, unsigned char *c);
+void peri_xram_dma_output(computer *comp, unsigned char c);
+/* Size in bytes, rounded up to whole pages. Must be set before first use. */
+void peri_xram_set_size(unsigned long size);
+void peri_xram_set_dma_cycles(unsigned long cycles_per_byte);
+
+/* Timer.
+ * SLEEP:   four bytes, low first: a number of clock cycles to wait. The
+ *          clock jumps forward by them at once; when the simulator runs at
+ *          a frequency, the host sleeps for as long as they would take.
+ * MARK:    any byte: remembers the current clock cycle.
+ * ELAPSED: reads the cycles since the mark, four bytes low first. The
+ *          count is taken at the first byte.
+ * There is one mark, shared by all CPUs. */
+void peri_timer_sleep_output(computer *comp, unsigned char c);
+void peri_timer_mark_output(computer *comp, unsigned char c);
+void peri_timer_elapsed_input(computer *comp, unsigned char *c);
+/* Clock frequency for SLEEP, 0 for none (the fast engine) */
+void peri_timer_set_frequency(double frequency);
+
+/* Math coprocessor.
+ * A, B:   operand bytes, low byte first.
+ * OP:     opcode (PERI_MATH_* << 4 | width); runs the operation and
+ *         clears the operands.
+ * RESULT: reads the next result byte, low byte first.
+ * An operation stalls the computer for its cost times the width (ADD, SUB,
+ * CMP) or the squared width (MUL, DIVMOD). */
+void peri_math_a_output(computer *comp, unsigned char c);
+void peri_math_b_output(computer *comp, unsigned char c);
+void peri_math_op_output(computer *comp, unsigned char c);
+void peri_math_result_input(computer *comp, unsigned char *c);
+extern char const *peri_math_op_name[PERI_MATH_OP_NR];
+void peri_math_set_cycles(int op, unsigned long cycles);
 
 #endif
 
@@ -0,0 +1,105 @@
+#include "profile.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+unsigned long profile_hash(unsigned char const *ram, int size)
+{
+    /* 32-bit FNV-1a */
+    unsigned long h = 2166136261UL;
+    int i;
+
+    for(i = 0; i < size; i++) {
+        h = ((h ^ ram[i]) * 16777619UL) & 0xffffffffUL;
+    }
+    return h;
+}
+
+void profile_init(struct profile *prof, unsigned char const *ram, int size)
+{
+    memset(prof, 0, sizeof(*prof));
+    prof->hash = profile_hash(ram, size);
+    prof->size = size;
+    prof->is_block[0] = 1;
+}
+
+void profile_count(struct profile *prof, computer const *comp, computer_word pos)
+{
+    unsigned char instr = comp->ram[pos];
+    computer_word next = (computer_word)(pos + computer_get_instruction_length(instr));
+
+    prof->exec[pos]++;
+    if(instr >> 4 == COMPUTER_INSTR_JXXX) {
+        if(comp->iar == computer_read_imm(comp, (computer_word)(pos + 1))) {
+            prof->taken[pos]++;
+        } else {
+            prof->not_taken[pos]++;
+        }
+        prof->is_block[next] = 1;
+    }
+    if(comp->iar != next) prof->is_block[comp->iar] = 1;
+}
+
+int profile_write(struct profile const *prof, char const *file)
+{
+    FILE *fp;
+    int i;
+
+    if((fp = fopen(file, "w")) == NULL) return -1;
+    fprintf(fp, "%s\n", PROFILE_MAGIC);
+    fprintf(fp, "image %08lx\n", prof->hash);
+    for(i = 0; i < prof->size; i++) {
+        if(prof->exec[i] == 0) continue;
+        fprintf(fp, "exec %03d %lu\n", i, prof->exec[i]);
+        if(prof->is_block[i]) fprintf(fp, "block %03d %lu\n", i, prof->exec[i]);
+        if(prof->taken[i] || prof->not_taken[i]) {
+            fprintf(fp, "branch %03d %lu %lu\n", i, prof->taken[i], prof->not_taken[i]);
+        }
+    }
+    return fclose(fp) ? -1 : 0;
+}
+
+int profile_load(struct profile *prof, char const *file)
+{
+    char buf[BUFSIZ];
+    FILE *fp;
+    int first = 1;
+
+    memset(prof, 0, sizeof(*prof));
+    if((fp = fopen(file, "r")) == NULL) return -1;
+    while(fgets(buf, sizeof(buf), fp)) {
+        char kind[16];
+        unsigned long a, b = 0;
+        char *end = buf + strlen(buf);
+        int pos, n;
+
+        while(end > buf && isspace((unsigned char)end[-1])) *--end = '\0';
+        if(first) {
+            if(strcmp(buf, PROFILE_MAGIC) != 0) break;
+            first = 0;
+            continue;
+        }
+        if(buf[0] == '\0' || buf[0] == '#') continue;
+        if(sscanf(buf, "image %lx", &prof->hash) == 1) continue;
+        n = sscanf(buf, "%15s %d %lu %lu", kind, &pos, &a, &b);
+        if(n < 3 || pos < 0 || pos >= PROFILE_MAX_SIZE) {
+            first = 1;
+            break;
+        }
+        if(pos >= prof->size) prof->size = pos + 1;
+        if(strcmp(kind, "exec") == 0) {
+            prof->exec[pos] = a;
+        } else if(strcmp(kind, "block") == 0) {
+            prof->is_block[pos] = 1;
+        } else if(strcmp(kind, "branch") == 0 && n == 4) {
+            prof->taken[pos] = a;
+            prof->not_taken[pos] = b;
+        } else {
+            first = 1;
+            break;
+        }
+    }
+    fclose(fp);
+    return first ? -1 : 0;
+}
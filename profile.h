@@ -0,0 +1,44 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "computer.h"
+
+/* Branch and block profile, written by "simulator --branch-profile" and
+ * read by "asm_compiler --profile-use". After the PROFILE_MAGIC line there
+ * is one "image HASH" line with the hash of the RAM image that was run,
+ * followed by lines of the kinds
+ *
+ *   exec POS COUNT
+ *   block POS COUNT
+ *   branch POS TAKEN NOT_TAKEN
+ *
+ * exec is the number of times the instruction at POS was run, block the
+ * number of times a basic block was entered at POS (by a jump, or by
+ * falling through a JXXX) and branch how often the JXXX at POS jumped and
+ * how often it fell through. Only positions that ran are listed. */
+
+#define PROFILE_MAGIC "# minicomp profile 1"
+/* Largest RAM a profile can describe, the 16-bit machine */
+#define PROFILE_MAX_SIZE (1 << 16)
+
+struct profile {
+    unsigned long hash;
+    int size; /* Number of RAM bytes, after profile_load() up to the last position listed */
+    unsigned long exec[PROFILE_MAX_SIZE];
+    unsigned long taken[PROFILE_MAX_SIZE];
+    unsigned long not_taken[PROFILE_MAX_SIZE];
+    unsigned char is_block[PROFILE_MAX_SIZE];
+};
+
+/* Hash of the first size bytes of ram, to match a profile to its image */
+unsigned long profile_hash(unsigned char const *ram, int size);
+/* Clear the counts of a profile for the image in ram */
+void profile_init(struct profile *prof, unsigned char const *ram, int size);
+/* Count the instruction at pos, which comp has just run */
+void profile_count(struct profile *prof, computer const *comp, computer_word pos);
+/* Returns -1 if the file can not be written */
+int profile_write(struct profile const *prof, char const *file);
+/* Returns -1 if the file can not be read or is not a profile */
+int profile_load(struct profile *prof, char const *file);
+
+#endif
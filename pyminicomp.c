@@ -0,0 +1,222 @@
+/* Python bindings for libminicomp.
+ *
+ *   import pyminicomp
+ *   result = pyminicomp.run(AsmProgram(path).to_ram(), input=b"12\n")
+ *   result.output, result.cycles, result.running
+ *
+ * The guest runs with the fast engine, with the printers, the keyboard,
+ * the random number generator and terminate connected to buffers owned by
+ * the call. The GIL is released while it runs, so a thread pool can run
+ * many guests at the same time. */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "minicomp.h"
+#include "peri.h"
+
+struct guest {
+    unsigned char const *input;
+    size_t input_len;
+    size_t input_pos;
+    char *output;
+    size_t output_len;
+    size_t output_size;
+    size_t max_output;
+    int out_of_memory;
+    int output_full;
+    /* Bytes received by the 16, 24 and 32-bit printers */
+    unsigned long num[3];
+    int num_len[3];
+    unsigned long random;
+};
+
+static void print(minicomp *mc, struct guest *g, char const *fmt, unsigned long value)
+{
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), fmt, value);
+
+    if(g->output_len + (size_t)len > g->output_size) {
+        size_t size = g->output_size ? g->output_size * 2 : 256;
+        char *output;
+
+        while(size < g->output_len + (size_t)len) size *= 2;
+        if((output = realloc(g->output, size)) == NULL) {
+            g->out_of_memory = 1;
+            minicomp_stop(mc);
+            return;
+        }
+        g->output = output;
+        g->output_size = size;
+    }
+    memcpy(g->output + g->output_len, buf, (size_t)len);
+    g->output_len += (size_t)len;
+    if(g->max_output && g->output_len >= g->max_output) {
+        g->output_full = 1;
+        minicomp_stop(mc);
+    }
+}
+
+static void printer_output(minicomp *mc, void *user, unsigned char addr, unsigned char value)
+{
+    struct guest *g = user;
+    int i;
+
+    switch(addr) {
+        case PERI_ADDR_ASCII_PRINTER: print(mc, g, "%c", value); return;
+        case PERI_ADDR_INTEGER_PRINTER: print(mc, g, "%lu", value); return;
+        case PERI_ADDR_HEX_PRINTER: print(mc, g, "%02lx", value); return;
+        case PERI_ADDR_INTEGER16_PRINTER: i = 0; break;
+        case PERI_ADDR_INTEGER24_PRINTER: i = 1; break;
+        default: i = 2; break;
+    }
+    g->num[i] |= (unsigned long)value << (8 * g->num_len[i]);
+    if(++g->num_len[i] == i + 2) {
+        print(mc, g, "%lu", g->num[i]);
+        g->num[i] = 0;
+        g->num_len[i] = 0;
+    }
+}
+
+static unsigned char keyboard_input(minicomp *mc, void *user, unsigned char addr)
+{
+    struct guest *g = user;
+
+    if(g->input_pos == g->input_len) return 0;
+    return g->input[g->input_pos++];
+}
+
+static unsigned char keyboard_has_input(minicomp *mc, void *user, unsigned char addr)
+{
+    struct guest *g = user;
+
+    return g->input_pos < g->input_len;
+}
+
+/* xorshift, so that runs are repeatable */
+static unsigned char random_input(minicomp *mc, void *user, unsigned char addr)
+{
+    struct guest *g = user;
+
+    g->random ^= g->random << 13;
+    g->random ^= g->random >> 7;
+    g->random ^= g->random << 17;
+    return (unsigned char)(g->random >> 24);
+}
+
+static PyTypeObject gs_result_type;
+
+static PyStructSequence_Field gs_result_fields[] = {
+    { "output", "bytes written to the printers, formatted like the simulator" },
+    { "cycles", "clock cycles used" },
+    { "running", "True if the cycle budget or output limit ran out first" },
+    { "input_used", "number of input bytes the program read" },
+    { NULL, NULL }
+};
+
+static PyStructSequence_Desc gs_result_desc = {
+    "pyminicomp.Result", "Result of pyminicomp.run()", gs_result_fields, 4
+};
+
+static PyObject *pyminicomp_run(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char kw_ram[] = "ram", kw_input[] = "input", kw_max_cycles[] = "max_cycles";
+    static char kw_max_output[] = "max_output", kw_seed[] = "seed";
+    static char *keywords[] = { kw_ram, kw_input, kw_max_cycles, kw_max_output, kw_seed, NULL };
+    Py_buffer ram = { 0 };
+    Py_buffer input = { 0 };
+    unsigned long long max_cycles = 1000000000ULL;
+    Py_ssize_t max_output = 0;
+    unsigned long long seed = 1;
+    struct guest g;
+    minicomp *mc;
+    PyObject *result;
+    int running;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|y*KnK", keywords, &ram, &input, &max_cycles, &max_output, &seed)) {
+        return NULL;
+    }
+    if(ram.len > MINICOMP_RAM_SIZE || max_output < 0) {
+        PyErr_SetString(PyExc_ValueError, ram.len > MINICOMP_RAM_SIZE ? "ram is larger than 256 bytes" : "max_output < 0");
+        goto fail;
+    }
+    if((mc = minicomp_create()) == NULL) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+    memset(&g, 0, sizeof(g));
+    g.input = input.buf;
+    g.input_len = input.buf ? (size_t)input.len : 0;
+    g.max_output = (size_t)max_output;
+    g.random = seed ? (unsigned long)seed : 1;
+    minicomp_load(mc, ram.buf, (size_t)ram.len);
+    minicomp_set_output(mc, PERI_ADDR_ASCII_PRINTER, printer_output, &g);
+    minicomp_set_output(mc, PERI_ADDR_INTEGER_PRINTER, printer_output, &g);
+    minicomp_set_output(mc, PERI_ADDR_HEX_PRINTER, printer_output, &g);
+    minicomp_set_output(mc, PERI_ADDR_INTEGER16_PRINTER, printer_output, &g);
+    minicomp_set_output(mc, PERI_ADDR_INTEGER24_PRINTER, printer_output, &g);
+    minicomp_set_output(mc, PERI_ADDR_INTEGER32_PRINTER, printer_output, &g);
+    minicomp_set_input(mc, PERI_ADDR_KEYBOARD, keyboard_input, &g);
+    minicomp_set_input(mc, PERI_ADDR_KEYBOARD_HAS_INPUT, keyboard_has_input, &g);
+    minicomp_set_input(mc, PERI_ADDR_RANDOM, random_input, &g);
+
+    Py_BEGIN_ALLOW_THREADS
+    minicomp_run_cycles(mc, (unsigned long)max_cycles);
+    Py_END_ALLOW_THREADS
+
+    running = minicomp_is_running(mc) || g.output_full;
+    if(g.out_of_memory) {
+        PyErr_NoMemory();
+        result = NULL;
+    } else if((result = PyStructSequence_New(&gs_result_type)) != NULL) {
+        PyStructSequence_SetItem(result, 0, PyBytes_FromStringAndSize(g.output ? g.output : "", (Py_ssize_t)g.output_len));
+        PyStructSequence_SetItem(result, 1, PyLong_FromUnsignedLong(minicomp_get_cycles(mc)));
+        PyStructSequence_SetItem(result, 2, PyBool_FromLong(running));
+        PyStructSequence_SetItem(result, 3, PyLong_FromSize_t(g.input_pos));
+        if(PyErr_Occurred()) Py_CLEAR(result);
+    }
+    free(g.output);
+    minicomp_destroy(mc);
+    PyBuffer_Release(&ram);
+    if(input.buf) PyBuffer_Release(&input);
+    return result;
+
+fail:
+    PyBuffer_Release(&ram);
+    if(input.buf) PyBuffer_Release(&input);
+    return NULL;
+}
+
+static PyMethodDef gs_methods[] = {
+    { "run", (PyCFunction)(void (*)(void))pyminicomp_run, METH_VARARGS | METH_KEYWORDS,
+      "run(ram, input=b'', max_cycles=1000000000, max_output=0, seed=1) -> Result\n\n"
+      "Run a RAM image until it turns off, max_cycles have passed or max_output\n"
+      "bytes have been printed (0 = no limit). input is what the keyboard\n"
+      "returns, one byte per read; after it the keyboard is empty. seed starts\n"
+      "the random number generator." },
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef gs_module = {
+    PyModuleDef_HEAD_INIT, "pyminicomp", "Run minicomp programs in-process.", -1, gs_methods,
+    NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit_pyminicomp(void)
+{
+    PyObject *module;
+
+    if(gs_result_type.tp_name == NULL && PyStructSequence_InitType2(&gs_result_type, &gs_result_desc) < 0) {
+        return NULL;
+    }
+    if((module = PyModule_Create(&gs_module)) == NULL) return NULL;
+    Py_INCREF(&gs_result_type);
+    if(PyModule_AddObject(module, "Result", (PyObject *)&gs_result_type) < 0) {
+        Py_DECREF(&gs_result_type);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,465 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <argp.h>
+#include "computer.h"
+#include "config_impl.h"
+
+/* Translates a RAM image into C. Every instruction that can be reached
+ * from the entry points through JMP, JXXX and falling through is
+ * translated. Jump targets get labels and start a block; JMPR dispatches
+ * through a switch over the labels. The program
+ * state lives in locals and is written back to a computer struct around
+ * IO, so the peripherals in peri.c work unchanged.
+ *
+ * A block is only valid while the bytes it was made from are unchanged,
+ * except for DATA operands, which are read from RAM. Stores and DMA into
+ * those bytes are counted per block, and a block with changed bytes runs
+ * in computer_step_instruction_fast() instead. The program goes back to
+ * the translated code at the first label of a valid block.
+ * Clock cycles and output are the same as with simulator --fast. */
+
+#define MAX_ENTRIES 256
+
+struct arguments {
+    int entry_nr;
+    int entry[MAX_ENTRIES];
+    char *ram_file;
+    char *c_file;
+};
+
+static struct arguments gs_arg = { 0, { 0 }, NULL, NULL };
+
+char const *argp_program_version = "ram2c " MINICOMP_VERSION;
+char const *argp_program_bug_address = "<boris.carlsson@gmail.com>";
+
+static char gs_argp_doc[] = "ram2c - Translate a minicomp RAM image into a C program.\n\n"
+    "Build the result with\n"
+    "  gcc -O2 -DHAVE_CONFIG_H -I<minicomp> c-file <minicomp>/computer.o <minicomp>/peri.o -lpthread\n";
+static char gs_argp_args_doc[] = "ram-file c-file";
+
+static struct argp_option gs_argp_options[] = {
+    { "entry", 'e', "ADDR", 0, "Also translate code reached from ADDR, e.g. a JMPR target (can be repeated)", 0 },
+    { 0, 0, 0, 0, 0, 0 }
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+    char *end;
+    long addr;
+
+    switch (key) {
+        case 'e':
+            addr = strtol(arg, &end, 0);
+            if(*end || addr < 0 || addr >= COMPUTER_RAM_SIZE || arguments->entry_nr == MAX_ENTRIES) argp_usage(state);
+            arguments->entry[arguments->entry_nr++] = (int)addr;
+            break;
+        case ARGP_KEY_ARG:
+            if(state->arg_num == 0) arguments->ram_file = arg;
+            if(state->arg_num == 1) arguments->c_file = arg;
+            break;
+        case ARGP_KEY_END:
+            if(state->arg_num != 2) argp_usage(state);
+            break;
+        default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp gs_argp = { gs_argp_options, parse_opt, gs_argp_args_doc, gs_argp_doc, 0, 0, 0 };
+
+static unsigned char gs_ram[COMPUTER_RAM_SIZE];
+static int gs_is_instr[COMPUTER_RAM_SIZE];
+static int gs_is_code[COMPUTER_RAM_SIZE];
+/* Instructions that get a label. The others are only reached by falling
+ * through from the instruction printed before them, which lets gcc keep
+ * the registers in host registers across them. */
+static int gs_is_label[COMPUTER_RAM_SIZE];
+/* Block number + 1 of the labels, and of the instructions whose opcode or
+ * jump target is at an address */
+static int gs_label_block[COMPUTER_RAM_SIZE];
+static int gs_op_block[COMPUTER_RAM_SIZE];
+static int gs_arg_block[COMPUTER_RAM_SIZE];
+static int gs_block_nr = 0;
+
+static int next_addr(int addr, int n)
+{
+    return (addr + n) % COMPUTER_RAM_SIZE;
+}
+
+/* Mark every instruction reachable from addr */
+static void explore(int addr)
+{
+    int stack[COMPUTER_RAM_SIZE * 2];
+    int sp = 0;
+
+    gs_is_label[addr] = 1;
+    stack[sp++] = addr;
+    while(sp > 0) {
+        unsigned char op;
+        int len;
+
+        addr = stack[--sp];
+        if(gs_is_instr[addr]) continue;
+        gs_is_instr[addr] = 1;
+        op = gs_ram[addr];
+        len = computer_get_instruction_length(op);
+
+        switch(op >> 4) {
+            case COMPUTER_INSTR_JMP:
+                stack[sp++] = gs_ram[next_addr(addr, 1)];
+                gs_is_label[gs_ram[next_addr(addr, 1)]] = 1;
+                break;
+            case COMPUTER_INSTR_JXXX:
+                stack[sp++] = gs_ram[next_addr(addr, 1)];
+                gs_is_label[gs_ram[next_addr(addr, 1)]] = 1;
+                stack[sp++] = next_addr(addr, 2);
+                break;
+            case COMPUTER_INSTR_JMPR:
+                break;
+            default:
+                stack[sp++] = next_addr(addr, len);
+                break;
+        }
+    }
+}
+
+static void print_table(FILE *out, char const *name, int const *table)
+{
+    int i;
+
+    fprintf(out, "static unsigned short const %s[COMPUTER_RAM_SIZE] = {", name);
+    for(i = 0; i < COMPUTER_RAM_SIZE; i++) {
+        fprintf(out, "%s%d%s", i % 16 ? "" : "\n    ", table[i], i + 1 < COMPUTER_RAM_SIZE ? ", " : "\n");
+    }
+    fprintf(out, "};\n\n");
+}
+
+static char const gs_prologue[] =
+    "#include <stdio.h>\n"
+    "#include <string.h>\n"
+    "#include \"computer.h\"\n"
+    "#include \"peri.h\"\n"
+    "#include \"config_impl.h\"\n"
+    "#ifdef HAVE_NCURSES\n"
+    "#   include <ncurses.h>\n"
+    "#endif\n\n"
+    "#define F_Z (1 << COMPUTER_FLAG_ZERO)\n"
+    "#define F_E (1 << COMPUTER_FLAG_EQUAL)\n"
+    "#define F_A (1 << COMPUTER_FLAG_A_LARGER)\n"
+    "#define F_C (1 << COMPUTER_FLAG_CARRY)\n"
+    "#define CARRY ((fl >> COMPUTER_FLAG_CARRY) & 1)\n"
+    "#define CMP_FLAGS(va, vb) (((va) > (vb) ? F_A : 0) | ((va) == (vb) ? F_E : 0))\n"
+    "#define SAVE(addr) (gs_comp.reg[0] = r0, gs_comp.reg[1] = r1, gs_comp.reg[2] = r2, gs_comp.reg[3] = r3, \\\n"
+    "                    gs_comp.flags = fl, gs_comp.io_addr = ioa, gs_comp.iar = (addr), gs_comp.clock_cycle = clk)\n"
+    "#define LOAD() (r0 = gs_comp.reg[0], r1 = gs_comp.reg[1], r2 = gs_comp.reg[2], r3 = gs_comp.reg[3], \\\n"
+    "                fl = gs_comp.flags, ioa = gs_comp.io_addr, clk = gs_comp.clock_cycle)\n\n"
+    "static computer gs_comp;\n\n";
+
+static char const gs_helpers[] =
+    "static void code_store(unsigned char addr, unsigned char value)\n"
+    "{\n"
+    "    int change = (value != gs_image[addr]) - (gs_comp.ram[addr] != gs_image[addr]);\n\n"
+    "    if(gs_op_block[addr]) gs_broken[gs_op_block[addr] - 1] += change;\n"
+    "    if(gs_arg_block[addr]) gs_broken[gs_arg_block[addr] - 1] += change;\n"
+    "    gs_comp.ram[addr] = value;\n"
+    "}\n\n"
+    "static void recount(void)\n"
+    "{\n"
+    "    int i;\n\n"
+    "    memset(gs_broken, 0, sizeof(gs_broken));\n"
+    "    for(i = 0; i < COMPUTER_RAM_SIZE; i++) {\n"
+    "        if(gs_comp.ram[i] == gs_image[i]) continue;\n"
+    "        if(gs_op_block[i]) gs_broken[gs_op_block[i] - 1]++;\n"
+    "        if(gs_arg_block[i]) gs_broken[gs_arg_block[i] - 1]++;\n"
+    "    }\n"
+    "}\n\n";
+
+static char const gs_interpreter[] =
+    "dispatch:\n"
+    "    switch(pc) {\n"
+    "%s"
+    "        default: break;\n"
+    "    }\n"
+    "    SAVE(pc);\n"
+    "interp:\n"
+    "    while(gs_comp.is_running) {\n"
+    "        unsigned char op = gs_comp.ram[gs_comp.iar];\n\n"
+    "        if(gs_entry[gs_comp.iar] && gs_broken[gs_entry[gs_comp.iar] - 1] == 0) {\n"
+    "            LOAD();\n"
+    "            pc = gs_comp.iar;\n"
+    "            goto dispatch;\n"
+    "        }\n"
+    "        if(op >> 4 == COMPUTER_INSTR_ST && gs_code[gs_comp.reg[(op >> 2) & 3]]) {\n"
+    "            code_store(gs_comp.reg[(op >> 2) & 3], gs_comp.reg[op & 3]);\n"
+    "        }\n"
+    "        computer_step_instruction_fast(&gs_comp);\n"
+    "        if(op >> 4 == COMPUTER_INSTR_IO && ((op >> 2) & 3) == 2 && peri_output_writes_ram(gs_comp.io_addr)) {\n"
+    "            recount();\n"
+    "        }\n"
+    "    }\n"
+    "}\n\n";
+
+static char const gs_main[] =
+    "int main(int argc, char *argv[])\n"
+    "{\n"
+    "    computer_reset(&gs_comp);\n"
+    "    memcpy(gs_comp.ram, gs_image, sizeof(gs_comp.ram));\n"
+    "    peri_set_idle_wait(1, 0);\n"
+    "#ifdef HAVE_NCURSES\n"
+    "    initscr();\n"
+    "    timeout(0);\n"
+    "    noecho();\n"
+    "#endif\n"
+    "    run();\n"
+    "#ifdef HAVE_NCURSES\n"
+    "    endwin();\n"
+    "#endif\n"
+    "    if(argc > 1 && strcmp(argv[1], \"-T\") == 0) {\n"
+    "        printf(\"Total clock-cycles: %ld.\\n\", gs_comp.clock_cycle);\n"
+    "    }\n"
+    "    return 0;\n"
+    "}\n";
+
+static char const *gs_reg[COMPUTER_REG_NR] = { "r0", "r1", "r2", "r3" };
+
+/* Code for the ALU operation op on registers a and b */
+static void print_alu(FILE *out, int op, char const *a, char const *b)
+{
+    char const *flags = "";
+
+    fprintf(out, "    { int va = %s, vb = %s;", a, b);
+    switch(op) {
+        case COMPUTER_ALU_ADD:
+            fprintf(out, " int s = va + vb + CARRY; %s = (unsigned char)s;", b);
+            flags = " | (s > 255 ? F_C : 0)";
+            break;
+        case COMPUTER_ALU_SHR:
+            fprintf(out, " %s = (unsigned char)((va >> 1) + (CARRY << 7));", b);
+            flags = " | (va & 1 ? F_C : 0)";
+            break;
+        case COMPUTER_ALU_SHL:
+            fprintf(out, " %s = (unsigned char)((va << 1) + CARRY);", b);
+            flags = " | (va & 128 ? F_C : 0)";
+            break;
+        case COMPUTER_ALU_NOT: fprintf(out, " %s = (unsigned char)~va;", b); break;
+        case COMPUTER_ALU_AND: fprintf(out, " %s = (unsigned char)(va & vb);", b); break;
+        case COMPUTER_ALU_OR: fprintf(out, " %s = (unsigned char)(va | vb);", b); break;
+        case COMPUTER_ALU_XOR: fprintf(out, " %s = (unsigned char)(va ^ vb);", b); break;
+    }
+    if(op == COMPUTER_ALU_CMP) {
+        fprintf(out, " fl = (unsigned char)CMP_FLAGS(va, vb); }\n");
+    } else {
+        fprintf(out, " fl = (unsigned char)(CMP_FLAGS(va, vb)%s | (%s == 0 ? F_Z : 0)); }\n", flags, b);
+    }
+}
+
+/* Address of the instruction printed after the one at addr, -1 if there
+ * is none */
+static int following_addr(int addr)
+{
+    for(addr++; addr < COMPUTER_RAM_SIZE; addr++) {
+        if(gs_is_instr[addr]) return addr;
+    }
+    return -1;
+}
+
+/* Label the instructions that can not be reached by falling through and
+ * number the blocks that start at the labels */
+static void mark_blocks(void)
+{
+    int addr;
+
+    for(addr = 0; addr < COMPUTER_RAM_SIZE; addr++) {
+        unsigned char op = gs_ram[addr];
+        int kind = op & 128 ? -1 : op >> 4;
+
+        if(!gs_is_instr[addr] || kind == COMPUTER_INSTR_JMP || kind == COMPUTER_INSTR_JMPR) continue;
+        if(next_addr(addr, computer_get_instruction_length(op)) != following_addr(addr)) {
+            gs_is_label[next_addr(addr, computer_get_instruction_length(op))] = 1;
+        }
+    }
+    for(addr = 0; addr < COMPUTER_RAM_SIZE; addr++) {
+        unsigned char op = gs_ram[addr];
+
+        if(!gs_is_instr[addr]) continue;
+        if(gs_is_label[addr]) gs_label_block[addr] = ++gs_block_nr;
+        gs_op_block[addr] = gs_block_nr;
+        gs_is_code[addr] = 1;
+        /* DATA reads its operand from RAM at run time, so programs that
+         * patch constants stay in the translated code */
+        if(computer_get_instruction_length(op) == 2 && op >> 4 != COMPUTER_INSTR_DATA) {
+            gs_arg_block[next_addr(addr, 1)] = gs_block_nr;
+            gs_is_code[next_addr(addr, 1)] = 1;
+        }
+    }
+}
+
+/* following is the address of the instruction printed after this one, -1
+ * if there is none */
+static void print_instruction(FILE *out, int addr, int following)
+{
+    unsigned char op = gs_ram[addr];
+    int a = (op >> 2) & 3;
+    int b = op & 3;
+    int len = computer_get_instruction_length(op);
+    int next = next_addr(addr, len);
+    int arg = gs_ram[next_addr(addr, 1)];
+    int block = gs_op_block[addr] - 1;
+    char name[16];
+
+    computer_get_instruction_name(op, name);
+    if(gs_is_label[addr]) {
+        fprintf(out, "L_%03d: /* %s */\n", addr, name);
+        fprintf(out, "    if(gs_broken[%d]) { SAVE(%d); goto interp; }\n", block, addr);
+    } else {
+        fprintf(out, "/* %03d: %s */\n", addr, name);
+    }
+    if(op & 128) {
+        print_alu(out, op >> 4 & 7, gs_reg[a], gs_reg[b]);
+        fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+    } else switch(op >> 4) {
+        case COMPUTER_INSTR_LD:
+            fprintf(out, "    %s = gs_comp.ram[%s];\n", gs_reg[b], gs_reg[a]);
+            fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+            break;
+        case COMPUTER_INSTR_ST:
+            fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+            fprintf(out, "    gs_comp.ram_writes++;\n");
+            fprintf(out, "    if(gs_code[%s]) {\n", gs_reg[a]);
+            fprintf(out, "        code_store(%s, %s);\n", gs_reg[a], gs_reg[b]);
+            fprintf(out, "        if(gs_broken[%d]) { SAVE(%d); goto interp; }\n", block, next);
+            fprintf(out, "    } else {\n");
+            fprintf(out, "        gs_comp.ram[%s] = %s;\n", gs_reg[a], gs_reg[b]);
+            fprintf(out, "    }\n");
+            break;
+        case COMPUTER_INSTR_DATA:
+            fprintf(out, "    %s = gs_comp.ram[%d];\n", gs_reg[b], next_addr(addr, 1));
+            fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+            break;
+        case COMPUTER_INSTR_JMPR:
+            fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+            fprintf(out, "    pc = %s;\n", gs_reg[b]);
+            fprintf(out, "    goto dispatch;\n");
+            return;
+        case COMPUTER_INSTR_JMP:
+            fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+            fprintf(out, "    goto L_%03d;\n", arg);
+            return;
+        case COMPUTER_INSTR_JXXX:
+            fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+            fprintf(out, "    if(fl & %d) goto L_%03d;\n", (a << 2) + b, arg);
+            break;
+        case COMPUTER_INSTR_CLF:
+            fprintf(out, "    fl = 0;\n");
+            fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+            break;
+        case COMPUTER_INSTR_IO:
+            if(a & 1) {
+                /* Address input/output */
+                fprintf(out, a == 1 ? "    %s = ioa;\n" : "    ioa = %s;\n", gs_reg[b]);
+                fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+                break;
+            }
+            fprintf(out, "    gs_comp.io_count++;\n");
+            fprintf(out, "    SAVE(%d);\n", addr);
+            if(a == 0) {
+                fprintf(out, "    gs_comp.dev->input[ioa](&gs_comp, &gs_comp.reg[%d]);\n", b);
+            } else {
+                fprintf(out, "    gs_comp.dev->output[ioa](&gs_comp, %s);\n", gs_reg[b]);
+            }
+            fprintf(out, "    LOAD();\n");
+            fprintf(out, "    clk += COMPUTER_FAST_INSTR_CYCLES;\n");
+            fprintf(out, "    if(!gs_comp.is_running) { SAVE(%d); return; }\n", next);
+            if(a == 2) {
+                fprintf(out, "    if(peri_output_writes_ram(ioa)) {\n");
+                fprintf(out, "        recount();\n");
+                fprintf(out, "        if(gs_broken[%d]) { SAVE(%d); goto interp; }\n", block, next);
+                fprintf(out, "    }\n");
+            }
+            break;
+    }
+    if(next != following) {
+        fprintf(out, "    goto L_%03d;\n", next);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in, *out;
+    char *cases;
+    size_t cases_len = 0;
+    int i;
+
+    argp_parse(&gs_argp, argc, argv, 0, 0, &gs_arg);
+    memset(gs_ram, 0, sizeof(gs_ram));
+
+    if((in = fopen(gs_arg.ram_file, "rb")) == NULL) {
+        fprintf(stderr, "Could not open '%s' for reading.\n", gs_arg.ram_file);
+        exit(EXIT_FAILURE);
+    }
+    if(fread(gs_ram, 1, sizeof(gs_ram), in) == 0 && ferror(in)) {
+        fprintf(stderr, "Could not read '%s'.\n", gs_arg.ram_file);
+        exit(EXIT_FAILURE);
+    }
+    fclose(in);
+
+    explore(0);
+    for(i = 0; i < gs_arg.entry_nr; i++) {
+        explore(gs_arg.entry[i]);
+    }
+    mark_blocks();
+
+    if((out = fopen(gs_arg.c_file, "w")) == NULL) {
+        fprintf(stderr, "Could not open '%s' for writing.\n", gs_arg.c_file);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "/* Generated by ram2c from %s */\n\n", gs_arg.ram_file);
+    fputs(gs_prologue, out);
+    fprintf(out, "static unsigned char const gs_image[COMPUTER_RAM_SIZE] = {");
+    for(i = 0; i < COMPUTER_RAM_SIZE; i++) {
+        fprintf(out, "%s%d%s", i % 16 ? "" : "\n    ", gs_ram[i], i + 1 < COMPUTER_RAM_SIZE ? ", " : "\n");
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "/* Number of changed bytes in each block */\n");
+    fprintf(out, "static int gs_broken[%d];\n\n", gs_block_nr > 0 ? gs_block_nr : 1);
+    fprintf(out, "/* 1 for bytes the translation depends on */\n");
+    print_table(out, "gs_code", gs_is_code);
+    fprintf(out, "/* Block number + 1 of the instruction whose opcode is at an address */\n");
+    print_table(out, "gs_op_block", gs_op_block);
+    fprintf(out, "/* Block number + 1 of the jump whose target is at an address */\n");
+    print_table(out, "gs_arg_block", gs_arg_block);
+    fprintf(out, "/* Block number + 1 of the labels */\n");
+    print_table(out, "gs_entry", gs_label_block);
+    fputs(gs_helpers, out);
+
+    fprintf(out, "static void run(void)\n{\n");
+    fprintf(out, "    unsigned char r0, r1, r2, r3, fl, ioa, pc;\n");
+    fprintf(out, "    unsigned long clk;\n\n");
+    fprintf(out, "    LOAD();\n");
+    fprintf(out, "    pc = gs_comp.iar;\n");
+    fprintf(out, "    goto dispatch;\n\n");
+    for(i = 0; i < COMPUTER_RAM_SIZE; i++) {
+        if(gs_is_instr[i]) print_instruction(out, i, following_addr(i));
+    }
+    fprintf(out, "\n");
+
+    if((cases = malloc(COMPUTER_RAM_SIZE * 32 + 1)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    cases[0] = '\0';
+    for(i = 0; i < COMPUTER_RAM_SIZE; i++) {
+        if(gs_is_label[i]) {
+            cases_len += (size_t)sprintf(cases + cases_len, "        case %d: goto L_%03d;\n", i, i);
+        }
+    }
+    fprintf(out, gs_interpreter, cases);
+    free(cases);
+    fputs(gs_main, out);
+    fclose(out);
+
+    return 0;
+}
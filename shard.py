@@ -0,0 +1,100 @@
+import argparse
+import concurrent.futures
+import dataclasses
+import os
+import subprocess
+import sys
+
+# Splits a numeric search range over several simulator runs of one image.
+# Each shard gets its start value patched into the image with
+# --set-ram-label, and its printed numbers are kept only if they are inside
+# the shard. A shard is stopped as soon as it prints a number past its end,
+# so the program must print its results in increasing order. The output of
+# the shards is written in shard order, as soon as all earlier shards are
+# done.
+#
+# Example, all primes in [10^9, 10^9 + 10^6) on all local cores:
+#   ./asm_compiler -Y prime_verylong.lab examples/prime_verylong.asm prime_verylong.ram
+#   python3 shard.py --labels prime_verylong.lab --bytes n0,n1,n2,n3 \
+#       --offset -4 --align 6 --align-rem 1 \
+#       --start 1000000000 --end 1001000000 --shards 64 prime_verylong.ram
+# (prime_verylong.asm adds 4 before testing the first n and needs n - 1
+# divisible by 6, hence the offset and alignment.)
+
+@dataclasses.dataclass
+class Shard:
+    index: int
+    start: int
+    end: int
+    value: int
+
+def start_value(start: int, offset: int, align: int, align_rem: int) -> int:
+    """Largest value <= start + offset with value % align == align_rem.
+    The program then starts at or before start, and the numbers before start
+    are dropped. Falls back to the smallest valid value if that is negative."""
+    value = start + offset
+    value -= (value - align_rem) % align
+    if value < 0:
+        value = align_rem % align
+    return value
+
+def make_shards(args) -> list[Shard]:
+    size = args.end - args.start
+    shards = []
+    for i in range(args.shards):
+        lo = args.start + size * i // args.shards
+        hi = args.start + size * (i + 1) // args.shards
+        if lo < hi:
+            shards.append(Shard(len(shards), lo, hi, start_value(lo, args.offset, args.align, args.align_rem)))
+    return shards
+
+def run_shard(shard: Shard, args) -> list[str]:
+    patch = ",".join(f"{name}={(shard.value >> (8 * i)) & 0xff}" for i, name in enumerate(args.bytes))
+    cmd = [args.simulator, "-B", "-F", "--label-file", args.labels, "--set-ram-label", patch, args.ram_file]
+    out = []
+    with subprocess.Popen(cmd, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, text=True) as proc:
+        for line in proc.stdout:
+            line = line.strip()
+            if not line:
+                continue
+            try:
+                num = int(line)
+            except ValueError:
+                out.append(line)
+                continue
+            if num >= shard.end:
+                proc.kill()
+                break
+            if num >= shard.start:
+                out.append(line)
+    return out
+
+def main(argv):
+    parser = argparse.ArgumentParser(prog="shard", description="Run a numeric range split over several simulators")
+    parser.add_argument("--simulator", default="./simulator")
+    parser.add_argument("--labels", required=True, help="label file from asm_compiler --label-file")
+    parser.add_argument("--bytes", required=True, type=lambda s: s.split(","),
+                        help="labels holding the start value, least significant byte first")
+    parser.add_argument("--start", required=True, type=int)
+    parser.add_argument("--end", required=True, type=int, help="end of the range (exclusive)")
+    parser.add_argument("--shards", type=int, help="number of shards, default the number of jobs")
+    parser.add_argument("--jobs", type=int, default=os.cpu_count() or 1, help="simulators run at the same time")
+    parser.add_argument("--offset", type=int, default=0, help="added to a shard start before patching")
+    parser.add_argument("--align", type=int, default=1)
+    parser.add_argument("--align-rem", type=int, default=0)
+    parser.add_argument("ram_file")
+    args = parser.parse_args(argv[1:])
+    if args.shards is None:
+        args.shards = args.jobs
+    if args.shards < 1 or args.jobs < 1 or args.align < 1 or args.end <= args.start:
+        parser.error("invalid range or shard count")
+
+    with concurrent.futures.ThreadPoolExecutor(max_workers=args.jobs) as pool:
+        futures = [pool.submit(run_shard, shard, args) for shard in make_shards(args)]
+        for future in futures:
+            for line in future.result():
+                print(line)
+            sys.stdout.flush()
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <unistd.h>
 #include <argp.h>
@@ -11,6 +13,17 @@
 #endif
 #include "computer.h"
 #include "peri.h"
+#include "multi.h"
+#include "debugger.h"
+#include "fb.h"
+#include "stats.h"
+#include "trace.h"
+#include "srcmap.h"
+#include "perf.h"
+#include "latency.h"
+#include "chan.h"
+#include "disk.h"
+#include "profile.h"
 #ifdef HAVE_SIGNAL
 #   include <signal.h>
 #endif
@@ -21,8 +34,59 @@
 #   endif
 #endif
 
+/* Keys for options without a short name */
+enum {
+    OPT_XRAM_DMA_CYCLES = 256,
+    OPT_MATH_CYCLES,
+    OPT_QUANTUM,
+    OPT_PARALLEL,
+    OPT_SHARED_RAM,
+    OPT_SET_RAM,
+    OPT_SET_RAM_LABEL,
+    OPT_LABEL_FILE,
+    OPT_DEBUG_SCRIPT,
+    OPT_UNDO_LOG,
+    OPT_NO_IDLE_WAIT,
+    OPT_FB,
+    OPT_FB_FPS,
+    OPT_FB_PRINTER,
+    OPT_STATS_FILE,
+    OPT_STATS_SOCKET,
+    OPT_STATS_INTERVAL,
+    OPT_TRACE,
+    OPT_MAP,
+    OPT_PERF,
+    OPT_PERF_REGIONS,
+    OPT_LATENCY,
+    OPT_CHAN,
+    OPT_DISK,
+    OPT_DISK_SECTORS,
+    OPT_DISK_SEEK_CYCLES,
+    OPT_DISK_BYTE_CYCLES,
+    OPT_BRANCH_PROFILE
+};
+
+#define MAX_RAM_PATCHES 256
+/* Cycles the fast engine runs between publishing statistics */
+#define RUN_CHUNK_CYCLES (1UL << 20)
+
 static computer gs_comp;
+static computer_devices gs_devices;
+static multi_system *gs_multi = NULL;
+static debugger *gs_debugger = NULL;
+static undo_log *gs_undo = NULL;
+/* Set by Ctrl-C while --undo-log records without the debugger */
+static volatile int gs_undo_interrupt = 0;
+/* Write the undo log at exit, unless it could be inspected in the debugger */
+static int gs_undo_dump = 0;
 static unsigned long gs_profile_count[COMPUTER_RAM_SIZE] = { 0 };
+/* Instructions started and cycles spent per address, for the source map.
+ * With --fast gs_profile_count counts instructions, without it cycles. */
+static unsigned long gs_profile_instr[COMPUTER_RAM_SIZE] = { 0 };
+static unsigned long gs_profile_cycles[COMPUTER_RAM_SIZE] = { 0 };
+static struct srcmap gs_srcmap;
+static int gs_srcmap_loaded = 0;
+static struct profile gs_branch_profile;
 
 #ifndef HAVE_NCURSES
     static struct termios gs_term_old;
@@ -40,13 +104,46 @@ struct arguments {
     unsigned long print_interval;
     char *ram_file;
     int number_input;
+    int cpu_nr;
+    unsigned long quantum;
+    int parallel;
+    int shared_ram;
+    char *label_file;
+    int ram_patch_nr;
+    char *ram_patch[MAX_RAM_PATCHES];
+    int ram_patch_is_label[MAX_RAM_PATCHES];
+    int debug;
+    char *debug_script;
+    unsigned long undo_log_size;
+    int no_idle_wait;
+    int fb;
+    int fb_cols;
+    int fb_rows;
+    int fb_fps;
+    int fb_printer;
+    char *stats_file;
+    char *stats_socket;
+    unsigned long stats_interval;
+    char *trace_file;
+    char *map_file;
+    int perf;
+    int latency;
+    int chan;
+    char *disk_file;
+    unsigned long disk_sectors;
+    unsigned long disk_seek_cycles;
+    unsigned long disk_byte_cycles;
+    char *branch_profile_file;
 };
 
 static struct arguments gs_arg = {
 #ifdef HAVE_TIMING
     1000,
 #endif
-    0, 0, 0, 0, 0, NULL, 0 };
+    0, 0, 0, 0, 0, NULL, 0, 0, 1000, 0, 0, NULL, 0, { NULL }, { 0 }, 0, NULL, 0, 0,
+    0, FB_DEFAULT_COLS, FB_DEFAULT_ROWS, FB_DEFAULT_FPS, 0,
+    NULL, NULL, STATS_DEFAULT_INTERVAL_MS, NULL, NULL, 0, 0, 0,
+    NULL, 0, DISK_DEFAULT_SEEK_CYCLES, DISK_DEFAULT_BYTE_CYCLES, NULL };
 
 char const *argp_program_version = "simulator " MINICOMP_VERSION;
 char const *argp_program_bug_address = "<boris.carlsson@gmail.com>";
@@ -68,9 +165,127 @@ static struct argp_option gs_argp_options[] = {
     { "profile", 'P', NULL, 0, "Print profile information at the end", 0 },
     { "no-profile", 'p', NULL, OPTION_HIDDEN, "Print profile information at the end", 0 },
     { "number-input", 'N', NULL, 0, "Parse input as numbers before sending to computer", 0 },
+    { "xram-size", 'X', "BYTES", 0, "Size of the extended RAM peripheral. Default 65536", 0 },
+    { "xram-dma-cycles", OPT_XRAM_DMA_CYCLES, "N", 0, "Cycles per byte for extended RAM DMA. Default 1", 0 },
+    { "math-cycles", OPT_MATH_CYCLES, "OP=N[,..]", 0, "Cost of math coprocessor ops (add, sub, mul, divmod, cmp). Default 7", 0 },
+    { "cpus", 'M', "N", 0, "Run N CPUs with the same image (implies --fast)", 0 },
+    { "quantum", OPT_QUANTUM, "N", 0, "Cycles each CPU runs in turn in deterministic mode. Default 1000", 0 },
+    { "parallel", OPT_PARALLEL, NULL, 0, "Run every CPU on its own host thread (not deterministic)", 0 },
+    { "shared-ram", OPT_SHARED_RAM, NULL, 0, "Enable the RAM window shared by all CPUs", 0 },
+    { "set-ram", OPT_SET_RAM, "ADDR=VAL[,..]", 0, "Patch the RAM image after loading it", 0 },
+    { "set-ram-label", OPT_SET_RAM_LABEL, "NAME[+N]=VAL[,..]", 0, "Patch the RAM image at a label (needs --label-file)", 0 },
+    { "label-file", OPT_LABEL_FILE, "FILE", 0, "Label file written by asm_compiler --label-file", 0 },
+    { "debug", 'D', NULL, 0, "Start in the debugger, reading commands from stdin (implies --batch-mode)", 0 },
+    { "debug-script", OPT_DEBUG_SCRIPT, "FILE", 0, "Start in the debugger, reading commands from FILE", 0 },
+    { "undo-log", OPT_UNDO_LOG, "N", 0, "Record the last N instructions, for stepping back in the debugger or a dump at the end", 0 },
+    { "no-idle-wait", OPT_NO_IDLE_WAIT, NULL, 0, "Keep simulating while the program waits for keyboard input", 0 },
+    { "fb", OPT_FB, "COLSxROWS", OPTION_ARG_OPTIONAL, "Enable the framebuffer display. Default 80x24", 0 },
+    { "fb-fps", OPT_FB_FPS, "N", 0, "Maximum framebuffer redraws per second. Default 30", 0 },
+    { "fb-printer", OPT_FB_PRINTER, NULL, 0, "Send the ASCII printer to the framebuffer (implies --fb)", 0 },
+    { "stats-file", OPT_STATS_FILE, "FILE", 0, "Write statistics to FILE every --stats-interval", 0 },
+    { "stats-socket", OPT_STATS_SOCKET, "PATH", 0, "Serve statistics on a Unix domain socket", 0 },
+    { "stats-interval", OPT_STATS_INTERVAL, "MS", 0, "Milliseconds between statistics file updates. Default 1000", 0 },
+    { "map", OPT_MAP, "FILE", 0, "Source map written by asm_compiler --map, adds cycles per line and label to --profile", 0 },
+    { "trace", OPT_TRACE, "FILE", 0, "Write every instruction to FILE, read it with tracetool (implies --fast)", 0 },
+    { "perf", OPT_PERF, NULL, 0, "Enable the performance counter devices and print the region report at the end", 0 },
+    { "perf-regions", OPT_PERF_REGIONS, "ID=NAME[,..]", 0, "Names of the regions in the --perf report (implies --perf)", 0 },
+    { "latency", OPT_LATENCY, "IN=OUT[,..]", 0, "Histograms of the time from a read of port IN to the next write to port OUT", 0 },
+    { "chan", OPT_CHAN, "IN:OUT[:STATUS]=PATH[,OUTPATH]", 0, "Connect ports to a Unix domain socket or FIFO at PATH", 0 },
+    { "disk", OPT_DISK, "FILE", 0, "Enable the block storage device, backed by FILE", 0 },
+    { "disk-sectors", OPT_DISK_SECTORS, "N", 0, "Create or extend the --disk file to N sectors of 256 bytes", 0 },
+    { "disk-seek-cycles", OPT_DISK_SEEK_CYCLES, "N", 0, "Cycles per block storage DMA transfer. Default 100", 0 },
+    { "disk-byte-cycles", OPT_DISK_BYTE_CYCLES, "N", 0, "Cycles per byte for block storage DMA. Default 1", 0 },
+    { "branch-profile", OPT_BRANCH_PROFILE, "FILE", 0, "Write branch and block counts to FILE for asm_compiler --profile-use (implies --fast)", 0 },
     { 0, 0, 0, 0, 0, 0 }
 };
 
+/* Parse "op=cycles,op=cycles" for the math coprocessor cost model */
+static int parse_math_cycles(char *arg)
+{
+    char *tok;
+
+    for(tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        int op;
+
+        if(eq == NULL) return -1;
+        *eq = '\0';
+        for(op = 0; op < PERI_MATH_OP_NR; op++) {
+            if(strcmp(tok, peri_math_op_name[op]) == 0) break;
+        }
+        if(op == PERI_MATH_OP_NR) return -1;
+        peri_math_set_cycles(op, strtoul(eq + 1, NULL, 0));
+    }
+    return 0;
+}
+
+/* Find the value of a label in the label file, -1 if it is not there */
+static int find_label(char const *name)
+{
+    char upper[256];
+    char buf[256];
+    int val = -1;
+    int i;
+    FILE *fp;
+
+    /* asm_compiler stores label names in upper case */
+    for(i = 0; name[i] && i < (int)sizeof(upper) - 1; i++) {
+        upper[i] = (char)toupper((unsigned char)name[i]);
+    }
+    upper[i] = '\0';
+
+    if(gs_arg.label_file == NULL || (fp = fopen(gs_arg.label_file, "r")) == NULL) return -1;
+    while(fscanf(fp, "%255s %d", buf, &val) == 2) {
+        if(strcmp(buf, upper) == 0) break;
+        val = -1;
+    }
+    fclose(fp);
+
+    return val;
+}
+
+/* Apply "ADDR=VAL,.." or, for labels, "NAME[+N]=VAL,.." to the RAM */
+static int apply_ram_patch(unsigned char *ram, char *arg, int is_label)
+{
+    char *tok;
+
+    for(tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        char *end;
+        long addr, val;
+
+        if(eq == NULL) {
+            fprintf(stderr, "ERROR: Missing '=' in RAM patch '%s'.\n", tok);
+            return -1;
+        }
+        *eq = '\0';
+        if(is_label) {
+            char *plus = strchr(tok, '+');
+            long offset = 0;
+
+            if(plus) {
+                *plus = '\0';
+                offset = strtol(plus + 1, NULL, 0);
+            }
+            if((addr = find_label(tok)) < 0) {
+                fprintf(stderr, "ERROR: Unknown label '%s'.\n", tok);
+                return -1;
+            }
+            addr += offset;
+        } else {
+            addr = strtol(tok, &end, 0);
+            if(*end != '\0') addr = -1;
+        }
+        val = strtol(eq + 1, &end, 0);
+        if(addr < 0 || addr >= COMPUTER_RAM_SIZE || *end != '\0' || val < -128 || val > 255) {
+            fprintf(stderr, "ERROR: Invalid RAM patch '%s=%s'.\n", tok, eq + 1);
+            return -1;
+        }
+        ram[addr] = (unsigned char)val;
+    }
+    return 0;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
     struct arguments *arguments = state->input;
@@ -112,6 +327,112 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         case 'N':
             arguments->number_input = 1;
             break;
+        case 'X':
+            peri_xram_set_size(strtoul(arg, NULL, 0));
+            break;
+        case OPT_XRAM_DMA_CYCLES:
+            peri_xram_set_dma_cycles(strtoul(arg, NULL, 0));
+            break;
+        case OPT_MATH_CYCLES:
+            if(parse_math_cycles(arg)) argp_usage(state);
+            break;
+        case 'M':
+            arguments->cpu_nr = (int)strtol(arg, NULL, 10);
+            if(arguments->cpu_nr < 1 || arguments->cpu_nr > MULTI_MAX_CPUS) argp_usage(state);
+            break;
+        case OPT_QUANTUM:
+            arguments->quantum = strtoul(arg, NULL, 10);
+            if(arguments->quantum == 0) argp_usage(state);
+            break;
+        case OPT_PARALLEL:
+            arguments->parallel = 1;
+            break;
+        case OPT_SHARED_RAM:
+            arguments->shared_ram = 1;
+            break;
+        case OPT_SET_RAM:
+        case OPT_SET_RAM_LABEL:
+            if(arguments->ram_patch_nr == MAX_RAM_PATCHES) argp_usage(state);
+            arguments->ram_patch_is_label[arguments->ram_patch_nr] = key == OPT_SET_RAM_LABEL;
+            arguments->ram_patch[arguments->ram_patch_nr++] = arg;
+            break;
+        case OPT_LABEL_FILE:
+            arguments->label_file = arg;
+            break;
+        case 'D':
+            arguments->debug = 1;
+            arguments->batch_mode = 1;
+            break;
+        case OPT_DEBUG_SCRIPT:
+            arguments->debug_script = arg;
+            break;
+        case OPT_NO_IDLE_WAIT:
+            arguments->no_idle_wait = 1;
+            break;
+        case OPT_UNDO_LOG:
+            arguments->undo_log_size = strtoul(arg, NULL, 0);
+            if(arguments->undo_log_size == 0) argp_usage(state);
+            break;
+        case OPT_FB:
+            arguments->fb = 1;
+            if(arg && sscanf(arg, "%dx%d", &arguments->fb_cols, &arguments->fb_rows) != 2) argp_usage(state);
+            break;
+        case OPT_FB_FPS:
+            arguments->fb_fps = atoi(arg);
+            if(arguments->fb_fps <= 0) argp_usage(state);
+            break;
+        case OPT_FB_PRINTER:
+            arguments->fb = 1;
+            arguments->fb_printer = 1;
+            break;
+        case OPT_STATS_FILE:
+            arguments->stats_file = arg;
+            break;
+        case OPT_STATS_SOCKET:
+            arguments->stats_socket = arg;
+            break;
+        case OPT_STATS_INTERVAL:
+            arguments->stats_interval = strtoul(arg, NULL, 0);
+            if(arguments->stats_interval == 0) argp_usage(state);
+            break;
+        case OPT_MAP:
+            arguments->map_file = arg;
+            break;
+        case OPT_TRACE:
+            arguments->trace_file = arg;
+            arguments->fast = 1;
+            break;
+        case OPT_PERF:
+            arguments->perf = 1;
+            break;
+        case OPT_PERF_REGIONS:
+            arguments->perf = 1;
+            if(perf_set_region_names(arg)) argp_usage(state);
+            break;
+        case OPT_LATENCY:
+            arguments->latency = 1;
+            if(latency_add_rules(arg)) argp_usage(state);
+            break;
+        case OPT_CHAN:
+            arguments->chan = 1;
+            if(chan_parse(arg)) argp_usage(state);
+            break;
+        case OPT_DISK:
+            arguments->disk_file = arg;
+            break;
+        case OPT_DISK_SECTORS:
+            arguments->disk_sectors = strtoul(arg, NULL, 0);
+            break;
+        case OPT_DISK_SEEK_CYCLES:
+            arguments->disk_seek_cycles = strtoul(arg, NULL, 0);
+            break;
+        case OPT_DISK_BYTE_CYCLES:
+            arguments->disk_byte_cycles = strtoul(arg, NULL, 0);
+            break;
+        case OPT_BRANCH_PROFILE:
+            arguments->branch_profile_file = arg;
+            arguments->fast = 1;
+            break;
         case ARGP_KEY_ARG:
             if(state->arg_num == 0) arguments->ram_file = arg;
             break;
@@ -177,8 +498,23 @@ static void finalize_screen()
 
 static void finalize()
 {
+    fb_finalize();
+    stats_finalize();
+    chan_finalize();
+    disk_finalize();
+    trace_close();
+    if(gs_arg.branch_profile_file && profile_write(&gs_branch_profile, gs_arg.branch_profile_file)) {
+        fprintf(stderr, "ERROR: Can not write the branch profile to '%s'.\n", gs_arg.branch_profile_file);
+    }
     if(gs_arg.print_total_clock_cycles) {
-        printf("Total clock-cycles: %ld.\n", gs_comp.clock_cycle);
+        if(gs_multi) {
+            int i;
+            for(i = 0; i < multi_get_cpu_nr(gs_multi); i++) {
+                printf("CPU %d total clock-cycles: %ld.\n", i, multi_get_cpu(gs_multi, i)->clock_cycle);
+            }
+        } else {
+            printf("Total clock-cycles: %ld.\n", gs_comp.clock_cycle);
+        }
     }
     if(gs_arg.profile) {
         int i;
@@ -187,23 +523,62 @@ static void finalize()
         printf("%3s: %-10s %20s %7s\n", "pos", "instr.", "count", "percent");
         for(i = 0; i < COMPUTER_RAM_SIZE; i++) {
             char name[10];
+            /* 64 KiB are too many lines, only show what ran */
+            if(COMPUTER_ADDR_BITS > 8 && gs_profile_count[i] == 0) continue;
             computer_get_instruction_name(gs_comp.ram[i], name);
             printf("%03d: %-10s %20lu %6.2f%%\n", i, name, gs_profile_count[i], 600 * (double)gs_profile_count[i] / (double)gs_comp.clock_cycle);
         }
+        if(gs_srcmap_loaded) {
+            srcmap_print_profile(&gs_srcmap, gs_arg.fast ? gs_profile_count : gs_profile_instr, gs_profile_cycles, 0, stdout);
+        }
     }
+    if(gs_arg.perf) perf_print_report(stdout);
+    if(gs_arg.latency) latency_print_report(stdout);
+    if(gs_srcmap_loaded) srcmap_free(&gs_srcmap);
     finalize_screen();
+    /* After the screen is restored, so the dump can be read or redirected */
+    if(gs_undo && gs_undo_dump) {
+        fprintf(stderr, "--- Undo log, oldest first ---\n");
+        undo_dump(gs_undo, &gs_comp, stderr);
+    }
+    undo_destroy(gs_undo);
+    gs_undo = NULL;
 }
 
 #ifdef HAVE_SIGNAL
 static void sig_handler(int signo)
 {
     if(signo == SIGINT) {
+        if(gs_debugger) {
+            debug_interrupt();
+            return;
+        }
+        if(gs_undo) {
+            gs_undo_interrupt = 1;
+            return;
+        }
+        if(gs_multi) multi_stop(gs_multi);
         finalize();
         exit(EXIT_FAILURE);
     }
+    if(signo == SIGUSR1) {
+        stats_request_report();
+        latency_request_report();
+    }
 }
 #endif
 
+static void run_debugger(FILE *in)
+{
+    if((gs_debugger = debug_create(&gs_comp, in, gs_arg.label_file ? find_label : NULL)) == NULL) return;
+    /* An interactive session can look at the log itself */
+    gs_undo_dump = gs_undo && !isatty(fileno(in));
+    debug_set_undo_log(gs_debugger, gs_undo);
+    debug_run(gs_debugger);
+    debug_destroy(gs_debugger);
+    gs_debugger = NULL;
+}
+
 int main(int argc, char *argv[])
 {
 #ifdef HAVE_TIMING
@@ -214,6 +589,9 @@ int main(int argc, char *argv[])
     if(signal(SIGINT, sig_handler) == SIG_ERR) {
         fprintf(stderr, "Warning: Can not catch SIGINT.\n");
     }
+    if(signal(SIGUSR1, sig_handler) == SIG_ERR) {
+        fprintf(stderr, "Warning: Can not catch SIGUSR1.\n");
+    }
 #endif
 
     argp_parse(&gs_argp, argc, argv, 0, 0, &gs_arg);
@@ -224,51 +602,249 @@ int main(int argc, char *argv[])
     if (gs_arg.number_input) {
         peri_keyboard_set_input_mode(PERI_INPUT_MODE_NUMBER);
     }
+    /* Other CPUs may still be working while one waits for input */
+    if(!gs_arg.no_idle_wait && gs_arg.cpu_nr == 0) {
+#ifdef HAVE_TIMING
+        peri_set_idle_wait(1, gs_arg.fast ? 0 : gs_arg.frequency);
+#else
+        peri_set_idle_wait(1, 0);
+#endif
+    }
+#ifdef HAVE_TIMING
+    /* Only the single CPU run loop keeps to the frequency */
+    if(!gs_arg.fast && gs_arg.cpu_nr == 0 && !gs_arg.debug && !gs_arg.debug_script) {
+        peri_timer_set_frequency(gs_arg.frequency);
+    }
+#endif
 
     init_screen();
+    if(gs_arg.fb && fb_init(gs_arg.fb_cols, gs_arg.fb_rows, gs_arg.fb_fps, gs_arg.fb_printer)) {
+        fprintf(stderr, "ERROR: Can not create a %dx%d framebuffer.\n", gs_arg.fb_cols, gs_arg.fb_rows);
+        goto clean;
+    }
+
+    if(gs_arg.disk_file && disk_init(gs_arg.disk_file, gs_arg.disk_sectors)) {
+        fprintf(stderr, "ERROR: Can not map the disk file '%s'.\n", gs_arg.disk_file);
+        goto clean;
+    }
+    disk_set_cycles(gs_arg.disk_seek_cycles, gs_arg.disk_byte_cycles);
 
     computer_reset(&gs_comp);
+    computer_devices_init(&gs_devices);
+    fb_attach(&gs_devices);
+    disk_attach(&gs_devices);
+    if(gs_arg.perf) {
+        perf_init();
+        perf_attach(&gs_devices);
+    }
+    chan_attach(&gs_devices);
+    latency_attach(&gs_devices);
+    /* Only count IO when statistics are asked for, --cpus counts its own devices */
+    if(gs_arg.cpu_nr == 0) {
+        if(gs_arg.stats_file || gs_arg.stats_socket) {
+            stats_attach(&gs_devices);
+        } else {
+            stats_attach_on_request(&gs_devices);
+        }
+    }
+    gs_comp.dev = &gs_devices;
+    if(stats_init(gs_arg.stats_file, gs_arg.stats_socket, gs_arg.stats_interval)) {
+        fprintf(stderr, "ERROR: Can not start the statistics reporter.\n");
+        goto clean;
+    }
+    if(chan_init()) {
+        fprintf(stderr, "ERROR: Can not open the channel.\n");
+        goto clean;
+    }
 
     {
+        unsigned char header[COMPUTER_IMAGE_HEADER_SIZE];
         FILE *fp;
-        int i;
+        size_t len;
+        int skip;
         if((fp = fopen(gs_arg.ram_file, "rb")) == NULL) {
             fprintf(stderr, "ERROR: Can not open file '%s' for reading.\n'", gs_arg.ram_file);
             goto clean;
         }
-        for(i = 0; i < COMPUTER_RAM_SIZE; i++) {
-            int c = fgetc(fp);
-            if(c == EOF) break;
-            gs_comp.ram[i] = (unsigned char)c;
+        len = fread(header, 1, sizeof(header), fp);
+        if((skip = computer_image_check(header, len)) < 0) {
+            fprintf(stderr, "ERROR: '%s' is not a %d-bit image, run it with %s.\n", gs_arg.ram_file,
+                    COMPUTER_ADDR_BITS, COMPUTER_ADDR_BITS == 8 ? "simulator16" : "simulator");
+            fclose(fp);
+            goto clean;
         }
+        len -= (size_t)skip;
+        memcpy(gs_comp.ram, header + skip, len);
+        fread(gs_comp.ram + len, 1, COMPUTER_RAM_SIZE - len, fp);
         fclose(fp);
     }
+    /* Before the patches, so the profile matches the image from the assembler */
+    if(gs_arg.branch_profile_file) profile_init(&gs_branch_profile, gs_comp.ram, COMPUTER_RAM_SIZE);
+
+    {
+        int i;
+        for(i = 0; i < gs_arg.ram_patch_nr; i++) {
+            if(apply_ram_patch(gs_comp.ram, gs_arg.ram_patch[i], gs_arg.ram_patch_is_label[i])) goto clean;
+        }
+    }
 
-    if(gs_arg.fast) {
-        if(gs_arg.print_interval || gs_arg.profile) {
-            unsigned long last_print = 0;
-            while(computer_is_running(&gs_comp)) {
+    if(gs_arg.map_file) {
+        if(srcmap_load(&gs_srcmap, gs_arg.map_file)) {
+            fprintf(stderr, "ERROR: '%s' is not a source map.\n", gs_arg.map_file);
+            goto clean;
+        }
+        gs_srcmap_loaded = 1;
+    }
+
+    if(gs_arg.debug || gs_arg.debug_script) {
+        FILE *in = stdin;
+        if(gs_arg.cpu_nr > 0) {
+            fprintf(stderr, "ERROR: The debugger can not be used with --cpus.\n");
+            goto clean;
+        }
+        if(gs_arg.trace_file) {
+            fprintf(stderr, "ERROR: The debugger can not be used with --trace.\n");
+            goto clean;
+        }
+        if(gs_arg.perf) {
+            fprintf(stderr, "ERROR: The debugger can not be used with --perf.\n");
+            goto clean;
+        }
+        if(gs_arg.branch_profile_file) {
+            fprintf(stderr, "ERROR: The debugger can not be used with --branch-profile.\n");
+            goto clean;
+        }
+        if(gs_arg.debug_script && (in = fopen(gs_arg.debug_script, "r")) == NULL) {
+            fprintf(stderr, "ERROR: Can not open file '%s' for reading.\n", gs_arg.debug_script);
+            goto clean;
+        }
+        if(gs_arg.undo_log_size && (gs_undo = undo_create(gs_arg.undo_log_size)) == NULL) {
+            fprintf(stderr, "ERROR: Can not allocate an undo log of %lu instructions.\n", gs_arg.undo_log_size);
+        }
+        run_debugger(in);
+        if(in != stdin) fclose(in);
+    } else if(gs_arg.undo_log_size && (gs_arg.cpu_nr > 0 || !gs_arg.fast)) {
+        fprintf(stderr, "ERROR: --undo-log needs --fast or the debugger, and can not be used with --cpus.\n");
+    } else if(gs_arg.undo_log_size && (gs_arg.trace_file || gs_arg.perf || gs_arg.branch_profile_file)) {
+        fprintf(stderr, "ERROR: --undo-log can not be used with --trace, --perf or --branch-profile.\n");
+    } else if(gs_arg.trace_file && gs_arg.cpu_nr > 0) {
+        fprintf(stderr, "ERROR: --trace can not be used with --cpus.\n");
+    } else if(gs_arg.perf && gs_arg.cpu_nr > 0) {
+        fprintf(stderr, "ERROR: --perf can not be used with --cpus.\n");
+    } else if(gs_arg.latency && gs_arg.cpu_nr > 0) {
+        fprintf(stderr, "ERROR: --latency can not be used with --cpus.\n");
+    } else if(gs_arg.chan && gs_arg.cpu_nr > 0) {
+        fprintf(stderr, "ERROR: --chan can not be used with --cpus.\n");
+    } else if(gs_arg.branch_profile_file && gs_arg.cpu_nr > 0) {
+        fprintf(stderr, "ERROR: --branch-profile can not be used with --cpus.\n");
+    } else if(gs_arg.cpu_nr > 0) {
+        if((gs_multi = multi_create(gs_arg.cpu_nr, gs_arg.shared_ram)) == NULL) {
+            fprintf(stderr, "ERROR: Can not create %d CPUs.\n", gs_arg.cpu_nr);
+            goto clean;
+        }
+        multi_load(gs_multi, gs_comp.ram, COMPUTER_RAM_SIZE);
+        fb_attach(multi_get_devices(gs_multi));
+        disk_attach(multi_get_devices(gs_multi));
+        if(gs_arg.stats_file || gs_arg.stats_socket) {
+            stats_attach(multi_get_devices(gs_multi));
+        } else if(!gs_arg.parallel) {
+            /* The CPU threads of --parallel use the devices while SIGUSR1 arrives */
+            stats_attach_on_request(multi_get_devices(gs_multi));
+        }
+        if(gs_arg.parallel) {
+            if(multi_run_parallel(gs_multi)) {
+                fprintf(stderr, "ERROR: Can not start CPU threads.\n");
+            }
+        } else {
+            multi_run_deterministic(gs_multi, gs_arg.quantum);
+        }
+    } else if(gs_arg.fast) {
+        unsigned long last_print = 0;
+        if(gs_arg.trace_file && trace_open(gs_arg.trace_file, &gs_comp)) {
+            fprintf(stderr, "ERROR: Can not write a trace to '%s'.\n", gs_arg.trace_file);
+            goto clean;
+        }
+        if(gs_arg.undo_log_size) {
+            if((gs_undo = undo_create(gs_arg.undo_log_size)) == NULL) {
+                fprintf(stderr, "ERROR: Can not allocate an undo log of %lu instructions.\n", gs_arg.undo_log_size);
+                goto clean;
+            }
+            gs_undo_dump = 1;
+        }
+        if(gs_arg.profile || gs_arg.trace_file || gs_arg.perf || gs_arg.branch_profile_file) {
+            while(computer_is_running(&gs_comp) && !gs_undo_interrupt) {
                 if(gs_arg.print_interval && last_print + gs_arg.print_interval <= gs_comp.clock_cycle) {
                     printf("clock-cycles: %ld\n", gs_comp.clock_cycle);
                     last_print = gs_comp.clock_cycle;
                 }
-                if(gs_arg.profile) {
-                    gs_profile_count[gs_comp.iar]++;
+                computer_word iar = gs_comp.iar;
+                unsigned long start = gs_comp.clock_cycle;
+
+                gs_profile_count[iar]++;
+                if(gs_arg.perf) perf_count(&gs_comp);
+                if(gs_arg.trace_file) {
+                    trace_step(&gs_comp);
+                } else if(gs_undo) {
+                    undo_step(gs_undo, &gs_comp);
+                } else {
+                    computer_step_instruction_fast(&gs_comp);
                 }
-                computer_step_instruction_fast(&gs_comp);
+                gs_profile_cycles[iar] += gs_comp.clock_cycle - start;
+                if(gs_arg.branch_profile_file) profile_count(&gs_branch_profile, &gs_comp, iar);
+                stats_publish(&gs_comp, 1);
             }
         } else {
-            while(computer_is_running(&gs_comp)) {
-                computer_step_instruction_fast(&gs_comp);
+            /* Run in chunks that end at the next print, so that the engine
+             * does not check anything per instruction */
+            while(computer_is_running(&gs_comp) && !gs_undo_interrupt) {
+                unsigned long end = gs_comp.clock_cycle + RUN_CHUNK_CYCLES;
+                unsigned long instructions;
+
+                if(gs_arg.print_interval && last_print + gs_arg.print_interval < end) {
+                    end = last_print + gs_arg.print_interval;
+                }
+                if(gs_undo) {
+                    instructions = undo_run(gs_undo, &gs_comp, end);
+                } else {
+                    instructions = computer_run_fast(&gs_comp, end);
+                }
+                if(gs_arg.print_interval && last_print + gs_arg.print_interval <= gs_comp.clock_cycle) {
+                    printf("clock-cycles: %ld\n", gs_comp.clock_cycle);
+                    last_print = gs_comp.clock_cycle;
+                }
+                stats_publish(&gs_comp, instructions);
             }
         }
+        if(gs_undo_interrupt) {
+            /* Ctrl-C while recording goes to the debugger, with the history,
+             * if there is a terminal to type commands on. Otherwise the log
+             * is written by finalize(). */
+            if(!isatty(fileno(stdin))) {
+                finalize();
+                exit(EXIT_FAILURE);
+            }
+            run_debugger(stdin);
+        }
     } else {
         unsigned long last_print = 0;
+        computer_word profile_iar = 0;
         while(computer_is_running(&gs_comp)) {
 #ifdef HAVE_TIMING
             double cycle_start = time_now();
 #endif
+            int instruction_start = gs_comp.clock_cycle % COMPUTER_INSTR_LEN == 0;
+
+            if(gs_arg.perf && instruction_start) perf_count(&gs_comp);
+
+            if(gs_arg.profile) {
+                if(instruction_start) {
+                    profile_iar = gs_comp.iar;
+                    gs_profile_instr[profile_iar]++;
+                }
+                gs_profile_cycles[profile_iar]++;
+            }
             computer_step_cycle(&gs_comp);
+            stats_publish(&gs_comp, (unsigned long)instruction_start);
             
             if(gs_arg.print_interval) {
                 if(last_print + gs_arg.print_interval <= gs_comp.clock_cycle) {
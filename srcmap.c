@@ -0,0 +1,244 @@
+#include "srcmap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+struct srcmap_group {
+    int file;
+    int line; /* Label index when grouping by label */
+    int is_code;
+    unsigned long count;
+    unsigned long cycles;
+};
+
+/* Lines of the source files, read when a profile is printed */
+struct srcmap_source {
+    char *text;
+    char **line;
+    int line_nr;
+};
+
+static void *xmalloc(size_t s)
+{
+    void *d;
+
+    if((d = malloc(s)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return d;
+}
+
+static int intern(struct srcmap *map, char const *name)
+{
+    int i;
+
+    for(i = 0; i < map->name_nr; i++) {
+        if(strcmp(map->name[i], name) == 0) return i;
+    }
+    if((map->name_nr & (map->name_nr - 1)) == 0) {
+        char **name_new = realloc(map->name, sizeof(*map->name) * (size_t)(map->name_nr ? 2 * map->name_nr : 1));
+
+        if(name_new == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        map->name = name_new;
+    }
+    map->name[map->name_nr] = xmalloc(strlen(name) + 1);
+    strcpy(map->name[map->name_nr], name);
+    return map->name_nr++;
+}
+
+int srcmap_load(struct srcmap *map, char const *file)
+{
+    char buf[BUFSIZ];
+    FILE *fp;
+    int first = 1;
+
+    memset(map, 0, sizeof(*map));
+    if((fp = fopen(file, "r")) == NULL) return -1;
+    while(fgets(buf, sizeof(buf), fp)) {
+        char label[BUFSIZ];
+        char *end = buf + strlen(buf);
+        int pos, line, n;
+        char kind;
+
+        while(end > buf && isspace((unsigned char)end[-1])) *--end = '\0';
+        if(first) {
+            first = 0;
+            if(strcmp(buf, SRCMAP_MAGIC) != 0) break;
+            continue;
+        }
+        if(buf[0] == '\0' || buf[0] == '#') continue;
+        if(sscanf(buf, "%d %d %c %s %n", &pos, &line, &kind, label, &n) != 4 || buf[n] == '\0' ||
+           pos < 0 || pos >= COMPUTER_RAM_SIZE || line <= 0 || (kind != 'c' && kind != 'd')) {
+            first = 1;
+            break;
+        }
+        map->pos[pos].line = line;
+        map->pos[pos].is_data = kind == 'd';
+        map->pos[pos].file = intern(map, buf + n);
+        map->pos[pos].label = strcmp(label, "-") == 0 ? -1 : intern(map, label);
+    }
+    fclose(fp);
+    if(first) {
+        srcmap_free(map);
+        return -1;
+    }
+    return 0;
+}
+
+void srcmap_free(struct srcmap *map)
+{
+    int i;
+
+    for(i = 0; i < map->name_nr; i++) free(map->name[i]);
+    free(map->name);
+    memset(map, 0, sizeof(*map));
+}
+
+static void source_read(struct srcmap_source *src, char const *file)
+{
+    FILE *fp;
+    long size;
+    char *p;
+
+    memset(src, 0, sizeof(*src));
+    if((fp = fopen(file, "r")) == NULL) return;
+    if(fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+        src->text = xmalloc((size_t)size + 1);
+        size = (long)fread(src->text, 1, (size_t)size, fp);
+        src->text[size] = '\0';
+        src->line = xmalloc(sizeof(*src->line) * (size_t)(size + 1));
+        for(p = src->text; *p; ) {
+            char *nl = strchr(p, '\n');
+
+            src->line[src->line_nr++] = p;
+            if(nl == NULL) break;
+            *nl = '\0';
+            p = nl + 1;
+        }
+    }
+    fclose(fp);
+}
+
+static char const *source_line(struct srcmap_source const *src, int line)
+{
+    char const *s;
+
+    if(line > src->line_nr) return "";
+    for(s = src->line[line - 1]; isspace((unsigned char)*s); s++);
+    return s;
+}
+
+static int compare_group(void const *a, void const *b)
+{
+    struct srcmap_group const *ga = a;
+    struct srcmap_group const *gb = b;
+
+    if(ga->cycles != gb->cycles) return ga->cycles < gb->cycles ? 1 : -1;
+    if(ga->file != gb->file) return ga->file - gb->file;
+    return ga->line - gb->line;
+}
+
+static int compare_line(void const *a, void const *b)
+{
+    struct srcmap_group const *ga = a;
+    struct srcmap_group const *gb = b;
+
+    if(ga->file != gb->file) return ga->file - gb->file;
+    return ga->line - gb->line;
+}
+
+/* Sum count and cycles of the positions with the same file and line, or
+ * with the same label if by_label. One entry per position is sorted by
+ * file and line, then equal neighbours are merged. */
+static int group(struct srcmap const *map, unsigned long const *count, unsigned long const *cycles,
+                 int by_label, struct srcmap_group *g)
+{
+    int i, j, n = 0;
+
+    for(i = 0; i < COMPUTER_RAM_SIZE; i++) {
+        struct srcmap_pos const *p = &map->pos[i];
+
+        if(p->line == 0 || (by_label && p->label < 0)) continue;
+        g[n].file = by_label ? 0 : p->file;
+        g[n].line = by_label ? p->label : p->line;
+        g[n].is_code = !p->is_data;
+        g[n].count = count[i];
+        g[n].cycles = cycles[i];
+        n++;
+    }
+    qsort(g, (size_t)n, sizeof(g[0]), compare_line);
+    for(i = j = 0; i < n; i++) {
+        if(j > 0 && g[j - 1].file == g[i].file && g[j - 1].line == g[i].line) {
+            g[j - 1].is_code |= g[i].is_code;
+            g[j - 1].count += g[i].count;
+            g[j - 1].cycles += g[i].cycles;
+        } else {
+            g[j++] = g[i];
+        }
+    }
+    return j;
+}
+
+void srcmap_print_profile(struct srcmap const *map, unsigned long const *count, unsigned long const *cycles,
+                          int top, FILE *fp)
+{
+    struct srcmap_group *g = xmalloc(sizeof(*g) * COMPUTER_RAM_SIZE);
+    struct srcmap_source *src = xmalloc(sizeof(*src) * (size_t)(map->name_nr + 1));
+    unsigned long total = 0;
+    int i, n, shown;
+
+    for(i = 0; i < COMPUTER_RAM_SIZE; i++) total += cycles[i];
+    if(total == 0) total = 1;
+    /* Only the names used as files are read */
+    memset(src, 0, sizeof(*src) * (size_t)(map->name_nr + 1));
+    for(i = 0; i < COMPUTER_RAM_SIZE; i++) {
+        if(map->pos[i].line && src[map->pos[i].file].line_nr == 0) {
+            source_read(&src[map->pos[i].file], map->name[map->pos[i].file]);
+            if(src[map->pos[i].file].line == NULL) src[map->pos[i].file].line_nr = -1;
+        }
+    }
+
+    fprintf(fp, "--- Cycles per source line ---\n");
+    fprintf(fp, "%-24s %20s %20s %7s  %s\n", "line", "count", "cycles", "percent", "source");
+    n = group(map, count, cycles, 0, g);
+    qsort(g, (size_t)n, sizeof(g[0]), compare_group);
+    for(i = shown = 0; i < n && (top <= 0 || shown < top); i++) {
+        char where[BUFSIZ];
+
+        if(g[i].count == 0) continue;
+        snprintf(where, sizeof(where), "%s:%d", map->name[g[i].file], g[i].line);
+        fprintf(fp, "%-24s %20lu %20lu %6.2f%%  %s\n", where, g[i].count, g[i].cycles,
+                100 * (double)g[i].cycles / (double)total, source_line(&src[g[i].file], g[i].line));
+        shown++;
+    }
+
+    fprintf(fp, "--- Cycles per label ---\n");
+    fprintf(fp, "%-24s %20s %20s %7s\n", "label", "count", "cycles", "percent");
+    n = group(map, count, cycles, 1, g);
+    qsort(g, (size_t)n, sizeof(g[0]), compare_group);
+    for(i = shown = 0; i < n && (top <= 0 || shown < top); i++) {
+        if(g[i].count == 0) continue;
+        fprintf(fp, "%-24s %20lu %20lu %6.2f%%\n", map->name[g[i].line], g[i].count, g[i].cycles,
+                100 * (double)g[i].cycles / (double)total);
+        shown++;
+    }
+
+    fprintf(fp, "--- Lines not run ---\n");
+    n = group(map, count, cycles, 0, g);
+    qsort(g, (size_t)n, sizeof(g[0]), compare_line);
+    for(i = 0; i < n; i++) {
+        if(g[i].count || !g[i].is_code) continue;
+        fprintf(fp, "%s:%d  %s\n", map->name[g[i].file], g[i].line, source_line(&src[g[i].file], g[i].line));
+    }
+
+    for(i = 0; i <= map->name_nr; i++) {
+        free(src[i].text);
+        free(src[i].line);
+    }
+    free(src);
+    free(g);
+}
@@ -0,0 +1,41 @@
+#ifndef SRCMAP_H_
+#define SRCMAP_H_
+
+#include <stdio.h>
+#include "computer.h"
+
+/* Source map, written by "asm_compiler --map" and "asm.py compile --map".
+ * After the SRCMAP_MAGIC line there is one line per RAM position where an
+ * instruction or a data byte starts:
+ *
+ *   POS LINE KIND LABEL FILE
+ *
+ * KIND is 'c' for an instruction and 'd' for data (". N"), LABEL is the
+ * last label defined before the line ('-' if none, "::" labels are not
+ * used) and FILE is the rest of the line. */
+
+#define SRCMAP_MAGIC "# minicomp map 1"
+
+struct srcmap_pos {
+    int line; /* 0 if nothing starts here */
+    int is_data;
+    int file; /* Index into name */
+    int label; /* Index into name, -1 if none */
+};
+
+struct srcmap {
+    struct srcmap_pos pos[COMPUTER_RAM_SIZE];
+    char **name; /* File and label names */
+    int name_nr;
+};
+
+/* Returns -1 if the file can not be read or is not a source map */
+int srcmap_load(struct srcmap *map, char const *file);
+void srcmap_free(struct srcmap *map);
+/* Print count and cycles per source line and per label, sorted by cycles
+ * (only the top lines if top > 0), followed by the instruction lines that
+ * never ran. count and cycles are indexed by RAM position. */
+void srcmap_print_profile(struct srcmap const *map, unsigned long const *count, unsigned long const *cycles,
+                          int top, FILE *fp);
+
+#endif
@@ -0,0 +1,244 @@
+#include "stats.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "config_impl.h"
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#   include <poll.h>
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#endif
+
+/* How often the reporter thread looks for clients and the stop flag */
+#define STATS_POLL_MS 100
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+/* The devices of --cpus --parallel are called from several threads */
+#define INC(x) __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+
+/* The counters at the previous report of one kind, for the MIPS since then */
+struct sample {
+    double time;
+    unsigned long instructions;
+};
+
+/* Written by the simulation thread only */
+static unsigned long gs_clock_cycle = 0;
+static unsigned long gs_instructions = 0;
+static unsigned long gs_iar = 0;
+static unsigned long gs_io_input_count[COMPUTER_ADDR_SIZE];
+static unsigned long gs_io_output_count[COMPUTER_ADDR_SIZE];
+
+static void (*gs_io_output[COMPUTER_ADDR_SIZE])(computer *, unsigned char);
+static void (*gs_io_input[COMPUTER_ADDR_SIZE])(computer *, unsigned char *);
+static volatile int gs_report_requested = 0;
+/* Devices to count once the first report is requested, see
+ * stats_attach_on_request() */
+static computer_devices *gs_pending_dev = NULL;
+static struct sample gs_signal_sample;
+
+#ifdef HAVE_PTHREAD
+static char const *gs_file = NULL;
+static char const *gs_socket_path = NULL;
+static int gs_socket = -1;
+static unsigned long gs_interval_ms = STATS_DEFAULT_INTERVAL_MS;
+static pthread_t gs_thread;
+static int gs_thread_running = 0;
+static int gs_stop = 0;
+static struct sample gs_file_sample;
+static struct sample gs_socket_sample;
+#endif
+
+static double time_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static void write_report(FILE *fp, struct sample *prev)
+{
+    unsigned long instructions = LOAD(gs_instructions);
+    double now = time_now();
+    double elapsed = now - prev->time;
+    int i;
+
+    fprintf(fp, "# TYPE minicomp_clock_cycles counter\nminicomp_clock_cycles %lu\n", LOAD(gs_clock_cycle));
+    fprintf(fp, "# TYPE minicomp_instructions counter\nminicomp_instructions %lu\n", instructions);
+    fprintf(fp, "# TYPE minicomp_mips gauge\nminicomp_mips %.3f\n",
+            elapsed > 0 ? (double)(instructions - prev->instructions) / elapsed * 1e-6 : 0.0);
+    fprintf(fp, "# TYPE minicomp_iar gauge\nminicomp_iar %lu\n", LOAD(gs_iar));
+    fprintf(fp, "# TYPE minicomp_io_operations counter\n");
+    for(i = 0; i < COMPUTER_ADDR_SIZE; i++) {
+        unsigned long in = LOAD(gs_io_input_count[i]);
+        unsigned long out = LOAD(gs_io_output_count[i]);
+
+        if(in) fprintf(fp, "minicomp_io_operations{addr=\"%d\",dir=\"in\"} %lu\n", i, in);
+        if(out) fprintf(fp, "minicomp_io_operations{addr=\"%d\",dir=\"out\"} %lu\n", i, out);
+    }
+    fflush(fp);
+    prev->time = now;
+    prev->instructions = instructions;
+}
+
+#ifdef HAVE_PTHREAD
+static void write_file(void)
+{
+    size_t len = strlen(gs_file);
+    char *tmp = malloc(len + 5);
+    FILE *fp;
+
+    if(tmp == NULL) return;
+    memcpy(tmp, gs_file, len);
+    memcpy(tmp + len, ".tmp", 5);
+    if((fp = fopen(tmp, "w")) != NULL) {
+        write_report(fp, &gs_file_sample);
+        if(fclose(fp) == 0) rename(tmp, gs_file);
+    }
+    free(tmp);
+}
+
+static void serve_client(void)
+{
+    int fd = accept(gs_socket, NULL, NULL);
+    FILE *fp;
+
+    if(fd < 0) return;
+    if((fp = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        return;
+    }
+    write_report(fp, &gs_socket_sample);
+    fclose(fp);
+}
+
+static void *stats_thread(void *arg)
+{
+    double next_file = time_now();
+
+    while(!__atomic_load_n(&gs_stop, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd;
+
+        pfd.fd = gs_socket;
+        pfd.events = POLLIN;
+        if(poll(&pfd, gs_socket >= 0 ? 1 : 0, STATS_POLL_MS) > 0 && (pfd.revents & POLLIN)) {
+            serve_client();
+        }
+        if(gs_file && time_now() >= next_file) {
+            write_file();
+            next_file += (double)gs_interval_ms * 1e-3;
+        }
+    }
+    return NULL;
+}
+
+static int open_socket(char const *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+int stats_init(char const *file, char const *socket_path, unsigned long interval_ms)
+{
+    gs_signal_sample.time = time_now();
+#ifdef HAVE_PTHREAD
+    gs_file_sample.time = gs_signal_sample.time;
+    gs_socket_sample.time = gs_signal_sample.time;
+#endif
+    if(file == NULL && socket_path == NULL) return 0;
+#ifdef HAVE_PTHREAD
+    gs_file = file;
+    gs_interval_ms = interval_ms;
+    if(socket_path) {
+        if((gs_socket = open_socket(socket_path)) < 0) return -1;
+        gs_socket_path = socket_path;
+    }
+    if(pthread_create(&gs_thread, NULL, stats_thread, NULL)) return -1;
+    gs_thread_running = 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static void count_output(computer *comp, unsigned char c)
+{
+    INC(gs_io_output_count[comp->io_addr]);
+    gs_io_output[comp->io_addr](comp, c);
+}
+
+static void count_input(computer *comp, unsigned char *c)
+{
+    INC(gs_io_input_count[comp->io_addr]);
+    gs_io_input[comp->io_addr](comp, c);
+}
+
+void stats_attach(computer_devices *dev)
+{
+    int i;
+
+    for(i = 0; i < COMPUTER_ADDR_SIZE; i++) {
+        if((gs_io_output[i] = dev->output[i]) != NULL) dev->output[i] = count_output;
+        if((gs_io_input[i] = dev->input[i]) != NULL) dev->input[i] = count_input;
+    }
+}
+
+void stats_attach_on_request(computer_devices *dev)
+{
+    gs_pending_dev = dev;
+}
+
+void stats_publish(computer const *comp, unsigned long instructions)
+{
+    STORE(gs_clock_cycle, comp->clock_cycle);
+    STORE(gs_instructions, gs_instructions + instructions);
+    STORE(gs_iar, comp->iar);
+    if(gs_report_requested) {
+        gs_report_requested = 0;
+        if(gs_pending_dev) {
+            stats_attach(gs_pending_dev);
+            gs_pending_dev = NULL;
+        }
+        write_report(stderr, &gs_signal_sample);
+    }
+}
+
+void stats_request_report(void)
+{
+    gs_report_requested = 1;
+}
+
+void stats_finalize(void)
+{
+#ifdef HAVE_PTHREAD
+    if(gs_thread_running) {
+        __atomic_store_n(&gs_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(gs_thread, NULL);
+        gs_thread_running = 0;
+        if(gs_file) write_file();
+    }
+    if(gs_socket >= 0) {
+        close(gs_socket);
+        unlink(gs_socket_path);
+        gs_socket = -1;
+    }
+#endif
+}
@@ -0,0 +1,39 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "computer.h"
+
+/* Live statistics. The run loop publishes its counters between chunks of
+ * instructions, and IO operations are counted by wrappers around the
+ * peripheral handlers, so the engine itself checks nothing. A reporter
+ * thread writes the counters as Prometheus text:
+ *
+ *  - to stderr when the process gets SIGUSR1
+ *  - to a file every interval (written to FILE.tmp and renamed)
+ *  - to every client that connects to a Unix domain socket
+ *
+ * Without pthreads only SIGUSR1 works, and the report is written from
+ * stats_publish(). minicomp_mips is the rate since the previous report of
+ * the same kind (since stats_init() for the first one). */
+
+#define STATS_DEFAULT_INTERVAL_MS 1000
+
+/* file and socket_path may be NULL. Returns -1 if the socket can not be
+ * created or the reporter thread can not be started. */
+int stats_init(char const *file, char const *socket_path, unsigned long interval_ms);
+/* Count IO operations per address through dev. Call after all
+ * peripherals are connected. */
+void stats_attach(computer_devices *dev);
+/* Count IO operations through dev from the first SIGUSR1 report on, so
+ * that runs without statistics do not go through the counting wrappers.
+ * dev must only be used by the thread calling stats_publish(). */
+void stats_attach_on_request(computer_devices *dev);
+/* Publish the state of comp, instructions is the number run since the
+ * previous call (by all CPUs with --cpus). Only one thread may call it. */
+void stats_publish(computer const *comp, unsigned long instructions);
+/* Ask for a report on stderr, may be called from a signal handler */
+void stats_request_report(void);
+/* Write the file a last time, stop the thread and remove the socket */
+void stats_finalize(void);
+
+#endif
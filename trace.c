@@ -0,0 +1,410 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "config_impl.h"
+#ifdef HAVE_PTHREAD
+#   include <pthread.h>
+#endif
+#ifdef HAVE_ZSTD
+#   include <zstd.h>
+#endif
+
+/* Buffers in flight between the run loop and the writer */
+#define TRACE_BUFFER_NR 4
+#define TRACE_ZSTD_LEVEL 3
+
+/* Encoding of an entry: tag, opcode, [iar], [RAM address], [value], [cycles] */
+#define TAG_IAR    1 /* iar is not the address after the previous instruction */
+#define TAG_CYCLES 2 /* cycles is not COMPUTER_FAST_INSTR_CYCLES */
+/* Worst case: tag, opcode, iar, address, value and a 64-bit varint */
+#define MAX_ENTRY_SIZE (2 + 3 * COMPUTER_IMM_LEN + 10)
+
+struct trace_raw {
+    computer_word iar;
+    unsigned char op;
+    computer_word target;
+    computer_word value;
+    unsigned int cycles;
+};
+
+struct trace_buffer {
+    struct trace_raw *raw;
+    unsigned long len;
+    unsigned long first_index;
+    unsigned long first_cycle;
+};
+
+static FILE *gs_fp = NULL;
+static int gs_error = 0;
+static struct trace_buffer gs_buffer[TRACE_BUFFER_NR];
+static struct trace_buffer *gs_cur = NULL;
+static unsigned long gs_index = 0;
+/* Encoded (and compressed) block, used by the writer only */
+static unsigned char *gs_out = NULL;
+#ifdef HAVE_ZSTD
+static unsigned char *gs_packed = NULL;
+static size_t gs_packed_size = 0;
+#endif
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t gs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gs_full_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t gs_free_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t gs_thread;
+static struct trace_buffer *gs_full[TRACE_BUFFER_NR];
+static int gs_full_first = 0;
+static int gs_full_nr = 0;
+static struct trace_buffer *gs_free[TRACE_BUFFER_NR];
+static int gs_free_nr = 0;
+static int gs_stop = 0;
+#endif
+
+static int write_kind(unsigned char op)
+{
+    int a = (op >> 2) & 3;
+
+    if(op & 128) return (op >> 4 & 7) == COMPUTER_ALU_CMP ? COMPUTER_WRITE_NONE : COMPUTER_WRITE_REG;
+    switch(op >> 4) {
+        case COMPUTER_INSTR_LD:
+        case COMPUTER_INSTR_DATA:
+            return COMPUTER_WRITE_REG;
+        case COMPUTER_INSTR_ST:
+            return COMPUTER_WRITE_RAM;
+        case COMPUTER_INSTR_IO:
+            return a == 0 || a == 1 ? COMPUTER_WRITE_REG : COMPUTER_WRITE_NONE;
+        default:
+            return COMPUTER_WRITE_NONE;
+    }
+}
+
+static void put_le(unsigned char *p, unsigned long long value, int len)
+{
+    int i;
+
+    for(i = 0; i < len; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static unsigned long long get_le(unsigned char const *p, int len)
+{
+    unsigned long long value = 0;
+    int i;
+
+    for(i = 0; i < len; i++) {
+        value |= (unsigned long long)p[i] << (8 * i);
+    }
+    return value;
+}
+
+static size_t encode(struct trace_buffer const *b, unsigned char *out)
+{
+    unsigned char *p = out;
+    int expected = -1;
+    unsigned long i;
+
+    for(i = 0; i < b->len; i++) {
+        struct trace_raw const *r = &b->raw[i];
+        int kind = write_kind(r->op);
+        unsigned char *tag = p;
+
+        *p++ = 0;
+        *p++ = r->op;
+        if(r->iar != expected) {
+            *tag |= TAG_IAR;
+            put_le(p, r->iar, COMPUTER_IMM_LEN);
+            p += COMPUTER_IMM_LEN;
+        }
+        if(kind == COMPUTER_WRITE_RAM) {
+            put_le(p, r->target, COMPUTER_IMM_LEN);
+            p += COMPUTER_IMM_LEN;
+        }
+        if(kind != COMPUTER_WRITE_NONE) {
+            put_le(p, r->value, COMPUTER_IMM_LEN);
+            p += COMPUTER_IMM_LEN;
+        }
+        if(r->cycles != COMPUTER_FAST_INSTR_CYCLES) {
+            unsigned long cycles = r->cycles;
+
+            *tag |= TAG_CYCLES;
+            while(cycles >= 128) {
+                *p++ = (unsigned char)(cycles | 128);
+                cycles >>= 7;
+            }
+            *p++ = (unsigned char)cycles;
+        }
+        expected = (r->iar + computer_get_instruction_length(r->op)) % COMPUTER_RAM_SIZE;
+    }
+    return (size_t)(p - out);
+}
+
+static void write_block(struct trace_buffer const *b)
+{
+    unsigned char header[TRACE_BLOCK_HEADER_SIZE];
+    size_t raw_size = encode(b, gs_out);
+    unsigned char const *data = gs_out;
+    size_t size = raw_size;
+    int compression = TRACE_COMPRESS_NONE;
+
+#ifdef HAVE_ZSTD
+    {
+        size_t packed = ZSTD_compress(gs_packed, gs_packed_size, gs_out, raw_size, TRACE_ZSTD_LEVEL);
+
+        if(!ZSTD_isError(packed)) {
+            data = gs_packed;
+            size = packed;
+            compression = TRACE_COMPRESS_ZSTD;
+        }
+    }
+#endif
+    memset(header, 0, sizeof(header));
+    put_le(header, b->first_index, 8);
+    put_le(header + 8, b->first_cycle, 8);
+    put_le(header + 16, b->len, 4);
+    put_le(header + 20, raw_size, 4);
+    put_le(header + 24, size, 4);
+    header[28] = (unsigned char)compression;
+    if(fwrite(header, sizeof(header), 1, gs_fp) != 1 || fwrite(data, 1, size, gs_fp) != size) {
+        gs_error = 1;
+    }
+}
+
+#ifdef HAVE_PTHREAD
+static void *writer_thread(void *arg)
+{
+    pthread_mutex_lock(&gs_mutex);
+    for(;;) {
+        struct trace_buffer *b;
+
+        while(gs_full_nr == 0 && !gs_stop) {
+            pthread_cond_wait(&gs_full_cond, &gs_mutex);
+        }
+        if(gs_full_nr == 0) break;
+        b = gs_full[gs_full_first];
+        gs_full_first = (gs_full_first + 1) % TRACE_BUFFER_NR;
+        gs_full_nr--;
+        pthread_mutex_unlock(&gs_mutex);
+
+        write_block(b);
+
+        pthread_mutex_lock(&gs_mutex);
+        gs_free[gs_free_nr++] = b;
+        pthread_cond_signal(&gs_free_cond);
+    }
+    pthread_mutex_unlock(&gs_mutex);
+    return NULL;
+}
+#endif
+
+/* Hand the current buffer to the writer and continue in an empty one */
+static void flush(computer const *comp)
+{
+    if(gs_cur->len > 0) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&gs_mutex);
+        gs_full[(gs_full_first + gs_full_nr) % TRACE_BUFFER_NR] = gs_cur;
+        gs_full_nr++;
+        pthread_cond_signal(&gs_full_cond);
+        while(gs_free_nr == 0) {
+            pthread_cond_wait(&gs_free_cond, &gs_mutex);
+        }
+        gs_cur = gs_free[--gs_free_nr];
+        pthread_mutex_unlock(&gs_mutex);
+#else
+        write_block(gs_cur);
+#endif
+    }
+    gs_cur->len = 0;
+    gs_cur->first_index = gs_index;
+    gs_cur->first_cycle = comp->clock_cycle;
+}
+
+int trace_open(char const *file, computer const *comp)
+{
+    unsigned char header[TRACE_HEADER_SIZE];
+    int i;
+
+    if((gs_fp = fopen(file, "wb")) == NULL) return -1;
+    for(i = 0; i < TRACE_BUFFER_NR; i++) {
+        if((gs_buffer[i].raw = malloc(TRACE_BLOCK_LEN * sizeof(struct trace_raw))) == NULL) return -1;
+    }
+    if((gs_out = malloc(TRACE_BLOCK_LEN * MAX_ENTRY_SIZE)) == NULL) return -1;
+#ifdef HAVE_ZSTD
+    gs_packed_size = ZSTD_compressBound(TRACE_BLOCK_LEN * MAX_ENTRY_SIZE);
+    if((gs_packed = malloc(gs_packed_size)) == NULL) return -1;
+#endif
+    memset(header, 0, sizeof(header));
+    memcpy(header, TRACE_MAGIC, 4);
+    header[4] = TRACE_VERSION;
+    header[6] = COMPUTER_ADDR_BITS;
+#ifdef HAVE_ZSTD
+    header[5] = TRACE_COMPRESS_ZSTD;
+#endif
+    memcpy(header + 8, comp->ram, COMPUTER_RAM_SIZE);
+    if(fwrite(header, sizeof(header), 1, gs_fp) != 1) return -1;
+
+    gs_cur = &gs_buffer[0];
+#ifdef HAVE_PTHREAD
+    for(i = 1; i < TRACE_BUFFER_NR; i++) {
+        gs_free[gs_free_nr++] = &gs_buffer[i];
+    }
+    if(pthread_create(&gs_thread, NULL, writer_thread, NULL)) {
+        fclose(gs_fp);
+        gs_fp = NULL;
+        return -1;
+    }
+#endif
+    gs_index = 0;
+    flush(comp);
+    return 0;
+}
+
+void trace_step(computer *comp)
+{
+    struct trace_raw *r = &gs_cur->raw[gs_cur->len];
+    unsigned long clock_cycle = comp->clock_cycle;
+    unsigned char op = comp->ram[comp->iar];
+
+    r->iar = comp->iar;
+    r->op = op;
+    computer_step_instruction_fast(comp);
+    /* ST does not change registers, so reg[a] is still the address */
+    r->target = write_kind(op) == COMPUTER_WRITE_RAM ? comp->reg[(op >> 2) & 3] : op & 3;
+    r->value = write_kind(op) == COMPUTER_WRITE_RAM ? comp->ram[r->target] : comp->reg[op & 3];
+    r->cycles = (unsigned int)(comp->clock_cycle - clock_cycle);
+    gs_index++;
+    if(++gs_cur->len == TRACE_BLOCK_LEN) flush(comp);
+}
+
+void trace_close(void)
+{
+    if(gs_fp == NULL) return;
+    if(gs_cur->len > 0) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&gs_mutex);
+        gs_full[(gs_full_first + gs_full_nr) % TRACE_BUFFER_NR] = gs_cur;
+        gs_full_nr++;
+        pthread_mutex_unlock(&gs_mutex);
+#else
+        write_block(gs_cur);
+#endif
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&gs_mutex);
+    gs_stop = 1;
+    pthread_cond_signal(&gs_full_cond);
+    pthread_mutex_unlock(&gs_mutex);
+    pthread_join(gs_thread, NULL);
+#endif
+    if(fclose(gs_fp) != 0 || gs_error) {
+        fprintf(stderr, "ERROR: Could not write the trace.\n");
+    }
+    gs_fp = NULL;
+}
+
+int trace_read_header(unsigned char const *data, size_t len, unsigned char *ram)
+{
+    if(len < TRACE_HEADER_SIZE || memcmp(data, TRACE_MAGIC, 4) != 0 || data[4] != TRACE_VERSION ||
+       data[6] != COMPUTER_ADDR_BITS) return -1;
+    if(ram) memcpy(ram, data + 8, COMPUTER_RAM_SIZE);
+    return data[5];
+}
+
+long trace_read_block(unsigned char const *data, size_t len, size_t offset, struct trace_block *block)
+{
+    unsigned char const *p = data + offset;
+
+    if(offset == len) return 0;
+    if(offset + TRACE_BLOCK_HEADER_SIZE > len) return -1;
+    block->first_index = (unsigned long)get_le(p, 8);
+    block->first_cycle = (unsigned long)get_le(p + 8, 8);
+    block->count = (unsigned long)get_le(p + 16, 4);
+    block->raw_size = (unsigned long)get_le(p + 20, 4);
+    block->stored_size = (unsigned long)get_le(p + 24, 4);
+    block->compression = p[28];
+    block->data = p + TRACE_BLOCK_HEADER_SIZE;
+    if(block->count > TRACE_BLOCK_LEN || offset + TRACE_BLOCK_HEADER_SIZE + block->stored_size > len) return -1;
+    return (long)(offset + TRACE_BLOCK_HEADER_SIZE + block->stored_size);
+}
+
+int trace_decode(struct trace_block const *block, struct trace_entry *entry)
+{
+    unsigned char const *p = block->data;
+    unsigned char const *end = block->data + block->stored_size;
+    unsigned char *raw = NULL;
+    unsigned long clock_cycle = block->first_cycle;
+    int expected = -1;
+    unsigned long i;
+    int ret = 0;
+
+    if(block->compression == TRACE_COMPRESS_ZSTD) {
+#ifdef HAVE_ZSTD
+        size_t size;
+
+        if((raw = malloc(block->raw_size)) == NULL) return -1;
+        size = ZSTD_decompress(raw, block->raw_size, block->data, block->stored_size);
+        if(ZSTD_isError(size) || size != block->raw_size) {
+            free(raw);
+            return -1;
+        }
+        p = raw;
+        end = raw + size;
+#else
+        return -1;
+#endif
+    } else if(block->compression != TRACE_COMPRESS_NONE) {
+        return -1;
+    }
+
+    for(i = 0; i < block->count; i++) {
+        struct trace_entry *e = &entry[i];
+        unsigned char tag;
+        int shift = 0;
+
+        if(end - p < 2) goto corrupt;
+        tag = *p++;
+        e->op = *p++;
+        e->kind = write_kind(e->op);
+        if(tag & TAG_IAR) {
+            if(end - p < COMPUTER_IMM_LEN) goto corrupt;
+            e->iar = (computer_word)get_le(p, COMPUTER_IMM_LEN);
+            p += COMPUTER_IMM_LEN;
+        } else if(expected < 0) {
+            goto corrupt;
+        } else {
+            e->iar = (computer_word)expected;
+        }
+        e->target = e->op & 3;
+        e->value = 0;
+        if(e->kind == COMPUTER_WRITE_RAM) {
+            if(end - p < COMPUTER_IMM_LEN) goto corrupt;
+            e->target = (computer_word)get_le(p, COMPUTER_IMM_LEN);
+            p += COMPUTER_IMM_LEN;
+        }
+        if(e->kind != COMPUTER_WRITE_NONE) {
+            if(end - p < COMPUTER_IMM_LEN) goto corrupt;
+            e->value = (computer_word)get_le(p, COMPUTER_IMM_LEN);
+            p += COMPUTER_IMM_LEN;
+        }
+        e->cycles = COMPUTER_FAST_INSTR_CYCLES;
+        if(tag & TAG_CYCLES) {
+            e->cycles = 0;
+            do {
+                if(p == end || shift > 63) goto corrupt;
+                e->cycles |= (unsigned long)(*p & 127) << shift;
+                shift += 7;
+            } while(*p++ & 128);
+        }
+        e->clock_cycle = clock_cycle;
+        clock_cycle += e->cycles;
+        expected = (e->iar + computer_get_instruction_length(e->op)) % COMPUTER_RAM_SIZE;
+    }
+    goto done;
+
+corrupt:
+    ret = -1;
+done:
+    free(raw);
+    return ret;
+}
@@ -0,0 +1,73 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+#include "computer.h"
+
+/* Instruction trace. The run loop stores iar, opcode, the written register
+ * or RAM byte and the cycles of every instruction into a buffer. Full
+ * buffers go to a writer thread, which encodes them into blocks and writes
+ * them to the file, so the run loop only does a few stores per
+ * instruction. Without pthreads the blocks are written from trace_step().
+ *
+ * File layout: a header with TRACE_MAGIC, the version, the compression,
+ * COMPUTER_ADDR_BITS and the RAM at the start, then blocks of at most
+ * TRACE_BLOCK_LEN instructions. A block header holds the number of the
+ * first instruction, the clock cycle before it, the number of
+ * instructions and the size of the data, so a reader can skip to any
+ * block. Each instruction is encoded as a tag byte and the opcode,
+ * followed by iar if it is not the address after the previous
+ * instruction, the RAM address for ST, the written value (addresses and
+ * values are COMPUTER_IMM_LEN bytes) and the cycles (as a varint) if they
+ * are not COMPUTER_FAST_INSTR_CYCLES. With HAVE_ZSTD the data of each
+ * block is compressed with zstd. */
+
+#define TRACE_MAGIC "MCTR"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE (8 + COMPUTER_RAM_SIZE)
+#define TRACE_BLOCK_HEADER_SIZE 32
+#define TRACE_BLOCK_LEN 65536
+
+#define TRACE_COMPRESS_NONE 0
+#define TRACE_COMPRESS_ZSTD 1
+
+struct trace_entry {
+    unsigned long clock_cycle; /* Before the instruction */
+    unsigned long cycles;
+    computer_word iar;
+    unsigned char op;
+    int kind; /* COMPUTER_WRITE_* */
+    computer_word target; /* Register index or RAM address */
+    computer_word value; /* Value written */
+};
+
+struct trace_block {
+    unsigned long first_index;
+    unsigned long first_cycle;
+    unsigned long count;
+    unsigned long raw_size;
+    unsigned long stored_size;
+    int compression;
+    unsigned char const *data;
+};
+
+/* Start tracing comp to file, from its current RAM and clock. Returns -1
+ * if the file can not be created or the writer thread can not be
+ * started. */
+int trace_open(char const *file, computer const *comp);
+/* Run one instruction with the fast engine and record it */
+void trace_step(computer *comp);
+/* Write the rest of the trace and close the file */
+void trace_close(void);
+
+/* Check the header of a trace in memory. Returns the compression used or
+ * -1 if data does not start with a trace header. */
+int trace_read_header(unsigned char const *data, size_t len, unsigned char *ram);
+/* Read the block header at offset. Returns the offset of the next block,
+ * 0 at the end and -1 if the block is truncated. */
+long trace_read_block(unsigned char const *data, size_t len, size_t offset, struct trace_block *block);
+/* Decode the block->count entries of block into entry. Returns -1 if the
+ * data is corrupt or compressed with something this build lacks. */
+int trace_decode(struct trace_block const *block, struct trace_entry *entry);
+
+#endif
@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <argp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "computer.h"
+#include "trace.h"
+#include "srcmap.h"
+#include "config_impl.h"
+
+/* Reads traces written by simulator --trace. The file is mapped and only
+ * the blocks that overlap the selected range are decoded. */
+
+#define CMD_STATS 0
+#define CMD_HIST  1
+#define CMD_DUMP  2
+
+struct arguments {
+    char *trace_file;
+    int cmd;
+    int by_cycle;
+    unsigned long first;
+    unsigned long last;
+    int top;
+    char *map_file;
+};
+
+static struct arguments gs_arg = { NULL, CMD_STATS, 0, 0, (unsigned long)-1, 0, NULL };
+
+char const *argp_program_version = "tracetool " MINICOMP_VERSION;
+char const *argp_program_bug_address = "<boris.carlsson@gmail.com>";
+
+static char gs_argp_doc[] = "tracetool - Read instruction traces written by simulator --trace.\n\n"
+    "Commands:\n"
+    "  stats  Number of instructions, cycles, writes and jumps (default)\n"
+    "  hist   Instructions and cycles per address\n"
+    "  dump   One line per instruction\n";
+static char gs_argp_args_doc[] = "trace-file [stats|hist|dump]";
+
+static struct argp_option gs_argp_options[] = {
+    { "range", 'r', "FIRST:LAST", 0, "Only instructions FIRST to LAST (counting from 0, either may be left out)", 0 },
+    { "cycles", 'c', "FIRST:LAST", 0, "Only instructions that start in clock cycles FIRST to LAST", 0 },
+    { "top", 'n', "N", 0, "Only the N addresses with the most cycles in hist", 0 },
+    { "map", 'm', "FILE", 0, "Source map written by asm_compiler --map, for lines and labels in hist and dump", 0 },
+    { 0, 0, 0, 0, 0, 0 }
+};
+
+static int parse_range(char const *arg, struct arguments *arguments)
+{
+    char const *colon = strchr(arg, ':');
+    char *end;
+
+    if(colon == NULL) return -1;
+    arguments->first = colon == arg ? 0 : strtoul(arg, &end, 0);
+    if(colon != arg && end != colon) return -1;
+    arguments->last = colon[1] == '\0' ? (unsigned long)-1 : strtoul(colon + 1, &end, 0);
+    if(colon[1] != '\0' && *end != '\0') return -1;
+    return arguments->first <= arguments->last ? 0 : -1;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+        case 'r':
+        case 'c':
+            if(parse_range(arg, arguments)) argp_usage(state);
+            arguments->by_cycle = key == 'c';
+            break;
+        case 'n':
+            arguments->top = atoi(arg);
+            break;
+        case 'm':
+            arguments->map_file = arg;
+            break;
+        case ARGP_KEY_ARG:
+            if(state->arg_num == 0) {
+                arguments->trace_file = arg;
+            } else if(state->arg_num == 1 && strcmp(arg, "stats") == 0) {
+                arguments->cmd = CMD_STATS;
+            } else if(state->arg_num == 1 && strcmp(arg, "hist") == 0) {
+                arguments->cmd = CMD_HIST;
+            } else if(state->arg_num == 1 && strcmp(arg, "dump") == 0) {
+                arguments->cmd = CMD_DUMP;
+            } else {
+                argp_usage(state);
+            }
+            break;
+        case ARGP_KEY_END:
+            if(state->arg_num < 1) argp_usage(state);
+            break;
+        default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp gs_argp = { gs_argp_options, parse_opt, gs_argp_args_doc, gs_argp_doc, 0, 0, 0 };
+
+/* Counters for stats and hist */
+static unsigned long gs_count = 0;
+static unsigned long gs_cycles = 0;
+static unsigned long gs_first_cycle = 0;
+static unsigned long gs_kind_count[COMPUTER_INSTR_NR + 1];
+static unsigned long gs_reg_writes = 0;
+static unsigned long gs_ram_writes = 0;
+static unsigned long gs_jumps = 0;
+static unsigned long gs_slow = 0;
+static unsigned long gs_addr_count[COMPUTER_RAM_SIZE];
+static unsigned long gs_addr_cycles[COMPUTER_RAM_SIZE];
+static struct srcmap gs_srcmap;
+
+static void print_entry(unsigned long index, struct trace_entry const *e)
+{
+    char name[16];
+
+    computer_get_instruction_name(e->op, name);
+    printf("%lu %lu %03d %-10s", index, e->clock_cycle, e->iar, name);
+    if(e->kind == COMPUTER_WRITE_REG) printf(" %s=%d", computer_reg_name[e->target], e->value);
+    if(e->kind == COMPUTER_WRITE_RAM) printf(" [%d]=%d", e->target, e->value);
+    if(e->cycles != COMPUTER_FAST_INSTR_CYCLES) printf(" (%lu cycles)", e->cycles);
+    if(gs_arg.map_file && gs_srcmap.pos[e->iar].line) {
+        struct srcmap_pos const *p = &gs_srcmap.pos[e->iar];
+
+        printf("  %s:%d", gs_srcmap.name[p->file], p->line);
+        if(p->label >= 0) printf(" %s", gs_srcmap.name[p->label]);
+    }
+    printf("\n");
+}
+
+static void count_entry(struct trace_entry const *e, struct trace_entry const *next)
+{
+    if(gs_count++ == 0) gs_first_cycle = e->clock_cycle;
+    gs_cycles += e->cycles;
+    gs_kind_count[e->op & 128 ? COMPUTER_INSTR_NR : e->op >> 4]++;
+    if(e->kind == COMPUTER_WRITE_REG) gs_reg_writes++;
+    if(e->kind == COMPUTER_WRITE_RAM) gs_ram_writes++;
+    if(e->cycles != COMPUTER_FAST_INSTR_CYCLES) gs_slow++;
+    if(next && next->iar != (e->iar + computer_get_instruction_length(e->op)) % COMPUTER_RAM_SIZE) gs_jumps++;
+    gs_addr_count[e->iar]++;
+    gs_addr_cycles[e->iar] += e->cycles;
+}
+
+static int in_range(unsigned long index, struct trace_entry const *e)
+{
+    unsigned long pos = gs_arg.by_cycle ? e->clock_cycle : index;
+
+    return pos >= gs_arg.first && pos <= gs_arg.last;
+}
+
+static void print_stats(size_t file_size, unsigned long block_nr, int compression)
+{
+    static char const *kind_name[COMPUTER_INSTR_NR + 1] = {
+        "LD", "ST", "DATA", "JMPR", "JMP", "JXXX", "CLF", "IO", "ALU" };
+    int i;
+
+    printf("Instructions: %lu\n", gs_count);
+    if(gs_count == 0) return;
+    printf("Clock cycles: %lu to %lu (%lu)\n", gs_first_cycle, gs_first_cycle + gs_cycles, gs_cycles);
+    printf("File: %lu bytes in %lu blocks, %s, %.2f bytes per instruction\n", (unsigned long)file_size, block_nr,
+           compression == TRACE_COMPRESS_ZSTD ? "zstd" : "not compressed", (double)file_size / (double)gs_count);
+    for(i = 0; i <= COMPUTER_INSTR_NR; i++) {
+        if(gs_kind_count[i]) {
+            printf("%-5s %20lu %6.2f%%\n", kind_name[i], gs_kind_count[i], 100 * (double)gs_kind_count[i] / (double)gs_count);
+        }
+    }
+    printf("Register writes: %lu\n", gs_reg_writes);
+    printf("RAM writes: %lu\n", gs_ram_writes);
+    printf("Jumps taken: %lu\n", gs_jumps);
+    printf("Instructions slower than %d cycles: %lu\n", COMPUTER_FAST_INSTR_CYCLES, gs_slow);
+}
+
+static int compare_addr(void const *a, void const *b)
+{
+    unsigned long ca = gs_addr_cycles[*(int const *)a];
+    unsigned long cb = gs_addr_cycles[*(int const *)b];
+
+    if(ca != cb) return ca < cb ? 1 : -1;
+    return *(int const *)a - *(int const *)b;
+}
+
+static void print_hist(unsigned char const *ram)
+{
+    int addr[COMPUTER_RAM_SIZE];
+    int i, n = 0;
+
+    for(i = 0; i < COMPUTER_RAM_SIZE; i++) {
+        if(gs_addr_count[i]) addr[n++] = i;
+    }
+    qsort(addr, (size_t)n, sizeof(addr[0]), compare_addr);
+    if(gs_arg.top > 0 && gs_arg.top < n) n = gs_arg.top;
+    printf("%3s: %-10s %20s %20s %7s\n", "pos", "instr.", "count", "cycles", "percent");
+    for(i = 0; i < n; i++) {
+        char name[16];
+
+        /* The instruction at the start, self-modifying code may differ */
+        computer_get_instruction_name(ram[addr[i]], name);
+        printf("%03d: %-10s %20lu %20lu %6.2f%%\n", addr[i], name, gs_addr_count[addr[i]], gs_addr_cycles[addr[i]],
+               100 * (double)gs_addr_cycles[addr[i]] / (double)gs_cycles);
+    }
+    if(gs_arg.map_file) srcmap_print_profile(&gs_srcmap, gs_addr_count, gs_addr_cycles, gs_arg.top, stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char ram[COMPUTER_RAM_SIZE];
+    struct trace_entry *entry, *held = NULL;
+    struct trace_entry last;
+    unsigned long block_nr = 0;
+    struct stat st;
+    unsigned char const *data;
+    int fd, compression;
+    long offset;
+
+    argp_parse(&gs_argp, argc, argv, 0, 0, &gs_arg);
+
+    if(gs_arg.map_file && srcmap_load(&gs_srcmap, gs_arg.map_file)) {
+        fprintf(stderr, "'%s' is not a source map.\n", gs_arg.map_file);
+        exit(EXIT_FAILURE);
+    }
+
+    if((fd = open(gs_arg.trace_file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Could not open '%s' for reading.\n", gs_arg.trace_file);
+        exit(EXIT_FAILURE);
+    }
+    data = st.st_size > 0 ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if(data == MAP_FAILED || (compression = trace_read_header(data, (size_t)st.st_size, ram)) < 0) {
+        fprintf(stderr, "'%s' is not a trace.\n", gs_arg.trace_file);
+        exit(EXIT_FAILURE);
+    }
+    if((entry = malloc(TRACE_BLOCK_LEN * sizeof(*entry))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* An entry is counted when the next one is known, to see if it jumped */
+    offset = TRACE_HEADER_SIZE;
+    for(;;) {
+        struct trace_block block;
+        unsigned long i;
+        long next = trace_read_block(data, (size_t)st.st_size, (size_t)offset, &block);
+
+        if(next == 0) break;
+        if(next < 0) {
+            fprintf(stderr, "The trace is truncated after %lu blocks.\n", block_nr);
+            break;
+        }
+        offset = next;
+        block_nr++;
+        if(gs_arg.by_cycle ? block.first_cycle > gs_arg.last :
+           block.first_index > gs_arg.last) break;
+        if(!gs_arg.by_cycle && block.first_index + block.count <= gs_arg.first) continue;
+        if(trace_decode(&block, entry)) {
+            fprintf(stderr, "Block %lu can not be decoded%s.\n", block_nr - 1,
+                    block.compression == TRACE_COMPRESS_ZSTD ? " (needs zstd)" : "");
+            exit(EXIT_FAILURE);
+        }
+        for(i = 0; i < block.count; i++) {
+            if(!in_range(block.first_index + i, &entry[i])) continue;
+            if(gs_arg.cmd == CMD_DUMP) {
+                print_entry(block.first_index + i, &entry[i]);
+                continue;
+            }
+            if(held) count_entry(held, &entry[i]);
+            last = entry[i];
+            held = &last;
+        }
+    }
+    if(held) count_entry(held, NULL);
+
+    if(gs_arg.cmd == CMD_STATS) print_stats((size_t)st.st_size, block_nr, compression);
+    if(gs_arg.cmd == CMD_HIST) print_hist(ram);
+    if(gs_arg.map_file) srcmap_free(&gs_srcmap);
+    free(entry);
+    munmap((void *)data, (size_t)st.st_size);
+    close(fd);
+    return 0;
+}
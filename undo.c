@@ -0,0 +1,336 @@
+#include "undo.h"
+#include "peri.h"
+#include <stdlib.h>
+#include <string.h>
+#include "config_impl.h"
+
+#define UNDO_SNAPSHOT_NR 64
+/* Periodic snapshots per log size, the rest of the snapshot ring is left
+ * for instructions that need one of their own */
+#define UNDO_PERIODIC_SNAPSHOTS 32
+#define UNDO_MAX_CYCLES 0xffffffUL
+
+/* One entry per instruction, 8 bytes in the 8-bit build */
+struct undo_entry {
+    computer_word iar;
+    unsigned char kind_flags; /* kind << 4 | flags */
+    unsigned char io_addr;
+    computer_word target;
+    computer_word old;
+    unsigned char cycles[3]; /* Clock cycles used, low byte first */
+};
+
+struct undo_snapshot {
+    unsigned long index; /* State before instruction index */
+    unsigned long clock_cycle;
+    unsigned char ram[COMPUTER_RAM_SIZE];
+    computer_word reg[COMPUTER_REG_NR];
+    computer_word iar;
+    unsigned char flags, io_addr;
+};
+
+struct undo_log {
+    unsigned long size;
+    unsigned long count;
+    unsigned long floor; /* Instructions before this can not be undone */
+    unsigned long interval;
+    unsigned long to_snapshot; /* Instructions until the next periodic snapshot */
+    unsigned long pos; /* Position of instruction count in the ring */
+    unsigned char write_kind[256]; /* UNDO_KIND_* per instruction byte */
+    struct undo_entry *entry;
+    /* Ring of snapshots, oldest first */
+    int snapshot_first;
+    int snapshot_nr;
+    struct undo_snapshot snapshot[UNDO_SNAPSHOT_NR];
+};
+
+undo_log *undo_create(unsigned long size)
+{
+    undo_log *log;
+
+    if(size == 0) return NULL;
+    if((log = calloc(1, sizeof(*log))) == NULL) return NULL;
+    if((log->entry = malloc(size * sizeof(*log->entry))) == NULL) {
+        free(log);
+        return NULL;
+    }
+    {
+        static computer probe;
+        int instr;
+
+        for(instr = 0; instr < 256; instr++) {
+            computer_word target;
+
+            probe.ram[0] = (unsigned char)instr;
+            switch(computer_get_write_target(&probe, &target)) {
+                case COMPUTER_WRITE_REG: log->write_kind[instr] = UNDO_KIND_REG; break;
+                case COMPUTER_WRITE_RAM: log->write_kind[instr] = UNDO_KIND_RAM; break;
+                default: log->write_kind[instr] = UNDO_KIND_NONE; break;
+            }
+        }
+    }
+    log->size = size;
+    log->interval = size / UNDO_PERIODIC_SNAPSHOTS;
+    if(log->interval == 0) log->interval = 1;
+
+    return log;
+}
+
+void undo_destroy(undo_log *log)
+{
+    if(log == NULL) return;
+    free(log->entry);
+    free(log);
+}
+
+unsigned long undo_get_count(undo_log const *log)
+{
+    return log->count;
+}
+
+unsigned long undo_get_oldest(undo_log const *log)
+{
+    return log->floor;
+}
+
+static struct undo_snapshot *newest_snapshot(undo_log *log)
+{
+    if(log->snapshot_nr == 0) return NULL;
+    return &log->snapshot[(log->snapshot_first + log->snapshot_nr - 1) % UNDO_SNAPSHOT_NR];
+}
+
+static void take_snapshot(undo_log *log, computer const *comp)
+{
+    struct undo_snapshot *s = newest_snapshot(log);
+
+    if(s && s->index == log->count) return;
+    if(log->snapshot_nr == UNDO_SNAPSHOT_NR) {
+        log->snapshot_first = (log->snapshot_first + 1) % UNDO_SNAPSHOT_NR;
+        log->snapshot_nr--;
+    }
+    log->snapshot_nr++;
+    s = newest_snapshot(log);
+    s->index = log->count;
+    s->clock_cycle = comp->clock_cycle;
+    memcpy(s->ram, comp->ram, sizeof(s->ram));
+    memcpy(s->reg, comp->reg, sizeof(s->reg));
+    s->iar = comp->iar;
+    s->flags = comp->flags;
+    s->io_addr = comp->io_addr;
+}
+
+static void restore_snapshot(undo_log *log, computer *comp, struct undo_snapshot const *s)
+{
+    comp->clock_cycle = s->clock_cycle;
+    memcpy(comp->ram, s->ram, sizeof(s->ram));
+    comp->ram_writes++;
+    memcpy(comp->reg, s->reg, sizeof(s->reg));
+    comp->iar = s->iar;
+    comp->flags = s->flags;
+    comp->io_addr = s->io_addr;
+    comp->is_running = 1;
+    log->count = s->index;
+    log->pos = s->index % log->size;
+}
+
+/* Snapshots after the current instruction belong to a future that may not
+ * happen again */
+static void drop_newer_snapshots(undo_log *log)
+{
+    struct undo_snapshot *s;
+
+    while((s = newest_snapshot(log)) != NULL && s->index > log->count) {
+        log->snapshot_nr--;
+    }
+}
+
+static struct undo_snapshot *find_snapshot(undo_log *log, unsigned long index)
+{
+    int i;
+
+    for(i = log->snapshot_nr - 1; i >= 0; i--) {
+        struct undo_snapshot *s = &log->snapshot[(log->snapshot_first + i) % UNDO_SNAPSHOT_NR];
+        if(s->index == index) return s;
+        if(s->index < index) break;
+    }
+    return NULL;
+}
+
+/* Output to these addresses may write RAM behind the instruction's back */
+static int is_bulk_io(unsigned char instr, unsigned char io_addr)
+{
+    return instr >> 4 == COMPUTER_INSTR_IO && ((instr >> 2) & 3) == ((COMPUTER_IO_OUTPUT << 1) | COMPUTER_IO_DATA) &&
+           peri_output_writes_ram(io_addr);
+}
+
+static inline void record_step(undo_log *log, computer *comp)
+{
+    struct undo_entry *e = &log->entry[log->pos];
+    unsigned long cycles = comp->clock_cycle;
+    unsigned char instr = comp->ram[comp->iar];
+    computer_word target;
+    int kind;
+
+    if(log->to_snapshot-- == 0) {
+        take_snapshot(log, comp);
+        log->to_snapshot = log->interval - 1;
+    }
+    /* The kind of write only depends on the instruction byte */
+    kind = log->write_kind[instr];
+    if(kind == UNDO_KIND_RAM) {
+        target = comp->reg[(instr >> 2) & 3];
+        e->old = comp->ram[target];
+    } else {
+        target = (computer_word)(instr & 3);
+        e->old = comp->reg[target];
+    }
+    if(is_bulk_io(instr, comp->io_addr)) {
+        take_snapshot(log, comp);
+        kind = UNDO_KIND_BULK;
+    }
+    e->iar = comp->iar;
+    e->kind_flags = (unsigned char)(kind << 4 | comp->flags);
+    e->io_addr = comp->io_addr;
+    e->target = target;
+
+    computer_step_instruction_fast(comp);
+
+    cycles = comp->clock_cycle - cycles;
+    if(cycles > UNDO_MAX_CYCLES) {
+        /* Can not be stored, so this instruction can not be undone */
+        log->floor = log->count + 1;
+    }
+    e->cycles[0] = (unsigned char)cycles;
+    e->cycles[1] = (unsigned char)(cycles >> 8);
+    e->cycles[2] = (unsigned char)(cycles >> 16);
+    log->count++;
+    if(++log->pos == log->size) log->pos = 0;
+    if(log->count - log->floor > log->size) {
+        log->floor = log->count - log->size;
+    }
+}
+
+void undo_step(undo_log *log, computer *comp)
+{
+    record_step(log, comp);
+}
+
+unsigned long undo_run(undo_log *log, computer *comp, unsigned long cycle)
+{
+    unsigned long instructions = 0;
+
+    while(comp->is_running && comp->clock_cycle < cycle) {
+        record_step(log, comp);
+        instructions++;
+    }
+    return instructions;
+}
+
+int undo_get_info(undo_log const *log, unsigned long index, struct undo_info *info)
+{
+    struct undo_entry const *e;
+
+    if(index < log->floor || index >= log->count) return -1;
+    e = &log->entry[index % log->size];
+    info->iar = e->iar;
+    info->kind = e->kind_flags >> 4;
+    info->target = e->target;
+    info->old = e->old;
+
+    return 0;
+}
+
+int undo_back(undo_log *log, computer *comp)
+{
+    struct undo_entry const *e;
+    unsigned long index;
+
+    if(log->count == log->floor) return -1;
+    index = log->count - 1;
+    e = &log->entry[index % log->size];
+    if(e->kind_flags >> 4 == UNDO_KIND_BULK) {
+        struct undo_snapshot *s = find_snapshot(log, index);
+        if(s == NULL) {
+            log->floor = log->count;
+            return -1;
+        }
+        restore_snapshot(log, comp, s);
+    } else {
+        if(e->kind_flags >> 4 == UNDO_KIND_REG) {
+            comp->reg[e->target] = e->old;
+        } else if(e->kind_flags >> 4 == UNDO_KIND_RAM) {
+            comp->ram[e->target] = (unsigned char)e->old;
+            comp->ram_writes++;
+        }
+        comp->iar = e->iar;
+        comp->flags = e->kind_flags & 15;
+        comp->io_addr = e->io_addr;
+        comp->clock_cycle -= (unsigned long)e->cycles[0] | (unsigned long)e->cycles[1] << 8 | (unsigned long)e->cycles[2] << 16;
+        comp->is_running = 1;
+        log->count = index;
+        log->pos = index % log->size;
+    }
+    drop_newer_snapshots(log);
+
+    return 0;
+}
+
+int undo_goto(undo_log *log, computer *comp, unsigned long index)
+{
+    int i;
+
+    if(index < log->floor || index > log->count) return -1;
+    /* Start from the closest snapshot at or after index */
+    for(i = 0; i < log->snapshot_nr; i++) {
+        struct undo_snapshot *s = &log->snapshot[(log->snapshot_first + i) % UNDO_SNAPSHOT_NR];
+        if(s->index >= index) {
+            if(s->index < log->count) {
+                restore_snapshot(log, comp, s);
+                drop_newer_snapshots(log);
+            }
+            break;
+        }
+    }
+    while(log->count > index) {
+        if(undo_back(log, comp)) return -1;
+    }
+    return 0;
+}
+
+static int get_bit(unsigned char const *map, int addr)
+{
+    return (map[addr >> 3] >> (addr & 7)) & 1;
+}
+
+long undo_find_back(undo_log const *log, unsigned char const *pc_map, unsigned char const *write_map)
+{
+    unsigned long index;
+
+    for(index = log->count; index > log->floor; index--) {
+        struct undo_entry const *e = &log->entry[(index - 1) % log->size];
+
+        if(pc_map && get_bit(pc_map, e->iar)) return (long)(index - 1);
+        if(write_map && e->kind_flags >> 4 == UNDO_KIND_RAM && get_bit(write_map, e->target)) return (long)(index - 1);
+    }
+    return -1;
+}
+
+void undo_dump(undo_log const *log, computer const *comp, FILE *fp)
+{
+    unsigned long index;
+
+    for(index = log->floor; index < log->count; index++) {
+        struct undo_entry const *e = &log->entry[index % log->size];
+        char name[10];
+
+        computer_get_instruction_name(comp->ram[e->iar], name);
+        fprintf(fp, "%lu %03d %s", index, e->iar, name);
+        switch(e->kind_flags >> 4) {
+            case UNDO_KIND_REG: fprintf(fp, ", r%d was %d", e->target, e->old); break;
+            case UNDO_KIND_RAM: fprintf(fp, ", ram %03d was %d", e->target, e->old); break;
+            case UNDO_KIND_BULK: fprintf(fp, ", RAM written by io %d", e->io_addr); break;
+            default: break;
+        }
+        fputc('\n', fp);
+    }
+}
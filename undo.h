@@ -0,0 +1,48 @@
+#ifndef UNDO_H_
+#define UNDO_H_
+
+#include <stdio.h>
+#include "computer.h"
+
+/* Entry kinds */
+#define UNDO_KIND_NONE 0 /* Only iar, flags and io_addr changed */
+#define UNDO_KIND_REG  1
+#define UNDO_KIND_RAM  2
+#define UNDO_KIND_BULK 3 /* Restored from a full snapshot, e.g. after DMA */
+
+typedef struct undo_log undo_log;
+
+struct undo_info {
+    computer_word iar;
+    int kind; /* UNDO_KIND_* */
+    computer_word target; /* Register index or RAM address */
+    computer_word old; /* Value before the instruction */
+};
+
+/* Create an undo log that remembers the last size instructions. */
+undo_log *undo_create(unsigned long size);
+void undo_destroy(undo_log *log);
+/* Run one instruction with the fast engine and record how to undo it */
+void undo_step(undo_log *log, computer *comp);
+/* Like computer_run_fast, recording every instruction */
+unsigned long undo_run(undo_log *log, computer *comp, unsigned long cycle);
+/* Number of the next instruction to run, counting from 0 */
+unsigned long undo_get_count(undo_log const *log);
+/* Oldest instruction number that can still be returned to */
+unsigned long undo_get_oldest(undo_log const *log);
+/* Information about instruction number index, -1 if it is not in the log */
+int undo_get_info(undo_log const *log, unsigned long index, struct undo_info *info);
+/* Undo the last instruction. Returns -1 if there is no more history. */
+int undo_back(undo_log *log, computer *comp);
+/* Undo instructions until index is the next instruction to run */
+int undo_goto(undo_log *log, computer *comp, unsigned long index);
+/* Latest instruction before the current one that starts at an address in
+ * pc_map or writes a RAM address in write_map (bitmaps, may be NULL).
+ * Returns -1 if there is none. */
+long undo_find_back(undo_log const *log, unsigned char const *pc_map, unsigned char const *write_map);
+/* Write one line per instruction in the log, oldest first: its number,
+ * address and name (of the byte now at the address in comp) and what it
+ * overwrote */
+void undo_dump(undo_log const *log, computer const *comp, FILE *fp);
+
+#endif